@@ -1,12 +1,44 @@
+#define _GNU_SOURCE
+
 #include "common.h"
 
-const int VERSION[] = {0, 3, 0};
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/ioprio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+const int VERSION[] = {0, 12, 0};
 
-const int MARKER_START = 0;
-const int MARKER_END = 1;
-const int DATA_OFFSET = 2;
+const long long MARKER_START = 0;
+const long long MARKER_END = 1;
+const long long MARKER_PRUNED = 2;
+const long long DATA_OFFSET = 3;
+
+const int STREAM_TREE = 0;
+const int STREAM_DATA = 1;
+const int STREAM_END = 2;
 
 const int NO_ERROR = 0;
+const int NOT_ATTEMPTED = -2;
+const int XATTR_DICT = -3;
+const int PACKED_RECORD = 0x50;
+
+const int DIGEST_NONE = 0;
+const int DIGEST_MD5 = 1;
+const int DIGEST_MD5_SPARSE = 2;
+const int DIGEST_MD5_TREE = 3;
+const int DIGEST_PENDING = 4;
+const int DIGEST_MD5_FINGERPRINT = 5;
+const int DIGEST_KIND_MASK = 0xff;
+const int DIGEST_EXTENTS = 0x100;
+const int DIGEST_SLOT = 0x200;
+const int DIGEST_SLOT_MD_SIZE = 64;
+
+const int JOURNAL_UPDATE = 0;
+const int JOURNAL_CREATE = 1;
+const int JOURNAL_DELETE = 2;
+const int JOURNAL_PRUNED = 3;
 
 int compare_versions(int data_version[], const int parser_version[]) {
     // Assume both versions consist of 3 integers
@@ -49,3 +81,33 @@ int update_buff(int new_length, int *old_length, char **buff) {
     }
     return 0;
 }
+
+// Lowest CPU priority and idle I/O class, for crawls next to live services
+void set_idle_priority(void) {
+    int ret;
+
+    ret = setpriority(PRIO_PROCESS, 0, 19);
+    if (ret) {
+        fprintf(stderr, "warning: setpriority() failed with errno %i\n", errno);
+    }
+    ret = syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+    if (ret) {
+        fprintf(stderr, "warning: ioprio_set() failed with errno %i\n", errno);
+    }
+}
+
+// Opens a file to read its contents without moving its atime, which would
+// otherwise differ in the next dump. Only the owner or CAP_FOWNER may ask
+// for O_NOATIME.
+int open_noatime(
+    const char *filepath
+) {
+    int fd;
+
+    fd = open(filepath, O_RDONLY | O_NONBLOCK | O_LARGEFILE | O_NOFOLLOW | O_NOATIME);
+    if (fd < 0 && errno == EPERM) {
+        fd = open(filepath, O_RDONLY | O_NONBLOCK | O_LARGEFILE | O_NOFOLLOW);
+    }
+
+    return fd;
+}
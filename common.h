@@ -8,15 +8,37 @@
 #include <errno.h>
 #include <linux/fs.h>
 
-#define MD_BUFF_SIZE 512
-
 extern const int VERSION[3];
 
-extern const int MARKER_START;
-extern const int MARKER_END;
-extern const int DATA_OFFSET;
+extern const long long MARKER_START;
+extern const long long MARKER_END;
+extern const long long MARKER_PRUNED;
+extern const long long DATA_OFFSET;
+
+extern const int STREAM_TREE;
+extern const int STREAM_DATA;
+extern const int STREAM_END;
 
 extern const int NO_ERROR;
+extern const int NOT_ATTEMPTED;
+extern const int XATTR_DICT;
+extern const int PACKED_RECORD;
+
+extern const int DIGEST_NONE;
+extern const int DIGEST_MD5;
+extern const int DIGEST_MD5_SPARSE;
+extern const int DIGEST_MD5_TREE;
+extern const int DIGEST_PENDING;
+extern const int DIGEST_MD5_FINGERPRINT;
+extern const int DIGEST_KIND_MASK;
+extern const int DIGEST_EXTENTS;
+extern const int DIGEST_SLOT;
+extern const int DIGEST_SLOT_MD_SIZE;
+
+extern const int JOURNAL_UPDATE;
+extern const int JOURNAL_CREATE;
+extern const int JOURNAL_DELETE;
+extern const int JOURNAL_PRUNED;
 
 struct statx_data {
     int ret;
@@ -40,4 +62,8 @@ int compare_versions(int data_version[], const int parser_version[]);
 
 int update_buff(int new_length, int *old_length, char **buff);
 
+void set_idle_priority(void);
+
+int open_noatime(const char *filepath);
+
 #endif /* METADUMP_COMMON_H */
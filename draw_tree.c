@@ -22,7 +22,7 @@ int main(int argc, char *argv[]) {
     FILE *treefile;
 
     int version[3];
-    int marker_or_datafile_pos;
+    long long marker_or_datafile_pos;
     int level;
 
     struct dirent de;
@@ -77,7 +77,11 @@ int main(int argc, char *argv[]) {
         for (int idx = 0; idx < level; idx++) {
             printf(" ");
         }
-        printf("%s\n", de.d_name);
+        if (marker_or_datafile_pos == MARKER_PRUNED) {
+            printf("%s (pruned)\n", de.d_name);
+        } else {
+            printf("%s\n", de.d_name);
+        }
     }
 
     fclose(treefile);
@@ -0,0 +1,88 @@
+#include "fscaps.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct fscaps *fscaps_table;
+int fscaps_count;
+int fscaps_last;
+
+struct fscaps *fscaps_lookup(
+    unsigned int dev_major,
+    unsigned int dev_minor
+) {
+    struct fscaps *table;
+
+    // A crawl rarely leaves its first superblock, so check the last hit first
+    if (fscaps_count > 0 &&
+        fscaps_table[fscaps_last].dev_major == dev_major &&
+        fscaps_table[fscaps_last].dev_minor == dev_minor) {
+        return &fscaps_table[fscaps_last];
+    }
+
+    for (int idx = 0; idx < fscaps_count; idx++) {
+        if (fscaps_table[idx].dev_major == dev_major && fscaps_table[idx].dev_minor == dev_minor) {
+            fscaps_last = idx;
+            return &fscaps_table[idx];
+        }
+    }
+
+    table = realloc(fscaps_table, (fscaps_count + 1) * sizeof(*fscaps_table));
+    if (table == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return NULL;
+    }
+    fscaps_table = table;
+
+    memset(&fscaps_table[fscaps_count], 0x00, sizeof(*fscaps_table));
+    fscaps_table[fscaps_count].dev_major = dev_major;
+    fscaps_table[fscaps_count].dev_minor = dev_minor;
+    fscaps_last = fscaps_count;
+    fscaps_count++;
+
+    return &fscaps_table[fscaps_last];
+}
+
+void fscaps_learn(
+    signed char *state,
+    int ret,
+    int err
+) {
+    if (*state != FSCAP_UNKNOWN) {
+        return;
+    }
+
+    // Any other error (EACCES, EIO, ...) says nothing about the filesystem
+    if (ret >= 0) {
+        *state = FSCAP_SUPPORTED;
+    } else if (err == ENOTTY || err == EOPNOTSUPP || err == ENOSYS) {
+        *state = FSCAP_UNSUPPORTED;
+    }
+}
+
+int fscaps_xattr_ns(
+    const char *name
+) {
+    if (strncmp(name, "security.", 9) == 0) {
+        return FSCAP_NS_SECURITY;
+    }
+    if (strncmp(name, "system.", 7) == 0) {
+        return FSCAP_NS_SYSTEM;
+    }
+    if (strncmp(name, "trusted.", 8) == 0) {
+        return FSCAP_NS_TRUSTED;
+    }
+    if (strncmp(name, "user.", 5) == 0) {
+        return FSCAP_NS_USER;
+    }
+    return -1;
+}
+
+void fscaps_free(void) {
+    free(fscaps_table);
+    fscaps_table = NULL;
+    fscaps_count = 0;
+    fscaps_last = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef METADUMP_FSCAPS_H
+#define METADUMP_FSCAPS_H
+
+#include <stdbool.h>
+
+#define FSCAP_UNKNOWN 0
+#define FSCAP_SUPPORTED 1
+#define FSCAP_UNSUPPORTED -1
+
+enum fscap_ioctl {
+    FSCAP_GETFLAGS,
+    FSCAP_GETVERSION,
+    FSCAP_FSGETXATTR,
+    FSCAP_IOCTL_COUNT
+};
+
+enum fscap_xattr_ns {
+    FSCAP_NS_SECURITY,
+    FSCAP_NS_SYSTEM,
+    FSCAP_NS_TRUSTED,
+    FSCAP_NS_USER,
+    FSCAP_NS_COUNT
+};
+
+// Capabilities of one superblock, learned from the first entries that use them
+struct fscaps {
+    unsigned int dev_major;
+    unsigned int dev_minor;
+    signed char ioctl[2][FSCAP_IOCTL_COUNT]; // indexed by [is_dir][ioctl]
+    signed char xattr;
+    signed char xattr_ns[FSCAP_NS_COUNT];
+};
+
+struct fscaps *fscaps_lookup(unsigned int dev_major, unsigned int dev_minor);
+
+void fscaps_learn(signed char *state, int ret, int err);
+
+int fscaps_xattr_ns(const char *name);
+
+void fscaps_free(void);
+
+#endif /* METADUMP_FSCAPS_H */
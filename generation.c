@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+
+#include "generation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define GENERATION_RESOLVE_ATTEMPTS 16
+
+char *generation_dir;
+long long generation_next;
+
+// Returns a malloc()ed "dir/gen/name", without gen if it is < 0 and
+// without name if it is NULL
+char *generation_path(
+    const char *dir,
+    long long gen,
+    const char *name
+) {
+    char *path;
+
+    path = malloc(strlen(dir) + 2 * 21 + (name != NULL ? strlen(name) : 0));
+    if (path == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return NULL;
+    }
+    strcpy(path, dir);
+    if (gen >= 0) {
+        sprintf(path + strlen(path), "/%lli", gen);
+    }
+    if (name != NULL) {
+        sprintf(path + strlen(path), "/%s", name);
+    }
+
+    return path;
+}
+
+// The generation current points to, 0 if there is none yet
+long long generation_current(void) {
+    char *path;
+    char target[32];
+    ssize_t length;
+
+    path = generation_path(generation_dir, -1, "current");
+    if (path == NULL) {
+        return -1;
+    }
+    length = readlink(path, target, sizeof(target) - 1);
+    free(path);
+    if (length < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "readlink() failed with errno %i for %s/current\n", errno, generation_dir);
+        return -1;
+    }
+    target[length] = '\0';
+
+    return strtoll(target, NULL, 10);
+}
+
+int generation_remove(
+    long long gen
+) {
+    int ret;
+    char *path;
+    const char *names[] = {"tree", "data", NULL};
+
+    ret = 0;
+    for (int idx = 0; idx < 3 && ret == 0; idx++) {
+        path = generation_path(generation_dir, gen, names[idx]);
+        if (path == NULL) {
+            return -1;
+        }
+        ret = names[idx] != NULL ? unlink(path) : rmdir(path);
+        if (ret && errno == ENOENT) {
+            ret = 0;
+        }
+        if (ret) {
+            fprintf(stderr, "Can't remove %s, errno %i\n", path, errno);
+        }
+        free(path);
+    }
+
+    return ret;
+}
+
+// Creates the directory of the next generation and returns the paths to
+// write its treefile and datafile to
+int generation_open(
+    const char *datapath,
+    char **treetmp,
+    char **datatmp
+) {
+    int ret;
+    long long current;
+    char *path;
+
+    *treetmp = NULL;
+    *datatmp = NULL;
+
+    free(generation_dir);
+    generation_dir = malloc(strlen(datapath) + strlen(GENERATION_SUFFIX) + 1);
+    if (generation_dir == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    sprintf(generation_dir, "%s%s", datapath, GENERATION_SUFFIX);
+
+    ret = mkdir(generation_dir, 0777);
+    if (ret && errno != EEXIST) {
+        fprintf(stderr, "Can't create %s, errno %i\n", generation_dir, errno);
+        return -1;
+    }
+
+    current = generation_current();
+    if (current < 0) {
+        return -1;
+    }
+    generation_next = current + 1;
+
+    // Left behind by a run that failed before publishing it
+    ret = generation_remove(generation_next);
+    if (ret) {
+        return ret;
+    }
+    path = generation_path(generation_dir, generation_next, NULL);
+    if (path == NULL) {
+        return -1;
+    }
+    ret = mkdir(path, 0777);
+    if (ret) {
+        fprintf(stderr, "Can't create %s, errno %i\n", path, errno);
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    *treetmp = generation_path(generation_dir, generation_next, "tree");
+    *datatmp = generation_path(generation_dir, generation_next, "data");
+    if (*treetmp == NULL || *datatmp == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int generation_sync(
+    const char *path
+) {
+    int ret;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return -1;
+    }
+    ret = fsync(fd);
+    close(fd);
+    if (ret) {
+        fprintf(stderr, "fsync() failed with errno %i for %s\n", errno, path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Points path at target, replacing whatever path was with one rename()
+int generation_link(
+    const char *path,
+    const char *target
+) {
+    int ret;
+    char *tmppath;
+    char current[PATH_MAX];
+    ssize_t length;
+
+    length = readlink(path, current, sizeof(current) - 1);
+    if (length >= 0) {
+        current[length] = '\0';
+        if (strcmp(current, target) == 0) {
+            return 0;
+        }
+    }
+
+    tmppath = malloc(strlen(path) + 5);
+    if (tmppath == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    sprintf(tmppath, "%s.new", path);
+
+    unlink(tmppath);
+    ret = symlink(target, tmppath);
+    if (ret) {
+        fprintf(stderr, "symlink() failed with errno %i for %s\n", errno, tmppath);
+        free(tmppath);
+        return -1;
+    }
+    ret = rename(tmppath, path);
+    if (ret) {
+        fprintf(stderr, "rename() failed with errno %i for %s\n", errno, path);
+        unlink(tmppath);
+        free(tmppath);
+        return -1;
+    }
+    free(tmppath);
+
+    return 0;
+}
+
+// Links the treefile and the datafile through current, relative to their
+// directory where they share one
+int generation_link_files(
+    const char *treepath,
+    const char *datapath
+) {
+    int ret;
+    char *tree_dir_copy;
+    char *data_dir_copy;
+    char *data_name_copy;
+    char *resolved;
+    char target[PATH_MAX];
+    int length;
+
+    tree_dir_copy = strdup(treepath);
+    data_dir_copy = strdup(datapath);
+    data_name_copy = strdup(datapath);
+    resolved = NULL;
+    ret = -1;
+    if (tree_dir_copy == NULL || data_dir_copy == NULL || data_name_copy == NULL) {
+        fprintf(stderr, "strdup() failed with errno %i\n", errno);
+        goto cleanup;
+    }
+
+    length = snprintf(target, sizeof(target), "%s%s/current/data", basename(data_name_copy), GENERATION_SUFFIX);
+    if (length >= (int)sizeof(target)) {
+        fprintf(stderr, "Path %s is too long\n", datapath);
+        goto cleanup;
+    }
+    ret = generation_link(datapath, target);
+    if (ret) {
+        goto cleanup;
+    }
+
+    if (strcmp(dirname(tree_dir_copy), dirname(data_dir_copy)) == 0) {
+        length = snprintf(target, sizeof(target), "%s%s/current/tree", basename(data_name_copy), GENERATION_SUFFIX);
+    } else {
+        resolved = realpath(generation_dir, NULL);
+        if (resolved == NULL) {
+            fprintf(stderr, "realpath() failed with errno %i for %s\n", errno, generation_dir);
+            ret = -1;
+            goto cleanup;
+        }
+        length = snprintf(target, sizeof(target), "%s/current/tree", resolved);
+    }
+    if (length >= (int)sizeof(target)) {
+        fprintf(stderr, "Path %s is too long\n", treepath);
+        ret = -1;
+        goto cleanup;
+    }
+    ret = generation_link(treepath, target);
+
+cleanup:
+    free(tree_dir_copy);
+    free(data_dir_copy);
+    free(data_name_copy);
+    free(resolved);
+
+    return ret;
+}
+
+// Switches current to the generation written since generation_open, then
+// drops the previous one; readers that have its files open keep them
+int generation_publish(
+    const char *treepath,
+    const char *datapath
+) {
+    int ret;
+    char *path;
+    char *current;
+    char *tmppath;
+    char target[32];
+
+    path = generation_path(generation_dir, generation_next, NULL);
+    if (path == NULL) {
+        return -1;
+    }
+    current = generation_path(generation_dir, -1, "current");
+    tmppath = generation_path(generation_dir, -1, "current.new");
+    if (current == NULL || tmppath == NULL) {
+        free(path);
+        free(current);
+        free(tmppath);
+        return -1;
+    }
+
+    // The new files must be on disk before current names them
+    ret = generation_sync(path);
+    for (int idx = 0; idx < 2 && ret == 0; idx++) {
+        free(path);
+        path = generation_path(generation_dir, generation_next, idx == 0 ? "tree" : "data");
+        ret = path != NULL ? generation_sync(path) : -1;
+    }
+
+    if (ret == 0) {
+        sprintf(target, "%lli", generation_next);
+        unlink(tmppath);
+        ret = symlink(target, tmppath);
+        if (ret) {
+            fprintf(stderr, "symlink() failed with errno %i for %s\n", errno, tmppath);
+        }
+    }
+    if (ret == 0) {
+        ret = rename(tmppath, current);
+        if (ret) {
+            fprintf(stderr, "rename() failed with errno %i for %s\n", errno, current);
+            unlink(tmppath);
+        }
+    }
+    if (ret == 0) {
+        ret = generation_sync(generation_dir);
+    }
+    free(path);
+    free(current);
+    free(tmppath);
+    if (ret) {
+        return -1;
+    }
+
+    ret = generation_link_files(treepath, datapath);
+    if (ret) {
+        return ret;
+    }
+
+    if (generation_next > 1) {
+        return generation_remove(generation_next - 1);
+    }
+
+    return 0;
+}
+
+// Resolves both paths to the files of one generation, which stay as they
+// are, so that a reader opening them one after the other can't pair files
+// of two generations. Plain files resolve to themselves.
+int generation_resolve(
+    const char *treepath,
+    const char *datapath,
+    char **treereal,
+    char **datareal
+) {
+    char *data_before;
+
+    for (int attempt = 0; attempt < GENERATION_RESOLVE_ATTEMPTS; attempt++) {
+        data_before = realpath(datapath, NULL);
+        *treereal = realpath(treepath, NULL);
+        *datareal = realpath(datapath, NULL);
+        if (data_before == NULL || *treereal == NULL || *datareal == NULL) {
+            fprintf(stderr, "realpath() failed with errno %i for %s or %s\n", errno, treepath, datapath);
+            free(data_before);
+            free(*treereal);
+            free(*datareal);
+            *treereal = NULL;
+            *datareal = NULL;
+            return -1;
+        }
+
+        // Generations only count up, so current didn't move if the
+        // datafile resolves the same on both sides of the treefile
+        if (strcmp(data_before, *datareal) == 0) {
+            free(data_before);
+            return 0;
+        }
+        free(data_before);
+        free(*treereal);
+        free(*datareal);
+    }
+
+    *treereal = NULL;
+    *datareal = NULL;
+    fprintf(stderr, "%s and %s keep changing\n", treepath, datapath);
+
+    return -1;
+}
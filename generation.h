@@ -0,0 +1,19 @@
+#ifndef METADUMP_GENERATION_H
+#define METADUMP_GENERATION_H
+
+// A dump that is rewritten while it is being read, as with --watch, is
+// published a generation at a time. Both files of generation N are written
+// to DATAFILE.gen/N/ and DATAFILE.gen/current is then switched to N with
+// one rename(). The treefile and the datafile are symlinks through current,
+// so they name the files of one generation at any time, and a crash or a
+// failed step leaves the previous generation in place.
+
+#define GENERATION_SUFFIX ".gen"
+
+int generation_open(const char *datapath, char **treetmp, char **datatmp);
+
+int generation_publish(const char *treepath, const char *datapath);
+
+int generation_resolve(const char *treepath, const char *datapath, char **treereal, char **datareal);
+
+#endif /* METADUMP_GENERATION_H */
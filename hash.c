@@ -0,0 +1,670 @@
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "hash.h"
+#include "throttle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <openssl/md5.h>
+
+// Per thread, so that several files can be hashed at once
+__thread char *hash_buff;
+
+pthread_mutex_t hash_zero_lock = PTHREAD_MUTEX_INITIALIZER;
+long long hash_zero_chunk;
+unsigned char hash_zero_digest[MD5_DIGEST_LENGTH];
+
+struct fingerprint_job {
+    int fd;
+    long long size;
+    int block_count;
+    pthread_mutex_t lock;
+    int next_block;
+    char *blocks;
+    ssize_t *lengths;
+};
+
+struct tree_job {
+    const char *filepath;
+    int fd;
+    long long size;
+    long long chunk;
+    long long chunk_count;
+    bool sparse;
+    pthread_mutex_t lock;
+    long long next_chunk;
+    int failed;
+    unsigned char *chunk_digests;
+};
+
+int hash_add_extent(
+    const char *filepath,
+    struct digest *dgst,
+    long long offset,
+    long long length
+) {
+    long long *extents;
+
+    if (dgst->extent_count == dgst->extent_alloc) {
+        extents = realloc(dgst->extents, 2 * (dgst->extent_alloc * 2 + 8) * sizeof(*extents));
+        if (extents == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i for %s\n", errno, filepath);
+            return -1;
+        }
+        dgst->extents = extents;
+        dgst->extent_alloc = dgst->extent_alloc * 2 + 8;
+    }
+
+    dgst->extents[2 * dgst->extent_count] = offset;
+    dgst->extents[2 * dgst->extent_count + 1] = length;
+    dgst->extent_count++;
+
+    return 0;
+}
+
+int hash_range(
+    const char *filepath,
+    int fd,
+    EVP_MD_CTX *mdctx,
+    char *buff,
+    long long offset,
+    long long length
+) {
+    int ret;
+    ssize_t bytes;
+    size_t want;
+
+    // A negative length reads up to the end of the file
+    while (length != 0) {
+        want = HASH_BUFF_SIZE;
+        if (length > 0 && length < want) {
+            want = length;
+        }
+
+        bytes = pread(fd, buff, want, offset);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            // Read errors end the digest early, like a short file would
+            break;
+        }
+        throttle_bytes(bytes);
+
+        ret = EVP_DigestUpdate(mdctx, buff, bytes);
+        if (ret != 1) {
+            fprintf(stderr, "EVP_DigestUpdate() failed with return code %i for %s\n", ret, filepath);
+            return -1;
+        }
+
+        offset += bytes;
+        if (length > 0) {
+            length -= bytes;
+        }
+    }
+
+    return 0;
+}
+
+void put_le64(
+    unsigned char *out,
+    unsigned long long value
+) {
+    for (int byte = 0; byte < 8; byte++) {
+        out[byte] = (value >> (8 * byte)) & 0xff;
+    }
+}
+
+int hash_holes(
+    const char *filepath,
+    EVP_MD_CTX *mdctx,
+    long long size,
+    struct digest *dgst
+) {
+    int ret;
+    unsigned char record[16];
+    long long offset;
+    long long end;
+
+    // Holes are fed in as little-endian (offset, length) pairs after all of
+    // the data, so a file without holes keeps its plain MD5
+    offset = 0;
+    for (long long idx = 0; idx <= dgst->extent_count; idx++) {
+        end = idx < dgst->extent_count ? dgst->extents[2 * idx] : size;
+        if (end > offset) {
+            put_le64(record, offset);
+            put_le64(record + 8, end - offset);
+            ret = EVP_DigestUpdate(mdctx, record, sizeof(record));
+            if (ret != 1) {
+                fprintf(stderr, "EVP_DigestUpdate() failed with return code %i for %s\n", ret, filepath);
+                return -1;
+            }
+            dgst->kind = DIGEST_MD5_SPARSE;
+        }
+        if (idx < dgst->extent_count) {
+            offset = dgst->extents[2 * idx] + dgst->extents[2 * idx + 1];
+        }
+    }
+
+    return 0;
+}
+
+int hash_sparse(
+    const char *filepath,
+    int fd,
+    EVP_MD_CTX *mdctx,
+    long long size,
+    struct digest *dgst
+) {
+    int ret;
+    off_t data;
+    off_t hole;
+    long long offset;
+
+    offset = 0;
+    while (offset < size) {
+        data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                // Nothing but a hole up to the end of the file
+                break;
+            }
+            return 1;
+        }
+        if (data >= size) {
+            break;
+        }
+
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            return 1;
+        }
+        if (hole > size) {
+            hole = size;
+        }
+
+        ret = hash_add_extent(filepath, dgst, data, hole - data);
+        if (ret) {
+            return ret;
+        }
+
+        ret = hash_range(filepath, fd, mdctx, hash_buff, data, hole - data);
+        if (ret) {
+            return ret;
+        }
+
+        offset = hole;
+    }
+
+    return hash_holes(filepath, mdctx, size, dgst);
+}
+
+int hash_map_extents(
+    const char *filepath,
+    int fd,
+    long long size,
+    struct digest *dgst
+) {
+    int ret;
+    off_t data;
+    off_t hole;
+    long long offset;
+
+    offset = 0;
+    while (offset < size) {
+        data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0 || data >= size) {
+            break;
+        }
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            break;
+        }
+        if (hole > size) {
+            hole = size;
+        }
+        ret = hash_add_extent(filepath, dgst, data, hole - data);
+        if (ret) {
+            return ret;
+        }
+        offset = hole;
+    }
+
+    return 0;
+}
+
+int hash_zero_chunk_digest(
+    const char *filepath,
+    long long chunk,
+    unsigned char *md_value
+) {
+    int ret;
+    char *zeros;
+    EVP_MD_CTX *mdctx;
+    unsigned int md_len;
+
+    pthread_mutex_lock(&hash_zero_lock);
+
+    ret = 0;
+    if (hash_zero_chunk != chunk) {
+        zeros = calloc(1, HASH_BUFF_SIZE);
+        mdctx = EVP_MD_CTX_new();
+        ret = -1;
+        if (zeros != NULL && mdctx != NULL && EVP_DigestInit_ex2(mdctx, EVP_md5(), NULL) == 1) {
+            ret = 0;
+            for (long long done = 0; done < chunk && !ret; done += HASH_BUFF_SIZE) {
+                if (EVP_DigestUpdate(mdctx, zeros, chunk - done < HASH_BUFF_SIZE ? chunk - done : HASH_BUFF_SIZE) != 1) {
+                    ret = -1;
+                }
+            }
+            if (!ret && EVP_DigestFinal_ex(mdctx, hash_zero_digest, &md_len) == 1) {
+                hash_zero_chunk = chunk;
+            } else {
+                ret = -1;
+            }
+        }
+        if (ret) {
+            fprintf(stderr, "hashing a zero chunk failed for %s\n", filepath);
+        }
+        EVP_MD_CTX_free(mdctx);
+        free(zeros);
+    }
+    if (!ret) {
+        memcpy(md_value, hash_zero_digest, MD5_DIGEST_LENGTH);
+    }
+
+    pthread_mutex_unlock(&hash_zero_lock);
+
+    return ret;
+}
+
+void *hash_tree_worker(
+    void *arg
+) {
+    struct tree_job *job = arg;
+    int ret;
+    long long idx;
+    long long start;
+    long long length;
+    off_t data;
+    char *buff;
+    EVP_MD_CTX *mdctx;
+    unsigned int md_len;
+
+    buff = malloc(HASH_BUFF_SIZE);
+    mdctx = EVP_MD_CTX_new();
+    if (buff == NULL || mdctx == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i for %s\n", errno, job->filepath);
+        pthread_mutex_lock(&job->lock);
+        job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+        free(buff);
+        EVP_MD_CTX_free(mdctx);
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        idx = job->failed ? job->chunk_count : job->next_chunk++;
+        pthread_mutex_unlock(&job->lock);
+        if (idx >= job->chunk_count) {
+            break;
+        }
+
+        start = idx * job->chunk;
+        length = job->size - start < job->chunk ? job->size - start : job->chunk;
+
+        if (job->sparse && length == job->chunk) {
+            // A chunk that lies entirely in a hole hashes like any other zero chunk
+            data = lseek(job->fd, start, SEEK_DATA);
+            if ((data < 0 && errno == ENXIO) || data >= start + length) {
+                ret = hash_zero_chunk_digest(job->filepath, job->chunk, &job->chunk_digests[idx * MD5_DIGEST_LENGTH]);
+                if (ret) {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        ret = EVP_DigestInit_ex2(mdctx, EVP_md5(), NULL) == 1 ? 0 : -1;
+        if (!ret) {
+            ret = hash_range(job->filepath, job->fd, mdctx, buff, start, length);
+        }
+        if (!ret) {
+            ret = EVP_DigestFinal_ex(mdctx, &job->chunk_digests[idx * MD5_DIGEST_LENGTH], &md_len) == 1 ? 0 : -1;
+        }
+        if (ret) {
+            break;
+        }
+    }
+
+    if (idx < job->chunk_count) {
+        pthread_mutex_lock(&job->lock);
+        job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    EVP_MD_CTX_free(mdctx);
+    free(buff);
+
+    return NULL;
+}
+
+int hash_tree(
+    const char *filepath,
+    int fd,
+    long long size,
+    const struct hash_opts *opts,
+    struct digest *dgst
+) {
+    int ret;
+    int thread_count;
+    pthread_t *threads;
+    struct tree_job job;
+    unsigned char header[16];
+    EVP_MD_CTX *mdctx;
+
+    memset(&job, 0x00, sizeof(job));
+    job.filepath = filepath;
+    job.fd = fd;
+    job.size = size;
+    job.chunk = opts->tree_chunk;
+    job.chunk_count = (size + opts->tree_chunk - 1) / opts->tree_chunk;
+    job.sparse = opts->sparse;
+    pthread_mutex_init(&job.lock, NULL);
+
+    job.chunk_digests = malloc(job.chunk_count * MD5_DIGEST_LENGTH);
+    if (job.chunk_digests == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i for %s\n", errno, filepath);
+        return -1;
+    }
+
+    thread_count = opts->threads;
+    if (thread_count > job.chunk_count) {
+        thread_count = job.chunk_count;
+    }
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+
+    threads = malloc(thread_count * sizeof(*threads));
+    if (threads == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i for %s\n", errno, filepath);
+        free(job.chunk_digests);
+        return -1;
+    }
+
+    // The calling thread is worker 0
+    for (int idx = 1; idx < thread_count; idx++) {
+        ret = pthread_create(&threads[idx], NULL, hash_tree_worker, &job);
+        if (ret) {
+            fprintf(stderr, "pthread_create() failed with return code %i for %s\n", ret, filepath);
+            thread_count = idx;
+            break;
+        }
+    }
+    hash_tree_worker(&job);
+    for (int idx = 1; idx < thread_count; idx++) {
+        pthread_join(threads[idx], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+
+    if (job.failed) {
+        free(job.chunk_digests);
+        return -1;
+    }
+
+    // Root digest: MD5 over the chunk size, the file size and every chunk digest
+    put_le64(header, job.chunk);
+    put_le64(header + 8, job.size);
+
+    mdctx = EVP_MD_CTX_new();
+    ret = -1;
+    if (mdctx != NULL &&
+        EVP_DigestInit_ex2(mdctx, EVP_md5(), NULL) == 1 &&
+        EVP_DigestUpdate(mdctx, header, sizeof(header)) == 1 &&
+        EVP_DigestUpdate(mdctx, job.chunk_digests, job.chunk_count * MD5_DIGEST_LENGTH) == 1 &&
+        EVP_DigestFinal_ex(mdctx, dgst->md_value, &dgst->md_len) == 1) {
+        ret = 0;
+    } else {
+        fprintf(stderr, "computing the root digest failed for %s\n", filepath);
+    }
+    EVP_MD_CTX_free(mdctx);
+    free(job.chunk_digests);
+
+    dgst->kind = DIGEST_MD5_TREE;
+    dgst->chunk_size = job.chunk;
+
+    return ret;
+}
+
+// Block 0 is the head of the file, the last block its tail, and the
+// others are spread evenly in between
+void *hash_fingerprint_worker(
+    void *arg
+) {
+    struct fingerprint_job *job = arg;
+    int idx;
+    long long offset;
+    ssize_t bytes;
+    char *block;
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        idx = job->next_block++;
+        pthread_mutex_unlock(&job->lock);
+        if (idx >= job->block_count) {
+            break;
+        }
+
+        offset = idx * (job->size - HASH_FINGERPRINT_BLOCK) / (job->block_count - 1);
+        block = job->blocks + (long long)idx * HASH_FINGERPRINT_BLOCK;
+        job->lengths[idx] = 0;
+        while (job->lengths[idx] < HASH_FINGERPRINT_BLOCK) {
+            bytes = pread(
+                job->fd,
+                block + job->lengths[idx],
+                HASH_FINGERPRINT_BLOCK - job->lengths[idx],
+                offset + job->lengths[idx]
+            );
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes <= 0) {
+                // Read errors end the block early, like a short file would
+                break;
+            }
+            throttle_bytes(bytes);
+            job->lengths[idx] += bytes;
+        }
+    }
+
+    return NULL;
+}
+
+int hash_fingerprint(
+    const char *filepath,
+    int fd,
+    long long size,
+    const struct hash_opts *opts,
+    struct digest *dgst
+) {
+    int ret;
+    int thread_count;
+    pthread_t *threads;
+    struct fingerprint_job job;
+    unsigned char header[24];
+    EVP_MD_CTX *mdctx;
+
+    memset(&job, 0x00, sizeof(job));
+    job.fd = fd;
+    job.size = size;
+    job.block_count = opts->fingerprint_blocks;
+    pthread_mutex_init(&job.lock, NULL);
+
+    job.blocks = malloc((long long)job.block_count * HASH_FINGERPRINT_BLOCK);
+    job.lengths = malloc(job.block_count * sizeof(*job.lengths));
+    thread_count = opts->threads < job.block_count ? opts->threads : job.block_count;
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+    threads = malloc(thread_count * sizeof(*threads));
+    if (job.blocks == NULL || job.lengths == NULL || threads == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i for %s\n", errno, filepath);
+        free(job.blocks);
+        free(job.lengths);
+        free(threads);
+        return -1;
+    }
+
+    // The calling thread is worker 0
+    for (int idx = 1; idx < thread_count; idx++) {
+        ret = pthread_create(&threads[idx], NULL, hash_fingerprint_worker, &job);
+        if (ret) {
+            fprintf(stderr, "pthread_create() failed with return code %i for %s\n", ret, filepath);
+            thread_count = idx;
+            break;
+        }
+    }
+    hash_fingerprint_worker(&job);
+    for (int idx = 1; idx < thread_count; idx++) {
+        pthread_join(threads[idx], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+
+    // MD5 over the block size, the block count, the file size and the blocks
+    put_le64(header, HASH_FINGERPRINT_BLOCK);
+    put_le64(header + 8, job.block_count);
+    put_le64(header + 16, size);
+
+    mdctx = EVP_MD_CTX_new();
+    ret = mdctx != NULL &&
+        EVP_DigestInit_ex2(mdctx, EVP_md5(), NULL) == 1 &&
+        EVP_DigestUpdate(mdctx, header, sizeof(header)) == 1 ? 0 : -1;
+    for (int idx = 0; idx < job.block_count && !ret; idx++) {
+        if (EVP_DigestUpdate(mdctx, job.blocks + (long long)idx * HASH_FINGERPRINT_BLOCK, job.lengths[idx]) != 1) {
+            ret = -1;
+        }
+    }
+    if (!ret && EVP_DigestFinal_ex(mdctx, dgst->md_value, &dgst->md_len) != 1) {
+        ret = -1;
+    }
+    if (ret) {
+        fprintf(stderr, "computing the fingerprint failed for %s\n", filepath);
+    }
+    EVP_MD_CTX_free(mdctx);
+    free(job.blocks);
+    free(job.lengths);
+
+    dgst->kind = DIGEST_MD5_FINGERPRINT;
+    dgst->chunk_size = job.block_count;
+
+    return ret;
+}
+
+int hash_fd(
+    const char *filepath,
+    int fd,
+    long long size,
+    const struct hash_opts *opts,
+    struct digest *dgst
+) {
+    int ret;
+    EVP_MD_CTX *mdctx;
+
+    if (hash_buff == NULL) {
+        hash_buff = malloc(HASH_BUFF_SIZE);
+        if (hash_buff == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i for %s\n", errno, filepath);
+            return -1;
+        }
+    }
+
+    dgst->kind = DIGEST_MD5;
+    dgst->extent_count = 0;
+    dgst->chunk_size = 0;
+
+    // Files no larger than the blocks are hashed in full
+    if (opts->fingerprint_blocks > 0 && size > (long long)opts->fingerprint_blocks * HASH_FINGERPRINT_BLOCK) {
+        return hash_fingerprint(filepath, fd, size, opts, dgst);
+    }
+
+    if (opts->tree_chunk > 0 && size > opts->tree_chunk) {
+        ret = hash_tree(filepath, fd, size, opts, dgst);
+        if (!ret && opts->extents) {
+            ret = hash_map_extents(filepath, fd, size, dgst);
+        }
+        return ret;
+    }
+
+    mdctx = EVP_MD_CTX_new();
+    if (mdctx == NULL) {
+        fprintf(stderr, "EVP_MD_CTX_new() failed for %s\n", filepath);
+        return -1;
+    }
+
+    ret = EVP_DigestInit_ex2(mdctx, EVP_md5(), NULL);
+    if (ret != 1) {
+        fprintf(stderr, "EVP_DigestInit_ex2() failed with return code %i for %s\n", ret, filepath);
+        EVP_MD_CTX_free(mdctx);
+        return -1;
+    }
+
+    ret = 1;
+    if (opts->sparse && size > 0) {
+        ret = hash_sparse(filepath, fd, mdctx, size, dgst);
+        if (ret > 0) {
+            // SEEK_DATA/SEEK_HOLE unusable, start over with a full read
+            dgst->kind = DIGEST_MD5;
+            dgst->extent_count = 0;
+            ret = EVP_DigestInit_ex2(mdctx, EVP_md5(), NULL) == 1 ? 1 : -1;
+        }
+    }
+    if (ret > 0) {
+        ret = hash_range(filepath, fd, mdctx, hash_buff, 0, -1);
+    }
+    if (ret) {
+        EVP_MD_CTX_free(mdctx);
+        return -1;
+    }
+
+    if (!opts->extents) {
+        dgst->extent_count = 0;
+    } else if (dgst->kind == DIGEST_MD5 && dgst->extent_count == 0 && size > 0) {
+        // Full read, so the whole file is one extent
+        ret = hash_add_extent(filepath, dgst, 0, size);
+        if (ret) {
+            EVP_MD_CTX_free(mdctx);
+            return ret;
+        }
+    }
+
+    ret = EVP_DigestFinal_ex(mdctx, dgst->md_value, &dgst->md_len);
+    if (ret != 1) {
+        fprintf(stderr, "EVP_DigestFinal_ex() failed with return code %i for %s\n", ret, filepath);
+        EVP_MD_CTX_free(mdctx);
+        return -1;
+    }
+
+    EVP_MD_CTX_free(mdctx);
+
+    return 0;
+}
+
+void hash_free(
+    struct digest *dgst
+) {
+    free(dgst->extents);
+    dgst->extents = NULL;
+    dgst->extent_alloc = 0;
+    dgst->extent_count = 0;
+    free(hash_buff);
+    hash_buff = NULL;
+}
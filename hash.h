@@ -0,0 +1,38 @@
+#ifndef METADUMP_HASH_H
+#define METADUMP_HASH_H
+
+#include <stdbool.h>
+#include <openssl/evp.h>
+
+#define HASH_BUFF_SIZE (128 * 1024)
+#define HASH_FINGERPRINT_BLOCK (64 * 1024)
+
+struct hash_opts {
+    bool sparse;
+    bool extents;
+    long long tree_chunk; // chunk size of the tree hash, 0 to disable
+    int fingerprint_blocks; // blocks sampled from larger files, 0 to disable
+    int threads;
+};
+
+struct digest {
+    int kind;
+    unsigned int md_len;
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+    long long chunk_size;
+    long long extent_count;
+    long long extent_alloc;
+    long long *extents; // offset/length pairs of the data extents
+};
+
+int hash_fd(
+    const char *filepath,
+    int fd,
+    long long size,
+    const struct hash_opts *opts,
+    struct digest *dgst
+);
+
+void hash_free(struct digest *dgst);
+
+#endif /* METADUMP_HASH_H */
@@ -0,0 +1,513 @@
+#define _GNU_SOURCE
+
+#include "inodes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// Entries are sorted in runs of this many and spilled to a temporary file,
+// which close merges into the index, so memory stays bounded on trees with
+// hundreds of millions of inodes
+#define INODES_RUN_ENTRIES (1024 * 1024)
+#define INODES_MERGE_ENTRIES 1024
+
+struct inodes_entry {
+    unsigned long long ino;
+    unsigned int dev_major;
+    unsigned int dev_minor;
+    long long tree_offset;
+    long long datafile_pos;
+    long long path_offset;
+    long long path_length;
+};
+
+// A sorted run in the spill file, with the part of it being merged
+struct inodes_run {
+    long long next;       // index in the spill file of the next entry to read
+    long long end;
+    struct inodes_entry *buff;
+    int buffered;
+    int used;
+};
+
+FILE *inodesfile;
+long long inodes_path_offset;
+struct inodes_entry *inodes_entries;
+long long inodes_count;
+long long inodes_alloc;
+long long inodes_total;
+FILE *inodes_spill;
+long long inodes_spilled;
+long long *inodes_run_ends;
+int inodes_run_count;
+
+int inodes_open(
+    const char *indexpath
+) {
+    int ret;
+
+    inodesfile = fopen(indexpath, "wb");
+    if (inodesfile == NULL) {
+        fprintf(stderr, "Can't open inode index %s\n", indexpath);
+        return -1;
+    }
+
+    ret = fwrite(&VERSION, sizeof(VERSION), 1, inodesfile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    inodes_path_offset = sizeof(VERSION);
+    inodes_count = 0;
+    inodes_total = 0;
+    inodes_spilled = 0;
+    inodes_run_count = 0;
+
+    return 0;
+}
+
+int compare_inodes_entries(
+    const void *a,
+    const void *b
+) {
+    const struct inodes_entry *entry_a = a;
+    const struct inodes_entry *entry_b = b;
+
+    if (entry_a->ino != entry_b->ino) {
+        return entry_a->ino < entry_b->ino ? -1 : 1;
+    }
+    if (entry_a->dev_major != entry_b->dev_major) {
+        return entry_a->dev_major < entry_b->dev_major ? -1 : 1;
+    }
+    if (entry_a->dev_minor != entry_b->dev_minor) {
+        return entry_a->dev_minor < entry_b->dev_minor ? -1 : 1;
+    }
+    // Hard links in tree order
+    return (entry_a->path_offset > entry_b->path_offset) - (entry_a->path_offset < entry_b->path_offset);
+}
+
+int inodes_spill_run(void) {
+    ssize_t bytes;
+    size_t length;
+    long long *new_run_ends;
+
+    if (inodes_spill == NULL) {
+        inodes_spill = tmpfile();
+        if (inodes_spill == NULL) {
+            fprintf(stderr, "tmpfile() failed with errno %i\n", errno);
+            return -1;
+        }
+    }
+    new_run_ends = realloc(inodes_run_ends, (inodes_run_count + 1) * sizeof(*inodes_run_ends));
+    if (new_run_ends == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    inodes_run_ends = new_run_ends;
+
+    qsort(inodes_entries, inodes_count, sizeof(*inodes_entries), compare_inodes_entries);
+
+    length = inodes_count * sizeof(*inodes_entries);
+    bytes = pwrite(fileno(inodes_spill), inodes_entries, length, inodes_spilled * sizeof(*inodes_entries));
+    if (bytes != (ssize_t)length) {
+        fprintf(stderr, "pwrite() failed with errno %i\n", errno);
+        return -1;
+    }
+    inodes_spilled += inodes_count;
+    inodes_run_ends[inodes_run_count++] = inodes_spilled;
+    inodes_count = 0;
+
+    return 0;
+}
+
+// treefile is NULL for the root, which has no tree entry
+int inodes_add(
+    const struct statx_data *stx,
+    FILE *treefile,
+    const char *relpath,
+    long long datafile_pos
+) {
+    int ret;
+    long long new_alloc;
+    struct inodes_entry *entry;
+    struct inodes_entry *new_entries;
+
+    if (inodesfile == NULL || stx->ret || !(stx->buff.stx_mask & STATX_INO)) {
+        return 0;
+    }
+
+    if (inodes_count == INODES_RUN_ENTRIES) {
+        ret = inodes_spill_run();
+        if (ret) {
+            return ret;
+        }
+    }
+    if (inodes_count == inodes_alloc) {
+        new_alloc = inodes_alloc * 2 + 1024;
+        if (new_alloc > INODES_RUN_ENTRIES) {
+            new_alloc = INODES_RUN_ENTRIES;
+        }
+        new_entries = realloc(inodes_entries, new_alloc * sizeof(*inodes_entries));
+        if (new_entries == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            return -1;
+        }
+        inodes_entries = new_entries;
+        inodes_alloc = new_alloc;
+    }
+    entry = &inodes_entries[inodes_count];
+
+    entry->ino = stx->buff.stx_ino;
+    entry->dev_major = stx->buff.stx_dev_major;
+    entry->dev_minor = stx->buff.stx_dev_minor;
+    entry->tree_offset = -1;
+    if (treefile != NULL) {
+        entry->tree_offset = ftello(treefile);
+        if (entry->tree_offset < 0) {
+            fprintf(stderr, "ftello() failed with errno %i\n", errno);
+            return -1;
+        }
+    }
+    entry->datafile_pos = datafile_pos;
+    entry->path_offset = inodes_path_offset;
+    entry->path_length = strlen(relpath);
+
+    // Paths go to the file right away, only the fixed-size entries are
+    // kept for sorting
+    if (entry->path_length > 0) {
+        ret = fwrite(relpath, entry->path_length, 1, inodesfile);
+        if (ret != 1) {
+            fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+            return -1;
+        }
+    }
+    inodes_path_offset += entry->path_length;
+    inodes_count++;
+    inodes_total++;
+
+    return 0;
+}
+
+// Returns 1 if the run has an entry to merge, 0 once it is exhausted
+int inodes_fill_run(
+    struct inodes_run *run
+) {
+    ssize_t bytes;
+    size_t length;
+
+    if (run->used < run->buffered) {
+        return 1;
+    }
+    if (run->next == run->end) {
+        return 0;
+    }
+
+    run->buffered = run->end - run->next < INODES_MERGE_ENTRIES ? run->end - run->next : INODES_MERGE_ENTRIES;
+    length = run->buffered * sizeof(*run->buff);
+    bytes = pread(fileno(inodes_spill), run->buff, length, run->next * sizeof(*run->buff));
+    if (bytes != (ssize_t)length) {
+        fprintf(stderr, "pread() failed with errno %i\n", errno);
+        return -1;
+    }
+    run->next += run->buffered;
+    run->used = 0;
+
+    return 1;
+}
+
+// Restores the min-heap of runs below slot
+void inodes_sift_down(
+    int *heap,
+    int heap_size,
+    int slot,
+    const struct inodes_run *runs
+) {
+    int child;
+    int top;
+    const struct inodes_run *a;
+    const struct inodes_run *b;
+
+    for (;;) {
+        child = 2 * slot + 1;
+        if (child >= heap_size) {
+            return;
+        }
+        if (child + 1 < heap_size) {
+            a = &runs[heap[child + 1]];
+            b = &runs[heap[child]];
+            if (compare_inodes_entries(&a->buff[a->used], &b->buff[b->used]) < 0) {
+                child++;
+            }
+        }
+        a = &runs[heap[child]];
+        b = &runs[heap[slot]];
+        if (compare_inodes_entries(&a->buff[a->used], &b->buff[b->used]) >= 0) {
+            return;
+        }
+        top = heap[slot];
+        heap[slot] = heap[child];
+        heap[child] = top;
+        slot = child;
+    }
+}
+
+int inodes_merge_runs(void) {
+    int ret;
+    int heap_size;
+    int *heap;
+    struct inodes_run *runs;
+    struct inodes_run *run;
+
+    runs = calloc(inodes_run_count, sizeof(*runs));
+    heap = malloc(inodes_run_count * sizeof(*heap));
+    if (runs == NULL || heap == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        free(runs);
+        free(heap);
+        return -1;
+    }
+
+    ret = 0;
+    heap_size = 0;
+    for (int idx = 0; idx < inodes_run_count && ret == 0; idx++) {
+        runs[idx].next = idx > 0 ? inodes_run_ends[idx - 1] : 0;
+        runs[idx].end = inodes_run_ends[idx];
+        runs[idx].buff = malloc(INODES_MERGE_ENTRIES * sizeof(*runs[idx].buff));
+        if (runs[idx].buff == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            ret = -1;
+            break;
+        }
+        ret = inodes_fill_run(&runs[idx]);
+        if (ret > 0) {
+            heap[heap_size++] = idx;
+            ret = 0;
+        }
+    }
+    for (int slot = heap_size / 2 - 1; slot >= 0 && ret == 0; slot--) {
+        inodes_sift_down(heap, heap_size, slot, runs);
+    }
+
+    while (heap_size > 0 && ret == 0) {
+        run = &runs[heap[0]];
+        if (fwrite(&run->buff[run->used], sizeof(*run->buff), 1, inodesfile) != 1) {
+            fprintf(stderr, "fwrite() failed with errno %i\n", errno);
+            ret = -1;
+            break;
+        }
+        run->used++;
+        ret = inodes_fill_run(run);
+        if (ret < 0) {
+            break;
+        }
+        if (ret == 0) {
+            heap[0] = heap[--heap_size];
+        }
+        ret = 0;
+        inodes_sift_down(heap, heap_size, 0, runs);
+    }
+
+    for (int idx = 0; idx < inodes_run_count; idx++) {
+        free(runs[idx].buff);
+    }
+    free(runs);
+    free(heap);
+
+    return ret;
+}
+
+int inodes_close(void) {
+    int ret;
+    long long trailer[2];
+
+    if (inodesfile == NULL) {
+        return 0;
+    }
+
+    if (inodes_run_count == 0) {
+        qsort(inodes_entries, inodes_count, sizeof(*inodes_entries), compare_inodes_entries);
+        ret = fwrite(inodes_entries, sizeof(*inodes_entries), inodes_count, inodesfile);
+        if (ret != inodes_count) {
+            fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+            return -1;
+        }
+    } else {
+        if (inodes_count > 0) {
+            ret = inodes_spill_run();
+            if (ret) {
+                return ret;
+            }
+        }
+        // The entries buffer isn't needed for the merge
+        free(inodes_entries);
+        inodes_entries = NULL;
+        inodes_alloc = 0;
+        ret = inodes_merge_runs();
+        if (ret) {
+            return ret;
+        }
+        fclose(inodes_spill);
+        inodes_spill = NULL;
+        free(inodes_run_ends);
+        inodes_run_ends = NULL;
+        inodes_run_count = 0;
+    }
+    trailer[0] = inodes_path_offset;
+    trailer[1] = inodes_total;
+    ret = fwrite(trailer, sizeof(trailer), 1, inodesfile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    free(inodes_entries);
+    inodes_entries = NULL;
+    inodes_count = 0;
+    inodes_alloc = 0;
+
+    ret = fclose(inodesfile);
+    inodesfile = NULL;
+    if (ret) {
+        fprintf(stderr, "fclose() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+int inodes_read(
+    FILE *file,
+    long long offset,
+    void *buff,
+    size_t length
+) {
+    int ret;
+
+    ret = fseeko(file, offset, SEEK_SET);
+    if (ret) {
+        fprintf(stderr, "fseeko() failed with errno %i\n", errno);
+        return -1;
+    }
+    ret = fread(buff, length, 1, file);
+    if (ret != 1) {
+        fprintf(stderr, "Truncated inode index at offset %lli\n", offset);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Binary search for the first entry of ino, then every entry after it
+// with the same inode number, on any device
+int inodes_find(
+    const char *indexpath,
+    unsigned long long ino,
+    struct inodes_match **matches,
+    int *match_count
+) {
+    int ret;
+    FILE *file;
+    int version[3];
+    long long trailer[2];
+    long long low;
+    long long high;
+    long long mid;
+    struct inodes_entry entry;
+    struct inodes_match *match;
+    struct inodes_match *new_matches;
+
+    *matches = NULL;
+    *match_count = 0;
+
+    file = fopen(indexpath, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Can't open inode index %s\n", indexpath);
+        return -1;
+    }
+
+    ret = inodes_read(file, 0, version, sizeof(version));
+    if (!ret) {
+        ret = compare_versions(version, VERSION);
+    }
+    if (!ret) {
+        ret = fseeko(file, -(off_t)sizeof(trailer), SEEK_END);
+        if (ret || fread(trailer, sizeof(trailer), 1, file) != 1) {
+            fprintf(stderr, "Truncated inode index %s\n", indexpath);
+            ret = -1;
+        }
+    }
+    if (ret) {
+        fclose(file);
+        return ret;
+    }
+
+    low = 0;
+    high = trailer[1];
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        ret = inodes_read(file, trailer[0] + mid * sizeof(entry), &entry, sizeof(entry));
+        if (ret) {
+            fclose(file);
+            return ret;
+        }
+        if (entry.ino < ino) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    for (; low < trailer[1]; low++) {
+        ret = inodes_read(file, trailer[0] + low * sizeof(entry), &entry, sizeof(entry));
+        if (ret) {
+            break;
+        }
+        if (entry.ino != ino) {
+            break;
+        }
+
+        new_matches = realloc(*matches, (*match_count + 1) * sizeof(**matches));
+        if (new_matches == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            ret = -1;
+            break;
+        }
+        *matches = new_matches;
+        match = &(*matches)[*match_count];
+        match->path = malloc(entry.path_length + 1);
+        if (match->path == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            ret = -1;
+            break;
+        }
+        (*match_count)++;
+        match->dev_major = entry.dev_major;
+        match->dev_minor = entry.dev_minor;
+        match->tree_offset = entry.tree_offset;
+        match->datafile_pos = entry.datafile_pos;
+        match->path[entry.path_length] = '\0';
+        if (entry.path_length > 0) {
+            ret = inodes_read(file, entry.path_offset, match->path, entry.path_length);
+            if (ret) {
+                break;
+            }
+        }
+    }
+
+    fclose(file);
+
+    return ret;
+}
+
+void inodes_free(
+    struct inodes_match *matches,
+    int match_count
+) {
+    for (int idx = 0; idx < match_count; idx++) {
+        free(matches[idx].path);
+    }
+    free(matches);
+}
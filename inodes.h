@@ -0,0 +1,30 @@
+#ifndef METADUMP_INODES_H
+#define METADUMP_INODES_H
+
+#include "common.h"
+
+#include <stdio.h>
+
+// Maps (inode, device) to the records and paths of a dump, hard links
+// included. The paths come first, then the entries sorted by inode and
+// device, then the offset of the entries and their count.
+
+struct inodes_match {
+    unsigned int dev_major;
+    unsigned int dev_minor;
+    long long tree_offset;    // of the tree entry, -1 for the root
+    long long datafile_pos;
+    char *path;               // relative to the root, "" for the root
+};
+
+int inodes_open(const char *indexpath);
+
+int inodes_add(const struct statx_data *stx, FILE *treefile, const char *relpath, long long datafile_pos);
+
+int inodes_close(void);
+
+int inodes_find(const char *indexpath, unsigned long long ino, struct inodes_match **matches, int *match_count);
+
+void inodes_free(struct inodes_match *matches, int match_count);
+
+#endif /* METADUMP_INODES_H */
@@ -0,0 +1,807 @@
+#define _GNU_SOURCE
+
+#include "journal.h"
+#include "generation.h"
+#include "pathmap.h"
+#include "reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define COPY_BUFF_SIZE (128 * 1024)
+
+// Latest journal entry of a path
+struct journal_path {
+    char *path;
+    int op;
+    bool is_dir;
+    bool emitted;
+    long long seq;
+    long long replace_seq; // seq of the last create or delete, -1 if none
+    off_t dirent_offset;  // the record follows the dirent
+    long long record_length;
+    long long next_child; // next path with the same parent, -1 at the end
+};
+
+FILE *journalfile;
+char *journal_path_name;
+
+// Compaction state
+FILE *compact_journal;
+FILE *compact_tree;
+int compact_data_fd;
+struct data_reader compact_reader;
+struct md_record compact_rec;
+FILE *compact_tree_out;
+FILE *compact_data_out;
+long long compact_data_pos;
+struct pathmap compact_paths;
+struct pathmap compact_children;
+struct journal_path *compact_jpaths;
+long long compact_jpath_count;
+long long compact_jpath_alloc;
+long long compact_lookahead;
+bool compact_have_lookahead;
+char *compact_buff;
+
+int journal_open(
+    const char *journalpath
+) {
+    int ret;
+
+    // The journal only holds changes on top of the dump just taken
+    journalfile = fopen(journalpath, "w+b");
+    if (journalfile == NULL) {
+        fprintf(stderr, "Can't open journal %s\n", journalpath);
+        return -1;
+    }
+
+    ret = fwrite(&VERSION, sizeof(VERSION), 1, journalfile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    journal_path_name = strdup(journalpath);
+    if (journal_path_name == NULL) {
+        fprintf(stderr, "strdup() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return journal_flush();
+}
+
+int journal_append(
+    int op,
+    const char *path,
+    const struct dirent *de,
+    const char *record,
+    size_t record_length
+) {
+    int ret;
+    struct journal_entry entry;
+
+    entry.op = op;
+    entry.path_length = strlen(path);
+    entry.record_length = op == JOURNAL_DELETE || op == JOURNAL_PRUNED ? 0 : record_length;
+
+    ret = fwrite(&entry, sizeof(entry), 1, journalfile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    if (entry.path_length > 0) {
+        ret = fwrite(path, entry.path_length, 1, journalfile);
+        if (ret != 1) {
+            fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+            return -1;
+        }
+    }
+    if (op == JOURNAL_DELETE) {
+        return 0;
+    }
+
+    ret = fwrite(de, sizeof(*de), 1, journalfile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    if (op == JOURNAL_PRUNED) {
+        return 0;
+    }
+    ret = fwrite(record, record_length, 1, journalfile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+int journal_flush(void) {
+    int ret;
+
+    ret = fflush(journalfile);
+    if (ret) {
+        fprintf(stderr, "fflush() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Bytes of entries, 0 when there is nothing to compact
+long long journal_size(void) {
+    return ftello(journalfile) - (long long)sizeof(VERSION);
+}
+
+int journal_reset(void) {
+    int ret;
+
+    ret = journal_flush();
+    if (ret) {
+        return ret;
+    }
+    ret = ftruncate(fileno(journalfile), sizeof(VERSION));
+    if (ret) {
+        fprintf(stderr, "ftruncate() failed with errno %i\n", errno);
+        return -1;
+    }
+    ret = fseeko(journalfile, sizeof(VERSION), SEEK_SET);
+    if (ret) {
+        fprintf(stderr, "fseeko() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+int journal_close(void) {
+    int ret;
+
+    free(journal_path_name);
+    ret = fclose(journalfile);
+    if (ret) {
+        fprintf(stderr, "fclose() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct journal_path *compact_lookup(
+    const char *path,
+    long long min_seq
+) {
+    long long *id;
+
+    id = pathmap_get(&compact_paths, path);
+    if (id == NULL || compact_jpaths[*id].seq <= min_seq) {
+        return NULL;
+    }
+
+    return &compact_jpaths[*id];
+}
+
+int compact_load(void) {
+    int ret;
+    int version[3];
+    long long seq;
+    long long *id;
+    char *path;
+    char *parent_end;
+    struct journal_entry entry;
+    struct journal_path *jpath;
+    struct dirent de;
+    struct statx_data stx;
+
+    compact_journal = fopen(journal_path_name, "rb");
+    if (compact_journal == NULL) {
+        fprintf(stderr, "Can't open journal %s\n", journal_path_name);
+        return -1;
+    }
+    ret = fread(&version, sizeof(version), 1, compact_journal);
+    if (ret != 1) {
+        fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    ret = compare_versions(version, VERSION);
+    if (ret) {
+        return ret;
+    }
+
+    path = malloc(PATH_MAX + 1);
+    if (path == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    // A torn entry at the end is what an interrupted append leaves behind
+    for (seq = 0; fread(&entry, sizeof(entry), 1, compact_journal) == 1; seq++) {
+        if (entry.path_length < 0 || entry.path_length > PATH_MAX) {
+            fprintf(stderr, "Corrupt journal entry %lli\n", seq);
+            free(path);
+            return -1;
+        }
+        if (entry.path_length > 0 && fread(path, entry.path_length, 1, compact_journal) != 1) {
+            break;
+        }
+        path[entry.path_length] = '\0';
+
+        if (entry.op != JOURNAL_DELETE) {
+            if (fread(&de, sizeof(de), 1, compact_journal) != 1) {
+                break;
+            }
+        }
+        if (entry.op != JOURNAL_DELETE && entry.op != JOURNAL_PRUNED) {
+            if (fread(&stx, sizeof(stx), 1, compact_journal) != 1) {
+                break;
+            }
+        }
+
+        id = pathmap_put(&compact_paths, path);
+        if (id == NULL) {
+            free(path);
+            return -1;
+        }
+        if (compact_paths.used > (size_t)compact_jpath_count) {
+            if (compact_jpath_count == compact_jpath_alloc) {
+                compact_jpath_alloc = compact_jpath_alloc ? 2 * compact_jpath_alloc : 1024;
+                jpath = realloc(compact_jpaths, compact_jpath_alloc * sizeof(*compact_jpaths));
+                if (jpath == NULL) {
+                    fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                    free(path);
+                    return -1;
+                }
+                compact_jpaths = jpath;
+            }
+            *id = compact_jpath_count++;
+            jpath = &compact_jpaths[*id];
+            memset(jpath, 0x00, sizeof(*jpath));
+            jpath->path = strdup(path);
+            jpath->replace_seq = -1;
+            jpath->next_child = -1;
+            if (jpath->path == NULL) {
+                fprintf(stderr, "strdup() failed with errno %i\n", errno);
+                free(path);
+                return -1;
+            }
+        }
+        jpath = &compact_jpaths[*id];
+
+        jpath->op = entry.op;
+        jpath->seq = seq;
+        if (entry.op == JOURNAL_CREATE || entry.op == JOURNAL_DELETE) {
+            jpath->replace_seq = seq;
+        }
+        jpath->is_dir = false;
+        if (entry.op == JOURNAL_PRUNED) {
+            jpath->dirent_offset = ftello(compact_journal) - sizeof(de);
+            jpath->record_length = 0;
+        } else if (entry.op != JOURNAL_DELETE) {
+            jpath->dirent_offset = ftello(compact_journal) - sizeof(de) - sizeof(stx);
+            jpath->record_length = entry.record_length;
+            jpath->is_dir = !stx.ret && S_ISDIR(stx.buff.stx_mode);
+            ret = fseeko(compact_journal, entry.record_length - sizeof(stx), SEEK_CUR);
+            if (ret) {
+                fprintf(stderr, "fseeko() failed with errno %i\n", errno);
+                free(path);
+                return -1;
+            }
+        }
+    }
+
+    // Chain the paths of each directory, which the walk of the old tree
+    // can't find on its own
+    for (long long idx = 0; idx < compact_jpath_count; idx++) {
+        jpath = &compact_jpaths[idx];
+        if (jpath->path[0] == '\0') {
+            continue;
+        }
+        strcpy(path, jpath->path);
+        parent_end = strrchr(path, '/');
+        if (parent_end != NULL) {
+            *parent_end = '\0';
+        } else {
+            path[0] = '\0';
+        }
+        id = pathmap_put(&compact_children, path);
+        if (id == NULL) {
+            free(path);
+            return -1;
+        }
+        jpath->next_child = *id - 1;
+        *id = idx + 1;
+    }
+
+    free(path);
+
+    return 0;
+}
+
+int compact_copy(
+    int fd,
+    off_t offset,
+    long long length
+) {
+    int ret;
+    ssize_t bytes;
+
+    while (length > 0) {
+        bytes = pread(fd, compact_buff, length < COPY_BUFF_SIZE ? length : COPY_BUFF_SIZE, offset);
+        if (bytes <= 0) {
+            fprintf(stderr, "pread() failed with return code %zi and errno %i\n", bytes, errno);
+            return -1;
+        }
+        ret = fwrite(compact_buff, bytes, 1, compact_data_out);
+        if (ret != 1) {
+            fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+            return -1;
+        }
+        offset += bytes;
+        length -= bytes;
+        compact_data_pos += bytes;
+    }
+
+    return 0;
+}
+
+int compact_stub(
+    const struct dirent *de
+) {
+    int ret;
+
+    ret = fwrite(&MARKER_PRUNED, sizeof(MARKER_PRUNED), 1, compact_tree_out);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    ret = fwrite(de, sizeof(*de), 1, compact_tree_out);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Writes a tree entry followed by its record, from the journal if jpath
+// is set and from the old dump otherwise
+int compact_entry(
+    const struct journal_path *jpath,
+    const struct dirent *base_de,
+    long long base_pos,
+    bool tree_entry
+) {
+    int ret;
+    long long pos;
+    struct dirent de;
+
+    pos = compact_data_pos;
+    if (jpath != NULL) {
+        ret = pread(fileno(compact_journal), &de, sizeof(de), jpath->dirent_offset);
+        if (ret != sizeof(de)) {
+            fprintf(stderr, "pread() failed with return code %i and errno %i\n", ret, errno);
+            return -1;
+        }
+        if (jpath->op == JOURNAL_PRUNED) {
+            return tree_entry ? compact_stub(&de) : 0;
+        }
+        ret = compact_copy(fileno(compact_journal), jpath->dirent_offset + sizeof(de), jpath->record_length);
+    } else {
+        if (tree_entry) {
+            de = *base_de;
+        }
+        ret = data_reader_read(&compact_reader, base_pos, &compact_rec);
+        if (ret) {
+            return ret;
+        }
+        ret = compact_copy(compact_data_fd, compact_rec.offset, compact_rec.length);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    if (!tree_entry) {
+        return 0;
+    }
+
+    ret = fwrite(&pos, sizeof(pos), 1, compact_tree_out);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    ret = fwrite(&de, sizeof(de), 1, compact_tree_out);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+int compact_token(
+    long long *token
+) {
+    int ret;
+
+    if (compact_have_lookahead) {
+        *token = compact_lookahead;
+        compact_have_lookahead = false;
+        return 0;
+    }
+
+    ret = fread(token, sizeof(*token), 1, compact_tree);
+    if (ret != 1) {
+        fprintf(stderr, "Treefile ended inside a directory\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Skips a subtree of the old tree whose MARKER_START has been consumed
+int compact_skip(void) {
+    int ret;
+    long long token;
+    int level;
+    struct dirent de;
+
+    level = 1;
+    while (level > 0) {
+        ret = compact_token(&token);
+        if (ret) {
+            return ret;
+        }
+        if (token == MARKER_START) {
+            level++;
+        } else if (token == MARKER_END) {
+            level--;
+        } else {
+            ret = fread(&de, sizeof(de), 1, compact_tree);
+            if (ret != 1) {
+                fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+char *compact_join(
+    const char *dirpath,
+    const char *name
+) {
+    char *path;
+
+    path = malloc(strlen(dirpath) + strlen(name) + 2);
+    if (path == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return NULL;
+    }
+    if (dirpath[0] == '\0') {
+        strcpy(path, name);
+    } else {
+        sprintf(path, "%s/%s", dirpath, name);
+    }
+
+    return path;
+}
+
+// Writes the children of dirpath: those of the old tree, if base is set
+// and its MARKER_START has been consumed, then those only the journal has.
+// Journal entries up to min_seq predate the replacement of an ancestor.
+int compact_dir(
+    const char *dirpath,
+    long long min_seq,
+    bool base
+) {
+    int ret;
+    long long token;
+    long long next;
+    bool has_children;
+    long long child_seq;
+    long long *head;
+    char *childpath;
+    struct dirent de;
+    struct journal_path *jpath;
+
+    ret = fwrite(&MARKER_START, sizeof(MARKER_START), 1, compact_tree_out);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    while (base) {
+        ret = compact_token(&token);
+        if (ret) {
+            return ret;
+        }
+        if (token == MARKER_END) {
+            break;
+        }
+        ret = fread(&de, sizeof(de), 1, compact_tree);
+        if (ret != 1) {
+            fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+            return -1;
+        }
+        ret = compact_token(&next);
+        if (ret) {
+            return ret;
+        }
+        has_children = next == MARKER_START;
+        if (!has_children) {
+            compact_lookahead = next;
+            compact_have_lookahead = true;
+        }
+
+        childpath = compact_join(dirpath, de.d_name);
+        if (childpath == NULL) {
+            return -1;
+        }
+        jpath = compact_lookup(childpath, min_seq);
+        if (jpath != NULL) {
+            jpath->emitted = true;
+        }
+
+        if (jpath != NULL && jpath->op == JOURNAL_DELETE) {
+            ret = has_children ? compact_skip() : 0;
+            free(childpath);
+            if (ret) {
+                return ret;
+            }
+            continue;
+        }
+        if (jpath == NULL && token == MARKER_PRUNED) {
+            ret = compact_stub(&de);
+            free(childpath);
+            if (ret) {
+                return ret;
+            }
+            continue;
+        }
+
+        ret = compact_entry(jpath, &de, token, true);
+        if (ret) {
+            free(childpath);
+            return ret;
+        }
+
+        child_seq = jpath != NULL && jpath->replace_seq > min_seq ? jpath->replace_seq : min_seq;
+        if (has_children && (jpath == NULL || (jpath->is_dir && child_seq == min_seq))) {
+            ret = compact_dir(childpath, child_seq, true);
+        } else if (has_children) {
+            // Replaced by something else since the dump
+            ret = compact_skip();
+            if (!ret && jpath->is_dir) {
+                ret = compact_dir(childpath, child_seq, false);
+            }
+        } else if (jpath != NULL && jpath->is_dir) {
+            // Was not a directory at the time of the dump
+            ret = compact_dir(childpath, child_seq, false);
+        }
+        free(childpath);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    head = pathmap_get(&compact_children, dirpath);
+    for (long long idx = head != NULL ? *head - 1 : -1; idx >= 0; idx = compact_jpaths[idx].next_child) {
+        jpath = &compact_jpaths[idx];
+        if (jpath->emitted || jpath->seq <= min_seq || jpath->op == JOURNAL_DELETE) {
+            continue;
+        }
+        jpath->emitted = true;
+
+        ret = compact_entry(jpath, NULL, 0, true);
+        if (ret) {
+            return ret;
+        }
+        if (jpath->is_dir) {
+            child_seq = jpath->replace_seq > min_seq ? jpath->replace_seq : min_seq;
+            ret = compact_dir(jpath->path, child_seq, false);
+            if (ret) {
+                return ret;
+            }
+        }
+    }
+
+    ret = fwrite(&MARKER_END, sizeof(MARKER_END), 1, compact_tree_out);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+FILE *compact_open_output(
+    const char *tmppath
+) {
+    FILE *file;
+    int ret;
+
+    file = fopen(tmppath, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Can't open %s\n", tmppath);
+        return NULL;
+    }
+    ret = fwrite(&VERSION, sizeof(VERSION), 1, file);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+int compact_run(
+    const char *treepath,
+    const char *datapath,
+    const char *tree_tmp,
+    const char *data_tmp
+) {
+    int ret;
+    long long token;
+    int version[3];
+    struct journal_path *jpath;
+
+    ret = compact_load();
+    if (ret) {
+        return ret;
+    }
+
+    compact_tree = fopen(treepath, "rb");
+    if (compact_tree == NULL) {
+        fprintf(stderr, "Can't open treefile %s\n", treepath);
+        return -1;
+    }
+    ret = fread(&version, sizeof(version), 1, compact_tree);
+    if (ret != 1) {
+        fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    ret = compare_versions(version, VERSION);
+    if (ret) {
+        return ret;
+    }
+    ret = data_reader_open(&compact_reader, datapath);
+    if (ret) {
+        return ret;
+    }
+    compact_data_fd = open(datapath, O_RDONLY);
+    if (compact_data_fd < 0) {
+        fprintf(stderr, "Can't open datafile %s\n", datapath);
+        return -1;
+    }
+
+    compact_tree_out = compact_open_output(tree_tmp);
+    if (compact_tree_out == NULL) {
+        return -1;
+    }
+    compact_data_out = compact_open_output(data_tmp);
+    if (compact_data_out == NULL) {
+        return -1;
+    }
+    compact_data_pos = sizeof(VERSION) + DATA_OFFSET;
+
+    // The root record comes first and has no tree entry
+    jpath = compact_lookup("", -1);
+    if (jpath != NULL && jpath->op == JOURNAL_DELETE) {
+        jpath = NULL;
+    }
+    ret = compact_entry(jpath, NULL, sizeof(VERSION) + DATA_OFFSET, false);
+    if (ret) {
+        return ret;
+    }
+
+    // A root that is not a directory has no MARKER_START
+    ret = fread(&token, sizeof(token), 1, compact_tree);
+    if (ret == 1) {
+        if (token != MARKER_START) {
+            fprintf(stderr, "Unexpected token %lli at the start of %s\n", token, treepath);
+            return -1;
+        }
+        ret = compact_dir("", -1, true);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    ret = fclose(compact_tree_out);
+    compact_tree_out = NULL;
+    if (ret) {
+        fprintf(stderr, "fclose() failed with errno %i\n", errno);
+        return -1;
+    }
+    ret = fclose(compact_data_out);
+    compact_data_out = NULL;
+    if (ret) {
+        fprintf(stderr, "fclose() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Folds the journal into a new generation of the dump, which replaces the
+// old one as a pair once it is complete, then empties the journal
+int journal_compact(
+    const char *treepath,
+    const char *datapath
+) {
+    int ret;
+    char *tree_tmp;
+    char *data_tmp;
+
+    ret = journal_flush();
+    if (ret) {
+        return ret;
+    }
+
+    compact_buff = malloc(COPY_BUFF_SIZE);
+    if (compact_buff == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    compact_data_fd = -1;
+    compact_have_lookahead = false;
+    memset(&compact_rec, 0x00, sizeof(compact_rec));
+
+    ret = generation_open(datapath, &tree_tmp, &data_tmp);
+    if (ret == 0) {
+        ret = compact_run(treepath, datapath, tree_tmp, data_tmp);
+    }
+    if (ret == 0) {
+        ret = generation_publish(treepath, datapath);
+    }
+    if (ret == 0) {
+        ret = journal_reset();
+    }
+
+    if (compact_tree_out != NULL) {
+        fclose(compact_tree_out);
+        compact_tree_out = NULL;
+    }
+    if (compact_data_out != NULL) {
+        fclose(compact_data_out);
+        compact_data_out = NULL;
+    }
+    if (compact_journal != NULL) {
+        fclose(compact_journal);
+        compact_journal = NULL;
+    }
+    if (compact_tree != NULL) {
+        fclose(compact_tree);
+        compact_tree = NULL;
+    }
+    if (compact_data_fd >= 0) {
+        close(compact_data_fd);
+    }
+    data_reader_close(&compact_reader);
+    record_free(&compact_rec);
+    for (long long idx = 0; idx < compact_jpath_count; idx++) {
+        free(compact_jpaths[idx].path);
+    }
+    free(compact_jpaths);
+    compact_jpaths = NULL;
+    compact_jpath_count = 0;
+    compact_jpath_alloc = 0;
+    pathmap_free(&compact_paths);
+    pathmap_free(&compact_children);
+    free(compact_buff);
+    free(tree_tmp);
+    free(data_tmp);
+
+    return ret;
+}
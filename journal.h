@@ -0,0 +1,38 @@
+#ifndef METADUMP_JOURNAL_H
+#define METADUMP_JOURNAL_H
+
+#include "common.h"
+
+#include <stddef.h>
+#include <dirent.h>
+
+// A journal holds VERSION, then for every change a header, the path
+// relative to the root and, unless the path was deleted, its dirent and,
+// unless the rules prune it, its datafile record
+struct journal_entry {
+    int op;
+    int path_length;
+    long long record_length;
+};
+
+int journal_open(const char *journalpath);
+
+int journal_append(
+    int op,
+    const char *path,
+    const struct dirent *de,
+    const char *record,
+    size_t record_length
+);
+
+int journal_flush(void);
+
+long long journal_size(void);
+
+int journal_reset(void);
+
+int journal_compact(const char *treepath, const char *datapath);
+
+int journal_close(void);
+
+#endif /* METADUMP_JOURNAL_H */
@@ -1,24 +1,66 @@
 #define _GNU_SOURCE
 
 #include "common.h"
+#include "fscaps.h"
+#include "generation.h"
+#include "hash.h"
+#include "inodes.h"
+#include "journal.h"
+#include "packed.h"
+#include "pathmap.h"
+#include "rules.h"
+#include "sample.h"
+#include "split.h"
+#include "store.h"
+#include "stream.h"
+#include "throttle.h"
+#include "trace.h"
+#include "verify.h"
+#include "watch.h"
+#include "xdict.h"
+#include "zonemap.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <dirent.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
 #include <openssl/evp.h>
 
+// Seconds without events before changes are journaled, and at most
+#define WATCH_QUIET 1
+#define WATCH_MAX_DELAY 5
+// Milliseconds between looks at the events the watch thread collected
+#define WATCH_TICK_MS 200
+
 int dev_major;
 int dev_minor;
 struct statx_data stx;
 struct ioctl_data ioc;
+struct digest dgst;
+struct hash_opts hash_opts;
+char **shard_names;
+int shard_count;
+bool use_store;
+bool defer_hash;
+bool drop_cache;
+bool packed_records;
+int statx_sync = AT_STATX_FORCE_SYNC;
+size_t root_length;
+int max_open_dirs = 256;
+long long statx_calls;
+volatile sig_atomic_t watch_stop;
 char *buff_llistxattr;
 char *buff_lgetxattr;
 int length_buff_llistxattr;
@@ -56,25 +98,53 @@ void print_error(
     );
 }
 
-int dump_statx(
-    const char *filepath,
-    FILE *datafile,
-    int *datafile_pos
+void collect_statx(
+    const char *filepath
 ) {
-    int ret;
+    double start;
+
+    throttle_file();
+    statx_calls++;
 
     memset(&stx, 0x00, sizeof(stx));
+    start = throttle_now();
     stx.ret = statx(
         AT_FDCWD,
         filepath,
-        AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW | AT_STATX_FORCE_SYNC,
+        AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW | statx_sync,
         STATX_ALL,
         &stx.buff
     );
-    stx._errno = errno;
+    stx._errno = stx.ret ? errno : 0;
+    trace_end(TRACE_STATX, filepath, start);
+    throttle_latency(throttle_now() - start);
     if (stx.ret) {
         print_error(filepath, "statx", stx.ret);
     }
+}
+
+int dump_statx(
+    const char *filepath,
+    FILE *datafile,
+    long long *datafile_pos
+) {
+    int ret;
+
+    int length;
+    unsigned char buff[PACKED_MAX_STATX];
+
+    collect_statx(filepath);
+
+    if (packed_records) {
+        length = packed_statx(buff, &stx);
+        ret = fwrite(buff, length, 1, datafile);
+        if (ret != 1) {
+            print_error(filepath, "fwrite", ret);
+            return -1;
+        }
+        *datafile_pos += length;
+        return 0;
+    }
 
     ret = fwrite(&stx, sizeof(stx), 1, datafile);
     if (ret != 1) {
@@ -86,119 +156,473 @@ int dump_statx(
     return 0;
 }
 
-int dump_ioctl_and_md5(
+int dump_open_errno(
     const char *filepath,
+    int open_errno,
     FILE *datafile,
-    int *datafile_pos
+    long long *datafile_pos
 ) {
     int ret;
-    int fd;
+    int length;
+    unsigned char buff[PACKED_MAX_IOCTL];
 
-    FILE *file;
-    EVP_MD_CTX *mdctx;
-    char buff[MD_BUFF_SIZE];
-    ssize_t bytes;
-    unsigned char md_value[EVP_MAX_MD_SIZE];
-    unsigned int md_len;
-
-    fd = open(filepath, O_RDONLY | O_NONBLOCK | O_LARGEFILE | O_NOFOLLOW);
-
-    if (fd < 0) {
-        ret = fwrite(&errno, sizeof(errno), 1, datafile);
+    if (packed_records) {
+        length = packed_int(buff, open_errno);
+        ret = fwrite(buff, length, 1, datafile);
         if (ret != 1) {
             print_error(filepath, "fwrite", ret);
             return -1;
         }
-        *datafile_pos += sizeof(errno);
+        *datafile_pos += length;
         return 0;
     }
-    ret = fwrite(&NO_ERROR, sizeof(errno), 1, datafile);
+
+    ret = fwrite(&open_errno, sizeof(open_errno), 1, datafile);
     if (ret != 1) {
         print_error(filepath, "fwrite", ret);
-        close(fd);
         return -1;
     }
-    *datafile_pos += sizeof(errno);
+    *datafile_pos += sizeof(open_errno);
 
-    memset(&ioc, 0x00, sizeof(ioc));
+    return 0;
+}
+
+void dump_ioctl(
+    const char *filepath,
+    int op,
+    int fd,
+    unsigned long request,
+    void *buff,
+    signed char *state,
+    int *ret,
+    int *err
+) {
+    double start;
+
+    if (state != NULL && *state == FSCAP_UNSUPPORTED) {
+        *ret = NOT_ATTEMPTED;
+        *err = 0;
+        return;
+    }
 
-    ioc.flags_ret = ioctl(fd, FS_IOC_GETFLAGS, &ioc.flags_buff);
-    ioc.flags_errno = errno;
+    start = trace_begin();
+    *ret = ioctl(fd, request, buff);
+    // A stale errno would make identical records differ
+    *err = *ret < 0 ? errno : 0;
+    trace_end(op, filepath, start);
+
+    if (state != NULL) {
+        fscaps_learn(state, *ret, *err);
+    }
+}
+
+bool needs_open(
+    struct fscaps *caps
+) {
+    if (caps == NULL) {
+        // statx failed, so the type is unknown
+        return true;
+    }
+    if (S_ISREG(stx.buff.stx_mode)) {
+        return true;
+    }
+    if (S_ISDIR(stx.buff.stx_mode)) {
+        for (int idx = 0; idx < FSCAP_IOCTL_COUNT; idx++) {
+            if (caps->ioctl[1][idx] != FSCAP_UNSUPPORTED) {
+                return true;
+            }
+        }
+    }
+    // Devices, FIFOs, sockets and symlinks have nothing to hash and opening
+    // them can block or have side effects
+    return false;
+}
 
-    ioc.version_ret = ioctl(fd, FS_IOC_GETVERSION, &ioc.version_buff);
-    ioc.version_errno = errno;
+int dump_digest(
+    const char *filepath,
+    FILE *datafile,
+    long long *datafile_pos
+) {
+    int ret;
+    int kind;
+    unsigned int md_size;
 
-    ioc.xattr_ret = ioctl(fd, FS_IOC_FSGETXATTR, &ioc.xattr_buff);
-    ioc.xattr_errno = errno;
+    kind = dgst.kind;
+    if (dgst.extent_count > 0) {
+        kind |= DIGEST_EXTENTS;
+    }
+    if (dgst.kind == DIGEST_PENDING) {
+        kind |= DIGEST_SLOT;
+    }
 
-    ret = fwrite(&ioc, sizeof(ioc), 1, datafile);
+    ret = fwrite(&kind, sizeof(kind), 1, datafile);
     if (ret != 1) {
         print_error(filepath, "fwrite", ret);
-        close(fd);
         return -1;
     }
-    *datafile_pos += sizeof(ioc);
+    *datafile_pos += sizeof(kind);
 
-    file = fdopen(fd, "r");
-    if (!file) {
-        fprintf(
-            stderr,
-            "fdopen() failed with errno %i for %s\n",
-            errno,
-            filepath
-        );
-        close(fd);
-        return -1;
+    if (dgst.kind == DIGEST_NONE) {
+        return 0;
     }
 
-    mdctx = EVP_MD_CTX_new();
+    ret = fwrite(&dgst.md_len, sizeof(dgst.md_len), 1, datafile);
+    if (ret != 1) {
+        print_error(filepath, "fwrite", ret);
+        return -1;
+    }
+    *datafile_pos += sizeof(dgst.md_len);
 
-    ret = EVP_DigestInit_ex2(mdctx, EVP_md5(), NULL);
+    md_size = kind & DIGEST_SLOT ? (unsigned int)DIGEST_SLOT_MD_SIZE : dgst.md_len;
+    ret = fwrite(dgst.md_value, md_size, 1, datafile);
     if (ret != 1) {
-        print_error(filepath, "EVP_DigestInit_ex2", ret);
-        EVP_MD_CTX_free(mdctx);
-        fclose(file);
+        print_error(filepath, "fwrite", ret);
         return -1;
     }
+    *datafile_pos += md_size;
+
+    if (kind & DIGEST_SLOT) {
+        // Fixed size, so that mdhash can fill in the digest in place
+        ret = fwrite(&dgst.chunk_size, sizeof(dgst.chunk_size), 1, datafile);
+        if (ret != 1) {
+            print_error(filepath, "fwrite", ret);
+            return -1;
+        }
+        *datafile_pos += sizeof(dgst.chunk_size);
+        return 0;
+    }
 
-    bytes = fread(buff, 1, sizeof(buff), file);
-    while (bytes > 0) {
-        ret = EVP_DigestUpdate(mdctx, buff, bytes);
+    if (dgst.kind == DIGEST_MD5_TREE || dgst.kind == DIGEST_MD5_FINGERPRINT) {
+        ret = fwrite(&dgst.chunk_size, sizeof(dgst.chunk_size), 1, datafile);
         if (ret != 1) {
-            print_error(filepath, "EVP_DigestUpdate", ret);
-            EVP_MD_CTX_free(mdctx);
-            fclose(file);
+            print_error(filepath, "fwrite", ret);
             return -1;
         }
-        bytes = fread(buff, 1, sizeof(buff), file);
+        *datafile_pos += sizeof(dgst.chunk_size);
+    }
+
+    if (!(kind & DIGEST_EXTENTS)) {
+        return 0;
     }
 
-    ret = EVP_DigestFinal_ex(mdctx, md_value, &md_len);
+    ret = fwrite(&dgst.extent_count, sizeof(dgst.extent_count), 1, datafile);
     if (ret != 1) {
-        print_error(filepath, "EVP_DigestFinal_ex", ret);
-        EVP_MD_CTX_free(mdctx);
-        fclose(file);
+        print_error(filepath, "fwrite", ret);
         return -1;
     }
+    *datafile_pos += sizeof(dgst.extent_count);
 
-    ret = fwrite(&md_len, sizeof(md_len), 1, datafile);
-    if (ret != 1) {
+    ret = fwrite(dgst.extents, 2 * sizeof(*dgst.extents), dgst.extent_count, datafile);
+    if (ret != dgst.extent_count) {
         print_error(filepath, "fwrite", ret);
-        fclose(file);
         return -1;
     }
-    *datafile_pos += sizeof(md_len);
+    *datafile_pos += dgst.extent_count * 2 * sizeof(*dgst.extents);
+
+    return 0;
+}
+
+int dump_ioctl_and_md5(
+    const char *filepath,
+    FILE *datafile,
+    long long *datafile_pos
+) {
+    int ret;
+    int fd;
+    int length;
+    double start;
+    unsigned char buff[PACKED_MAX_IOCTL];
+
+    struct fscaps *caps;
+    signed char *ioctl_caps;
+
+    caps = NULL;
+    ioctl_caps = NULL;
+    if (!stx.ret) {
+        caps = fscaps_lookup(stx.buff.stx_dev_major, stx.buff.stx_dev_minor);
+        if (caps == NULL) {
+            return -1;
+        }
+        ioctl_caps = caps->ioctl[S_ISDIR(stx.buff.stx_mode) ? 1 : 0];
+    }
+
+    if (!needs_open(caps)) {
+        return dump_open_errno(filepath, NOT_ATTEMPTED, datafile, datafile_pos);
+    }
+
+    start = trace_begin();
+    fd = open_noatime(filepath);
+    trace_end(TRACE_OPEN, filepath, start);
+
+    if (fd < 0) {
+        return dump_open_errno(filepath, errno, datafile, datafile_pos);
+    }
+    ret = dump_open_errno(filepath, NO_ERROR, datafile, datafile_pos);
+    if (ret) {
+        close(fd);
+        return ret;
+    }
+
+    memset(&ioc, 0x00, sizeof(ioc));
+
+    dump_ioctl(
+        filepath,
+        TRACE_GETFLAGS,
+        fd,
+        FS_IOC_GETFLAGS,
+        &ioc.flags_buff,
+        ioctl_caps ? &ioctl_caps[FSCAP_GETFLAGS] : NULL,
+        &ioc.flags_ret,
+        &ioc.flags_errno
+    );
+    dump_ioctl(
+        filepath,
+        TRACE_GETVERSION,
+        fd,
+        FS_IOC_GETVERSION,
+        &ioc.version_buff,
+        ioctl_caps ? &ioctl_caps[FSCAP_GETVERSION] : NULL,
+        &ioc.version_ret,
+        &ioc.version_errno
+    );
+    dump_ioctl(
+        filepath,
+        TRACE_FSGETXATTR,
+        fd,
+        FS_IOC_FSGETXATTR,
+        &ioc.xattr_buff,
+        ioctl_caps ? &ioctl_caps[FSCAP_FSGETXATTR] : NULL,
+        &ioc.xattr_ret,
+        &ioc.xattr_errno
+    );
+
+    if (packed_records) {
+        length = packed_ioctl(buff, &ioc);
+        ret = fwrite(buff, length, 1, datafile);
+        if (ret != 1) {
+            print_error(filepath, "fwrite", ret);
+            close(fd);
+            return -1;
+        }
+        *datafile_pos += length;
+    } else {
+        ret = fwrite(&ioc, sizeof(ioc), 1, datafile);
+        if (ret != 1) {
+            print_error(filepath, "fwrite", ret);
+            close(fd);
+            return -1;
+        }
+        *datafile_pos += sizeof(ioc);
+    }
+
+    if (caps != NULL && !S_ISREG(stx.buff.stx_mode)) {
+        // Only regular files have content to hash
+        close(fd);
+        dgst.kind = DIGEST_NONE;
+        return dump_digest(filepath, datafile, datafile_pos);
+    }
+
+    if (defer_hash && caps != NULL) {
+        close(fd);
+        memset(&dgst.md_value, 0x00, sizeof(dgst.md_value));
+        dgst.kind = DIGEST_PENDING;
+        dgst.md_len = 0;
+        dgst.chunk_size = 0;
+        dgst.extent_count = 0;
+        return dump_digest(filepath, datafile, datafile_pos);
+    }
+
+    start = trace_begin();
+    ret = hash_fd(
+        filepath,
+        fd,
+        caps != NULL ? (long long)stx.buff.stx_size : -1,
+        &hash_opts,
+        &dgst
+    );
+    trace_end(TRACE_HASH, filepath, start);
+    if (drop_cache) {
+        // The crawl never reads the data again, so keep it from evicting
+        // the working set of other services
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+    if (ret) {
+        return ret;
+    }
+
+    return dump_digest(filepath, datafile, datafile_pos);
+}
+
+int write_field(
+    const char *filepath,
+    const void *buff,
+    size_t length,
+    FILE *datafile,
+    long long *datafile_pos
+) {
+    int ret;
+
+    if (length == 0) {
+        return 0;
+    }
 
-    ret = fwrite(md_value, md_len, 1, datafile);
+    ret = fwrite(buff, length, 1, datafile);
     if (ret != 1) {
         print_error(filepath, "fwrite", ret);
-        fclose(file);
         return -1;
     }
-    *datafile_pos += md_len;
+    *datafile_pos += length;
+
+    return 0;
+}
+
+// Refers to names and repeated values by their dictionary ids, and keeps
+// only the result of the last call for each value
+int dump_xattr_dict(
+    const char *filepath,
+    FILE *datafile,
+    long long *datafile_pos,
+    struct fscaps *caps,
+    ssize_t length_probe
+) {
+    int ret;
+    int err;
+    int count;
+    int id;
+    int name_length;
+    int ns;
+    ssize_t length_llistxattr;
+    ssize_t length_lgetxattr;
+    ssize_t marker;
+    double start;
+
+    ret = update_buff(length_probe, &length_buff_llistxattr, &buff_llistxattr);
+    if (ret) {
+        return ret;
+    }
+
+    start = trace_begin();
+    length_llistxattr = llistxattr(filepath, buff_llistxattr, length_probe);
+    err = errno;
+    trace_end(TRACE_LISTXATTR, filepath, start);
+
+    // Without names the record is the same as without the dictionary
+    if (length_llistxattr < 1) {
+        ret = write_field(filepath, &length_probe, sizeof(length_probe), datafile, datafile_pos);
+        if (ret) {
+            return ret;
+        }
+        ret = write_field(filepath, &length_llistxattr, sizeof(length_llistxattr), datafile, datafile_pos);
+        if (ret) {
+            return ret;
+        }
+        if (length_llistxattr < 0) {
+            return write_field(filepath, &err, sizeof(err), datafile, datafile_pos);
+        }
+        return 0;
+    }
+
+    count = 0;
+    for (char *name = buff_llistxattr; name != buff_llistxattr + length_llistxattr; name = strchr(name, '\0') + 1) {
+        count += name[0] != '\0';
+    }
+
+    marker = XATTR_DICT;
+    ret = write_field(filepath, &marker, sizeof(marker), datafile, datafile_pos);
+    if (ret) {
+        return ret;
+    }
+    ret = write_field(filepath, &count, sizeof(count), datafile, datafile_pos);
+    if (ret) {
+        return ret;
+    }
+
+    for (char *name = buff_llistxattr; name != buff_llistxattr + length_llistxattr; name = strchr(name, '\0') + 1) {
+        if (name[0] == '\0') {
+            continue;
+        }
+
+        name_length = strlen(name);
+        ret = xdict_id(XDICT_NAME, name, name_length, &id);
+        if (ret) {
+            return ret;
+        }
+        ret = write_field(filepath, &id, sizeof(id), datafile, datafile_pos);
+        if (ret) {
+            return ret;
+        }
+        if (id == XDICT_INLINE) {
+            ret = write_field(filepath, &name_length, sizeof(name_length), datafile, datafile_pos);
+            if (ret) {
+                return ret;
+            }
+            ret = write_field(filepath, name, name_length, datafile, datafile_pos);
+            if (ret) {
+                return ret;
+            }
+        }
+
+        ns = fscaps_xattr_ns(name);
+        if (caps != NULL && ns >= 0 && caps->xattr_ns[ns] == FSCAP_UNSUPPORTED) {
+            length_lgetxattr = NOT_ATTEMPTED;
+            ret = write_field(filepath, &length_lgetxattr, sizeof(length_lgetxattr), datafile, datafile_pos);
+            if (ret) {
+                return ret;
+            }
+            continue;
+        }
+
+        start = trace_begin();
+        length_lgetxattr = lgetxattr(filepath, name, NULL, 0);
+        err = errno;
+        trace_end(TRACE_GETXATTR, filepath, start);
+        if (caps != NULL && ns >= 0) {
+            fscaps_learn(&caps->xattr_ns[ns], length_lgetxattr, err);
+        }
+
+        if (length_lgetxattr > 0) {
+            ret = update_buff(length_lgetxattr, &length_buff_lgetxattr, &buff_lgetxattr);
+            if (ret) {
+                return ret;
+            }
+
+            start = trace_begin();
+            length_lgetxattr = lgetxattr(filepath, name, buff_lgetxattr, length_lgetxattr);
+            err = errno;
+            trace_end(TRACE_GETXATTR, filepath, start);
+        }
+
+        ret = write_field(filepath, &length_lgetxattr, sizeof(length_lgetxattr), datafile, datafile_pos);
+        if (ret) {
+            return ret;
+        }
+        if (length_lgetxattr < 0) {
+            ret = write_field(filepath, &err, sizeof(err), datafile, datafile_pos);
+            if (ret) {
+                return ret;
+            }
+            continue;
+        }
+        if (length_lgetxattr == 0) {
+            continue;
+        }
 
-    EVP_MD_CTX_free(mdctx);
-    fclose(file);
+        ret = xdict_id(XDICT_VALUE, buff_lgetxattr, length_lgetxattr, &id);
+        if (ret) {
+            return ret;
+        }
+        ret = write_field(filepath, &id, sizeof(id), datafile, datafile_pos);
+        if (ret) {
+            return ret;
+        }
+        if (id == XDICT_INLINE) {
+            ret = write_field(filepath, buff_lgetxattr, length_lgetxattr, datafile, datafile_pos);
+            if (ret) {
+                return ret;
+            }
+        }
+    }
 
     return 0;
 }
@@ -206,13 +630,44 @@ int dump_ioctl_and_md5(
 int dump_xattr(
     const char *filepath,
     FILE *datafile,
-    int *datafile_pos
+    long long *datafile_pos
 ) {
     int ret;
     ssize_t length_llistxattr;
     ssize_t length_lgetxattr;
+    struct fscaps *caps;
+    int ns;
+    double start;
+
+    caps = NULL;
+    if (!stx.ret) {
+        caps = fscaps_lookup(stx.buff.stx_dev_major, stx.buff.stx_dev_minor);
+        if (caps == NULL) {
+            return -1;
+        }
+    }
+
+    if (caps != NULL && caps->xattr == FSCAP_UNSUPPORTED) {
+        length_llistxattr = NOT_ATTEMPTED;
+        ret = fwrite(&length_llistxattr, sizeof(length_llistxattr), 1, datafile);
+        if (ret != 1) {
+            print_error(filepath, "fwrite", ret);
+            return -1;
+        }
+        *datafile_pos += sizeof(length_llistxattr);
+        return 0;
+    }
 
+    start = trace_begin();
     length_llistxattr = llistxattr(filepath, NULL, 0);
+    trace_end(TRACE_LISTXATTR, filepath, start);
+    if (caps != NULL) {
+        fscaps_learn(&caps->xattr, length_llistxattr, errno);
+    }
+
+    if (xdict_enabled() && length_llistxattr > 0) {
+        return dump_xattr_dict(filepath, datafile, datafile_pos, caps, length_llistxattr);
+    }
 
     ret = fwrite(&length_llistxattr, sizeof(length_llistxattr), 1, datafile);
     if (ret != 1) {
@@ -238,7 +693,9 @@ int dump_xattr(
         return ret;
     }
 
+    start = trace_begin();
     length_llistxattr = llistxattr(filepath, buff_llistxattr, length_llistxattr);
+    trace_end(TRACE_LISTXATTR, filepath, start);
 
     ret = fwrite(&length_llistxattr, sizeof(length_llistxattr), 1, datafile);
     if (ret != 1) {
@@ -271,7 +728,24 @@ int dump_xattr(
             continue;
         }
 
+        ns = fscaps_xattr_ns(name);
+        if (caps != NULL && ns >= 0 && caps->xattr_ns[ns] == FSCAP_UNSUPPORTED) {
+            length_lgetxattr = NOT_ATTEMPTED;
+            ret = fwrite(&length_lgetxattr, sizeof(length_lgetxattr), 1, datafile);
+            if (ret != 1) {
+                print_error(filepath, "fwrite", ret);
+                return -1;
+            }
+            *datafile_pos += sizeof(length_lgetxattr);
+            continue;
+        }
+
+        start = trace_begin();
         length_lgetxattr = lgetxattr(filepath, name, NULL, 0);
+        trace_end(TRACE_GETXATTR, filepath, start);
+        if (caps != NULL && ns >= 0) {
+            fscaps_learn(&caps->xattr_ns[ns], length_lgetxattr, errno);
+        }
 
         ret = fwrite(&length_lgetxattr, sizeof(length_lgetxattr), 1, datafile);
         if (ret != 1) {
@@ -297,7 +771,9 @@ int dump_xattr(
             return ret;
         }
 
+        start = trace_begin();
         length_lgetxattr = lgetxattr(filepath, name, buff_lgetxattr, length_lgetxattr);
+        trace_end(TRACE_GETXATTR, filepath, start);
 
         ret = fwrite(&length_lgetxattr, sizeof(length_lgetxattr), 1, datafile);
         if (ret != 1) {
@@ -333,22 +809,32 @@ int dump_dir(
     const char *filepath,
     FILE *treefile,
     FILE *datafile,
-    int *datafile_pos
+    long long *datafile_pos,
+    bool top_level
 );
 
-int dump_file(
+int dump_entry(
     const char *filepath,
+    const struct dirent *de,
     FILE *treefile,
     FILE *datafile,
-    int *datafile_pos,
-    bool top_level
+    long long *datafile_pos,
+    bool top_level,
+    bool *descend
 ) {
     int ret;
+    long long record_pos;
+    long long statx_length;
+    struct statx_data key_stx;
+    unsigned char key_packed[PACKED_MAX_STATX];
 
+    *descend = false;
+    record_pos = *datafile_pos;
     ret = dump_statx(filepath, datafile, datafile_pos);
     if (ret) {
         return ret;
     }
+    statx_length = *datafile_pos - record_pos;
 
     ret = dump_ioctl_and_md5(filepath, datafile, datafile_pos);
     if (ret) {
@@ -360,141 +846,1707 @@ int dump_file(
         return ret;
     }
 
-    if (!stx.ret && S_ISDIR(stx.buff.stx_mode)) {
-        if (top_level) {
-            dev_major = stx.buff.stx_dev_major;
-            dev_minor = stx.buff.stx_dev_minor;
+    // The tree entry can only point at the record once the store has it
+    if (use_store) {
+        // Leave atime out of the key, or hashing the file would make each
+        // dump store a new copy; the stored atime is the first one seen
+        key_stx = stx;
+        memset(&key_stx.buff.stx_atime, 0x00, sizeof(key_stx.buff.stx_atime));
+        if (packed_records) {
+            ret = store_put(&record_pos, key_packed, packed_statx(key_packed, &key_stx), statx_length);
+        } else {
+            ret = store_put(&record_pos, &key_stx, sizeof(key_stx), statx_length);
+        }
+        if (ret) {
+            return ret;
+        }
+        *datafile_pos = DATA_OFFSET;
+    }
+
+    ret = inodes_add(&stx, top_level ? NULL : treefile, top_level ? "" : filepath + root_length + 1, record_pos);
+    if (ret) {
+        return ret;
+    }
+
+    if (!top_level) {
+        ret = zonemap_add(&stx, record_pos);
+        if (ret) {
+            return ret;
+        }
+
+        ret = split_add(treefile, filepath + root_length + 1, record_pos);
+        if (ret) {
+            return ret;
+        }
+
+        ret = fwrite(&record_pos, sizeof(record_pos), 1, treefile);
+        if (ret != 1) {
+            print_error(filepath, "fwrite", ret);
+            return -1;
+        }
+
+        ret = fwrite(de, sizeof(*de), 1, treefile);
+        if (ret != 1) {
+            print_error(filepath, "fwrite", ret);
+            return -1;
+        }
+    }
+
+    if (!stx.ret && S_ISDIR(stx.buff.stx_mode)) {
+        if (top_level) {
+            root_length = strlen(filepath);
+            dev_major = stx.buff.stx_dev_major;
+            dev_minor = stx.buff.stx_dev_minor;
         } else {
             if (dev_major != stx.buff.stx_dev_major || dev_minor != stx.buff.stx_dev_minor) {
                 fprintf(stderr, "skipping directory %s because it seems to be a mountpoint\n", filepath);
                 return 0;
             }
         }
-        ret = dump_dir(filepath, treefile, datafile, datafile_pos);
-        if (ret) {
-            return ret;
-        }
+        *descend = true;
     }
 
     return 0;
 }
 
-int dump_dir(
+int dump_file(
     const char *filepath,
+    const struct dirent *de,
     FILE *treefile,
     FILE *datafile,
-    int *datafile_pos
+    long long *datafile_pos,
+    bool top_level
 ) {
     int ret;
-    struct dirent *de;
-    DIR *dr;
-    char *fullpath;
+    bool descend;
 
-    ret = fwrite(&MARKER_START, sizeof(MARKER_START), 1, treefile);
+    ret = dump_entry(filepath, de, treefile, datafile, datafile_pos, top_level, &descend);
+    if (ret) {
+        return ret;
+    }
+
+    if (descend) {
+        return dump_dir(filepath, treefile, datafile, datafile_pos, top_level);
+    }
+
+    return 0;
+}
+
+// Records an entry the rules exclude by its dirent alone
+int dump_pruned(
+    const char *filepath,
+    const struct dirent *de,
+    FILE *treefile
+) {
+    int ret;
+
+    ret = fwrite(&MARKER_PRUNED, sizeof(MARKER_PRUNED), 1, treefile);
     if (ret != 1) {
         print_error(filepath, "fwrite", ret);
         return -1;
     }
 
-    dr = opendir(filepath);
-    if (dr == NULL) {
-        fprintf(stderr, "opendir() failed with errno %i for %s\n", errno, filepath);
+    ret = fwrite(de, sizeof(*de), 1, treefile);
+    if (ret != 1) {
+        print_error(filepath, "fwrite", ret);
         return -1;
     }
 
-    while ((de = readdir(dr)) != NULL) {
-        if (strcmp(de->d_name, ".") == 0) {
-            continue;
-        }
-        if (strcmp(de->d_name, "..") == 0) {
-            continue;
+    return 0;
+}
+
+int compare_names(
+    const void *a,
+    const void *b
+) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+bool in_shard(
+    const char *name
+) {
+    if (shard_count == 0) {
+        return true;
+    }
+    return bsearch(&name, shard_names, shard_count, sizeof(*shard_names), compare_names) != NULL;
+}
+
+// A directory on the crawl stack. Only the innermost max_open_dirs keep
+// their DIR open, the entries the others have left wait in the spill file.
+struct dir_frame {
+    size_t path_length;
+    DIR *dr;
+    off_t spill_start;
+    off_t spill_next;
+    off_t spill_end;
+};
+
+struct dir_frame *dir_stack;
+int dir_depth;
+int dir_alloc;
+int dir_open;
+int dir_lowest_open;
+// Path of the entry being dumped, which the directories share as a prefix
+char *dir_path;
+size_t dir_path_alloc;
+FILE *spill_file;
+off_t spill_used;
+
+// Points dir_path at name in the innermost directory, or at name itself
+// when the stack is empty
+int set_entry_path(
+    const char *name
+) {
+    size_t length;
+    size_t needed;
+    char *new_path;
+
+    length = dir_depth > 0 ? dir_stack[dir_depth - 1].path_length : 0;
+    needed = length + strlen(name) + 2;
+    if (needed > dir_path_alloc) {
+        new_path = realloc(dir_path, needed * 2);
+        if (new_path == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            return -1;
         }
+        dir_path = new_path;
+        dir_path_alloc = needed * 2;
+    }
 
-        ret = fwrite(datafile_pos, sizeof(*datafile_pos), 1, treefile);
-        if (ret != 1) {
-            print_error(filepath, "fwrite", ret);
+    if (dir_depth > 0) {
+        dir_path[length++] = '/';
+    }
+    strcpy(dir_path + length, name);
+
+    return 0;
+}
+
+// Writes the entries a directory has left to the spill file and closes it
+int spill_dir(
+    struct dir_frame *frame
+) {
+    ssize_t bytes;
+    struct dirent *de;
+
+    if (spill_file == NULL) {
+        spill_file = tmpfile();
+        if (spill_file == NULL) {
+            fprintf(stderr, "tmpfile() failed with errno %i\n", errno);
             return -1;
         }
+    }
 
-        ret = fwrite(de, sizeof(*de), 1, treefile);
-        if (ret != 1) {
-            print_error(filepath, "fwrite", ret);
+    frame->spill_start = spill_used;
+    frame->spill_next = spill_used;
+    while ((de = readdir(frame->dr)) != NULL) {
+        bytes = pwrite(fileno(spill_file), de, sizeof(*de), spill_used);
+        if (bytes != sizeof(*de)) {
+            fprintf(stderr, "pwrite() failed with errno %i\n", errno);
             return -1;
         }
+        spill_used += bytes;
+    }
+    frame->spill_end = spill_used;
 
-        fullpath = malloc(strlen(filepath)+ strlen(de->d_name) + 2);
-        if (fullpath == NULL) {
-            fprintf(stderr, "malloc() failed with errno %i for %s\n", errno, filepath);
+    closedir(frame->dr);
+    frame->dr = NULL;
+    dir_open--;
+
+    return 0;
+}
+
+// Opens the directory at dir_path as the innermost one
+int push_dir(
+    FILE *treefile
+) {
+    int ret;
+    struct dir_frame *new_stack;
+    struct dir_frame *frame;
+
+    ret = fwrite(&MARKER_START, sizeof(MARKER_START), 1, treefile);
+    if (ret != 1) {
+        print_error(dir_path, "fwrite", ret);
+        return -1;
+    }
+
+    if (dir_depth == dir_alloc) {
+        new_stack = realloc(dir_stack, (dir_alloc + 64) * sizeof(*dir_stack));
+        if (new_stack == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
             return -1;
         }
+        dir_stack = new_stack;
+        dir_alloc += 64;
+    }
 
-        sprintf(fullpath, "%s/%s", filepath, de->d_name);
-        ret = dump_file(fullpath, treefile, datafile, datafile_pos, false);
+    // The outermost open directory is the one resumed last
+    if (dir_open >= max_open_dirs) {
+        ret = spill_dir(&dir_stack[dir_lowest_open]);
         if (ret) {
             return ret;
         }
-        free(fullpath);
+        dir_lowest_open++;
     }
 
-    closedir(dr);
+    frame = &dir_stack[dir_depth];
+    frame->path_length = strlen(dir_path);
+    frame->dr = opendir(dir_path);
+    if (frame->dr == NULL) {
+        fprintf(stderr, "opendir() failed with errno %i for %s\n", errno, dir_path);
+        return -1;
+    }
+    dir_depth++;
+    dir_open++;
+
+    return 0;
+}
+
+int pop_dir(
+    FILE *treefile
+) {
+    int ret;
+    struct dir_frame *frame;
+
+    frame = &dir_stack[dir_depth - 1];
+    dir_path[frame->path_length] = '\0';
+    if (frame->dr != NULL) {
+        closedir(frame->dr);
+        dir_open--;
+    } else {
+        // Spilled directories are finished in reverse order, their space
+        // in the spill file can be reused
+        spill_used = frame->spill_start;
+        dir_lowest_open = dir_depth - 1;
+    }
+    dir_depth--;
 
     ret = fwrite(&MARKER_END, sizeof(MARKER_END), 1, treefile);
     if (ret != 1) {
-        print_error(filepath, "fwrite", ret);
+        print_error(dir_path, "fwrite", ret);
         return -1;
     }
 
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    int ret;
-    FILE *treefile = fopen(argv[1], "wb");
-    FILE *datafile = fopen(argv[2], "wb");
-    int datafile_pos = DATA_OFFSET;
+// Sets *de to the next entry of the innermost directory, NULL at its end
+int next_entry(
+    struct dirent *spilled,
+    struct dirent **de
+) {
+    ssize_t bytes;
+    struct dir_frame *frame;
 
-    length_buff_llistxattr = 0;
-    length_buff_lgetxattr = 0;
-    buff_llistxattr = malloc(0);
-    buff_lgetxattr = malloc(0);
+    frame = &dir_stack[dir_depth - 1];
+    if (frame->dr != NULL) {
+        *de = readdir(frame->dr);
+        return 0;
+    }
 
-    if (argc != 4) {
-        printf("Exactly 3 arguments required\n");
+    if (frame->spill_next == frame->spill_end) {
+        *de = NULL;
+        return 0;
+    }
+    bytes = pread(fileno(spill_file), spilled, sizeof(*spilled), frame->spill_next);
+    if (bytes != sizeof(*spilled)) {
+        fprintf(stderr, "pread() failed with errno %i\n", errno);
         return -1;
     }
+    frame->spill_next += bytes;
+    *de = spilled;
 
-    ret = fwrite(&VERSION, sizeof(VERSION), 1, treefile);
-    if (ret != 1) {
-        fprintf(
-            stderr,
-            "fwrite() failed with return code %i and errno %i\n",
-            ret,
-            errno
-        );
-        return -1;
+    return 0;
+}
+
+// Crawls the tree below filepath depth first without recursing, with at
+// most max_open_dirs directories open at a time
+int dump_dir(
+    const char *filepath,
+    FILE *treefile,
+    FILE *datafile,
+    long long *datafile_pos,
+    bool top_level
+) {
+    int ret;
+    bool descend;
+    struct dirent *de;
+    struct dirent spilled;
+
+    ret = set_entry_path(filepath);
+    if (ret == 0) {
+        ret = push_dir(treefile);
     }
-    ret = fwrite(&VERSION, sizeof(VERSION), 1, datafile);
-    if (ret != 1) {
-        fprintf(
-            stderr,
-            "fwrite() failed with return code %i and errno %i\n",
-            ret,
-            errno
-        );
+
+    while (ret == 0 && dir_depth > 0) {
+        ret = next_entry(&spilled, &de);
+        if (ret) {
+            break;
+        }
+        if (de == NULL) {
+            ret = pop_dir(treefile);
+            continue;
+        }
+        if (strcmp(de->d_name, ".") == 0) {
+            continue;
+        }
+        if (strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (top_level && dir_depth == 1 && !in_shard(de->d_name)) {
+            continue;
+        }
+
+        ret = set_entry_path(de->d_name);
+        if (ret) {
+            break;
+        }
+        // Decided on the name alone, before any statx() or open()
+        if (rules_excluded(dir_path + root_length + 1, de->d_name)) {
+            ret = dump_pruned(dir_path, de, treefile);
+            continue;
+        }
+        ret = dump_entry(dir_path, de, treefile, datafile, datafile_pos, false, &descend);
+        if (ret == 0 && descend) {
+            ret = push_dir(treefile);
+        }
+    }
+
+    // Left open only on errors
+    for (int idx = 0; idx < dir_depth; idx++) {
+        if (dir_stack[idx].dr != NULL) {
+            closedir(dir_stack[idx].dr);
+        }
+    }
+    free(dir_stack);
+    free(dir_path);
+    dir_stack = NULL;
+    dir_path = NULL;
+    dir_depth = 0;
+    dir_alloc = 0;
+    dir_open = 0;
+    dir_lowest_open = 0;
+    dir_path_alloc = 0;
+    if (spill_file != NULL) {
+        fclose(spill_file);
+        spill_file = NULL;
+        spill_used = 0;
+    }
+
+    return ret;
+}
+
+int add_sample_path(
+    char ***paths,
+    long long *count,
+    long long *alloc,
+    char *path
+) {
+    char **new_paths;
+
+    if (*count == *alloc) {
+        *alloc = *alloc ? 2 * *alloc : 64;
+        new_paths = realloc(*paths, *alloc * sizeof(**paths));
+        if (new_paths == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            return -1;
+        }
+        *paths = new_paths;
+    }
+    (*paths)[(*count)++] = path;
+
+    return 0;
+}
+
+// Stats a random subset of the files of filepath and descends into a random
+// subset of its subdirectories; adds the estimated totals of its subtree,
+// as if it were the root, to totals. weight is the number of directories
+// of the tree filepath stands for.
+int sample_dir(
+    const char *filepath,
+    double weight,
+    bool top_level,
+    struct sample_totals *totals
+) {
+    int ret;
+    DIR *dr;
+    struct dirent *de;
+    char *fullpath;
+    char *swap;
+    char **files;
+    char **dirs;
+    char **unknown;
+    long long file_count;
+    long long dir_count;
+    long long unknown_count;
+    long long special_count;
+    long long file_alloc;
+    long long dir_alloc;
+    long long unknown_alloc;
+    long long picked;
+    long long other;
+    double dir_fraction;
+    struct sample_stratum stratum;
+    struct sample_stratum census;
+    struct sample_totals child;
+
+    files = NULL;
+    dirs = NULL;
+    unknown = NULL;
+    file_count = dir_count = unknown_count = special_count = 0;
+    file_alloc = dir_alloc = unknown_alloc = 0;
+
+    // Listing is cheap next to statx(), and tells files from directories and
+    // from the other types, which only need counting
+    dr = opendir(filepath);
+    if (dr == NULL) {
+        fprintf(stderr, "opendir() failed with errno %i for %s\n", errno, filepath);
+        return 0;
+    }
+    ret = 0;
+    while (ret == 0 && (de = readdir(dr)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (top_level && !in_shard(de->d_name)) {
+            continue;
+        }
+        fullpath = malloc(strlen(filepath) + strlen(de->d_name) + 2);
+        if (fullpath == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i for %s\n", errno, filepath);
+            ret = -1;
+            break;
+        }
+        sprintf(fullpath, "%s/%s", filepath, de->d_name);
+        if (rules_excluded(fullpath + root_length + 1, de->d_name)) {
+            free(fullpath);
+            continue;
+        }
+
+        if (de->d_type == DT_DIR) {
+            ret = add_sample_path(&dirs, &dir_count, &dir_alloc, fullpath);
+        } else if (de->d_type == DT_UNKNOWN) {
+            ret = add_sample_path(&unknown, &unknown_count, &unknown_alloc, fullpath);
+        } else if (de->d_type == DT_REG) {
+            ret = add_sample_path(&files, &file_count, &file_alloc, fullpath);
+        } else {
+            special_count++;
+            free(fullpath);
+            continue;
+        }
+        if (ret) {
+            free(fullpath);
+        }
+    }
+    closedir(dr);
+
+    // The filesystem doesn't report types, so these are all statted
+    memset(&census, 0x00, sizeof(census));
+    for (long long idx = 0; idx < special_count; idx++) {
+        sample_file(&census, NULL, weight);
+    }
+    for (long long idx = 0; ret == 0 && idx < unknown_count; idx++) {
+        collect_statx(unknown[idx]);
+        if (!stx.ret && S_ISDIR(stx.buff.stx_mode)) {
+            ret = add_sample_path(&dirs, &dir_count, &dir_alloc, unknown[idx]);
+            unknown[idx] = NULL;
+        } else {
+            sample_file(&census, stx.ret ? NULL : &stx.buff, weight);
+        }
+    }
+    census.population = census.sampled;
+    sample_add_stratum(totals, &census);
+
+    // A simple random sample of the rest, picked by a partial shuffle
+    memset(&stratum, 0x00, sizeof(stratum));
+    stratum.population = file_count;
+    picked = sample_size(file_count);
+    for (long long idx = 0; ret == 0 && idx < picked; idx++) {
+        other = idx + (long long)(sample_random() * (file_count - idx));
+        swap = files[idx];
+        files[idx] = files[other];
+        files[other] = swap;
+
+        collect_statx(files[idx]);
+        sample_file(&stratum, stx.ret ? NULL : &stx.buff, weight * file_count / picked);
+    }
+    sample_add_stratum(totals, &stratum);
+
+    dir_fraction = sample_dir_fraction();
+    for (long long idx = 0; ret == 0 && idx < dir_count; idx++) {
+        if (sample_random() >= dir_fraction) {
+            continue;
+        }
+
+        memset(&child, 0x00, sizeof(child));
+        child.total[SAMPLE_DIRS] = 1;
+        collect_statx(dirs[idx]);
+        if (!stx.ret && S_ISDIR(stx.buff.stx_mode) &&
+            dev_major == stx.buff.stx_dev_major && dev_minor == stx.buff.stx_dev_minor) {
+            ret = sample_dir(dirs[idx], weight / dir_fraction, false, &child);
+        }
+        sample_add_child(totals, &child);
+    }
+
+    for (long long idx = 0; idx < file_count; idx++) {
+        free(files[idx]);
+    }
+    for (long long idx = 0; idx < dir_count; idx++) {
+        free(dirs[idx]);
+    }
+    for (long long idx = 0; idx < unknown_count; idx++) {
+        free(unknown[idx]);
+    }
+    free(files);
+    free(dirs);
+    free(unknown);
+
+    return ret;
+}
+
+int sample_tree(
+    const char *root,
+    const char *summarypath
+) {
+    int ret;
+    struct sample_totals totals;
+
+    memset(&totals, 0x00, sizeof(totals));
+    collect_statx(root);
+    if (stx.ret || !S_ISDIR(stx.buff.stx_mode)) {
+        fprintf(stderr, "%s is not a directory\n", root);
         return -1;
     }
-    datafile_pos += sizeof(*&VERSION);
+    root_length = strlen(root);
+    dev_major = stx.buff.stx_dev_major;
+    dev_minor = stx.buff.stx_dev_minor;
+    totals.total[SAMPLE_DIRS] = 1;
 
-    ret = dump_file(argv[3], treefile, datafile, &datafile_pos, true);
+    ret = sample_dir(root, 1, true, &totals);
     if (ret) {
         return ret;
     }
 
-    fclose(treefile);
-    fclose(datafile);
+    return sample_report(summarypath, root, &totals, statx_calls);
+}
 
-    free(buff_llistxattr);
+int add_shard_name(
+    const char *name
+) {
+    char **names;
+
+    names = realloc(shard_names, (shard_count + 1) * sizeof(*shard_names));
+    if (names == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    shard_names = names;
+
+    shard_names[shard_count] = strdup(name);
+    if (shard_names[shard_count] == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    shard_count++;
+
+    return 0;
+}
+
+int load_shard_names(
+    const char *listpath
+) {
+    int ret;
+    FILE *listfile;
+    char *line;
+    size_t length;
+    ssize_t bytes;
+
+    listfile = fopen(listpath, "r");
+    if (listfile == NULL) {
+        fprintf(stderr, "Can't open subtree list %s\n", listpath);
+        return -1;
+    }
+
+    line = NULL;
+    length = 0;
+    while ((bytes = getline(&line, &length, listfile)) != -1) {
+        if (bytes > 0 && line[bytes - 1] == '\n') {
+            line[bytes - 1] = '\0';
+        }
+        if (line[0] == '\0') {
+            continue;
+        }
+        ret = add_shard_name(line);
+        if (ret) {
+            free(line);
+            fclose(listfile);
+            return ret;
+        }
+    }
+
+    free(line);
+    fclose(listfile);
+
+    return 0;
+}
+
+char *join_path(
+    const char *dirpath,
+    const char *name
+) {
+    char *path;
+
+    path = malloc(strlen(dirpath) + strlen(name) + 2);
+    if (path == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return NULL;
+    }
+    if (name[0] == '\0') {
+        strcpy(path, dirpath);
+    } else if (dirpath[0] == '\0') {
+        strcpy(path, name);
+    } else {
+        sprintf(path, "%s/%s", dirpath, name);
+    }
+
+    return path;
+}
+
+int journal_tree(
+    const char *root,
+    const char *relpath,
+    bool created
+);
+
+// Appends the current state of relpath to the journal, and that of
+// everything below it if it is a new directory
+int journal_path(
+    const char *root,
+    const char *relpath,
+    bool created
+) {
+    int ret;
+    long long record_pos;
+    bool excluded;
+    char *fullpath;
+    char *parent;
+    char *record;
+    size_t record_length;
+    const char *name;
+    FILE *recordfile;
+    struct dirent de;
+    struct stat st;
+
+    name = strrchr(relpath, '/');
+    name = name != NULL ? name + 1 : relpath;
+    excluded = rules_excluded_path(relpath);
+    if (excluded && name != relpath) {
+        // Nothing below a pruned stub is recorded
+        parent = strndup(relpath, name - relpath - 1);
+        if (parent == NULL) {
+            fprintf(stderr, "strdup() failed with errno %i\n", errno);
+            return -1;
+        }
+        ret = rules_excluded_path(parent);
+        free(parent);
+        if (ret) {
+            return 0;
+        }
+    }
+
+    fullpath = join_path(root, relpath);
+    if (fullpath == NULL) {
+        return -1;
+    }
+
+    ret = lstat(fullpath, &st);
+    if (ret) {
+        free(fullpath);
+        if (errno != ENOENT && errno != ENOTDIR) {
+            fprintf(stderr, "lstat() failed with errno %i for %s\n", errno, relpath);
+            return -1;
+        }
+        return journal_append(JOURNAL_DELETE, relpath, NULL, NULL, 0);
+    }
+
+    // The dirent readdir() would have returned
+    memset(&de, 0x00, sizeof(de));
+    de.d_ino = st.st_ino;
+    de.d_type = IFTODT(st.st_mode);
+    de.d_reclen = (offsetof(struct dirent, d_name) + strlen(name) + 8) & ~7;
+    strncpy(de.d_name, name, sizeof(de.d_name) - 1);
+
+    if (excluded) {
+        free(fullpath);
+        return journal_append(JOURNAL_PRUNED, relpath, &de, NULL, 0);
+    }
+
+    recordfile = open_memstream(&record, &record_length);
+    if (recordfile == NULL) {
+        fprintf(stderr, "open_memstream() failed with errno %i\n", errno);
+        free(fullpath);
+        return -1;
+    }
+
+    record_pos = 0;
+    ret = dump_statx(fullpath, recordfile, &record_pos);
+    if (!ret) {
+        ret = dump_ioctl_and_md5(fullpath, recordfile, &record_pos);
+    }
+    if (!ret) {
+        ret = dump_xattr(fullpath, recordfile, &record_pos);
+    }
+    fclose(recordfile);
+    free(fullpath);
+    if (ret) {
+        free(record);
+        return ret;
+    }
+
+    ret = journal_append(created ? JOURNAL_CREATE : JOURNAL_UPDATE, relpath, &de, record, record_length);
+    free(record);
+    if (ret) {
+        return ret;
+    }
+
+    if (created && !stx.ret && S_ISDIR(stx.buff.stx_mode)) {
+        if (dev_major != stx.buff.stx_dev_major || dev_minor != stx.buff.stx_dev_minor) {
+            return 0;
+        }
+        // Watch before listing, so no entry created in between is missed
+        ret = watch_add_tree(relpath);
+        if (ret) {
+            return ret;
+        }
+        return journal_tree(root, relpath, created);
+    }
+
+    return 0;
+}
+
+int journal_tree(
+    const char *root,
+    const char *relpath,
+    bool created
+) {
+    int ret;
+    DIR *dr;
+    struct dirent *de;
+    char *fullpath;
+    char *childpath;
+
+    fullpath = join_path(root, relpath);
+    if (fullpath == NULL) {
+        return -1;
+    }
+    dr = opendir(fullpath);
+    if (dr == NULL) {
+        fprintf(stderr, "opendir() failed with errno %i for %s\n", errno, fullpath);
+        free(fullpath);
+        return 0;
+    }
+    free(fullpath);
+
+    ret = 0;
+    while (ret == 0 && (de = readdir(dr)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        childpath = join_path(relpath, de->d_name);
+        if (childpath == NULL) {
+            ret = -1;
+            break;
+        }
+        ret = journal_path(root, childpath, created);
+        free(childpath);
+    }
+    closedir(dr);
+
+    return ret;
+}
+
+int journal_dirty(
+    const char *root,
+    struct pathmap *dirty
+) {
+    int ret;
+    char **paths;
+    long long *flags;
+    size_t count;
+    size_t tree_length;
+    const char *tree;
+
+    paths = malloc(dirty->used * sizeof(*paths));
+    if (paths == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    count = 0;
+    for (size_t idx = 0; idx < dirty->alloc; idx++) {
+        if (dirty->entries[idx].key != NULL) {
+            paths[count++] = dirty->entries[idx].key;
+        }
+    }
+
+    // Parents come before their children, which a new parent hides in the
+    // compacted dump unless they were journaled after it
+    qsort(paths, count, sizeof(*paths), compare_names);
+
+    ret = 0;
+    tree = NULL;
+    tree_length = 0;
+    for (size_t idx = 0; ret == 0 && idx < count; idx++) {
+        if (tree != NULL && strncmp(paths[idx], tree, tree_length) == 0 && paths[idx][tree_length] == '/') {
+            continue;
+        }
+        flags = pathmap_get(dirty, paths[idx]);
+        ret = journal_path(root, paths[idx], *flags & WATCH_CREATED);
+        if (*flags & WATCH_CREATED) {
+            tree = paths[idx];
+            tree_length = strlen(tree);
+        }
+    }
+    free(paths);
+    if (ret) {
+        return ret;
+    }
+
+    return journal_flush();
+}
+
+int dump_plain(
+    const char *root,
+    const char *treepath,
+    const char *datapath
+) {
+    int ret;
+    long long datafile_pos;
+    char *tree_tmp;
+    char *data_tmp;
+    FILE *treefile;
+    FILE *datafile;
+
+    // Written as a new generation, which replaces the previous one as a
+    // pair once it is complete
+    ret = generation_open(datapath, &tree_tmp, &data_tmp);
+    if (ret) {
+        return ret;
+    }
+
+    treefile = fopen(tree_tmp, "wb");
+    if (treefile == NULL) {
+        fprintf(stderr, "Can't open treefile %s\n", tree_tmp);
+        return -1;
+    }
+    datafile = fopen(data_tmp, "wb");
+    if (datafile == NULL) {
+        fprintf(stderr, "Can't open datafile %s\n", data_tmp);
+        return -1;
+    }
+
+    ret = fwrite(&VERSION, sizeof(VERSION), 1, treefile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    ret = fwrite(&VERSION, sizeof(VERSION), 1, datafile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    datafile_pos = DATA_OFFSET + sizeof(VERSION);
+
+    ret = dump_file(root, NULL, treefile, datafile, &datafile_pos, true);
+    if (ret) {
+        return ret;
+    }
+
+    ret = fclose(treefile);
+    if (ret) {
+        fprintf(stderr, "fclose() failed with errno %i\n", errno);
+        return -1;
+    }
+    ret = fclose(datafile);
+    if (ret) {
+        fprintf(stderr, "fclose() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    ret = generation_publish(treepath, datapath);
+    if (ret) {
+        return ret;
+    }
+    free(tree_tmp);
+    free(data_tmp);
+
+    return 0;
+}
+
+void stop_watch(
+    int signum
+) {
+    (void)signum;
+    watch_stop = 1;
+}
+
+// Dumps root, then journals every change to it and folds the journal into
+// the dump every compact_interval seconds and on SIGINT or SIGTERM
+int watch_dump(
+    const char *treepath,
+    const char *datapath,
+    const char *root,
+    const char *journalpath,
+    double compact_interval
+) {
+    int ret;
+    bool arrived;
+    bool overflow;
+    double now;
+    double first_event;
+    double last_event;
+    double last_compact;
+    struct pathmap dirty;
+    struct sigaction action;
+    const char *own_paths[] = {treepath, datapath, journalpath};
+    char *tmppath;
+    char *gendir;
+
+    // Changes made during the initial dump are picked up by the journal
+    ret = watch_open(root);
+    if (ret) {
+        return ret;
+    }
+    for (int idx = 0; idx < 3; idx++) {
+        tmppath = malloc(strlen(own_paths[idx]) + 5);
+        if (tmppath == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            return -1;
+        }
+        sprintf(tmppath, "%s.new", own_paths[idx]);
+        ret = watch_ignore(own_paths[idx]);
+        if (!ret) {
+            ret = watch_ignore(tmppath);
+        }
+        free(tmppath);
+        if (ret) {
+            return ret;
+        }
+    }
+    gendir = malloc(strlen(datapath) + strlen(GENERATION_SUFFIX) + 1);
+    if (gendir == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    sprintf(gendir, "%s%s", datapath, GENERATION_SUFFIX);
+    ret = watch_ignore(gendir);
+    free(gendir);
+    if (ret) {
+        return ret;
+    }
+    ret = watch_start();
+    if (ret) {
+        return ret;
+    }
+
+    ret = dump_plain(root, treepath, datapath);
+    if (ret) {
+        return ret;
+    }
+    ret = journal_open(journalpath);
+    if (ret) {
+        return ret;
+    }
+
+    memset(&action, 0x00, sizeof(action));
+    action.sa_handler = stop_watch;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    memset(&dirty, 0x00, sizeof(dirty));
+    first_event = 0;
+    last_event = 0;
+    last_compact = throttle_now();
+    while (!watch_stop) {
+        poll(NULL, 0, WATCH_TICK_MS);
+        now = throttle_now();
+        ret = watch_status(&arrived, &overflow);
+        if (ret) {
+            return ret;
+        }
+        if (arrived) {
+            if (first_event == 0) {
+                first_event = now;
+            }
+            last_event = now;
+        }
+
+        // Lost events can't be journaled, only a full dump recovers. What
+        // changes while it runs is collected again.
+        if (overflow) {
+            fprintf(stderr, "Event queue overflowed, dumping %s again\n", root);
+            watch_take(&dirty);
+            pathmap_free(&dirty);
+            ret = dump_plain(root, treepath, datapath);
+            if (!ret) {
+                ret = journal_reset();
+            }
+            if (ret) {
+                return ret;
+            }
+            overflow = false;
+            first_event = 0;
+            last_compact = throttle_now();
+            continue;
+        }
+
+        // Wait for a burst of changes to settle, but not forever
+        if (first_event != 0 && (now - last_event >= WATCH_QUIET || now - first_event >= WATCH_MAX_DELAY)) {
+            watch_take(&dirty);
+            if (dirty.used > 0) {
+                ret = journal_dirty(root, &dirty);
+                if (ret) {
+                    return ret;
+                }
+            }
+            pathmap_free(&dirty);
+            first_event = 0;
+        }
+
+        if (journal_size() > 0 && now - last_compact >= compact_interval) {
+            ret = journal_compact(treepath, datapath);
+            if (ret) {
+                return ret;
+            }
+            last_compact = now;
+        }
+    }
+
+    watch_take(&dirty);
+    if (dirty.used > 0) {
+        ret = journal_dirty(root, &dirty);
+        if (ret) {
+            return ret;
+        }
+    }
+    pathmap_free(&dirty);
+    if (journal_size() > 0) {
+        ret = journal_compact(treepath, datapath);
+        if (ret) {
+            return ret;
+        }
+    }
+    watch_close();
+
+    return journal_close();
+}
+
+void print_usage(
+    const char *name
+) {
+    fprintf(stderr, "Usage: %s [options] treefile datafile root\n", name);
+    fprintf(stderr, "       %s [options] --stream=FILE root\n", name);
+    fprintf(stderr, "       %s [options] --store=DIR treefile root\n", name);
+    fprintf(stderr, "       %s [options] --verify treefile datafile root\n", name);
+    fprintf(stderr, "       %s [options] --watch=JOURNAL treefile datafile root\n", name);
+    fprintf(stderr, "       %s [options] --sample=FRACTION summary root\n", name);
+    fprintf(stderr, "  --sparse      skip holes when hashing (SEEK_DATA/SEEK_HOLE)\n");
+    fprintf(stderr, "  --extents     record the data extent map of each file (implies --sparse)\n");
+    fprintf(stderr, "  --tree-hash[=MIB]\n");
+    fprintf(stderr, "                hash files larger than MIB (default 64) MiB as a tree of\n");
+    fprintf(stderr, "                MIB-sized chunks read in parallel\n");
+    fprintf(stderr, "  --fingerprint[=N]\n");
+    fprintf(stderr, "                instead of hashing files larger than N (default 8) blocks of\n");
+    fprintf(stderr, "                %i KiB in full, hash their size and N blocks from the head,\n", HASH_FINGERPRINT_BLOCK / 1024);
+    fprintf(stderr, "                the tail and evenly in between, read in parallel\n");
+    fprintf(stderr, "  --threads=N   threads used by the tree hash and fingerprint (default:\n");
+    fprintf(stderr, "                online CPUs)\n");
+    fprintf(stderr, "  --max-bytes=RATE\n");
+    fprintf(stderr, "                read at most RATE bytes per second (K, M and G suffixes)\n");
+    fprintf(stderr, "  --max-files=RATE\n");
+    fprintf(stderr, "                visit at most RATE files per second\n");
+    fprintf(stderr, "  --idle        run at nice 19 in the idle I/O class\n");
+    fprintf(stderr, "  --drop-cache  drop each file from the page cache once hashed\n");
+    fprintf(stderr, "  --backoff     slow down while statx() latency is above its baseline\n");
+    fprintf(stderr, "  --no-sync     let statx() return cached attributes on network\n");
+    fprintf(stderr, "                filesystems instead of forcing a round trip\n");
+    fprintf(stderr, "  --defer-hash  leave the digests of regular files pending, for mdhash to\n");
+    fprintf(stderr, "                fill in later (not with --stream or --store)\n");
+    fprintf(stderr, "  --stream=FILE write the tree and data as one framed stream to FILE\n");
+    fprintf(stderr, "                (- for stdout), see mdsplit\n");
+    fprintf(stderr, "  --store=DIR   write records to the shared store DIR, each distinct record\n");
+    fprintf(stderr, "                once; read the dump with DIR/" STORE_DATA " as its datafile;\n");
+    fprintf(stderr, "                records that only differ in atime keep the first atime\n");
+    fprintf(stderr, "  --verify      check root against an existing dump instead of dumping it;\n");
+    fprintf(stderr, "                files are re-hashed only when their statx data differs\n");
+    fprintf(stderr, "  --verify-sample=FRACTION\n");
+    fprintf(stderr, "                also re-hash this fraction of the unchanged files\n");
+    fprintf(stderr, "  --exclude=PATTERN\n");
+    fprintf(stderr, "  --include=PATTERN\n");
+    fprintf(stderr, "                skip or crawl the entries matching PATTERN (repeatable, the\n");
+    fprintf(stderr, "                first matching rule wins); a PATTERN without / is a glob on\n");
+    fprintf(stderr, "                the name, with / a glob on the path relative to root, and\n");
+    fprintf(stderr, "                re:REGEX an extended regex on that path; wildcards match a\n");
+    fprintf(stderr, "                leading . too; skipped entries are recorded as pruned stubs\n");
+    fprintf(stderr, "                and not descended into\n");
+    fprintf(stderr, "  --rules=FILE  read rules from FILE, one \"- PATTERN\" or \"+ PATTERN\" per line\n");
+    fprintf(stderr, "  --watch=JOURNAL\n");
+    fprintf(stderr, "                keep running after the dump and record every change to root\n");
+    fprintf(stderr, "                in JOURNAL, which is folded into the dump periodically and\n");
+    fprintf(stderr, "                on SIGINT or SIGTERM; treefile and datafile become links to\n");
+    fprintf(stderr, "                the current version in datafile.gen/\n");
+    fprintf(stderr, "  --compact=SECONDS\n");
+    fprintf(stderr, "                how often --watch folds the journal in (default 3600)\n");
+    fprintf(stderr, "  --sample=FRACTION\n");
+    fprintf(stderr, "                instead of dumping, stat FRACTION of the regular files of\n");
+    fprintf(stderr, "                each directory and write estimated totals with 95%% confidence\n");
+    fprintf(stderr, "                intervals and a size histogram to summary (- for stdout);\n");
+    fprintf(stderr, "                other types are counted apart and left out of the sizes\n");
+    fprintf(stderr, "  --sample-dirs=FRACTION\n");
+    fprintf(stderr, "                with --sample, only descend into FRACTION of the directories\n");
+    fprintf(stderr, "  --seed=N      seed of the random choices of --sample\n");
+    fprintf(stderr, "  --zonemap=FILE\n");
+    fprintf(stderr, "                write per-block min/max of size, mtime and uid to FILE\n");
+    fprintf(stderr, "                so mdquery can skip blocks\n");
+    fprintf(stderr, "  --xattr-dict  write extended attribute names and repeated values once, to\n");
+    fprintf(stderr, "                datafile" XDICT_SUFFIX ", and refer to them by id in the records\n");
+    fprintf(stderr, "  --packed      write the statx and ioctl results as varints, only the\n");
+    fprintf(stderr, "                statx fields the kernel marked as valid\n");
+    fprintf(stderr, "  --splits=FILE write a split point every %i records to FILE, so mdquery\n", SPLIT_ENTRIES);
+    fprintf(stderr, "                and mdexport can read the dump with several threads\n");
+    fprintf(stderr, "  --inode-index=FILE\n");
+    fprintf(stderr, "                write the paths and records of each inode to FILE, for\n");
+    fprintf(stderr, "                parse --inode\n");
+    fprintf(stderr, "  --subtree=NAME\n");
+    fprintf(stderr, "                only crawl this top-level entry of root (repeatable)\n");
+    fprintf(stderr, "  --subtrees=FILE\n");
+    fprintf(stderr, "                only crawl the top-level entries listed in FILE, one per\n");
+    fprintf(stderr, "                line; shard dumps are combined with mdmerge\n");
+    fprintf(stderr, "  --max-open-dirs=N\n");
+    fprintf(stderr, "                keep at most N directories open while crawling (default\n");
+    fprintf(stderr, "                256), the others have their remaining entries set aside in\n");
+    fprintf(stderr, "                a temporary file\n");
+    fprintf(stderr, "  --slowest=K   time each statx, open, ioctl, hash and xattr call and write\n");
+    fprintf(stderr, "                the K slowest with their paths and the totals per call to\n");
+    fprintf(stderr, "                stderr\n");
+    fprintf(stderr, "  --trace=FILE  write every timed call to FILE as Chrome trace events\n");
+}
+
+int main(int argc, char *argv[]) {
+    int ret;
+    int opt;
+    FILE *treefile;
+    FILE *datafile;
+    FILE *streamfile;
+    const char *stream_path;
+    const char *store_path;
+    const char *watch_path;
+    const char *root;
+    double compact_interval;
+    double sample_fraction;
+    double sample_dirs;
+    long seed;
+    double bytes_rate;
+    double files_rate;
+    bool backoff;
+    bool verify;
+    bool use_zonemap;
+    bool use_splits;
+    bool use_inodes;
+    bool use_xdict;
+    struct verify_opts verify_opts;
+    long long datafile_pos = DATA_OFFSET;
+
+    const struct option long_options[] = {
+        {"sparse", no_argument, NULL, 's'},
+        {"extents", no_argument, NULL, 'e'},
+        {"tree-hash", optional_argument, NULL, 't'},
+        {"fingerprint", optional_argument, NULL, 'F'},
+        {"threads", required_argument, NULL, 'j'},
+        {"defer-hash", no_argument, NULL, 'd'},
+        {"max-bytes", required_argument, NULL, 'b'},
+        {"max-files", required_argument, NULL, 'f'},
+        {"idle", no_argument, NULL, 'i'},
+        {"drop-cache", no_argument, NULL, 'c'},
+        {"backoff", no_argument, NULL, 'B'},
+        {"no-sync", no_argument, NULL, 'y'},
+        {"verify", no_argument, NULL, 'v'},
+        {"verify-sample", required_argument, NULL, 'V'},
+        {"exclude", required_argument, NULL, 'x'},
+        {"include", required_argument, NULL, 'I'},
+        {"rules", required_argument, NULL, 'r'},
+        {"sample", required_argument, NULL, 'p'},
+        {"sample-dirs", required_argument, NULL, 'P'},
+        {"seed", required_argument, NULL, 'R'},
+        {"watch", required_argument, NULL, 'w'},
+        {"compact", required_argument, NULL, 'C'},
+        {"stream", required_argument, NULL, 'S'},
+        {"store", required_argument, NULL, 'D'},
+        {"zonemap", required_argument, NULL, 'z'},
+        {"splits", required_argument, NULL, 'L'},
+        {"inode-index", required_argument, NULL, 'Q'},
+        {"xattr-dict", no_argument, NULL, 'X'},
+        {"packed", no_argument, NULL, 'k'},
+        {"subtree", required_argument, NULL, 'n'},
+        {"subtrees", required_argument, NULL, 'N'},
+        {"max-open-dirs", required_argument, NULL, 'o'},
+        {"trace", required_argument, NULL, 'T'},
+        {"slowest", required_argument, NULL, 'K'},
+        {NULL, 0, NULL, 0}
+    };
+
+    streamfile = NULL;
+    stream_path = NULL;
+    store_path = NULL;
+    watch_path = NULL;
+    compact_interval = 3600;
+    sample_fraction = 0;
+    sample_dirs = 1;
+    seed = time(NULL) ^ getpid();
+    bytes_rate = 0;
+    files_rate = 0;
+    backoff = false;
+    verify = false;
+    use_zonemap = false;
+    use_splits = false;
+    use_inodes = false;
+    use_xdict = false;
+    verify_opts.sample = 0;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            hash_opts.sparse = true;
+            break;
+        case 'e':
+            hash_opts.sparse = true;
+            hash_opts.extents = true;
+            break;
+        case 't':
+            hash_opts.tree_chunk = (optarg ? atoll(optarg) : 64) * 1024 * 1024;
+            if (hash_opts.tree_chunk <= 0) {
+                fprintf(stderr, "Invalid tree hash chunk size %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'F':
+            hash_opts.fingerprint_blocks = optarg ? atoi(optarg) : 8;
+            if (hash_opts.fingerprint_blocks < 2) {
+                fprintf(stderr, "Invalid number of fingerprint blocks %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'j':
+            hash_opts.threads = atoi(optarg);
+            if (hash_opts.threads < 1) {
+                fprintf(stderr, "Invalid thread count %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'd':
+            defer_hash = true;
+            break;
+        case 'b':
+            ret = throttle_parse_rate(optarg, &bytes_rate);
+            if (ret) {
+                fprintf(stderr, "Invalid rate %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'f':
+            ret = throttle_parse_rate(optarg, &files_rate);
+            if (ret) {
+                fprintf(stderr, "Invalid rate %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'i':
+            set_idle_priority();
+            break;
+        case 'c':
+            drop_cache = true;
+            break;
+        case 'B':
+            backoff = true;
+            break;
+        case 'y':
+            statx_sync = AT_STATX_SYNC_AS_STAT;
+            break;
+        case 'v':
+            verify = true;
+            break;
+        case 'V':
+            verify_opts.sample = atof(optarg);
+            if (verify_opts.sample < 0 || verify_opts.sample > 1) {
+                fprintf(stderr, "Invalid sample fraction %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'x':
+        case 'I':
+            ret = rules_add(opt == 'I', optarg);
+            if (ret) {
+                return ret;
+            }
+            break;
+        case 'r':
+            ret = rules_load(optarg);
+            if (ret) {
+                return ret;
+            }
+            break;
+        case 'p':
+            sample_fraction = atof(optarg);
+            if (sample_fraction <= 0 || sample_fraction > 1) {
+                fprintf(stderr, "Invalid sample fraction %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'P':
+            sample_dirs = atof(optarg);
+            if (sample_dirs <= 0 || sample_dirs > 1) {
+                fprintf(stderr, "Invalid sample fraction %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'R':
+            seed = atol(optarg);
+            break;
+        case 'w':
+            watch_path = optarg;
+            break;
+        case 'C':
+            compact_interval = atof(optarg);
+            if (compact_interval <= 0) {
+                fprintf(stderr, "Invalid compaction interval %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'S':
+            stream_path = optarg;
+            break;
+        case 'D':
+            store_path = optarg;
+            break;
+        case 'z':
+            ret = zonemap_open(optarg);
+            if (ret) {
+                return ret;
+            }
+            use_zonemap = true;
+            break;
+        case 'L':
+            ret = split_open(optarg);
+            if (ret) {
+                return ret;
+            }
+            use_splits = true;
+            break;
+        case 'Q':
+            ret = inodes_open(optarg);
+            if (ret) {
+                return ret;
+            }
+            use_inodes = true;
+            break;
+        case 'X':
+            use_xdict = true;
+            break;
+        case 'k':
+            packed_records = true;
+            break;
+        case 'n':
+            ret = add_shard_name(optarg);
+            if (ret) {
+                return ret;
+            }
+            break;
+        case 'N':
+            ret = load_shard_names(optarg);
+            if (ret) {
+                return ret;
+            }
+            break;
+        case 'T':
+            ret = trace_open(optarg);
+            if (ret) {
+                return ret;
+            }
+            break;
+        case 'K':
+            if (atoi(optarg) < 1) {
+                fprintf(stderr, "Invalid number of operations %s\n", optarg);
+                return -1;
+            }
+            ret = trace_slowest(atoi(optarg));
+            if (ret) {
+                return ret;
+            }
+            break;
+        case 'o':
+            max_open_dirs = atoi(optarg);
+            if (max_open_dirs < 1) {
+                fprintf(stderr, "Invalid number of open directories %s\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (hash_opts.threads == 0) {
+        hash_opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    throttle_set(bytes_rate, files_rate, backoff);
+
+    ret = rules_compile();
+    if (ret) {
+        return ret;
+    }
+
+    if (verify) {
+        if (stream_path != NULL || store_path != NULL) {
+            fprintf(stderr, "--verify can't be combined with --stream or --store\n");
+            return -1;
+        }
+        if (argc - optind != 3) {
+            fprintf(stderr, "Exactly 3 arguments required\n");
+            print_usage(argv[0]);
+            return -1;
+        }
+        verify_opts.threads = hash_opts.threads;
+        verify_opts.statx_flags = statx_sync;
+        return verify_dump(argv[optind], argv[optind + 1], argv[optind + 2], &verify_opts);
+    }
+
+    if (shard_count > 0) {
+        qsort(shard_names, shard_count, sizeof(*shard_names), compare_names);
+    }
+
+    if (sample_fraction > 0) {
+        if (stream_path != NULL || store_path != NULL || watch_path != NULL || use_zonemap || use_splits || use_inodes) {
+            fprintf(stderr, "--sample can't be combined with --stream, --store, --watch, --zonemap, --splits or --inode-index\n");
+            return -1;
+        }
+        if (argc - optind != 2) {
+            fprintf(stderr, "Exactly 2 arguments required with --sample\n");
+            print_usage(argv[0]);
+            return -1;
+        }
+        sample_set(sample_fraction, sample_dirs, seed);
+        ret = sample_tree(argv[optind + 1], argv[optind]);
+        if (ret) {
+            return ret;
+        }
+        return trace_close();
+    }
+
+    if (defer_hash && hash_opts.extents) {
+        fprintf(stderr, "--extents can't be combined with --defer-hash\n");
+        return -1;
+    }
+
+    // mdhash fills in digests in place, which a stream has no datafile for
+    // and which would change shared store records under their content key
+    if (defer_hash && (stream_path != NULL || store_path != NULL)) {
+        fprintf(stderr, "--defer-hash can't be combined with --stream or --store\n");
+        return -1;
+    }
+
+    if (stream_path != NULL && store_path != NULL) {
+        fprintf(stderr, "--stream and --store can't be combined\n");
+        return -1;
+    }
+
+    // Split points and the inode index hold offsets into a treefile
+    // written in place
+    if (stream_path != NULL && (use_splits || use_inodes)) {
+        fprintf(stderr, "--stream can't be combined with --splits or --inode-index\n");
+        return -1;
+    }
+
+    // The dictionary belongs to one datafile, which it is kept next to
+    if (use_xdict && (stream_path != NULL || store_path != NULL || watch_path != NULL)) {
+        fprintf(stderr, "--xattr-dict can't be combined with --stream, --store or --watch\n");
+        return -1;
+    }
+
+    // Compaction reads the statx data of journal records as is
+    if (packed_records && watch_path != NULL) {
+        fprintf(stderr, "--packed can't be combined with --watch\n");
+        return -1;
+    }
+
+    length_buff_llistxattr = 0;
+    length_buff_lgetxattr = 0;
+    buff_llistxattr = malloc(0);
+    buff_lgetxattr = malloc(0);
+
+    if (watch_path != NULL) {
+        if (stream_path != NULL || store_path != NULL || use_zonemap || use_splits || use_inodes || shard_count > 0) {
+            fprintf(stderr, "--watch can't be combined with --stream, --store, --zonemap, --splits, --inode-index or --subtree\n");
+            return -1;
+        }
+        if (argc - optind != 3) {
+            fprintf(stderr, "Exactly 3 arguments required\n");
+            print_usage(argv[0]);
+            return -1;
+        }
+        return watch_dump(argv[optind], argv[optind + 1], argv[optind + 2], watch_path, compact_interval);
+    }
+
+    if (stream_path != NULL) {
+        if (argc - optind != 1) {
+            fprintf(stderr, "Exactly 1 argument required with --stream\n");
+            print_usage(argv[0]);
+            return -1;
+        }
+        root = argv[optind];
+
+        if (strcmp(stream_path, "-") == 0) {
+            streamfile = stdout;
+        } else {
+            streamfile = fopen(stream_path, "wb");
+            if (streamfile == NULL) {
+                fprintf(stderr, "Can't open stream %s\n", stream_path);
+                return -1;
+            }
+        }
+
+        ret = stream_open(streamfile, &treefile, &datafile);
+        if (ret) {
+            return ret;
+        }
+    } else if (store_path != NULL) {
+        if (argc - optind != 2) {
+            fprintf(stderr, "Exactly 2 arguments required with --store\n");
+            print_usage(argv[0]);
+            return -1;
+        }
+        root = argv[optind + 1];
+
+        treefile = fopen(argv[optind], "wb");
+        if (treefile == NULL) {
+            fprintf(stderr, "Can't open treefile %s\n", argv[optind]);
+            return -1;
+        }
+
+        ret = store_open(store_path, &datafile);
+        if (ret) {
+            return ret;
+        }
+        use_store = true;
+    } else {
+        if (argc - optind != 3) {
+            fprintf(stderr, "Exactly 3 arguments required\n");
+            print_usage(argv[0]);
+            return -1;
+        }
+        root = argv[optind + 2];
+
+        treefile = fopen(argv[optind], "wb");
+        if (treefile == NULL) {
+            fprintf(stderr, "Can't open treefile %s\n", argv[optind]);
+            return -1;
+        }
+        datafile = fopen(argv[optind + 1], "wb");
+        if (datafile == NULL) {
+            fprintf(stderr, "Can't open datafile %s\n", argv[optind + 1]);
+            return -1;
+        }
+
+        if (use_xdict) {
+            ret = xdict_open(argv[optind + 1]);
+        } else {
+            ret = xdict_remove(argv[optind + 1]);
+        }
+        if (ret) {
+            return ret;
+        }
+    }
+
+    ret = fwrite(&VERSION, sizeof(VERSION), 1, treefile);
+    if (ret != 1) {
+        fprintf(
+            stderr,
+            "fwrite() failed with return code %i and errno %i\n",
+            ret,
+            errno
+        );
+        return -1;
+    }
+    // The store writes its own version
+    if (!use_store) {
+        ret = fwrite(&VERSION, sizeof(VERSION), 1, datafile);
+        if (ret != 1) {
+            fprintf(
+                stderr,
+                "fwrite() failed with return code %i and errno %i\n",
+                ret,
+                errno
+            );
+            return -1;
+        }
+        datafile_pos += sizeof(*&VERSION);
+    }
+
+    ret = dump_file(root, NULL, treefile, datafile, &datafile_pos, true);
+    if (ret) {
+        return ret;
+    }
+
+    ret = zonemap_close();
+    if (ret) {
+        return ret;
+    }
+
+    ret = split_close();
+    if (ret) {
+        return ret;
+    }
+
+    ret = inodes_close();
+    if (ret) {
+        return ret;
+    }
+
+    ret = xdict_close();
+    if (ret) {
+        return ret;
+    }
+
+    ret = trace_close();
+    if (ret) {
+        return ret;
+    }
+
+    if (stream_path != NULL) {
+        ret = stream_close(streamfile, treefile, datafile);
+        if (ret) {
+            return ret;
+        }
+        if (streamfile != stdout) {
+            fclose(streamfile);
+        }
+    } else if (use_store) {
+        fclose(treefile);
+        ret = store_close();
+        if (ret) {
+            return ret;
+        }
+    } else {
+        fclose(treefile);
+        fclose(datafile);
+    }
+
+    free(buff_llistxattr);
     free(buff_lgetxattr);
+    fscaps_free();
+    hash_free(&dgst);
+    for (int idx = 0; idx < shard_count; idx++) {
+        free(shard_names[idx]);
+    }
+    free(shard_names);
 
     return 0;
 }
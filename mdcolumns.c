@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+// Every column file starts with a 64-byte header followed by the values of
+// all entries in tree order. Raw columns are plain little-endian arrays of
+// width bytes per value, ready for mmap. Delta columns are split into
+// blocks of block_rows values, each a run of zigzag varints of the
+// difference to the previous value (starting from 0), with an index of
+// rows / block_rows + 1 file offsets at index_offset.
+
+#define COLUMN_RAW 0
+#define COLUMN_DELTA 1
+#define COLUMN_BLOCK_ROWS 65536
+#define COLUMN_BUFF_SIZE (1024 * 1024)
+
+struct column_header {
+    char magic[8];
+    int version[3];
+    int width;
+    int encoding;
+    int block_rows;
+    long long rows;
+    long long index_offset;
+    char padding[16];
+};
+
+struct column {
+    const char *name;
+    int width;
+    bool numeric;
+    FILE *file;
+    int encoding;
+    long long rows;
+    long long offset;
+    long long *block;
+    int block_used;
+    long long *index;
+    long long index_count;
+    long long index_alloc;
+};
+
+enum column_id {
+    COLUMN_PATH_ID,
+    COLUMN_SIZE,
+    COLUMN_MTIME,
+    COLUMN_UID,
+    COLUMN_GID,
+    COLUMN_MODE,
+    COLUMN_INO,
+    COLUMN_DIGEST,
+    COLUMN_COUNT
+};
+
+struct column columns[COLUMN_COUNT] = {
+    {.name = "path_id", .width = 8, .numeric = true},
+    {.name = "size", .width = 8, .numeric = true},
+    {.name = "mtime", .width = 8, .numeric = true},
+    {.name = "uid", .width = 4, .numeric = true},
+    {.name = "gid", .width = 4, .numeric = true},
+    {.name = "mode", .width = 4, .numeric = true},
+    {.name = "ino", .width = 8, .numeric = true},
+    {.name = "digest", .width = 16, .numeric = false}
+};
+
+void print_error(
+    const char *func,
+    int ret
+) {
+    fprintf(
+        stderr,
+        "%s() failed with return code %i and errno %i\n",
+        func,
+        ret,
+        errno
+    );
+}
+
+FILE *open_output(
+    const char *outdir,
+    const char *name
+) {
+    FILE *file;
+    char *path;
+
+    path = malloc(strlen(outdir) + strlen(name) + 2);
+    if (path == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return NULL;
+    }
+    sprintf(path, "%s/%s", outdir, name);
+
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Can't open %s\n", path);
+    } else {
+        setvbuf(file, NULL, _IOFBF, COLUMN_BUFF_SIZE);
+    }
+    free(path);
+
+    return file;
+}
+
+int write_header(
+    struct column *column
+) {
+    int ret;
+    struct column_header header;
+
+    memset(&header, 0x00, sizeof(header));
+    memcpy(header.magic, "MDCOLUMN", sizeof(header.magic));
+    memcpy(header.version, VERSION, sizeof(header.version));
+    header.width = column->width;
+    header.encoding = column->encoding;
+    header.block_rows = COLUMN_BLOCK_ROWS;
+    header.rows = column->rows;
+    header.index_offset = column->encoding == COLUMN_DELTA ? column->offset : 0;
+
+    ret = fwrite(&header, sizeof(header), 1, column->file);
+    if (ret != 1) {
+        print_error("fwrite", ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+int flush_block(
+    struct column *column
+) {
+    int ret;
+    long long *index;
+    unsigned char varint[10];
+    unsigned long long zigzag;
+    long long prev;
+    int length;
+
+    if (column->index_count + 2 > column->index_alloc) {
+        index = realloc(column->index, (column->index_alloc * 2 + 64) * sizeof(*index));
+        if (index == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            return -1;
+        }
+        column->index = index;
+        column->index_alloc = column->index_alloc * 2 + 64;
+    }
+    column->index[column->index_count++] = column->offset;
+
+    prev = 0;
+    for (int idx = 0; idx < column->block_used; idx++) {
+        zigzag = ((unsigned long long)(column->block[idx] - prev) << 1) ^ ((column->block[idx] - prev) >> 63);
+        prev = column->block[idx];
+
+        length = 0;
+        do {
+            varint[length] = zigzag & 0x7f;
+            zigzag >>= 7;
+            if (zigzag) {
+                varint[length] |= 0x80;
+            }
+            length++;
+        } while (zigzag);
+
+        ret = fwrite(varint, length, 1, column->file);
+        if (ret != 1) {
+            print_error("fwrite", ret);
+            return -1;
+        }
+        column->offset += length;
+    }
+    column->block_used = 0;
+
+    return 0;
+}
+
+int put_value(
+    struct column *column,
+    long long value
+) {
+    int ret;
+    union {
+        int64_t i64;
+        uint32_t u32;
+    } raw;
+
+    column->rows++;
+
+    if (column->encoding == COLUMN_DELTA) {
+        column->block[column->block_used++] = value;
+        if (column->block_used == COLUMN_BLOCK_ROWS) {
+            return flush_block(column);
+        }
+        return 0;
+    }
+
+    if (column->width == 8) {
+        raw.i64 = value;
+    } else {
+        raw.u32 = value;
+    }
+    ret = fwrite(&raw, column->width, 1, column->file);
+    if (ret != 1) {
+        print_error("fwrite", ret);
+        return -1;
+    }
+    column->offset += column->width;
+
+    return 0;
+}
+
+int put_bytes(
+    struct column *column,
+    const void *value
+) {
+    int ret;
+
+    column->rows++;
+
+    ret = fwrite(value, column->width, 1, column->file);
+    if (ret != 1) {
+        print_error("fwrite", ret);
+        return -1;
+    }
+    column->offset += column->width;
+
+    return 0;
+}
+
+int close_column(
+    struct column *column
+) {
+    int ret;
+
+    if (column->encoding == COLUMN_DELTA) {
+        if (column->block_used > 0) {
+            ret = flush_block(column);
+            if (ret) {
+                return ret;
+            }
+        }
+        if (column->index_count + 1 > column->index_alloc) {
+            column->index = realloc(column->index, (column->index_count + 1) * sizeof(*column->index));
+            if (column->index == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                return -1;
+            }
+        }
+        // The final entry marks the end of the last block
+        column->index[column->index_count] = column->offset;
+        ret = fwrite(column->index, sizeof(*column->index), column->index_count + 1, column->file);
+        if (ret != column->index_count + 1) {
+            print_error("fwrite", ret);
+            return -1;
+        }
+    }
+
+    // The header is rewritten now that rows and the index offset are known
+    ret = fseek(column->file, 0, SEEK_SET);
+    if (ret) {
+        print_error("fseek", ret);
+        return -1;
+    }
+    ret = write_header(column);
+    if (ret) {
+        return ret;
+    }
+
+    ret = fclose(column->file);
+    if (ret) {
+        print_error("fclose", ret);
+        return -1;
+    }
+
+    free(column->block);
+    free(column->index);
+
+    return 0;
+}
+
+void print_usage(
+    const char *name
+) {
+    fprintf(stderr, "Usage: %s [--compress] treefile datafile outdir\n", name);
+    fprintf(stderr, "  --compress  delta/varint-encode the integer columns in %i-row blocks\n", COLUMN_BLOCK_ROWS);
+}
+
+int main(
+    int argc,
+    char *argv[]
+) {
+    int ret;
+    int opt;
+    bool compress;
+    const char *outdir;
+    FILE *paths_offsets;
+    FILE *paths_data;
+    FILE *manifest;
+    long long paths_offset;
+    unsigned char digest[16];
+
+    struct tree_walk walk;
+    struct data_reader reader;
+    struct md_record rec;
+    struct statx *buff;
+
+    const struct option long_options[] = {
+        {"compress", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+
+    compress = false;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            compress = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (argc - optind != 3) {
+        fprintf(stderr, "Exactly 3 arguments required\n");
+        print_usage(argv[0]);
+        return -1;
+    }
+    outdir = argv[optind + 2];
+
+    ret = mkdir(outdir, 0777);
+    if (ret && errno != EEXIST) {
+        fprintf(stderr, "mkdir() failed with errno %i for %s\n", errno, outdir);
+        return -1;
+    }
+
+    ret = tree_walk_open(&walk, argv[optind]);
+    if (ret) {
+        return ret;
+    }
+    ret = data_reader_open(&reader, argv[optind + 1]);
+    if (ret) {
+        return ret;
+    }
+
+    for (int idx = 0; idx < COLUMN_COUNT; idx++) {
+        columns[idx].file = open_output(outdir, columns[idx].name);
+        if (columns[idx].file == NULL) {
+            return -1;
+        }
+        columns[idx].encoding = compress && columns[idx].numeric ? COLUMN_DELTA : COLUMN_RAW;
+        if (columns[idx].encoding == COLUMN_DELTA) {
+            columns[idx].block = malloc(COLUMN_BLOCK_ROWS * sizeof(*columns[idx].block));
+            if (columns[idx].block == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                return -1;
+            }
+        }
+        // Placeholder until the row count is known
+        ret = write_header(&columns[idx]);
+        if (ret) {
+            return ret;
+        }
+        columns[idx].offset = sizeof(struct column_header);
+    }
+
+    // path_id indexes paths.offsets, which holds rows + 1 offsets into paths.data
+    paths_offsets = open_output(outdir, "paths.offsets");
+    paths_data = open_output(outdir, "paths.data");
+    if (paths_offsets == NULL || paths_data == NULL) {
+        return -1;
+    }
+    paths_offset = 0;
+
+    memset(&rec, 0x00, sizeof(rec));
+    while ((ret = tree_walk_next(&walk)) > 0) {
+        ret = data_reader_read(&reader, walk.pos, &rec);
+        if (ret) {
+            return ret;
+        }
+        buff = &rec.stx.buff;
+
+        ret = fwrite(&paths_offset, sizeof(paths_offset), 1, paths_offsets);
+        if (ret != 1) {
+            print_error("fwrite", ret);
+            return -1;
+        }
+        ret = fwrite(walk.path, strlen(walk.path), 1, paths_data);
+        if (ret != 1) {
+            print_error("fwrite", ret);
+            return -1;
+        }
+        paths_offset += strlen(walk.path);
+
+        ret = put_value(&columns[COLUMN_PATH_ID], walk.entry);
+        ret |= put_value(&columns[COLUMN_SIZE], buff->stx_size);
+        ret |= put_value(&columns[COLUMN_MTIME], buff->stx_mtime.tv_sec);
+        ret |= put_value(&columns[COLUMN_UID], buff->stx_uid);
+        ret |= put_value(&columns[COLUMN_GID], buff->stx_gid);
+        ret |= put_value(&columns[COLUMN_MODE], buff->stx_mode);
+        ret |= put_value(&columns[COLUMN_INO], buff->stx_ino);
+
+        // Entries without a 16-byte digest get zeros
+        memset(digest, 0x00, sizeof(digest));
+        if (rec.md_len == sizeof(digest)) {
+            memcpy(digest, rec.md_value, sizeof(digest));
+        }
+        ret |= put_bytes(&columns[COLUMN_DIGEST], digest);
+        if (ret) {
+            return -1;
+        }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = fwrite(&paths_offset, sizeof(paths_offset), 1, paths_offsets);
+    if (ret != 1) {
+        print_error("fwrite", ret);
+        return -1;
+    }
+    ret = fclose(paths_offsets);
+    ret |= fclose(paths_data);
+    if (ret) {
+        print_error("fclose", ret);
+        return -1;
+    }
+
+    manifest = open_output(outdir, "manifest");
+    if (manifest == NULL) {
+        return -1;
+    }
+    fprintf(manifest, "rows %lli\n", walk.entry + 1);
+    for (int idx = 0; idx < COLUMN_COUNT; idx++) {
+        fprintf(
+            manifest,
+            "column %s width %i encoding %s\n",
+            columns[idx].name,
+            columns[idx].width,
+            columns[idx].encoding == COLUMN_DELTA ? "delta" : "raw"
+        );
+        ret = close_column(&columns[idx]);
+        if (ret) {
+            return ret;
+        }
+    }
+    fprintf(manifest, "strings paths paths.offsets paths.data\n");
+    ret = fclose(manifest);
+    if (ret) {
+        print_error("fclose", ret);
+        return -1;
+    }
+
+    tree_walk_close(&walk);
+    data_reader_close(&reader);
+    record_free(&rec);
+
+    return 0;
+}
@@ -0,0 +1,487 @@
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+// A digest index holds, after the version and the header, the path of the
+// datafile it was built from, a Bloom filter of the digests, the entries
+// sorted by digest and the paths of the entries. A query reads a few bytes
+// of the filter of each index and only searches the entries of the indexes
+// whose filter may contain the digest.
+
+#define INDEX_MD_SIZE 16
+#define FILTER_BITS_PER_ENTRY 10
+#define FILTER_HASHES 7
+#define FILTER_MAX_HASHES 32
+
+struct index_header {
+    long long entry_count;
+    long long filter_bits;
+    int filter_hashes;
+    int datapath_length;
+    long long filter_offset;
+    long long entries_offset;
+    long long paths_offset;
+};
+
+struct index_entry {
+    unsigned char md[INDEX_MD_SIZE];
+    int kind;
+    int path_length;
+    long long datafile_pos;
+    long long path_offset; // relative to paths_offset
+};
+
+void print_error(
+    const char *func,
+    int ret
+) {
+    fprintf(
+        stderr,
+        "%s() failed with return code %i and errno %i\n",
+        func,
+        ret,
+        errno
+    );
+}
+
+const char *digest_name(
+    int kind
+) {
+    if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5) {
+        return "md5";
+    }
+    if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5_SPARSE) {
+        return "md5-sparse";
+    }
+    if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5_TREE) {
+        return "md5-tree";
+    }
+    if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5_FINGERPRINT) {
+        return "md5-fingerprint";
+    }
+    return "";
+}
+
+// The digests are uniformly distributed already, so two halves of one
+// give the probe sequence of double hashing
+unsigned long long filter_bit(
+    const unsigned char *md,
+    int probe,
+    long long filter_bits
+) {
+    unsigned long long h1;
+    unsigned long long h2;
+
+    memcpy(&h1, md, sizeof(h1));
+    memcpy(&h2, md + sizeof(h1), sizeof(h2));
+    h2 |= 1;
+
+    return (h1 + probe * h2) % filter_bits;
+}
+
+int compare_entries(
+    const void *a,
+    const void *b
+) {
+    const struct index_entry *entry_a = a;
+    const struct index_entry *entry_b = b;
+    int ret;
+
+    ret = memcmp(entry_a->md, entry_b->md, INDEX_MD_SIZE);
+    if (ret) {
+        return ret;
+    }
+    return (entry_a->datafile_pos > entry_b->datafile_pos) - (entry_a->datafile_pos < entry_b->datafile_pos);
+}
+
+int build_index(
+    const char *treepath,
+    const char *datapath,
+    const char *indexpath
+) {
+    int ret;
+    FILE *indexfile;
+    struct index_header header;
+    struct index_entry *entries;
+    struct index_entry *new_entries;
+    long long entry_alloc;
+    char *paths;
+    char *new_paths;
+    long long paths_used;
+    long long paths_alloc;
+    size_t path_length;
+    unsigned char *filter;
+    unsigned long long bit;
+    char *datareal;
+
+    struct tree_walk walk;
+    struct data_reader reader;
+    struct md_record rec;
+
+    ret = tree_walk_open(&walk, treepath);
+    if (ret) {
+        return ret;
+    }
+    ret = data_reader_open(&reader, datapath);
+    if (ret) {
+        return ret;
+    }
+    // --find prints it, usually from another working directory
+    datareal = realpath(datapath, NULL);
+    if (datareal == NULL) {
+        fprintf(stderr, "realpath() failed with errno %i for %s\n", errno, datapath);
+        return -1;
+    }
+
+    memset(&header, 0x00, sizeof(header));
+    entries = NULL;
+    entry_alloc = 0;
+    paths = NULL;
+    paths_used = 0;
+    paths_alloc = 0;
+
+    memset(&rec, 0x00, sizeof(rec));
+    while ((ret = tree_walk_next(&walk)) > 0) {
+        ret = data_reader_read(&reader, walk.pos, &rec);
+        if (ret) {
+            return ret;
+        }
+        // Pending digests have no value yet
+        if (rec.md_len != INDEX_MD_SIZE || (rec.digest_kind & DIGEST_KIND_MASK) == DIGEST_PENDING) {
+            continue;
+        }
+
+        if (header.entry_count == entry_alloc) {
+            new_entries = realloc(entries, (entry_alloc * 2 + 1024) * sizeof(*entries));
+            if (new_entries == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                return -1;
+            }
+            entries = new_entries;
+            entry_alloc = entry_alloc * 2 + 1024;
+        }
+        path_length = strlen(walk.path);
+        if (paths_used + (long long)path_length > paths_alloc) {
+            new_paths = realloc(paths, paths_alloc * 2 + path_length + 65536);
+            if (new_paths == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                return -1;
+            }
+            paths = new_paths;
+            paths_alloc = paths_alloc * 2 + path_length + 65536;
+        }
+
+        memcpy(entries[header.entry_count].md, rec.md_value, INDEX_MD_SIZE);
+        entries[header.entry_count].kind = rec.digest_kind & DIGEST_KIND_MASK;
+        entries[header.entry_count].path_length = path_length;
+        entries[header.entry_count].datafile_pos = walk.pos;
+        entries[header.entry_count].path_offset = paths_used;
+        memcpy(paths + paths_used, walk.path, path_length);
+        paths_used += path_length;
+        header.entry_count++;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    qsort(entries, header.entry_count, sizeof(*entries), compare_entries);
+
+    header.filter_bits = (header.entry_count * FILTER_BITS_PER_ENTRY + 63) / 64 * 64;
+    if (header.filter_bits == 0) {
+        header.filter_bits = 64;
+    }
+    header.filter_hashes = FILTER_HASHES;
+    header.datapath_length = strlen(datareal);
+    header.filter_offset = sizeof(VERSION) + sizeof(header) + header.datapath_length;
+    header.entries_offset = header.filter_offset + header.filter_bits / 8;
+    header.paths_offset = header.entries_offset + header.entry_count * sizeof(*entries);
+
+    filter = calloc(header.filter_bits / 8, 1);
+    if (filter == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    for (long long idx = 0; idx < header.entry_count; idx++) {
+        for (int probe = 0; probe < header.filter_hashes; probe++) {
+            bit = filter_bit(entries[idx].md, probe, header.filter_bits);
+            filter[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+
+    indexfile = fopen(indexpath, "wb");
+    if (indexfile == NULL) {
+        fprintf(stderr, "Can't open digest index %s\n", indexpath);
+        return -1;
+    }
+    ret = fwrite(&VERSION, sizeof(VERSION), 1, indexfile) != 1 ||
+        fwrite(&header, sizeof(header), 1, indexfile) != 1 ||
+        fwrite(datareal, header.datapath_length, 1, indexfile) != 1 ||
+        fwrite(filter, header.filter_bits / 8, 1, indexfile) != 1 ||
+        (header.entry_count > 0 && fwrite(entries, sizeof(*entries), header.entry_count, indexfile) != (size_t)header.entry_count) ||
+        (paths_used > 0 && fwrite(paths, paths_used, 1, indexfile) != 1);
+    if (ret) {
+        print_error("fwrite", ret);
+        return -1;
+    }
+    ret = fclose(indexfile);
+    if (ret) {
+        print_error("fclose", ret);
+        return -1;
+    }
+
+    free(filter);
+    free(entries);
+    free(paths);
+    free(datareal);
+    tree_walk_close(&walk);
+    data_reader_close(&reader);
+    record_free(&rec);
+
+    return 0;
+}
+
+int read_at(
+    int fd,
+    void *buff,
+    size_t length,
+    long long offset,
+    const char *indexpath
+) {
+    ssize_t bytes;
+
+    bytes = pread(fd, buff, length, offset);
+    if (bytes != (ssize_t)length) {
+        fprintf(stderr, "Truncated digest index %s\n", indexpath);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Prints the matches of one index, leaving the entries alone when the
+// filter rules the digest out
+int find_in_index(
+    const char *indexpath,
+    const unsigned char *md,
+    long long *matches
+) {
+    int ret;
+    int fd;
+    int version[3];
+    struct index_header header;
+    struct index_entry entry;
+    unsigned char byte;
+    unsigned long long bit;
+    long long low;
+    long long high;
+    long long mid;
+    char *datapath;
+    char *path;
+
+    fd = open(indexpath, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open digest index %s\n", indexpath);
+        return -1;
+    }
+
+    ret = read_at(fd, version, sizeof(version), 0, indexpath);
+    if (!ret) {
+        ret = compare_versions(version, VERSION);
+    }
+    if (!ret) {
+        ret = read_at(fd, &header, sizeof(header), sizeof(VERSION), indexpath);
+    }
+    if (!ret && (header.entry_count < 0 || header.filter_bits <= 0 || header.datapath_length < 0 ||
+        header.filter_hashes < 1 || header.filter_hashes > FILTER_MAX_HASHES)) {
+        fprintf(stderr, "Invalid digest index %s\n", indexpath);
+        ret = -1;
+    }
+    if (ret) {
+        close(fd);
+        return ret;
+    }
+
+    for (int probe = 0; probe < header.filter_hashes; probe++) {
+        bit = filter_bit(md, probe, header.filter_bits);
+        ret = read_at(fd, &byte, 1, header.filter_offset + bit / 8, indexpath);
+        if (ret || !(byte & (1 << (bit % 8)))) {
+            close(fd);
+            return ret;
+        }
+    }
+
+    low = 0;
+    high = header.entry_count;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        ret = read_at(fd, &entry, sizeof(entry), header.entries_offset + mid * sizeof(entry), indexpath);
+        if (ret) {
+            close(fd);
+            return ret;
+        }
+        if (memcmp(entry.md, md, INDEX_MD_SIZE) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    datapath = NULL;
+    for (; low < header.entry_count; low++) {
+        ret = read_at(fd, &entry, sizeof(entry), header.entries_offset + low * sizeof(entry), indexpath);
+        if (ret || memcmp(entry.md, md, INDEX_MD_SIZE) != 0) {
+            break;
+        }
+
+        if (datapath == NULL) {
+            datapath = malloc(header.datapath_length + 1);
+            if (datapath == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                ret = -1;
+                break;
+            }
+            datapath[header.datapath_length] = '\0';
+            ret = read_at(fd, datapath, header.datapath_length, sizeof(VERSION) + sizeof(header), indexpath);
+            if (ret) {
+                break;
+            }
+        }
+        path = malloc(entry.path_length + 1);
+        if (path == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            ret = -1;
+            break;
+        }
+        path[entry.path_length] = '\0';
+        ret = read_at(fd, path, entry.path_length, header.paths_offset + entry.path_offset, indexpath);
+        if (ret) {
+            free(path);
+            break;
+        }
+        printf("%s\t%lli\t%s\t%s\n", datapath, entry.datafile_pos, digest_name(entry.kind), path);
+        free(path);
+        (*matches)++;
+    }
+
+    free(datapath);
+    close(fd);
+
+    return ret;
+}
+
+int parse_digest(
+    const char *hex,
+    unsigned char *md
+) {
+    unsigned int byte;
+
+    if (strlen(hex) != 2 * INDEX_MD_SIZE) {
+        return -1;
+    }
+    for (int idx = 0; idx < INDEX_MD_SIZE; idx++) {
+        if (sscanf(hex + 2 * idx, "%2x", &byte) != 1) {
+            return -1;
+        }
+        md[idx] = byte;
+    }
+
+    return 0;
+}
+
+void print_usage(
+    const char *name
+) {
+    fprintf(stderr, "Usage: %s --index=FILE treefile datafile\n", name);
+    fprintf(stderr, "       %s --find=DIGEST index...\n", name);
+    fprintf(stderr, "  --index=FILE  write a digest index of the dump to FILE\n");
+    fprintf(stderr, "  --find=DIGEST print the datafile, record position, digest kind and path\n");
+    fprintf(stderr, "                of every entry with the hex DIGEST in the indexes; exits\n");
+    fprintf(stderr, "                with 1 when there is none, and with an error after searching\n");
+    fprintf(stderr, "                the others when an index can't be read\n");
+}
+
+int main(
+    int argc,
+    char *argv[]
+) {
+    int ret;
+    int opt;
+    const char *indexpath;
+    const char *find;
+    unsigned char md[INDEX_MD_SIZE];
+    long long matches;
+    bool failed;
+
+    const struct option long_options[] = {
+        {"index", required_argument, NULL, 'i'},
+        {"find", required_argument, NULL, 'f'},
+        {NULL, 0, NULL, 0}
+    };
+
+    indexpath = NULL;
+    find = NULL;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'i':
+            indexpath = optarg;
+            break;
+        case 'f':
+            find = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if ((indexpath == NULL) == (find == NULL)) {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    if (indexpath != NULL) {
+        if (argc - optind != 2) {
+            fprintf(stderr, "Exactly 2 arguments required\n");
+            print_usage(argv[0]);
+            return -1;
+        }
+        return build_index(argv[optind], argv[optind + 1], indexpath);
+    }
+
+    if (argc - optind < 1) {
+        fprintf(stderr, "At least 1 index required\n");
+        print_usage(argv[0]);
+        return -1;
+    }
+    ret = parse_digest(find, md);
+    if (ret) {
+        fprintf(stderr, "Invalid digest %s\n", find);
+        return -1;
+    }
+
+    // One unreadable index must not hide the matches in the others
+    matches = 0;
+    failed = false;
+    for (int idx = optind; idx < argc; idx++) {
+        ret = find_in_index(argv[idx], md, &matches);
+        if (ret) {
+            fprintf(stderr, "Skipped digest index %s\n", argv[idx]);
+            failed = true;
+        }
+    }
+
+    if (failed) {
+        return -1;
+    }
+    return matches > 0 ? 0 : 1;
+}
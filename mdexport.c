@@ -0,0 +1,763 @@
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "reader.h"
+#include "split.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define OUT_BUFF_SIZE (1024 * 1024)
+
+// Hand-rolled formatter: one buffer, no printf and no allocation per record
+struct out_buff {
+    int fd;
+    char *buff;
+    size_t used;
+    int failed;
+};
+
+// Per thread, each writing its own piece of the export
+__thread struct out_buff out;
+
+// One of the pieces a dump with a split index is exported in
+struct export_job {
+    const char *treepath;
+    const char *datapath;
+    const struct split_point *splits;
+    long long split_count;
+    int part;
+    int parts;
+    bool json;
+    int fd;
+    FILE *piecefile;      // where the pieces after the first are kept
+    pthread_t thread;
+    int failed;
+};
+
+void out_write(
+    const char *text,
+    size_t length
+);
+
+void out_flush(void) {
+    out_write(out.buff, out.used);
+    out.used = 0;
+}
+
+// Makes room for at least length more bytes
+static inline void out_reserve(
+    size_t length
+) {
+    if (out.used + length > OUT_BUFF_SIZE) {
+        out_flush();
+    }
+}
+
+static inline void out_char(
+    char c
+) {
+    out_reserve(1);
+    out.buff[out.used++] = c;
+}
+
+void out_write(
+    const char *text,
+    size_t length
+) {
+    ssize_t bytes;
+
+    while (length > 0) {
+        bytes = write(out.fd, text, length);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            fprintf(stderr, "write() failed with return code %zi and errno %i\n", bytes, errno);
+            out.failed = -1;
+            return;
+        }
+        text += bytes;
+        length -= bytes;
+    }
+}
+
+void out_bytes(
+    const char *text,
+    size_t length
+) {
+    if (length > OUT_BUFF_SIZE) {
+        // Oversized fields bypass the buffer
+        out_flush();
+        out_write(text, length);
+        return;
+    }
+    out_reserve(length);
+    memcpy(out.buff + out.used, text, length);
+    out.used += length;
+}
+
+static inline void out_u64(
+    unsigned long long value
+) {
+    char digits[20];
+    int length;
+
+    length = 0;
+    do {
+        digits[length++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    out_reserve(length);
+    while (length > 0) {
+        out.buff[out.used++] = digits[--length];
+    }
+}
+
+static inline void out_i64(
+    long long value
+) {
+    if (value < 0) {
+        out_char('-');
+        out_u64(-(unsigned long long)value);
+    } else {
+        out_u64(value);
+    }
+}
+
+static inline void out_octal(
+    unsigned int value
+) {
+    char digits[12];
+    int length;
+
+    length = 0;
+    do {
+        digits[length++] = '0' + (value & 7);
+        value >>= 3;
+    } while (value);
+
+    out_reserve(length);
+    while (length > 0) {
+        out.buff[out.used++] = digits[--length];
+    }
+}
+
+void out_time(
+    const struct statx_timestamp *ts
+) {
+    unsigned int nsec;
+
+    out_i64(ts->tv_sec);
+    out_reserve(10);
+    out.buff[out.used++] = '.';
+    nsec = ts->tv_nsec;
+    for (int idx = 8; idx >= 0; idx--) {
+        out.buff[out.used + idx] = '0' + nsec % 10;
+        nsec /= 10;
+    }
+    out.used += 9;
+}
+
+void out_hex(
+    const unsigned char *value,
+    unsigned int length
+) {
+    const char *digits = "0123456789abcdef";
+
+    out_reserve(2 * length);
+    for (unsigned int idx = 0; idx < length; idx++) {
+        out.buff[out.used++] = digits[value[idx] >> 4];
+        out.buff[out.used++] = digits[value[idx] & 0xf];
+    }
+}
+
+void out_csv_str(
+    const char *text,
+    size_t length
+) {
+    bool quote;
+
+    quote = false;
+    for (size_t idx = 0; idx < length && !quote; idx++) {
+        quote = text[idx] == ',' || text[idx] == '"' || text[idx] == '\n' || text[idx] == '\r';
+    }
+    if (!quote) {
+        out_bytes(text, length);
+        return;
+    }
+
+    out_char('"');
+    for (size_t idx = 0; idx < length; idx++) {
+        if (text[idx] == '"') {
+            out_char('"');
+        }
+        out_char(text[idx]);
+    }
+    out_char('"');
+}
+
+// Length of the well-formed UTF-8 sequence starting at text, or 0
+size_t utf8_length(
+    const unsigned char *text,
+    size_t length
+) {
+    size_t needed;
+    unsigned char low;
+    unsigned char high;
+
+    if (text[0] < 0x80) {
+        return 1;
+    }
+    // The bounds of the second byte rule out overlong forms, surrogates
+    // and code points past U+10FFFF
+    low = 0x80;
+    high = 0xbf;
+    if (text[0] >= 0xc2 && text[0] <= 0xdf) {
+        needed = 2;
+    } else if (text[0] >= 0xe0 && text[0] <= 0xef) {
+        needed = 3;
+        if (text[0] == 0xe0) {
+            low = 0xa0;
+        } else if (text[0] == 0xed) {
+            high = 0x9f;
+        }
+    } else if (text[0] >= 0xf0 && text[0] <= 0xf4) {
+        needed = 4;
+        if (text[0] == 0xf0) {
+            low = 0x90;
+        } else if (text[0] == 0xf4) {
+            high = 0x8f;
+        }
+    } else {
+        return 0;
+    }
+
+    if (needed > length || text[1] < low || text[1] > high) {
+        return 0;
+    }
+    for (size_t idx = 2; idx < needed; idx++) {
+        if (text[idx] < 0x80 || text[idx] > 0xbf) {
+            return 0;
+        }
+    }
+
+    return needed;
+}
+
+// Names are arbitrary bytes. Valid UTF-8 is copied as is, so \u0080 to
+// \u00ff never stand for a character and each one is a byte that isn't
+// valid UTF-8.
+void out_json_str(
+    const char *text,
+    size_t length
+) {
+    const char *digits = "0123456789abcdef";
+    const unsigned char *bytes = (const unsigned char *)text;
+    unsigned char c;
+    size_t sequence;
+
+    out_char('"');
+    for (size_t idx = 0; idx < length; idx += sequence) {
+        c = bytes[idx];
+        sequence = utf8_length(bytes + idx, length - idx);
+        if (c == '"' || c == '\\') {
+            out_reserve(2);
+            out.buff[out.used++] = '\\';
+            out.buff[out.used++] = c;
+        } else if (c < 0x20 || sequence == 0) {
+            out_reserve(6);
+            memcpy(out.buff + out.used, "\\u00", 4);
+            out.buff[out.used + 4] = digits[c >> 4];
+            out.buff[out.used + 5] = digits[c & 0xf];
+            out.used += 6;
+            sequence = 1;
+        } else {
+            out_bytes(text + idx, sequence);
+        }
+    }
+    out_char('"');
+}
+
+const char *type_name(
+    unsigned int mode
+) {
+    switch (mode & S_IFMT) {
+    case S_IFREG:
+        return "f";
+    case S_IFDIR:
+        return "d";
+    case S_IFLNK:
+        return "l";
+    case S_IFCHR:
+        return "c";
+    case S_IFBLK:
+        return "b";
+    case S_IFIFO:
+        return "p";
+    case S_IFSOCK:
+        return "s";
+    default:
+        return "?";
+    }
+}
+
+const char *digest_name(
+    int kind
+) {
+    if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5) {
+        return "md5";
+    }
+    if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5_SPARSE) {
+        return "md5-sparse";
+    }
+    if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5_TREE) {
+        return "md5-tree";
+    }
+    if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5_FINGERPRINT) {
+        return "md5-fingerprint";
+    }
+    if ((kind & DIGEST_KIND_MASK) == DIGEST_PENDING) {
+        return "pending";
+    }
+    return "";
+}
+
+#define FIELD_COUNT 17
+
+const char *FIELD_HEADERS[FIELD_COUNT] = {
+    "path", "type", "mode", "uid", "gid", "size", "blocks", "ino", "nlink",
+    "dev", "atime", "mtime", "ctime", "btime", "digest_kind", "digest", "xattrs"
+};
+
+void out_key(
+    bool json,
+    int field
+) {
+    if (json) {
+        if (field > 0) {
+            out_char(',');
+        }
+        out_json_str(FIELD_HEADERS[field], strlen(FIELD_HEADERS[field]));
+        out_char(':');
+    } else if (field > 0) {
+        out_char(',');
+    }
+}
+
+void out_text(
+    bool json,
+    const char *text,
+    size_t length
+) {
+    if (json) {
+        out_json_str(text, length);
+    } else {
+        out_csv_str(text, length);
+    }
+}
+
+void out_record(
+    bool json,
+    const char *path,
+    const struct md_record *rec
+) {
+    const struct statx *buff = &rec->stx.buff;
+    const char *text;
+
+    if (json) {
+        out_char('{');
+    }
+
+    out_key(json, 0);
+    out_text(json, path, strlen(path));
+
+    // A failed statx leaves only the path
+    if (rec->stx.ret) {
+        for (int field = 1; field < FIELD_COUNT; field++) {
+            out_key(json, field);
+            if (json) {
+                out_bytes("null", 4);
+            }
+        }
+        out_bytes(json ? "}\n" : "\n", json ? 2 : 1);
+        return;
+    }
+
+    out_key(json, 1);
+    text = type_name(buff->stx_mode);
+    out_text(json, text, strlen(text));
+    out_key(json, 2);
+    if (json) {
+        out_u64(buff->stx_mode & ~S_IFMT);
+    } else {
+        out_octal(buff->stx_mode & ~S_IFMT);
+    }
+    out_key(json, 3);
+    out_u64(buff->stx_uid);
+    out_key(json, 4);
+    out_u64(buff->stx_gid);
+    out_key(json, 5);
+    out_u64(buff->stx_size);
+    out_key(json, 6);
+    out_u64(buff->stx_blocks);
+    out_key(json, 7);
+    out_u64(buff->stx_ino);
+    out_key(json, 8);
+    out_u64(buff->stx_nlink);
+    out_key(json, 9);
+    if (json) {
+        out_char('"');
+    }
+    out_u64(buff->stx_dev_major);
+    out_char(':');
+    out_u64(buff->stx_dev_minor);
+    if (json) {
+        out_char('"');
+    }
+    out_key(json, 10);
+    out_time(&buff->stx_atime);
+    out_key(json, 11);
+    out_time(&buff->stx_mtime);
+    out_key(json, 12);
+    out_time(&buff->stx_ctime);
+    out_key(json, 13);
+    out_time(&buff->stx_btime);
+
+    out_key(json, 14);
+    text = digest_name(rec->digest_kind);
+    out_text(json, text, strlen(text));
+    out_key(json, 15);
+    if (json) {
+        out_char('"');
+    }
+    out_hex(rec->md_value, rec->md_len);
+    if (json) {
+        out_char('"');
+    }
+
+    // Extended attribute names, separated by ';' in CSV
+    out_key(json, 16);
+    if (json) {
+        out_char('[');
+        for (int idx = 0; idx < rec->xattr_count; idx++) {
+            if (idx > 0) {
+                out_char(',');
+            }
+            out_json_str(rec->xattrs[idx].name, strlen(rec->xattrs[idx].name));
+        }
+        out_bytes("]}\n", 3);
+    } else {
+        for (int idx = 0; idx < rec->xattr_count; idx++) {
+            if (idx > 0) {
+                out_char(';');
+            }
+            out_csv_str(rec->xattrs[idx].name, strlen(rec->xattrs[idx].name));
+        }
+        out_char('\n');
+    }
+}
+
+int export_run(
+    struct export_job *job
+) {
+    int ret;
+    struct tree_walk walk;
+    struct data_reader reader;
+    struct md_record rec;
+
+    out.fd = job->fd;
+    out.used = 0;
+    out.failed = 0;
+    out.buff = malloc(OUT_BUFF_SIZE);
+    if (out.buff == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    ret = tree_walk_open(&walk, job->treepath);
+    if (ret) {
+        return ret;
+    }
+    ret = split_seek(&walk, job->splits, job->split_count, job->part, job->parts);
+    if (ret) {
+        return ret;
+    }
+    ret = data_reader_open(&reader, job->datapath);
+    if (ret) {
+        return ret;
+    }
+
+    memset(&rec, 0x00, sizeof(rec));
+    while ((ret = tree_walk_next(&walk)) > 0) {
+        ret = data_reader_read(&reader, walk.pos, &rec);
+        if (ret) {
+            return ret;
+        }
+        out_record(job->json, walk.path, &rec);
+        if (out.failed) {
+            return out.failed;
+        }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    out_flush();
+    if (out.failed) {
+        return out.failed;
+    }
+
+    tree_walk_close(&walk);
+    data_reader_close(&reader);
+    record_free(&rec);
+    free(out.buff);
+    out.buff = NULL;
+
+    return 0;
+}
+
+void *export_worker(
+    void *arg
+) {
+    struct export_job *job = arg;
+
+    job->failed = export_run(job);
+
+    return NULL;
+}
+
+// Appends a piece written by a worker to the output
+int export_copy(
+    struct export_job *job
+) {
+    ssize_t bytes;
+    char *buff;
+
+    buff = malloc(OUT_BUFF_SIZE);
+    if (buff == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    lseek(job->fd, 0, SEEK_SET);
+    while ((bytes = read(job->fd, buff, OUT_BUFF_SIZE)) != 0) {
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            fprintf(stderr, "read() failed with errno %i\n", errno);
+            free(buff);
+            return -1;
+        }
+        out_write(buff, bytes);
+        if (out.failed) {
+            free(buff);
+            return out.failed;
+        }
+    }
+
+    free(buff);
+    fclose(job->piecefile);
+
+    return 0;
+}
+
+void print_usage(
+    const char *name
+) {
+    fprintf(stderr, "Usage: %s [options] treefile datafile\n", name);
+    fprintf(stderr, "  --format=csv|json  output format (default csv, json is one object per line)\n");
+    fprintf(stderr, "                     bytes of a JSON string that aren't valid UTF-8 are\n");
+    fprintf(stderr, "                     written as \\u0080 to \\u00ff\n");
+    fprintf(stderr, "  --no-header        omit the CSV header line\n");
+    fprintf(stderr, "  --output=FILE      write to FILE instead of stdout\n");
+    fprintf(stderr, "  --splits=FILE      split index written by metadump --splits, which lets\n");
+    fprintf(stderr, "                     the dump be read by several threads\n");
+    fprintf(stderr, "  --threads=N        threads reading the dump with --splits (default:\n");
+    fprintf(stderr, "                     online CPUs)\n");
+}
+
+int main(
+    int argc,
+    char *argv[]
+) {
+    int ret;
+    int opt;
+    bool json;
+    bool header;
+    const char *outpath;
+    const char *splitpath;
+    int threads;
+
+    struct split_point *splits;
+    long long split_count;
+    struct export_job *jobs;
+
+    const struct option long_options[] = {
+        {"format", required_argument, NULL, 'f'},
+        {"no-header", no_argument, NULL, 'H'},
+        {"output", required_argument, NULL, 'o'},
+        {"splits", required_argument, NULL, 's'},
+        {"threads", required_argument, NULL, 'j'},
+        {NULL, 0, NULL, 0}
+    };
+
+    json = false;
+    header = true;
+    outpath = NULL;
+    splitpath = NULL;
+    threads = 0;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) {
+                json = false;
+            } else if (strcmp(optarg, "json") == 0) {
+                json = true;
+            } else {
+                fprintf(stderr, "Unknown format %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'H':
+            header = false;
+            break;
+        case 'o':
+            outpath = optarg;
+            break;
+        case 's':
+            splitpath = optarg;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 1) {
+                fprintf(stderr, "Invalid number of threads %s\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        fprintf(stderr, "Exactly 2 arguments required\n");
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    out.fd = STDOUT_FILENO;
+    if (outpath != NULL) {
+        out.fd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out.fd < 0) {
+            fprintf(stderr, "Can't open %s\n", outpath);
+            return -1;
+        }
+    }
+    out.buff = malloc(OUT_BUFF_SIZE);
+    if (out.buff == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    splits = NULL;
+    split_count = 0;
+    if (splitpath != NULL) {
+        ret = split_load(splitpath, &splits, &split_count);
+        if (ret) {
+            return ret;
+        }
+    } else {
+        threads = 1;
+    }
+    if (threads == 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if (header && !json) {
+        for (int field = 0; field < FIELD_COUNT; field++) {
+            if (field > 0) {
+                out_char(',');
+            }
+            out_bytes(FIELD_HEADERS[field], strlen(FIELD_HEADERS[field]));
+        }
+        out_char('\n');
+    }
+    out_flush();
+    if (out.failed) {
+        return out.failed;
+    }
+    free(out.buff);
+
+    jobs = calloc(threads, sizeof(*jobs));
+    if (jobs == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    // The first piece goes straight to the output, the others wait in
+    // temporary files until the ones before them are out
+    for (int idx = 0; idx < threads; idx++) {
+        jobs[idx].treepath = argv[optind];
+        jobs[idx].datapath = argv[optind + 1];
+        jobs[idx].splits = splits;
+        jobs[idx].split_count = split_count;
+        jobs[idx].part = idx;
+        jobs[idx].parts = threads;
+        jobs[idx].json = json;
+        jobs[idx].fd = out.fd;
+        if (idx == 0) {
+            continue;
+        }
+
+        jobs[idx].piecefile = tmpfile();
+        if (jobs[idx].piecefile == NULL) {
+            fprintf(stderr, "tmpfile() failed with errno %i\n", errno);
+            return -1;
+        }
+        jobs[idx].fd = fileno(jobs[idx].piecefile);
+        ret = pthread_create(&jobs[idx].thread, NULL, export_worker, &jobs[idx]);
+        if (ret) {
+            fprintf(stderr, "pthread_create() failed with return code %i\n", ret);
+            return -1;
+        }
+    }
+
+    ret = export_run(&jobs[0]);
+    for (int idx = 1; idx < threads; idx++) {
+        pthread_join(jobs[idx].thread, NULL);
+        if (ret == 0) {
+            ret = jobs[idx].failed;
+        }
+    }
+    if (ret) {
+        return ret;
+    }
+
+    for (int idx = 1; idx < threads; idx++) {
+        ret = export_copy(&jobs[idx]);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (outpath != NULL) {
+        close(out.fd);
+    }
+
+    free(jobs);
+    split_free(splits, split_count);
+
+    return 0;
+}
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "hash.h"
+#include "reader.h"
+#include "throttle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct pending {
+    unsigned long long ino;
+    long long size;
+    long long mtime_sec;
+    unsigned int mtime_nsec;
+    long long digest_offset;
+    char *path;
+};
+
+struct pending *pendings;
+size_t pending_count;
+size_t pending_alloc;
+
+void print_error(
+    const char *func,
+    int ret
+) {
+    fprintf(
+        stderr,
+        "%s() failed with return code %i and errno %i\n",
+        func,
+        ret,
+        errno
+    );
+}
+
+int add_pending(
+    const struct tree_walk *walk,
+    const struct md_record *rec
+) {
+    struct pending *new_pendings;
+    struct pending *item;
+
+    if (pending_count == pending_alloc) {
+        pending_alloc = pending_alloc ? 2 * pending_alloc : 1024;
+        new_pendings = realloc(pendings, pending_alloc * sizeof(*pendings));
+        if (new_pendings == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            return -1;
+        }
+        pendings = new_pendings;
+    }
+
+    item = &pendings[pending_count];
+    item->ino = rec->stx.buff.stx_ino;
+    item->size = rec->stx.buff.stx_size;
+    item->mtime_sec = rec->stx.buff.stx_mtime.tv_sec;
+    item->mtime_nsec = rec->stx.buff.stx_mtime.tv_nsec;
+    item->digest_offset = rec->digest_offset;
+    item->path = strdup(walk->path);
+    if (item->path == NULL) {
+        fprintf(stderr, "strdup() failed with errno %i\n", errno);
+        return -1;
+    }
+    pending_count++;
+
+    return 0;
+}
+
+int compare_inodes(
+    const void *a,
+    const void *b
+) {
+    const struct pending *pa = a;
+    const struct pending *pb = b;
+
+    if (pa->ino != pb->ino) {
+        return pa->ino < pb->ino ? -1 : 1;
+    }
+    return 0;
+}
+
+// Returns 1 if the file was hashed, 0 if it was left pending
+int fill_digest(
+    int datafd,
+    const char *root,
+    const struct pending *item,
+    const struct hash_opts *opts,
+    bool drop_cache,
+    struct digest *dgst
+) {
+    int ret;
+    int fd;
+    int kind;
+    char *filepath;
+    struct stat st;
+    unsigned char slot[2 * sizeof(int) + EVP_MAX_MD_SIZE + sizeof(long long)];
+    size_t slot_size;
+
+    filepath = malloc(strlen(root) + strlen(item->path) + 2);
+    if (filepath == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    sprintf(filepath, "%s/%s", root, item->path);
+
+    fd = open_noatime(filepath);
+    if (fd < 0) {
+        fprintf(stderr, "warning: can't open %s, errno %i\n", filepath, errno);
+        free(filepath);
+        return 0;
+    }
+
+    // A digest of other content than the dump describes would be wrong
+    ret = fstat(fd, &st);
+    if (ret || st.st_ino != item->ino || st.st_size != item->size ||
+        st.st_mtim.tv_sec != item->mtime_sec || st.st_mtim.tv_nsec != item->mtime_nsec) {
+        fprintf(stderr, "warning: %s changed since the dump\n", filepath);
+        close(fd);
+        free(filepath);
+        return 0;
+    }
+
+    ret = hash_fd(filepath, fd, item->size, opts, dgst);
+    if (drop_cache) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+    if (ret) {
+        free(filepath);
+        return 0;
+    }
+    free(filepath);
+
+    // Same layout as the pending slot written by metadump
+    kind = dgst->kind | DIGEST_SLOT;
+    memset(slot, 0x00, sizeof(slot));
+    memcpy(slot, &kind, sizeof(kind));
+    memcpy(slot + sizeof(int), &dgst->md_len, sizeof(dgst->md_len));
+    memcpy(slot + 2 * sizeof(int), dgst->md_value, dgst->md_len);
+    memcpy(slot + 2 * sizeof(int) + DIGEST_SLOT_MD_SIZE, &dgst->chunk_size, sizeof(dgst->chunk_size));
+    slot_size = 2 * sizeof(int) + DIGEST_SLOT_MD_SIZE + sizeof(long long);
+
+    ret = pwrite(datafd, slot, slot_size, item->digest_offset);
+    if (ret != (int)slot_size) {
+        print_error("pwrite", ret);
+        return -1;
+    }
+
+    return 1;
+}
+
+void print_usage(
+    const char *name
+) {
+    fprintf(stderr, "Usage: %s [options] treefile datafile root\n", name);
+    fprintf(stderr, "Fills in the digests left pending by metadump --defer-hash, in inode\n");
+    fprintf(stderr, "order and at idle I/O priority\n");
+    fprintf(stderr, "  --sparse      skip holes when hashing (SEEK_DATA/SEEK_HOLE)\n");
+    fprintf(stderr, "  --tree-hash[=MIB]\n");
+    fprintf(stderr, "                hash files larger than MIB (default 64) MiB as a tree\n");
+    fprintf(stderr, "  --fingerprint[=N]\n");
+    fprintf(stderr, "                hash only the size and N (default 8) %i KiB blocks of\n", HASH_FINGERPRINT_BLOCK / 1024);
+    fprintf(stderr, "                files larger than those blocks\n");
+    fprintf(stderr, "  --threads=N   threads used by the tree hash and fingerprint (default:\n");
+    fprintf(stderr, "                online CPUs)\n");
+    fprintf(stderr, "  --max-bytes=RATE\n");
+    fprintf(stderr, "                read at most RATE bytes per second (K, M and G suffixes)\n");
+    fprintf(stderr, "  --drop-cache  drop each file from the page cache once hashed\n");
+}
+
+int main(
+    int argc,
+    char *argv[]
+) {
+    int ret;
+    int opt;
+    int datafd;
+    const char *root;
+    long long filled;
+    bool drop_cache;
+    double bytes_rate;
+
+    struct tree_walk walk;
+    struct data_reader reader;
+    struct md_record rec;
+    struct hash_opts opts;
+    struct digest dgst;
+
+    const struct option long_options[] = {
+        {"sparse", no_argument, NULL, 's'},
+        {"tree-hash", optional_argument, NULL, 't'},
+        {"fingerprint", optional_argument, NULL, 'F'},
+        {"threads", required_argument, NULL, 'j'},
+        {"max-bytes", required_argument, NULL, 'b'},
+        {"drop-cache", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+
+    memset(&opts, 0x00, sizeof(opts));
+    drop_cache = false;
+    bytes_rate = 0;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            opts.sparse = true;
+            break;
+        case 't':
+            opts.tree_chunk = (optarg ? atoll(optarg) : 64) * 1024 * 1024;
+            if (opts.tree_chunk <= 0) {
+                fprintf(stderr, "Invalid tree hash chunk size %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'F':
+            opts.fingerprint_blocks = optarg ? atoi(optarg) : 8;
+            if (opts.fingerprint_blocks < 2) {
+                fprintf(stderr, "Invalid number of fingerprint blocks %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'j':
+            opts.threads = atoi(optarg);
+            if (opts.threads < 1) {
+                fprintf(stderr, "Invalid thread count %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'b':
+            ret = throttle_parse_rate(optarg, &bytes_rate);
+            if (ret) {
+                fprintf(stderr, "Invalid rate %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'c':
+            drop_cache = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (argc - optind != 3) {
+        fprintf(stderr, "Exactly 3 arguments required\n");
+        print_usage(argv[0]);
+        return -1;
+    }
+    root = argv[optind + 2];
+
+    if (opts.threads == 0) {
+        opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    set_idle_priority();
+    throttle_set(bytes_rate, 0, false);
+
+    ret = tree_walk_open(&walk, argv[optind]);
+    if (ret) {
+        return ret;
+    }
+    ret = data_reader_open(&reader, argv[optind + 1]);
+    if (ret) {
+        return ret;
+    }
+
+    memset(&rec, 0x00, sizeof(rec));
+    while ((ret = tree_walk_next(&walk)) > 0) {
+        ret = data_reader_read(&reader, walk.pos, &rec);
+        if (ret) {
+            return ret;
+        }
+        if ((rec.digest_kind & DIGEST_KIND_MASK) != DIGEST_PENDING) {
+            continue;
+        }
+        ret = add_pending(&walk, &rec);
+        if (ret) {
+            return ret;
+        }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    tree_walk_close(&walk);
+    data_reader_close(&reader);
+    record_free(&rec);
+
+    // Inode order approximates on-disk order on most local filesystems
+    qsort(pendings, pending_count, sizeof(*pendings), compare_inodes);
+
+    datafd = open(argv[optind + 1], O_WRONLY);
+    if (datafd < 0) {
+        fprintf(stderr, "Can't open datafile %s\n", argv[optind + 1]);
+        return -1;
+    }
+
+    memset(&dgst, 0x00, sizeof(dgst));
+    filled = 0;
+    for (size_t idx = 0; idx < pending_count; idx++) {
+        ret = fill_digest(datafd, root, &pendings[idx], &opts, drop_cache, &dgst);
+        if (ret < 0) {
+            return ret;
+        }
+        filled += ret;
+        free(pendings[idx].path);
+    }
+
+    ret = close(datafd);
+    if (ret) {
+        print_error("close", ret);
+        return -1;
+    }
+
+    if (filled != (long long)pending_count) {
+        fprintf(stderr, "%lli of %zu digests left pending\n", (long long)pending_count - filled, pending_count);
+    }
+
+    hash_free(&dgst);
+    free(pendings);
+
+    return 0;
+}
@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define COPY_BUFF_SIZE (1024 * 1024)
+
+char **top_names;
+int top_count;
+
+void print_error(
+    const char *func,
+    int ret
+) {
+    fprintf(
+        stderr,
+        "%s() failed with return code %i and errno %i\n",
+        func,
+        ret,
+        errno
+    );
+}
+
+int compare_names(
+    const void *a,
+    const void *b
+) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int add_top_name(
+    const char *name
+) {
+    char **names;
+
+    names = realloc(top_names, (top_count + 1) * sizeof(*top_names));
+    if (names == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    top_names = names;
+
+    top_names[top_count] = strdup(name);
+    if (top_names[top_count] == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    top_count++;
+
+    return 0;
+}
+
+int copy_range(
+    int in_fd,
+    int out_fd,
+    off_t in_off,
+    off_t out_off,
+    off_t length
+) {
+    ssize_t bytes;
+    ssize_t written;
+    static char buff[COPY_BUFF_SIZE];
+
+    // Let the kernel move the bytes (or reflink them) where it can
+    while (length > 0) {
+        bytes = copy_file_range(in_fd, &in_off, out_fd, &out_off, length, 0);
+        if (bytes < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+            break;
+        }
+        if (bytes <= 0) {
+            print_error("copy_file_range", bytes);
+            return -1;
+        }
+        length -= bytes;
+    }
+
+    while (length > 0) {
+        bytes = pread(in_fd, buff, length < COPY_BUFF_SIZE ? length : COPY_BUFF_SIZE, in_off);
+        if (bytes <= 0) {
+            print_error("pread", bytes);
+            return -1;
+        }
+        written = pwrite(out_fd, buff, bytes, out_off);
+        if (written != bytes) {
+            print_error("pwrite", written);
+            return -1;
+        }
+        in_off += bytes;
+        out_off += bytes;
+        length -= bytes;
+    }
+
+    return 0;
+}
+
+int merge_tree(
+    FILE *treefile,
+    FILE *out_treefile,
+    long long delta,
+    long long first_token
+) {
+    int ret;
+    long long token;
+    int level;
+    struct dirent de;
+
+    // The outer MARKER_START has been consumed, so level 1 is the top level
+    level = 1;
+    token = first_token;
+    for (;;) {
+        if (token == MARKER_START) {
+            level++;
+        } else if (token == MARKER_END) {
+            level--;
+            if (level == 0) {
+                return 0;
+            }
+        } else if (token != MARKER_PRUNED) {
+            token += delta;
+        }
+
+        ret = fwrite(&token, sizeof(token), 1, out_treefile);
+        if (ret != 1) {
+            print_error("fwrite", ret);
+            return -1;
+        }
+
+        if (token != MARKER_START && token != MARKER_END) {
+            ret = fread(&de, sizeof(de), 1, treefile);
+            if (ret != 1) {
+                print_error("fread", ret);
+                return -1;
+            }
+            if (level == 1) {
+                ret = add_top_name(de.d_name);
+                if (ret) {
+                    return ret;
+                }
+            }
+            ret = fwrite(&de, sizeof(de), 1, out_treefile);
+            if (ret != 1) {
+                print_error("fwrite", ret);
+                return -1;
+            }
+        }
+
+        ret = fread(&token, sizeof(token), 1, treefile);
+        if (ret != 1) {
+            fprintf(stderr, "Treefile ended inside a directory\n");
+            return -1;
+        }
+    }
+}
+
+int main(
+    int argc,
+    char *argv[]
+) {
+    int ret;
+    FILE *out_treefile;
+    int out_data_fd;
+    off_t out_size;
+
+    FILE *treefile;
+    int data_fd;
+    struct stat st;
+
+    int version[3];
+    long long marker;
+    long long first_token;
+    off_t root_end;
+    off_t region_start;
+    struct statx_data root_stx;
+    struct statx_data shard_stx;
+    struct data_reader reader;
+    struct md_record rec;
+
+    if (argc < 5 || argc % 2 != 1) {
+        fprintf(stderr, "Usage: %s out_treefile out_datafile treefile datafile [treefile datafile ...]\n", argv[0]);
+        return -1;
+    }
+
+    out_treefile = fopen(argv[1], "wb");
+    if (out_treefile == NULL) {
+        fprintf(stderr, "Can't open treefile %s\n", argv[1]);
+        return -1;
+    }
+
+    out_data_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_data_fd < 0) {
+        fprintf(stderr, "Can't open datafile %s\n", argv[2]);
+        return -1;
+    }
+
+    ret = fwrite(&VERSION, sizeof(VERSION), 1, out_treefile);
+    if (ret != 1) {
+        print_error("fwrite", ret);
+        return -1;
+    }
+    ret = fwrite(&MARKER_START, sizeof(MARKER_START), 1, out_treefile);
+    if (ret != 1) {
+        print_error("fwrite", ret);
+        return -1;
+    }
+    ret = write(out_data_fd, &VERSION, sizeof(VERSION));
+    if (ret != sizeof(VERSION)) {
+        print_error("write", ret);
+        return -1;
+    }
+    out_size = sizeof(VERSION);
+    memset(&rec, 0x00, sizeof(rec));
+    memset(&root_stx, 0x00, sizeof(root_stx));
+
+    for (int shard = 0; 3 + 2 * shard < argc; shard++) {
+        treefile = fopen(argv[3 + 2 * shard], "rb");
+        if (treefile == NULL) {
+            fprintf(stderr, "Can't open treefile %s\n", argv[3 + 2 * shard]);
+            return -1;
+        }
+
+        ret = fread(&version, sizeof(version), 1, treefile);
+        if (ret != 1) {
+            print_error("fread", ret);
+            return -1;
+        }
+        ret = compare_versions(version, VERSION);
+        if (ret) {
+            return ret;
+        }
+
+        ret = fread(&marker, sizeof(marker), 1, treefile);
+        if (ret != 1 || marker != MARKER_START) {
+            fprintf(stderr, "The root of %s is not a directory\n", argv[3 + 2 * shard]);
+            return -1;
+        }
+        ret = fread(&first_token, sizeof(first_token), 1, treefile);
+        if (ret != 1) {
+            print_error("fread", ret);
+            return -1;
+        }
+
+        data_fd = open(argv[4 + 2 * shard], O_RDONLY);
+        if (data_fd < 0) {
+            fprintf(stderr, "Can't open datafile %s\n", argv[4 + 2 * shard]);
+            return -1;
+        }
+
+        ret = pread(data_fd, &version, sizeof(version), 0);
+        if (ret != sizeof(version)) {
+            print_error("pread", ret);
+            return -1;
+        }
+        ret = compare_versions(version, VERSION);
+        if (ret) {
+            return ret;
+        }
+
+        ret = fstat(data_fd, &st);
+        if (ret) {
+            print_error("fstat", ret);
+            return -1;
+        }
+
+        // The first token may be a pruned stub, so take the length of the
+        // root record from the record itself
+        ret = data_reader_open(&reader, argv[4 + 2 * shard]);
+        if (ret) {
+            return ret;
+        }
+        // Each dictionary numbers its entries on its own
+        if (reader.dict.loaded) {
+            fprintf(stderr, "%s has an xattr dictionary, shards dumped with --xattr-dict can't be merged\n", argv[4 + 2 * shard]);
+            return -1;
+        }
+        ret = data_reader_read(&reader, sizeof(VERSION) + DATA_OFFSET, &rec);
+        if (ret) {
+            return ret;
+        }
+        root_end = rec.offset + rec.length;
+        shard_stx = rec.stx;
+        data_reader_close(&reader);
+
+        if (shard == 0) {
+            // The first shard also provides the root record
+            root_stx = shard_stx;
+            region_start = sizeof(VERSION);
+        } else {
+            if (root_stx.buff.stx_ino != shard_stx.buff.stx_ino ||
+                root_stx.buff.stx_dev_major != shard_stx.buff.stx_dev_major ||
+                root_stx.buff.stx_dev_minor != shard_stx.buff.stx_dev_minor) {
+                fprintf(stderr, "warning: root of %s differs from the first shard\n", argv[3 + 2 * shard]);
+            }
+            region_start = root_end;
+        }
+
+        ret = copy_range(data_fd, out_data_fd, region_start, out_size, st.st_size - region_start);
+        if (ret) {
+            return ret;
+        }
+
+        ret = merge_tree(treefile, out_treefile, out_size - region_start, first_token);
+        if (ret) {
+            return ret;
+        }
+
+        out_size += st.st_size - region_start;
+
+        close(data_fd);
+        fclose(treefile);
+    }
+
+    ret = fwrite(&MARKER_END, sizeof(MARKER_END), 1, out_treefile);
+    if (ret != 1) {
+        print_error("fwrite", ret);
+        return -1;
+    }
+
+    ret = fclose(out_treefile);
+    if (ret) {
+        print_error("fclose", ret);
+        return -1;
+    }
+    ret = close(out_data_fd);
+    if (ret) {
+        print_error("close", ret);
+        return -1;
+    }
+
+    qsort(top_names, top_count, sizeof(*top_names), compare_names);
+    for (int idx = 0; idx < top_count; idx++) {
+        if (idx > 0 && strcmp(top_names[idx - 1], top_names[idx]) == 0) {
+            fprintf(stderr, "warning: %s appears in more than one shard\n", top_names[idx]);
+        }
+    }
+    for (int idx = 0; idx < top_count; idx++) {
+        free(top_names[idx]);
+    }
+    free(top_names);
+
+    record_free(&rec);
+
+    return 0;
+}
@@ -0,0 +1,1042 @@
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "reader.h"
+#include "split.h"
+#include "zonemap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <regex.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+enum node_kind {
+    NODE_AND,
+    NODE_OR,
+    NODE_NOT,
+    NODE_PRED
+};
+
+enum field {
+    FIELD_SIZE,
+    FIELD_BLOCKS,
+    FIELD_INO,
+    FIELD_NLINK,
+    FIELD_UID,
+    FIELD_GID,
+    FIELD_MODE,
+    FIELD_TYPE,
+    FIELD_ATIME,
+    FIELD_MTIME,
+    FIELD_CTIME,
+    FIELD_BTIME,
+    FIELD_NAME,
+    FIELD_PATH,
+    FIELD_DIGEST,
+    FIELD_XATTR
+};
+
+enum op {
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_MATCH
+};
+
+struct node {
+    enum node_kind kind;
+    struct node *left;
+    struct node *right;
+    enum field field;
+    enum op op;
+    long long value;
+    char *pattern;
+    regex_t regex;
+};
+
+struct field_name {
+    const char *name;
+    enum field field;
+};
+
+const struct field_name FIELD_NAMES[] = {
+    {"size", FIELD_SIZE},
+    {"blocks", FIELD_BLOCKS},
+    {"ino", FIELD_INO},
+    {"nlink", FIELD_NLINK},
+    {"uid", FIELD_UID},
+    {"gid", FIELD_GID},
+    {"mode", FIELD_MODE},
+    {"type", FIELD_TYPE},
+    {"atime", FIELD_ATIME},
+    {"mtime", FIELD_MTIME},
+    {"ctime", FIELD_CTIME},
+    {"btime", FIELD_BTIME},
+    {"name", FIELD_NAME},
+    {"path", FIELD_PATH},
+    {"digest", FIELD_DIGEST},
+    {"xattr", FIELD_XATTR},
+    {NULL, 0}
+};
+
+struct query_ctx {
+    struct tree_walk *walk;
+    struct data_reader *reader;
+    struct md_record *rec;
+    bool loaded;
+    int failed;
+};
+
+// One of the pieces a dump with a split index is queried in
+struct query_job {
+    const char *treepath;
+    const char *datapath;
+    struct node *root;
+    const struct zone *zones;
+    long long zone_count;
+    int block_entries;
+    const struct split_point *splits;
+    long long split_count;
+    int part;
+    int parts;
+    char separator;
+    FILE *outfile;
+    pthread_t thread;
+    int failed;
+};
+
+// Tokenizer state over the joined expression
+const char *expr_cursor;
+char *token_text;
+size_t token_alloc;
+time_t query_now;
+
+bool is_op_char(
+    char c
+) {
+    return c == '<' || c == '>' || c == '=' || c == '!' || c == '~';
+}
+
+// Returns the next token in token_text, or NULL at the end of the input
+char *next_token(void) {
+    const char *start;
+    size_t length;
+    char quote;
+
+    while (isspace((unsigned char)*expr_cursor)) {
+        expr_cursor++;
+    }
+    if (*expr_cursor == '\0') {
+        return NULL;
+    }
+
+    start = expr_cursor;
+    if (*expr_cursor == '(' || *expr_cursor == ')') {
+        expr_cursor++;
+        length = 1;
+    } else if (is_op_char(*expr_cursor)) {
+        while (is_op_char(*expr_cursor)) {
+            expr_cursor++;
+        }
+        length = expr_cursor - start;
+    } else if (*expr_cursor == '\'' || *expr_cursor == '"') {
+        quote = *expr_cursor++;
+        start = expr_cursor;
+        while (*expr_cursor != '\0' && *expr_cursor != quote) {
+            expr_cursor++;
+        }
+        length = expr_cursor - start;
+        if (*expr_cursor == quote) {
+            expr_cursor++;
+        }
+    } else {
+        while (*expr_cursor != '\0' && !isspace((unsigned char)*expr_cursor) &&
+               *expr_cursor != '(' && *expr_cursor != ')' && !is_op_char(*expr_cursor)) {
+            expr_cursor++;
+        }
+        length = expr_cursor - start;
+    }
+
+    if (length + 1 > token_alloc) {
+        token_text = realloc(token_text, length + 1);
+        if (token_text == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            exit(-1);
+        }
+        token_alloc = length + 1;
+    }
+    memcpy(token_text, start, length);
+    token_text[length] = '\0';
+
+    return token_text;
+}
+
+char *peek_token(void) {
+    const char *saved;
+    char *token;
+
+    saved = expr_cursor;
+    token = next_token();
+    expr_cursor = saved;
+
+    return token;
+}
+
+struct node *new_node(
+    enum node_kind kind,
+    struct node *left,
+    struct node *right
+) {
+    struct node *node;
+
+    node = calloc(1, sizeof(*node));
+    if (node == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        exit(-1);
+    }
+    node->kind = kind;
+    node->left = left;
+    node->right = right;
+
+    return node;
+}
+
+int parse_size(
+    const char *text,
+    long long *value
+) {
+    char *end;
+    long long mult;
+
+    *value = strtoll(text, &end, 0);
+    if (end == text) {
+        return -1;
+    }
+
+    mult = 1;
+    switch (toupper((unsigned char)*end)) {
+    case 'P':
+        mult *= 1024;
+        /* fall through */
+    case 'T':
+        mult *= 1024;
+        /* fall through */
+    case 'G':
+        mult *= 1024;
+        /* fall through */
+    case 'M':
+        mult *= 1024;
+        /* fall through */
+    case 'K':
+        mult *= 1024;
+        end++;
+        break;
+    case '\0':
+        break;
+    default:
+        return -1;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+
+    *value *= mult;
+
+    return 0;
+}
+
+int parse_time(
+    const char *text,
+    long long *value
+) {
+    struct tm tm;
+    char *end;
+    long long amount;
+    long long unit;
+
+    // now, now-7d, now+1h
+    if (strncmp(text, "now", 3) == 0) {
+        *value = query_now;
+        if (text[3] == '\0') {
+            return 0;
+        }
+        amount = strtoll(text + 3, &end, 10);
+        switch (*end) {
+        case 's':
+            unit = 1;
+            break;
+        case 'm':
+            unit = 60;
+            break;
+        case 'h':
+            unit = 3600;
+            break;
+        case 'd':
+            unit = 86400;
+            break;
+        case 'w':
+            unit = 7 * 86400;
+            break;
+        default:
+            return -1;
+        }
+        if (end[1] != '\0') {
+            return -1;
+        }
+        *value += amount * unit;
+        return 0;
+    }
+
+    // YYYY-MM-DD[THH:MM:SS] in UTC
+    memset(&tm, 0x00, sizeof(tm));
+    end = strptime(text, "%Y-%m-%d", &tm);
+    if (end != NULL) {
+        if (*end == 'T') {
+            end = strptime(end + 1, "%H:%M:%S", &tm);
+        }
+        if (end != NULL && *end == '\0') {
+            *value = timegm(&tm);
+            return 0;
+        }
+    }
+
+    // Seconds since the epoch
+    *value = strtoll(text, &end, 10);
+    if (end == text || *end != '\0') {
+        return -1;
+    }
+
+    return 0;
+}
+
+int parse_type(
+    const char *text,
+    long long *value
+) {
+    switch (text[0] == '\0' || text[1] != '\0' ? '\0' : text[0]) {
+    case 'f':
+        *value = S_IFREG;
+        return 0;
+    case 'd':
+        *value = S_IFDIR;
+        return 0;
+    case 'l':
+        *value = S_IFLNK;
+        return 0;
+    case 'c':
+        *value = S_IFCHR;
+        return 0;
+    case 'b':
+        *value = S_IFBLK;
+        return 0;
+    case 'p':
+        *value = S_IFIFO;
+        return 0;
+    case 's':
+        *value = S_IFSOCK;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+struct node *parse_expr(void);
+
+struct node *parse_pred(
+    const char *field_text
+) {
+    int ret;
+    struct node *node;
+    const struct field_name *field;
+    char *token;
+    char *end;
+
+    for (field = FIELD_NAMES; field->name != NULL; field++) {
+        if (strcmp(field->name, field_text) == 0) {
+            break;
+        }
+    }
+    if (field->name == NULL) {
+        fprintf(stderr, "Unknown field %s\n", field_text);
+        return NULL;
+    }
+
+    node = new_node(NODE_PRED, NULL, NULL);
+    node->field = field->field;
+
+    token = next_token();
+    if (token == NULL) {
+        fprintf(stderr, "Missing operator after %s\n", field->name);
+        return NULL;
+    }
+    if (strcmp(token, "<") == 0) {
+        node->op = OP_LT;
+    } else if (strcmp(token, "<=") == 0) {
+        node->op = OP_LE;
+    } else if (strcmp(token, ">") == 0) {
+        node->op = OP_GT;
+    } else if (strcmp(token, ">=") == 0) {
+        node->op = OP_GE;
+    } else if (strcmp(token, "=") == 0 || strcmp(token, "==") == 0) {
+        node->op = OP_EQ;
+    } else if (strcmp(token, "!=") == 0) {
+        node->op = OP_NE;
+    } else if (strcmp(token, "~") == 0) {
+        node->op = OP_MATCH;
+    } else {
+        fprintf(stderr, "Unknown operator %s\n", token);
+        return NULL;
+    }
+
+    token = next_token();
+    if (token == NULL) {
+        fprintf(stderr, "Missing value after %s\n", field->name);
+        return NULL;
+    }
+
+    switch (node->field) {
+    case FIELD_NAME:
+    case FIELD_PATH:
+    case FIELD_DIGEST:
+    case FIELD_XATTR:
+        if (node->op != OP_EQ && node->op != OP_NE && node->op != OP_MATCH) {
+            fprintf(stderr, "%s only supports =, != and ~\n", field->name);
+            return NULL;
+        }
+        node->pattern = strdup(token);
+        if (node->op == OP_MATCH) {
+            ret = regcomp(&node->regex, token, REG_EXTENDED | REG_NOSUB);
+            if (ret) {
+                fprintf(stderr, "Invalid regular expression %s\n", token);
+                return NULL;
+            }
+        }
+        return node;
+    case FIELD_TYPE:
+        if (node->op != OP_EQ && node->op != OP_NE) {
+            fprintf(stderr, "type only supports = and !=\n");
+            return NULL;
+        }
+        ret = parse_type(token, &node->value);
+        break;
+    case FIELD_ATIME:
+    case FIELD_MTIME:
+    case FIELD_CTIME:
+    case FIELD_BTIME:
+        ret = parse_time(token, &node->value);
+        break;
+    case FIELD_MODE:
+        node->value = strtoll(token, &end, 8);
+        ret = end == token || *end != '\0' ? -1 : 0;
+        break;
+    default:
+        ret = parse_size(token, &node->value);
+        break;
+    }
+    if (ret || node->op == OP_MATCH) {
+        fprintf(stderr, "Invalid value %s for %s\n", token, field->name);
+        return NULL;
+    }
+
+    return node;
+}
+
+struct node *parse_factor(void) {
+    char *token;
+    struct node *node;
+
+    token = next_token();
+    if (token == NULL) {
+        fprintf(stderr, "Unexpected end of expression\n");
+        return NULL;
+    }
+
+    if (strcmp(token, "not") == 0 || strcmp(token, "!") == 0) {
+        node = parse_factor();
+        return node == NULL ? NULL : new_node(NODE_NOT, node, NULL);
+    }
+
+    if (strcmp(token, "(") == 0) {
+        node = parse_expr();
+        if (node == NULL) {
+            return NULL;
+        }
+        token = next_token();
+        if (token == NULL || strcmp(token, ")") != 0) {
+            fprintf(stderr, "Missing )\n");
+            return NULL;
+        }
+        return node;
+    }
+
+    return parse_pred(token);
+}
+
+struct node *parse_term(void) {
+    struct node *left;
+    struct node *right;
+    char *token;
+
+    left = parse_factor();
+    while (left != NULL) {
+        token = peek_token();
+        if (token == NULL || strcmp(token, ")") == 0 || strcmp(token, "or") == 0) {
+            break;
+        }
+        // "and" is optional between factors
+        if (strcmp(token, "and") == 0) {
+            next_token();
+        }
+        right = parse_factor();
+        if (right == NULL) {
+            return NULL;
+        }
+        left = new_node(NODE_AND, left, right);
+    }
+
+    return left;
+}
+
+struct node *parse_expr(void) {
+    struct node *left;
+    struct node *right;
+    char *token;
+
+    left = parse_term();
+    while (left != NULL) {
+        token = peek_token();
+        if (token == NULL || strcmp(token, "or") != 0) {
+            break;
+        }
+        next_token();
+        right = parse_term();
+        if (right == NULL) {
+            return NULL;
+        }
+        left = new_node(NODE_OR, left, right);
+    }
+
+    return left;
+}
+
+bool compare_value(
+    long long value,
+    enum op op,
+    long long target
+) {
+    switch (op) {
+    case OP_LT:
+        return value < target;
+    case OP_LE:
+        return value <= target;
+    case OP_GT:
+        return value > target;
+    case OP_GE:
+        return value >= target;
+    case OP_EQ:
+        return value == target;
+    case OP_NE:
+        return value != target;
+    default:
+        return false;
+    }
+}
+
+bool match_text(
+    struct node *node,
+    const char *text
+) {
+    if (node->op == OP_MATCH) {
+        return regexec(&node->regex, text, 0, NULL, 0) == 0;
+    }
+    return fnmatch(node->pattern, text, 0) == 0;
+}
+
+bool eval_pred(
+    struct node *node,
+    struct query_ctx *ctx
+) {
+    int ret;
+    struct statx *buff;
+    char hex[2 * EVP_MAX_MD_SIZE + 1];
+    bool found;
+
+    if (node->field == FIELD_NAME) {
+        return match_text(node, ctx->walk->de.d_name) != (node->op == OP_NE);
+    }
+    if (node->field == FIELD_PATH) {
+        return match_text(node, ctx->walk->path) != (node->op == OP_NE);
+    }
+
+    // Everything else needs the record, which is only decoded once asked for
+    if (!ctx->loaded) {
+        ret = data_reader_read(ctx->reader, ctx->walk->pos, ctx->rec);
+        if (ret) {
+            ctx->failed = ret;
+            return false;
+        }
+        ctx->loaded = true;
+    }
+    buff = &ctx->rec->stx.buff;
+
+    switch (node->field) {
+    case FIELD_SIZE:
+        return compare_value(buff->stx_size, node->op, node->value);
+    case FIELD_BLOCKS:
+        return compare_value(buff->stx_blocks, node->op, node->value);
+    case FIELD_INO:
+        return compare_value(buff->stx_ino, node->op, node->value);
+    case FIELD_NLINK:
+        return compare_value(buff->stx_nlink, node->op, node->value);
+    case FIELD_UID:
+        return compare_value(buff->stx_uid, node->op, node->value);
+    case FIELD_GID:
+        return compare_value(buff->stx_gid, node->op, node->value);
+    case FIELD_MODE:
+        return compare_value(buff->stx_mode & ~S_IFMT, node->op, node->value);
+    case FIELD_TYPE:
+        return compare_value(buff->stx_mode & S_IFMT, node->op, node->value);
+    case FIELD_ATIME:
+        return compare_value(buff->stx_atime.tv_sec, node->op, node->value);
+    case FIELD_MTIME:
+        return compare_value(buff->stx_mtime.tv_sec, node->op, node->value);
+    case FIELD_CTIME:
+        return compare_value(buff->stx_ctime.tv_sec, node->op, node->value);
+    case FIELD_BTIME:
+        return compare_value(buff->stx_btime.tv_sec, node->op, node->value);
+    case FIELD_DIGEST:
+        if (ctx->rec->md_len == 0) {
+            return node->op == OP_NE;
+        }
+        for (unsigned int idx = 0; idx < ctx->rec->md_len; idx++) {
+            sprintf(hex + 2 * idx, "%02x", ctx->rec->md_value[idx]);
+        }
+        return match_text(node, hex) != (node->op == OP_NE);
+    case FIELD_XATTR:
+        found = false;
+        for (int idx = 0; idx < ctx->rec->xattr_count && !found; idx++) {
+            found = match_text(node, ctx->rec->xattrs[idx].name);
+        }
+        return found != (node->op == OP_NE);
+    default:
+        return false;
+    }
+}
+
+bool eval_node(
+    struct node *node,
+    struct query_ctx *ctx
+) {
+    switch (node->kind) {
+    case NODE_AND:
+        return eval_node(node->left, ctx) && eval_node(node->right, ctx);
+    case NODE_OR:
+        return eval_node(node->left, ctx) || eval_node(node->right, ctx);
+    case NODE_NOT:
+        return !eval_node(node->left, ctx);
+    default:
+        return eval_pred(node, ctx);
+    }
+}
+
+bool range_may_match(
+    long long min,
+    long long max,
+    enum op op,
+    long long target,
+    bool negated
+) {
+    if (negated) {
+        switch (op) {
+        case OP_LT:
+            op = OP_GE;
+            break;
+        case OP_LE:
+            op = OP_GT;
+            break;
+        case OP_GT:
+            op = OP_LE;
+            break;
+        case OP_GE:
+            op = OP_LT;
+            break;
+        case OP_EQ:
+            op = OP_NE;
+            break;
+        case OP_NE:
+            op = OP_EQ;
+            break;
+        default:
+            return true;
+        }
+    }
+
+    switch (op) {
+    case OP_LT:
+        return min < target;
+    case OP_LE:
+        return min <= target;
+    case OP_GT:
+        return max > target;
+    case OP_GE:
+        return max >= target;
+    case OP_EQ:
+        return min <= target && target <= max;
+    case OP_NE:
+        return min != target || max != target;
+    default:
+        return true;
+    }
+}
+
+// Whether any entry summarised by the zone could make node evaluate to
+// !negated
+bool zone_may_match(
+    struct node *node,
+    const struct zone *zone,
+    bool negated
+) {
+    switch (node->kind) {
+    case NODE_AND:
+        if (negated) {
+            return zone_may_match(node->left, zone, true) || zone_may_match(node->right, zone, true);
+        }
+        return zone_may_match(node->left, zone, false) && zone_may_match(node->right, zone, false);
+    case NODE_OR:
+        if (negated) {
+            return zone_may_match(node->left, zone, true) && zone_may_match(node->right, zone, true);
+        }
+        return zone_may_match(node->left, zone, false) || zone_may_match(node->right, zone, false);
+    case NODE_NOT:
+        return zone_may_match(node->left, zone, !negated);
+    default:
+        break;
+    }
+
+    switch (node->field) {
+    case FIELD_SIZE:
+        return range_may_match(zone->min_size, zone->max_size, node->op, node->value, negated);
+    case FIELD_MTIME:
+        return range_may_match(zone->min_mtime, zone->max_mtime, node->op, node->value, negated);
+    case FIELD_UID:
+        return range_may_match(zone->min_uid, zone->max_uid, node->op, node->value, negated);
+    default:
+        return true;
+    }
+}
+
+int query_run(
+    struct query_job *job
+) {
+    int ret;
+    long long block;
+    long long checked_block;
+    bool block_may_match;
+    bool matched;
+
+    struct tree_walk walk;
+    struct data_reader reader;
+    struct md_record rec;
+    struct query_ctx ctx;
+
+    ret = tree_walk_open(&walk, job->treepath);
+    if (ret) {
+        return ret;
+    }
+    ret = split_seek(&walk, job->splits, job->split_count, job->part, job->parts);
+    if (ret) {
+        return ret;
+    }
+    ret = data_reader_open(&reader, job->datapath);
+    if (ret) {
+        return ret;
+    }
+
+    memset(&rec, 0x00, sizeof(rec));
+    ctx.walk = &walk;
+    ctx.reader = &reader;
+    ctx.rec = &rec;
+    ctx.failed = 0;
+
+    // A piece may start in the middle of a block
+    checked_block = -1;
+    block_may_match = true;
+    while ((ret = tree_walk_next(&walk)) > 0) {
+        if (job->zones != NULL) {
+            block = walk.entry / job->block_entries;
+            if (block != checked_block) {
+                block_may_match = block >= job->zone_count || zone_may_match(job->root, &job->zones[block], false);
+                checked_block = block;
+            }
+            if (!block_may_match) {
+                continue;
+            }
+        }
+
+        // A failed read makes its predicate false, which a negation would
+        // turn into a match
+        ctx.loaded = false;
+        matched = eval_node(job->root, &ctx);
+        if (ctx.failed) {
+            return ctx.failed;
+        }
+        if (matched) {
+            fputs(walk.path, job->outfile);
+            putc(job->separator, job->outfile);
+        }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    tree_walk_close(&walk);
+    data_reader_close(&reader);
+    record_free(&rec);
+
+    return 0;
+}
+
+void *query_worker(
+    void *arg
+) {
+    struct query_job *job = arg;
+
+    job->failed = query_run(job);
+
+    return NULL;
+}
+
+// Appends a piece written by a worker to stdout
+int query_copy(
+    struct query_job *job
+) {
+    size_t bytes;
+    char buff[64 * 1024];
+
+    rewind(job->outfile);
+    while ((bytes = fread(buff, 1, sizeof(buff), job->outfile)) > 0) {
+        if (fwrite(buff, 1, bytes, stdout) != bytes) {
+            fprintf(stderr, "fwrite() failed with errno %i\n", errno);
+            return -1;
+        }
+    }
+    if (ferror(job->outfile)) {
+        fprintf(stderr, "fread() failed with errno %i\n", errno);
+        return -1;
+    }
+    fclose(job->outfile);
+
+    return 0;
+}
+
+void print_usage(
+    const char *name
+) {
+    fprintf(stderr, "Usage: %s [options] treefile datafile expression...\n", name);
+    fprintf(stderr, "  --zonemap=FILE  skip blocks using a zone map written by metadump --zonemap\n");
+    fprintf(stderr, "  --print0        separate paths with NUL instead of newline\n");
+    fprintf(stderr, "  --splits=FILE   split index written by metadump --splits, which lets the\n");
+    fprintf(stderr, "                  dump be read by several threads\n");
+    fprintf(stderr, "  --threads=N     threads reading the dump with --splits (default: online\n");
+    fprintf(stderr, "                  CPUs)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Predicates are FIELD OP VALUE, combined with and (implicit), or, not and ().\n");
+    fprintf(stderr, "Numeric fields: size blocks ino nlink uid gid (K/M/G/T/P suffixes),\n");
+    fprintf(stderr, "  mode (octal), type (f d l c b p s),\n");
+    fprintf(stderr, "  atime mtime ctime btime (epoch, YYYY-MM-DD[THH:MM:SS] UTC, now, now-7d)\n");
+    fprintf(stderr, "  with < <= > >= = !=\n");
+    fprintf(stderr, "Text fields: name path digest (hex) xattr (any name) with = != (glob), ~ (regex)\n");
+    fprintf(stderr, "Example: %s tree data 'size>1G uid=1234 mtime>=now-7d'\n", name);
+}
+
+int main(
+    int argc,
+    char *argv[]
+) {
+    int ret;
+    int opt;
+    const char *zonepath;
+    char separator;
+    char *expr;
+    size_t expr_length;
+    struct node *root;
+    const char *splitpath;
+    int threads;
+
+    struct zone *zones;
+    long long zone_count;
+    int block_entries;
+
+    struct split_point *splits;
+    long long split_count;
+    struct query_job *jobs;
+
+    const struct option long_options[] = {
+        {"zonemap", required_argument, NULL, 'z'},
+        {"print0", no_argument, NULL, '0'},
+        {"splits", required_argument, NULL, 's'},
+        {"threads", required_argument, NULL, 'j'},
+        {NULL, 0, NULL, 0}
+    };
+
+    zonepath = NULL;
+    separator = '\n';
+    splitpath = NULL;
+    threads = 0;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'z':
+            zonepath = optarg;
+            break;
+        case '0':
+            separator = '\0';
+            break;
+        case 's':
+            splitpath = optarg;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 1) {
+                fprintf(stderr, "Invalid number of threads %s\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (argc - optind < 3) {
+        fprintf(stderr, "At least 3 arguments required\n");
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    query_now = time(NULL);
+
+    // The expression may be given as one argument or split across several
+    expr_length = 1;
+    for (int idx = optind + 2; idx < argc; idx++) {
+        expr_length += strlen(argv[idx]) + 1;
+    }
+    expr = malloc(expr_length);
+    if (expr == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    expr[0] = '\0';
+    for (int idx = optind + 2; idx < argc; idx++) {
+        strcat(expr, argv[idx]);
+        strcat(expr, " ");
+    }
+
+    expr_cursor = expr;
+    root = parse_expr();
+    if (root == NULL) {
+        return -1;
+    }
+    if (peek_token() != NULL) {
+        fprintf(stderr, "Unexpected %s\n", peek_token());
+        return -1;
+    }
+
+    zones = NULL;
+    zone_count = 0;
+    block_entries = 0;
+    if (zonepath != NULL) {
+        ret = zonemap_load(zonepath, &zones, &zone_count, &block_entries);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    splits = NULL;
+    split_count = 0;
+    if (splitpath != NULL) {
+        ret = split_load(splitpath, &splits, &split_count);
+        if (ret) {
+            return ret;
+        }
+    } else {
+        threads = 1;
+    }
+    if (threads == 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    jobs = calloc(threads, sizeof(*jobs));
+    if (jobs == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    // The first piece goes straight to stdout, the others wait in
+    // temporary files until the ones before them are out
+    for (int idx = 0; idx < threads; idx++) {
+        jobs[idx].treepath = argv[optind];
+        jobs[idx].datapath = argv[optind + 1];
+        jobs[idx].root = root;
+        jobs[idx].zones = zones;
+        jobs[idx].zone_count = zone_count;
+        jobs[idx].block_entries = block_entries;
+        jobs[idx].splits = splits;
+        jobs[idx].split_count = split_count;
+        jobs[idx].part = idx;
+        jobs[idx].parts = threads;
+        jobs[idx].separator = separator;
+        jobs[idx].outfile = stdout;
+        if (idx == 0) {
+            continue;
+        }
+
+        jobs[idx].outfile = tmpfile();
+        if (jobs[idx].outfile == NULL) {
+            fprintf(stderr, "tmpfile() failed with errno %i\n", errno);
+            return -1;
+        }
+        ret = pthread_create(&jobs[idx].thread, NULL, query_worker, &jobs[idx]);
+        if (ret) {
+            fprintf(stderr, "pthread_create() failed with return code %i\n", ret);
+            return -1;
+        }
+    }
+
+    ret = query_run(&jobs[0]);
+    for (int idx = 1; idx < threads; idx++) {
+        pthread_join(jobs[idx].thread, NULL);
+        if (ret == 0) {
+            ret = jobs[idx].failed;
+        }
+    }
+    if (ret) {
+        return ret;
+    }
+
+    for (int idx = 1; idx < threads; idx++) {
+        ret = query_copy(&jobs[idx]);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    free(jobs);
+    split_free(splits, split_count);
+    free(zones);
+    free(expr);
+    free(token_text);
+
+    return 0;
+}
@@ -0,0 +1,782 @@
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "generation.h"
+#include "mdserve.h"
+#include "pathmap.h"
+#include "reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define RECV_BUFF_SIZE (64 * 1024)
+
+struct node {
+    char *path;
+    long long offset;     // of the record in the datafile
+    long long length;
+    unsigned long long ino;
+    long long parent;     // -1 for the root
+    long long first_child;
+    long long last_child;
+    long long next_sibling;
+    struct mdserve_summary summary;
+};
+
+struct inode_ref {
+    unsigned long long ino;
+    long long node;
+};
+
+// Everything a query needs, built once per load
+struct dump {
+    struct node *nodes;
+    long long node_count;
+    long long node_alloc;
+    struct pathmap paths;
+    struct inode_ref *inodes;
+    char *data;
+    size_t data_size;
+};
+
+struct response_buff {
+    char *buff;
+    size_t used;
+    size_t alloc;
+};
+
+// Responses wait in out until the socket takes them, so a slow client
+// never holds up the others
+struct client {
+    int fd;
+    char *in;
+    size_t used;
+    size_t alloc;
+    struct response_buff out;
+    size_t sent;
+};
+
+struct dump dump;
+struct client *clients;
+int client_count;
+struct pollfd *pollfds;
+char *path_buff;
+volatile sig_atomic_t stop_serving;
+volatile sig_atomic_t reload_dump;
+
+int add_node(
+    struct dump *d,
+    const char *path,
+    const struct md_record *rec,
+    unsigned long long ino,
+    long long parent
+) {
+    struct node *nodes;
+    struct node *node;
+    long long *id;
+
+    if (d->node_count == d->node_alloc) {
+        d->node_alloc = d->node_alloc ? 2 * d->node_alloc : 1024;
+        nodes = realloc(d->nodes, d->node_alloc * sizeof(*d->nodes));
+        if (nodes == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            return -1;
+        }
+        d->nodes = nodes;
+    }
+
+    node = &d->nodes[d->node_count];
+    memset(node, 0x00, sizeof(*node));
+    node->path = strdup(path);
+    if (node->path == NULL) {
+        fprintf(stderr, "strdup() failed with errno %i\n", errno);
+        return -1;
+    }
+    node->offset = rec->offset;
+    node->length = rec->length;
+    node->ino = ino;
+    node->parent = parent;
+    node->first_child = -1;
+    node->last_child = -1;
+    node->next_sibling = -1;
+
+    if (!rec->stx.ret) {
+        if (S_ISREG(rec->stx.buff.stx_mode)) {
+            node->summary.files = 1;
+        } else if (S_ISDIR(rec->stx.buff.stx_mode)) {
+            node->summary.dirs = 1;
+        } else {
+            node->summary.others = 1;
+        }
+        node->summary.bytes = rec->stx.buff.stx_size;
+        node->summary.blocks = rec->stx.buff.stx_blocks;
+        node->summary.max_mtime = rec->stx.buff.stx_mtime.tv_sec;
+    }
+
+    if (parent >= 0) {
+        if (d->nodes[parent].last_child >= 0) {
+            d->nodes[d->nodes[parent].last_child].next_sibling = d->node_count;
+        } else {
+            d->nodes[parent].first_child = d->node_count;
+        }
+        d->nodes[parent].last_child = d->node_count;
+    }
+
+    id = pathmap_put(&d->paths, path);
+    if (id == NULL) {
+        return -1;
+    }
+    *id = d->node_count++;
+
+    return 0;
+}
+
+int compare_inodes(
+    const void *a,
+    const void *b
+) {
+    const struct inode_ref *ra = a;
+    const struct inode_ref *rb = b;
+
+    if (ra->ino != rb->ino) {
+        return ra->ino < rb->ino ? -1 : 1;
+    }
+    return ra->node < rb->node ? -1 : ra->node > rb->node;
+}
+
+void free_dump(
+    struct dump *d
+) {
+    for (long long idx = 0; idx < d->node_count; idx++) {
+        free(d->nodes[idx].path);
+    }
+    free(d->nodes);
+    free(d->inodes);
+    pathmap_free(&d->paths);
+    if (d->data != NULL) {
+        munmap(d->data, d->data_size);
+    }
+    memset(d, 0x00, sizeof(*d));
+}
+
+// Reads the whole dump once; queries then only touch memory and the
+// mapped datafile. On failure the caller frees d.
+int load_dump(
+    struct dump *d,
+    const char *treelink,
+    const char *datalink
+) {
+    int ret;
+    int fd;
+    char *treepath;
+    char *datapath;
+    long long parent;
+    long long *last_at_level;
+    long long *new_last_at_level;
+    size_t levels;
+    struct stat st;
+    struct tree_walk walk;
+    struct data_reader reader;
+    struct md_record rec;
+    struct mdserve_summary *sum;
+    struct mdserve_summary *parent_sum;
+
+    memset(d, 0x00, sizeof(*d));
+    memset(&walk, 0x00, sizeof(walk));
+    memset(&reader, 0x00, sizeof(reader));
+    memset(&rec, 0x00, sizeof(rec));
+    levels = 0;
+    last_at_level = NULL;
+
+    // The three opens below must see one generation of a --watch dump
+    ret = generation_resolve(treelink, datalink, &treepath, &datapath);
+    if (ret) {
+        return ret;
+    }
+
+    ret = tree_walk_open(&walk, treepath);
+    if (ret) {
+        goto cleanup;
+    }
+    ret = data_reader_open(&reader, datapath);
+    if (ret) {
+        goto cleanup;
+    }
+
+    // The root record comes first and has no tree entry
+    ret = data_reader_read(&reader, sizeof(VERSION) + DATA_OFFSET, &rec);
+    if (ret) {
+        goto cleanup;
+    }
+    ret = add_node(d, "", &rec, rec.stx.buff.stx_ino, -1);
+    if (ret) {
+        goto cleanup;
+    }
+
+    while ((ret = tree_walk_next(&walk)) > 0) {
+        ret = data_reader_read(&reader, walk.pos, &rec);
+        if (ret) {
+            goto cleanup;
+        }
+
+        if ((size_t)walk.level >= levels) {
+            new_last_at_level = realloc(last_at_level, (walk.level + 64) * sizeof(*last_at_level));
+            if (new_last_at_level == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                ret = -1;
+                goto cleanup;
+            }
+            last_at_level = new_last_at_level;
+            levels = walk.level + 64;
+        }
+        parent = walk.level > 1 ? last_at_level[walk.level - 1] : 0;
+        last_at_level[walk.level] = d->node_count;
+
+        ret = add_node(d, walk.path, &rec, rec.stx.ret ? walk.de.d_ino : rec.stx.buff.stx_ino, parent);
+        if (ret) {
+            goto cleanup;
+        }
+    }
+    if (ret < 0) {
+        goto cleanup;
+    }
+
+    // Children follow their parent in tree order
+    for (long long idx = d->node_count - 1; idx > 0; idx--) {
+        sum = &d->nodes[idx].summary;
+        parent_sum = &d->nodes[d->nodes[idx].parent].summary;
+        parent_sum->files += sum->files;
+        parent_sum->dirs += sum->dirs;
+        parent_sum->others += sum->others;
+        parent_sum->bytes += sum->bytes;
+        parent_sum->blocks += sum->blocks;
+        if (sum->max_mtime > parent_sum->max_mtime) {
+            parent_sum->max_mtime = sum->max_mtime;
+        }
+    }
+
+    d->inodes = malloc(d->node_count * sizeof(*d->inodes));
+    if (d->inodes == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        ret = -1;
+        goto cleanup;
+    }
+    for (long long idx = 0; idx < d->node_count; idx++) {
+        d->inodes[idx].ino = d->nodes[idx].ino;
+        d->inodes[idx].node = idx;
+    }
+    qsort(d->inodes, d->node_count, sizeof(*d->inodes), compare_inodes);
+
+    fd = open(datapath, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open datafile %s\n", datapath);
+        ret = -1;
+        goto cleanup;
+    }
+    ret = fstat(fd, &st);
+    if (ret) {
+        fprintf(stderr, "fstat() failed with errno %i\n", errno);
+        close(fd);
+        ret = -1;
+        goto cleanup;
+    }
+    d->data_size = st.st_size;
+    d->data = mmap(NULL, d->data_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (d->data == MAP_FAILED) {
+        fprintf(stderr, "mmap() failed with errno %i\n", errno);
+        d->data = NULL;
+        ret = -1;
+        goto cleanup;
+    }
+    madvise(d->data, d->data_size, MADV_RANDOM);
+
+cleanup:
+    free(treepath);
+    free(datapath);
+    free(last_at_level);
+    tree_walk_close(&walk);
+    data_reader_close(&reader);
+    record_free(&rec);
+
+    return ret;
+}
+
+int response_append(
+    struct response_buff *out,
+    const void *data,
+    size_t length
+) {
+    char *buff;
+    size_t alloc;
+
+    if (out->used + length > out->alloc) {
+        alloc = out->alloc ? out->alloc : RECV_BUFF_SIZE;
+        while (out->used + length > alloc) {
+            alloc *= 2;
+        }
+        buff = realloc(out->buff, alloc);
+        if (buff == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            return -1;
+        }
+        out->buff = buff;
+        out->alloc = alloc;
+    }
+    memcpy(out->buff + out->used, data, length);
+    out->used += length;
+
+    return 0;
+}
+
+int append_entry(
+    struct response_buff *out,
+    const struct node *node
+) {
+    int ret;
+    struct mdserve_entry entry;
+
+    entry.path_length = strlen(node->path);
+    entry.record_length = node->length;
+
+    ret = response_append(out, &entry, sizeof(entry));
+    if (ret) {
+        return ret;
+    }
+    ret = response_append(out, node->path, entry.path_length);
+    if (ret) {
+        return ret;
+    }
+
+    return response_append(out, dump.data + node->offset, node->length);
+}
+
+long long find_path(
+    const char *payload,
+    uint32_t length
+) {
+    long long *id;
+
+    if (length > PATH_MAX) {
+        return -1;
+    }
+    memcpy(path_buff, payload, length);
+    path_buff[length] = '\0';
+
+    id = pathmap_get(&dump.paths, path_buff);
+    return id != NULL ? *id : -1;
+}
+
+// Appends the response to a request; only a failure to allocate is an error
+int handle_request(
+    uint32_t op,
+    const char *payload,
+    uint32_t length,
+    struct response_buff *out,
+    bool nested
+) {
+    int ret;
+    size_t header_at;
+    long long node;
+    long long lo;
+    long long hi;
+    long long mid;
+    uint64_t ino;
+    struct mdserve_request sub;
+    struct mdserve_response *response;
+    struct mdserve_response header;
+
+    header_at = out->used;
+    header.status = 0;
+    header.length = 0;
+    ret = response_append(out, &header, sizeof(header));
+    if (ret) {
+        return ret;
+    }
+
+    ret = 0;
+    if (op == MDSERVE_LOOKUP || op == MDSERVE_LIST || op == MDSERVE_SUMMARY) {
+        node = find_path(payload, length);
+        if (node < 0) {
+            header.status = ENOENT;
+        } else if (op == MDSERVE_LOOKUP) {
+            ret = append_entry(out, &dump.nodes[node]);
+        } else if (op == MDSERVE_LIST) {
+            for (long long child = dump.nodes[node].first_child; ret == 0 && child >= 0; child = dump.nodes[child].next_sibling) {
+                ret = append_entry(out, &dump.nodes[child]);
+            }
+        } else {
+            ret = response_append(out, &dump.nodes[node].summary, sizeof(dump.nodes[node].summary));
+        }
+    } else if (op == MDSERVE_INODE) {
+        if (length != sizeof(ino)) {
+            header.status = EINVAL;
+        } else {
+            memcpy(&ino, payload, sizeof(ino));
+            lo = 0;
+            hi = dump.node_count;
+            while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (dump.inodes[mid].ino < ino) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            if (lo == dump.node_count || dump.inodes[lo].ino != ino) {
+                header.status = ENOENT;
+            }
+            for (; ret == 0 && lo < dump.node_count && dump.inodes[lo].ino == ino; lo++) {
+                ret = append_entry(out, &dump.nodes[dump.inodes[lo].node]);
+            }
+        }
+    } else if (op == MDSERVE_BATCH && !nested) {
+        while (ret == 0 && length > 0) {
+            if (length < sizeof(sub)) {
+                header.status = EINVAL;
+                break;
+            }
+            memcpy(&sub, payload, sizeof(sub));
+            if (sub.length > length - sizeof(sub)) {
+                header.status = EINVAL;
+                break;
+            }
+            ret = handle_request(sub.op, payload + sizeof(sub), sub.length, out, true);
+            payload += sizeof(sub) + sub.length;
+            length -= sizeof(sub) + sub.length;
+        }
+    } else {
+        header.status = EINVAL;
+    }
+    if (ret) {
+        return ret;
+    }
+
+    // A failed request carries no payload, except the responses of a batch
+    // before the malformed one
+    if (header.status && op != MDSERVE_BATCH) {
+        out->used = header_at + sizeof(header);
+    }
+    response = (struct mdserve_response *)(out->buff + header_at);
+    response->status = header.status;
+    response->length = out->used - header_at - sizeof(header);
+
+    return 0;
+}
+
+// Returns 1 if the client should be dropped
+int flush_client(
+    struct client *client
+) {
+    ssize_t bytes;
+
+    while (client->sent < client->out.used) {
+        bytes = send(client->fd, client->out.buff + client->sent, client->out.used - client->sent, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : 1;
+        }
+        client->sent += bytes;
+    }
+    client->out.used = 0;
+    client->sent = 0;
+
+    return 0;
+}
+
+void close_client(
+    int idx
+) {
+    close(clients[idx].fd);
+    free(clients[idx].in);
+    free(clients[idx].out.buff);
+    clients[idx] = clients[client_count - 1];
+    pollfds[idx + 1] = pollfds[client_count];
+    client_count--;
+}
+
+int add_client(
+    int fd
+) {
+    struct client *new_clients;
+    struct pollfd *new_pollfds;
+
+    new_clients = realloc(clients, (client_count + 1) * sizeof(*clients));
+    if (new_clients == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    clients = new_clients;
+    new_pollfds = realloc(pollfds, (client_count + 2) * sizeof(*pollfds));
+    if (new_pollfds == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    pollfds = new_pollfds;
+
+    memset(&clients[client_count], 0x00, sizeof(*clients));
+    clients[client_count].fd = fd;
+    pollfds[client_count + 1].fd = fd;
+    pollfds[client_count + 1].events = POLLIN;
+    client_count++;
+
+    return 0;
+}
+
+// Returns -1 on an allocation failure, 1 if the client should be dropped
+int serve_client(
+    struct client *client,
+    struct pollfd *pollfd
+) {
+    int ret;
+    ssize_t bytes;
+    size_t done;
+    char *buff;
+    struct mdserve_request request;
+
+    // Read no more requests until the previous responses are sent
+    if (client->sent < client->out.used) {
+        ret = flush_client(client);
+        pollfd->events = client->sent < client->out.used ? POLLOUT : POLLIN;
+        return ret;
+    }
+
+    if (client->alloc - client->used < RECV_BUFF_SIZE) {
+        buff = realloc(client->in, client->alloc + RECV_BUFF_SIZE);
+        if (buff == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            return -1;
+        }
+        client->in = buff;
+        client->alloc += RECV_BUFF_SIZE;
+    }
+
+    bytes = recv(client->fd, client->in + client->used, client->alloc - client->used, 0);
+    if (bytes <= 0) {
+        return bytes < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : 1;
+    }
+    client->used += bytes;
+
+    // Answer every complete request, several may have arrived at once
+    done = 0;
+    while (client->used - done >= sizeof(request)) {
+        memcpy(&request, client->in + done, sizeof(request));
+        if (request.length > MDSERVE_MAX_REQUEST) {
+            return 1;
+        }
+        if (client->used - done - sizeof(request) < request.length) {
+            break;
+        }
+        ret = handle_request(request.op, client->in + done + sizeof(request), request.length, &client->out, false);
+        if (ret) {
+            return ret;
+        }
+        done += sizeof(request) + request.length;
+    }
+    memmove(client->in, client->in + done, client->used - done);
+    client->used -= done;
+
+    // Make room for the rest of a large request
+    if (client->used >= sizeof(request)) {
+        memcpy(&request, client->in, sizeof(request));
+        if (sizeof(request) + request.length > client->alloc) {
+            buff = realloc(client->in, sizeof(request) + request.length);
+            if (buff == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                return -1;
+            }
+            client->in = buff;
+            client->alloc = sizeof(request) + request.length;
+        }
+    }
+
+    ret = flush_client(client);
+    pollfd->events = client->sent < client->out.used ? POLLOUT : POLLIN;
+
+    return ret;
+}
+
+int open_socket(
+    const char *socketpath
+) {
+    int ret;
+    int fd;
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(socketpath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", socketpath);
+        return -1;
+    }
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketpath);
+
+    // Left behind by a previous run
+    if (lstat(socketpath, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socketpath);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "socket() failed with errno %i\n", errno);
+        return -1;
+    }
+    ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret) {
+        fprintf(stderr, "bind() failed with errno %i for %s\n", errno, socketpath);
+        return -1;
+    }
+    ret = listen(fd, 64);
+    if (ret) {
+        fprintf(stderr, "listen() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return fd;
+}
+
+void handle_signal(
+    int signum
+) {
+    if (signum == SIGHUP) {
+        reload_dump = 1;
+    } else {
+        stop_serving = 1;
+    }
+}
+
+void print_usage(
+    const char *name
+) {
+    fprintf(stderr, "Usage: %s treefile datafile socket\n", name);
+    fprintf(stderr, "Answers the queries of mdserve.h on the Unix socket; SIGHUP reloads the dump,\n");
+    fprintf(stderr, "for instance after metadump --watch compacted it\n");
+}
+
+int main(
+    int argc,
+    char *argv[]
+) {
+    int ret;
+    int fd;
+    const char *treepath;
+    const char *datapath;
+    const char *socketpath;
+    struct dump new_dump;
+    struct sigaction action;
+
+    if (argc != 4) {
+        fprintf(stderr, "Exactly 3 arguments required\n");
+        print_usage(argv[0]);
+        return -1;
+    }
+    treepath = argv[1];
+    datapath = argv[2];
+    socketpath = argv[3];
+
+    path_buff = malloc(PATH_MAX + 1);
+    if (path_buff == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    ret = load_dump(&dump, treepath, datapath);
+    if (ret) {
+        return ret;
+    }
+
+    fd = open_socket(socketpath);
+    if (fd < 0) {
+        return -1;
+    }
+    pollfds = malloc(sizeof(*pollfds));
+    if (pollfds == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    pollfds[0].fd = fd;
+    pollfds[0].events = POLLIN;
+
+    memset(&action, 0x00, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+
+    fprintf(stderr, "Serving %lli entries on %s\n", dump.node_count, socketpath);
+
+    while (!stop_serving) {
+        if (reload_dump) {
+            reload_dump = 0;
+            // Keep serving the old dump if the new one can't be read
+            ret = load_dump(&new_dump, treepath, datapath);
+            if (ret) {
+                free_dump(&new_dump);
+            } else {
+                free_dump(&dump);
+                dump = new_dump;
+                fprintf(stderr, "Reloaded %lli entries\n", dump.node_count);
+            }
+        }
+
+        ret = poll(pollfds, client_count + 1, -1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "poll() failed with errno %i\n", errno);
+            return -1;
+        }
+
+        for (int idx = client_count - 1; idx >= 0; idx--) {
+            if (pollfds[idx + 1].revents == 0) {
+                continue;
+            }
+            ret = serve_client(&clients[idx], &pollfds[idx + 1]);
+            if (ret < 0) {
+                return ret;
+            }
+            if (ret > 0) {
+                close_client(idx);
+            }
+        }
+
+        if (pollfds[0].revents & POLLIN) {
+            ret = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (ret >= 0) {
+                ret = add_client(ret);
+                if (ret) {
+                    return ret;
+                }
+            }
+        }
+    }
+
+    while (client_count > 0) {
+        close_client(client_count - 1);
+    }
+    close(fd);
+    unlink(socketpath);
+    free_dump(&dump);
+    free(clients);
+    free(pollfds);
+    free(path_buff);
+
+    return 0;
+}
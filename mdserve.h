@@ -0,0 +1,43 @@
+#ifndef METADUMP_MDSERVE_H
+#define METADUMP_MDSERVE_H
+
+#include <stdint.h>
+
+// Wire protocol of mdserve, in host byte order since the socket is local.
+// A client sends a request header and its payload and reads back a
+// response header and its payload, any number of times per connection.
+
+#define MDSERVE_LOOKUP 1    // path -> its entry
+#define MDSERVE_INODE 2     // uint64_t inode -> the entries of its links
+#define MDSERVE_LIST 3      // path of a directory -> the entries of its children
+#define MDSERVE_SUMMARY 4   // path -> struct mdserve_summary of its subtree
+#define MDSERVE_BATCH 5     // requests back to back -> their responses back to back
+
+#define MDSERVE_MAX_REQUEST (1024 * 1024)
+
+struct mdserve_request {
+    uint32_t op;
+    uint32_t length;      // of the payload; paths are relative to the root, no NUL
+};
+
+struct mdserve_response {
+    int32_t status;       // 0, or an errno such as ENOENT or EINVAL
+    uint32_t length;
+};
+
+// Followed by the path and the datafile record, as written by metadump
+struct mdserve_entry {
+    uint32_t path_length;
+    uint32_t record_length;
+};
+
+struct mdserve_summary {
+    int64_t files;
+    int64_t dirs;
+    int64_t others;
+    int64_t bytes;        // sum of stx_size
+    int64_t blocks;       // sum of stx_blocks
+    int64_t max_mtime;
+};
+
+#endif /* METADUMP_MDSERVE_H */
@@ -0,0 +1,149 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define COPY_BUFF_SIZE (256 * 1024)
+
+void print_error(
+    const char *func,
+    int ret
+) {
+    fprintf(
+        stderr,
+        "%s() failed with return code %i and errno %i\n",
+        func,
+        ret,
+        errno
+    );
+}
+
+int copy_frame(
+    FILE *streamfile,
+    FILE *outfile,
+    int length,
+    char *buff
+) {
+    int ret;
+    int chunk;
+
+    while (length > 0) {
+        chunk = length < COPY_BUFF_SIZE ? length : COPY_BUFF_SIZE;
+
+        ret = fread(buff, chunk, 1, streamfile);
+        if (ret != 1) {
+            fprintf(stderr, "Truncated frame\n");
+            return -1;
+        }
+
+        ret = fwrite(buff, chunk, 1, outfile);
+        if (ret != 1) {
+            print_error("fwrite", ret);
+            return -1;
+        }
+
+        length -= chunk;
+    }
+
+    return 0;
+}
+
+int main(
+    int argc,
+    char *argv[]
+) {
+    int ret;
+    FILE *streamfile;
+    FILE *treefile;
+    FILE *datafile;
+    FILE *outfile;
+
+    int version[3];
+    int header[2];
+    static char buff[COPY_BUFF_SIZE];
+
+    if (argc != 4) {
+        fprintf(stderr, "Exactly 3 arguments required\n");
+        fprintf(stderr, "Usage: %s stream treefile datafile\n", argv[0]);
+        return -1;
+    }
+
+    if (strcmp(argv[1], "-") == 0) {
+        streamfile = stdin;
+    } else {
+        streamfile = fopen(argv[1], "rb");
+        if (streamfile == NULL) {
+            fprintf(stderr, "Can't open stream %s\n", argv[1]);
+            return -1;
+        }
+    }
+
+    ret = fread(&version, sizeof(version), 1, streamfile);
+    if (ret != 1) {
+        print_error("fread", ret);
+        return -1;
+    }
+    ret = compare_versions(version, VERSION);
+    if (ret) {
+        return ret;
+    }
+
+    treefile = fopen(argv[2], "wb");
+    if (treefile == NULL) {
+        fprintf(stderr, "Can't open treefile %s\n", argv[2]);
+        return -1;
+    }
+
+    datafile = fopen(argv[3], "wb");
+    if (datafile == NULL) {
+        fprintf(stderr, "Can't open datafile %s\n", argv[3]);
+        return -1;
+    }
+
+    for (;;) {
+        ret = fread(header, sizeof(header), 1, streamfile);
+        if (ret != 1) {
+            fprintf(stderr, "Stream ended without an end frame\n");
+            return -1;
+        }
+
+        if (header[0] == STREAM_END) {
+            break;
+        }
+        if (header[0] == STREAM_TREE) {
+            outfile = treefile;
+        } else if (header[0] == STREAM_DATA) {
+            outfile = datafile;
+        } else {
+            fprintf(stderr, "Unknown frame type %i\n", header[0]);
+            return -1;
+        }
+        if (header[1] < 0) {
+            fprintf(stderr, "Invalid frame length %i\n", header[1]);
+            return -1;
+        }
+
+        ret = copy_frame(streamfile, outfile, header[1], buff);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    ret = fclose(treefile);
+    if (ret) {
+        print_error("fclose", ret);
+        return -1;
+    }
+    ret = fclose(datafile);
+    if (ret) {
+        print_error("fclose", ret);
+        return -1;
+    }
+
+    if (streamfile != stdin) {
+        fclose(streamfile);
+    }
+
+    return 0;
+}
@@ -0,0 +1,408 @@
+#include "packed.h"
+
+#include <string.h>
+
+int varint_put(
+    unsigned char *buff,
+    unsigned long long value
+) {
+    int length;
+
+    length = 0;
+    do {
+        buff[length] = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            buff[length] |= 0x80;
+        }
+        length++;
+    } while (value);
+
+    return length;
+}
+
+int zigzag_put(
+    unsigned char *buff,
+    long long value
+) {
+    return varint_put(buff, ((unsigned long long)value << 1) ^ (value >> 63));
+}
+
+int time_put(
+    unsigned char *buff,
+    const struct statx_timestamp *time,
+    const struct statx_timestamp *base
+) {
+    int length;
+
+    length = zigzag_put(buff, time->tv_sec - base->tv_sec);
+    length += zigzag_put(buff + length, (long long)time->tv_nsec - base->tv_nsec);
+
+    return length;
+}
+
+int packed_statx(
+    unsigned char *buff,
+    const struct statx_data *stx
+) {
+    int length;
+    unsigned int mask;
+    struct statx_timestamp zero;
+    const struct statx_timestamp *base;
+
+    buff[0] = PACKED_RECORD;
+    length = 1;
+    length += zigzag_put(buff + length, stx->ret);
+    length += varint_put(buff + length, stx->_errno);
+    if (stx->ret) {
+        return length;
+    }
+
+    mask = stx->buff.stx_mask;
+    length += varint_put(buff + length, mask);
+    length += varint_put(buff + length, stx->buff.stx_blksize);
+    length += varint_put(buff + length, stx->buff.stx_attributes);
+    length += varint_put(buff + length, stx->buff.stx_attributes_mask);
+    if (mask & (STATX_TYPE | STATX_MODE)) {
+        length += varint_put(buff + length, stx->buff.stx_mode);
+    }
+    if (mask & STATX_NLINK) {
+        length += varint_put(buff + length, stx->buff.stx_nlink);
+    }
+    if (mask & STATX_UID) {
+        length += varint_put(buff + length, stx->buff.stx_uid);
+    }
+    if (mask & STATX_GID) {
+        length += varint_put(buff + length, stx->buff.stx_gid);
+    }
+    if (mask & STATX_INO) {
+        length += varint_put(buff + length, stx->buff.stx_ino);
+    }
+    if (mask & STATX_SIZE) {
+        length += varint_put(buff + length, stx->buff.stx_size);
+    }
+    if (mask & STATX_BLOCKS) {
+        length += varint_put(buff + length, stx->buff.stx_blocks);
+    }
+
+    // The other timestamps are usually equal or close to mtime
+    memset(&zero, 0x00, sizeof(zero));
+    base = &zero;
+    if (mask & STATX_MTIME) {
+        length += time_put(buff + length, &stx->buff.stx_mtime, &zero);
+        base = &stx->buff.stx_mtime;
+    }
+    if (mask & STATX_ATIME) {
+        length += time_put(buff + length, &stx->buff.stx_atime, base);
+    }
+    if (mask & STATX_CTIME) {
+        length += time_put(buff + length, &stx->buff.stx_ctime, base);
+    }
+    if (mask & STATX_BTIME) {
+        length += time_put(buff + length, &stx->buff.stx_btime, base);
+    }
+
+    length += varint_put(buff + length, stx->buff.stx_rdev_major);
+    length += varint_put(buff + length, stx->buff.stx_rdev_minor);
+    length += varint_put(buff + length, stx->buff.stx_dev_major);
+    length += varint_put(buff + length, stx->buff.stx_dev_minor);
+#ifdef STATX_MNT_ID
+    if (mask & STATX_MNT_ID) {
+        length += varint_put(buff + length, stx->buff.stx_mnt_id);
+    }
+#endif
+#ifdef STATX_DIOALIGN
+    if (mask & STATX_DIOALIGN) {
+        length += varint_put(buff + length, stx->buff.stx_dio_mem_align);
+        length += varint_put(buff + length, stx->buff.stx_dio_offset_align);
+    }
+#endif
+
+    return length;
+}
+
+int packed_int(
+    unsigned char *buff,
+    int value
+) {
+    return zigzag_put(buff, value);
+}
+
+// Buffers are only filled in by successful calls
+int packed_ioctl(
+    unsigned char *buff,
+    const struct ioctl_data *ioc
+) {
+    int length;
+
+    length = zigzag_put(buff, ioc->flags_ret);
+    length += varint_put(buff + length, ioc->flags_errno);
+    if (ioc->flags_ret == 0) {
+        length += zigzag_put(buff + length, ioc->flags_buff);
+    }
+
+    length += zigzag_put(buff + length, ioc->version_ret);
+    length += varint_put(buff + length, ioc->version_errno);
+    if (ioc->version_ret == 0) {
+        length += zigzag_put(buff + length, ioc->version_buff);
+    }
+
+    length += zigzag_put(buff + length, ioc->xattr_ret);
+    length += varint_put(buff + length, ioc->xattr_errno);
+    if (ioc->xattr_ret == 0) {
+        length += varint_put(buff + length, ioc->xattr_buff.fsx_xflags);
+        length += varint_put(buff + length, ioc->xattr_buff.fsx_extsize);
+        length += varint_put(buff + length, ioc->xattr_buff.fsx_nextents);
+        length += varint_put(buff + length, ioc->xattr_buff.fsx_projid);
+        length += varint_put(buff + length, ioc->xattr_buff.fsx_cowextsize);
+    }
+
+    return length;
+}
+
+// The readers return the number of bytes read, or -1 at the end of the
+// file or on a varint longer than 64 bits
+int varint_get(
+    FILE *file,
+    unsigned long long *value
+) {
+    int byte;
+    int length;
+
+    *value = 0;
+    for (length = 0; length < 10; length++) {
+        byte = getc(file);
+        if (byte == EOF) {
+            return -1;
+        }
+        *value |= (unsigned long long)(byte & 0x7f) << (7 * length);
+        if (!(byte & 0x80)) {
+            return length + 1;
+        }
+    }
+
+    return -1;
+}
+
+int zigzag_get(
+    FILE *file,
+    long long *value
+) {
+    int length;
+    unsigned long long zigzag;
+
+    length = varint_get(file, &zigzag);
+    *value = (zigzag >> 1) ^ -(zigzag & 1);
+
+    return length;
+}
+
+// Adds the length of the varint to *total, or sets it to -1
+void varint_add(
+    FILE *file,
+    unsigned long long *value,
+    int *total
+) {
+    int length;
+
+    if (*total < 0) {
+        *value = 0;
+        return;
+    }
+    length = varint_get(file, value);
+    *total = length < 0 ? -1 : *total + length;
+}
+
+void zigzag_add(
+    FILE *file,
+    long long *value,
+    int *total
+) {
+    int length;
+
+    if (*total < 0) {
+        *value = 0;
+        return;
+    }
+    length = zigzag_get(file, value);
+    *total = length < 0 ? -1 : *total + length;
+}
+
+void time_add(
+    FILE *file,
+    struct statx_timestamp *time,
+    const struct statx_timestamp *base,
+    int *total
+) {
+    long long value;
+
+    zigzag_add(file, &value, total);
+    time->tv_sec = base->tv_sec + value;
+    zigzag_add(file, &value, total);
+    time->tv_nsec = base->tv_nsec + value;
+}
+
+// Reads what follows the PACKED_RECORD byte
+int unpack_statx(
+    FILE *file,
+    struct statx_data *stx
+) {
+    int total;
+    unsigned int mask;
+    long long svalue;
+    unsigned long long value;
+    struct statx_timestamp zero;
+    const struct statx_timestamp *base;
+
+    memset(stx, 0x00, sizeof(*stx));
+    total = 0;
+    zigzag_add(file, &svalue, &total);
+    stx->ret = svalue;
+    varint_add(file, &value, &total);
+    stx->_errno = value;
+    if (stx->ret) {
+        return total;
+    }
+
+    varint_add(file, &value, &total);
+    mask = value;
+    stx->buff.stx_mask = mask;
+    varint_add(file, &value, &total);
+    stx->buff.stx_blksize = value;
+    varint_add(file, &value, &total);
+    stx->buff.stx_attributes = value;
+    varint_add(file, &value, &total);
+    stx->buff.stx_attributes_mask = value;
+    if (mask & (STATX_TYPE | STATX_MODE)) {
+        varint_add(file, &value, &total);
+        stx->buff.stx_mode = value;
+    }
+    if (mask & STATX_NLINK) {
+        varint_add(file, &value, &total);
+        stx->buff.stx_nlink = value;
+    }
+    if (mask & STATX_UID) {
+        varint_add(file, &value, &total);
+        stx->buff.stx_uid = value;
+    }
+    if (mask & STATX_GID) {
+        varint_add(file, &value, &total);
+        stx->buff.stx_gid = value;
+    }
+    if (mask & STATX_INO) {
+        varint_add(file, &value, &total);
+        stx->buff.stx_ino = value;
+    }
+    if (mask & STATX_SIZE) {
+        varint_add(file, &value, &total);
+        stx->buff.stx_size = value;
+    }
+    if (mask & STATX_BLOCKS) {
+        varint_add(file, &value, &total);
+        stx->buff.stx_blocks = value;
+    }
+
+    memset(&zero, 0x00, sizeof(zero));
+    base = &zero;
+    if (mask & STATX_MTIME) {
+        time_add(file, &stx->buff.stx_mtime, &zero, &total);
+        base = &stx->buff.stx_mtime;
+    }
+    if (mask & STATX_ATIME) {
+        time_add(file, &stx->buff.stx_atime, base, &total);
+    }
+    if (mask & STATX_CTIME) {
+        time_add(file, &stx->buff.stx_ctime, base, &total);
+    }
+    if (mask & STATX_BTIME) {
+        time_add(file, &stx->buff.stx_btime, base, &total);
+    }
+
+    varint_add(file, &value, &total);
+    stx->buff.stx_rdev_major = value;
+    varint_add(file, &value, &total);
+    stx->buff.stx_rdev_minor = value;
+    varint_add(file, &value, &total);
+    stx->buff.stx_dev_major = value;
+    varint_add(file, &value, &total);
+    stx->buff.stx_dev_minor = value;
+#ifdef STATX_MNT_ID
+    if (mask & STATX_MNT_ID) {
+        varint_add(file, &value, &total);
+        stx->buff.stx_mnt_id = value;
+    }
+#endif
+#ifdef STATX_DIOALIGN
+    if (mask & STATX_DIOALIGN) {
+        varint_add(file, &value, &total);
+        stx->buff.stx_dio_mem_align = value;
+        varint_add(file, &value, &total);
+        stx->buff.stx_dio_offset_align = value;
+    }
+#endif
+
+    return total;
+}
+
+int unpack_int(
+    FILE *file,
+    int *value
+) {
+    int total;
+    long long svalue;
+
+    total = 0;
+    zigzag_add(file, &svalue, &total);
+    *value = svalue;
+
+    return total;
+}
+
+int unpack_ioctl(
+    FILE *file,
+    struct ioctl_data *ioc
+) {
+    int total;
+    long long svalue;
+    unsigned long long value;
+
+    memset(ioc, 0x00, sizeof(*ioc));
+    total = 0;
+
+    zigzag_add(file, &svalue, &total);
+    ioc->flags_ret = svalue;
+    varint_add(file, &value, &total);
+    ioc->flags_errno = value;
+    if (ioc->flags_ret == 0) {
+        zigzag_add(file, &svalue, &total);
+        ioc->flags_buff = svalue;
+    }
+
+    zigzag_add(file, &svalue, &total);
+    ioc->version_ret = svalue;
+    varint_add(file, &value, &total);
+    ioc->version_errno = value;
+    if (ioc->version_ret == 0) {
+        zigzag_add(file, &svalue, &total);
+        ioc->version_buff = svalue;
+    }
+
+    zigzag_add(file, &svalue, &total);
+    ioc->xattr_ret = svalue;
+    varint_add(file, &value, &total);
+    ioc->xattr_errno = value;
+    if (ioc->xattr_ret == 0) {
+        varint_add(file, &value, &total);
+        ioc->xattr_buff.fsx_xflags = value;
+        varint_add(file, &value, &total);
+        ioc->xattr_buff.fsx_extsize = value;
+        varint_add(file, &value, &total);
+        ioc->xattr_buff.fsx_nextents = value;
+        varint_add(file, &value, &total);
+        ioc->xattr_buff.fsx_projid = value;
+        varint_add(file, &value, &total);
+        ioc->xattr_buff.fsx_cowextsize = value;
+    }
+
+    return total;
+}
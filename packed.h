@@ -0,0 +1,30 @@
+#ifndef METADUMP_PACKED_H
+#define METADUMP_PACKED_H
+
+#include "common.h"
+
+#include <stdio.h>
+
+// A packed record starts with the byte PACKED_RECORD where a plain one has
+// the first byte of statx_data.ret, which is 0 or -1. The statx result and
+// the ioctl results that follow are varints, and only the statx fields
+// stx_mask marks as valid are stored. Timestamps other than mtime are
+// stored as the difference to mtime. The digest and xattrs are as in a
+// plain record, so mdhash can still fill in digests in place.
+
+#define PACKED_MAX_STATX 256
+#define PACKED_MAX_IOCTL 128
+
+int packed_statx(unsigned char *buff, const struct statx_data *stx);
+
+int packed_int(unsigned char *buff, int value);
+
+int packed_ioctl(unsigned char *buff, const struct ioctl_data *ioc);
+
+int unpack_statx(FILE *file, struct statx_data *stx);
+
+int unpack_int(FILE *file, int *value);
+
+int unpack_ioctl(FILE *file, struct ioctl_data *ioc);
+
+#endif /* METADUMP_PACKED_H */
@@ -1,11 +1,17 @@
 #include "common.h"
+#include "hash.h"
+#include "inodes.h"
+#include "packed.h"
 #include "statx-wrapper.h"
+#include "xdict.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <dirent.h>
 #include <errno.h>
 #include <string.h>
+#include <getopt.h>
 #include <openssl/evp.h>
 
 void print_error(
@@ -47,7 +53,7 @@ void print_error(
 int find_file(
     FILE *treefile,
     char *search_path,
-    int *marker
+    long long *marker
 ) {
     int ret;
     int level;
@@ -132,15 +138,23 @@ void check_statx_mask(
 }
 
 int parse_statx(
-    FILE *datafile
+    FILE *datafile,
+    bool packed
 ) {
     int ret;
     struct statx_data stx;
 
-    ret = fread(&stx, sizeof(stx), 1, datafile);
-    if (ret != 1) {
-        print_error("fread", ret);
-        return -1;
+    if (packed) {
+        if (unpack_statx(datafile, &stx) < 0) {
+            fprintf(stderr, "Truncated packed record\n");
+            return -1;
+        }
+    } else {
+        ret = fread(&stx, sizeof(stx), 1, datafile);
+        if (ret != 1) {
+            print_error("fread", ret);
+            return -1;
+        }
     }
 
     if (stx.ret) {
@@ -207,36 +221,167 @@ int parse_statx(
     return 0;
 }
 
-int parse_ioctl_and_md5(
+int parse_digest(
     FILE *datafile
 ) {
     int ret;
-    int open_errno;
-    struct ioctl_data ioc;
-
+    int kind;
     char md_value[EVP_MAX_MD_SIZE];
-    int md_len;
+    unsigned int md_len;
+    long long chunk_size;
+    long long extent_count;
+    long long extent[2];
 
-    ret = fread(&open_errno, sizeof(errno), 1, datafile);
+    ret = fread(&kind, sizeof(kind), 1, datafile);
     if (ret != 1) {
         print_error("fread", ret);
         return -1;
     }
 
-    printf("\nFS_IOC:\n");
+    printf("\n");
 
-    if (open_errno != NO_ERROR) {
-        printf(" Open Error: %i \n", open_errno);
+    if ((kind & DIGEST_KIND_MASK) == DIGEST_NONE) {
+        printf("Message Digest: none\n");
         return 0;
     }
 
-    ret = fread(&ioc, sizeof(ioc), 1, datafile);
+    ret = fread(&md_len, sizeof(md_len), 1, datafile);
     if (ret != 1) {
         print_error("fread", ret);
         return -1;
     }
 
-    if (ioc.flags_ret) {
+    if (kind & DIGEST_SLOT) {
+        // Fixed size slot, filled in place by mdhash
+        if (md_len > (unsigned int)DIGEST_SLOT_MD_SIZE) {
+            printf("md_len invalid\n");
+            return -1;
+        }
+        ret = fread(md_value, DIGEST_SLOT_MD_SIZE, 1, datafile);
+        if (ret != 1) {
+            print_error("fread", ret);
+            return -1;
+        }
+        ret = fread(&chunk_size, sizeof(chunk_size), 1, datafile);
+        if (ret != 1) {
+            print_error("fread", ret);
+            return -1;
+        }
+        if ((kind & DIGEST_KIND_MASK) == DIGEST_PENDING) {
+            printf("Message Digest: pending\n");
+            return 0;
+        }
+        if (md_len == 0) {
+            printf("md_len invalid\n");
+            return -1;
+        }
+    } else {
+        if (md_len > EVP_MAX_MD_SIZE || md_len == 0) {
+            printf("md_len invalid\n");
+            return -1;
+        }
+        ret = fread(md_value, md_len, 1, datafile);
+        if (ret != 1) {
+            print_error("fread", ret);
+            return -1;
+        }
+        if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5_TREE || (kind & DIGEST_KIND_MASK) == DIGEST_MD5_FINGERPRINT) {
+            ret = fread(&chunk_size, sizeof(chunk_size), 1, datafile);
+            if (ret != 1) {
+                print_error("fread", ret);
+                return -1;
+            }
+        }
+    }
+
+    if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5) {
+        printf("MD5 Message Digest: ");
+    } else if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5_SPARSE) {
+        printf("MD5 Message Digest (sparse): ");
+    } else if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5_TREE) {
+        printf("MD5 Tree Digest (%lli byte chunks): ", chunk_size);
+    } else if ((kind & DIGEST_KIND_MASK) == DIGEST_MD5_FINGERPRINT) {
+        printf("MD5 Fingerprint (%lli blocks of %i bytes): ", chunk_size, HASH_FINGERPRINT_BLOCK);
+    } else {
+        printf("Unknown digest kind %i\n", kind & DIGEST_KIND_MASK);
+        return -1;
+    }
+    for (char *byte = md_value; byte != md_value + md_len; byte = byte + 1) {
+        printf("%02x", *byte & 0xff);
+    }
+    printf("\n");
+
+    if (!(kind & DIGEST_EXTENTS)) {
+        return 0;
+    }
+
+    ret = fread(&extent_count, sizeof(extent_count), 1, datafile);
+    if (ret != 1) {
+        print_error("fread", ret);
+        return -1;
+    }
+
+    printf("Data Extents:\t%lli\n", extent_count);
+    for (long long idx = 0; idx < extent_count; idx++) {
+        ret = fread(extent, sizeof(extent), 1, datafile);
+        if (ret != 1) {
+            print_error("fread", ret);
+            return -1;
+        }
+        printf(" %lli+%lli\n", extent[0], extent[1]);
+    }
+
+    return 0;
+}
+
+int parse_ioctl_and_md5(
+    FILE *datafile,
+    bool packed
+) {
+    int ret;
+    int open_errno;
+    struct ioctl_data ioc;
+
+    if (packed) {
+        if (unpack_int(datafile, &open_errno) < 0) {
+            fprintf(stderr, "Truncated packed record\n");
+            return -1;
+        }
+    } else {
+        ret = fread(&open_errno, sizeof(errno), 1, datafile);
+        if (ret != 1) {
+            print_error("fread", ret);
+            return -1;
+        }
+    }
+
+    printf("\nFS_IOC:\n");
+
+    if (open_errno == NOT_ATTEMPTED) {
+        printf(" Open: not attempted - unsupported\n");
+        return 0;
+    }
+    if (open_errno != NO_ERROR) {
+        printf(" Open Error: %i \n", open_errno);
+        return 0;
+    }
+
+    if (packed) {
+        if (unpack_ioctl(datafile, &ioc) < 0) {
+            fprintf(stderr, "Truncated packed record\n");
+            return -1;
+        }
+    } else {
+        ret = fread(&ioc, sizeof(ioc), 1, datafile);
+        if (ret != 1) {
+            print_error("fread", ret);
+            return -1;
+        }
+    }
+
+    if (ioc.flags_ret == NOT_ATTEMPTED) {
+        printf(" FS_IOC_GETFLAGS: not attempted - unsupported\n");
+    } else if (ioc.flags_ret) {
         printf(
             " FS_IOC_GETFLAGS failed with return code %i and errno %i\n",
             ioc.flags_ret,
@@ -254,7 +399,9 @@ int parse_ioctl_and_md5(
         printf("\n");
     }
 
-    if (ioc.version_ret) {
+    if (ioc.version_ret == NOT_ATTEMPTED) {
+        printf(" FS_IOC_GETVERSION: not attempted - unsupported\n");
+    } else if (ioc.version_ret) {
         printf(
             " FS_IOC_GETVERSION failed with return code %i and errno %i\n",
             ioc.version_ret,
@@ -264,7 +411,9 @@ int parse_ioctl_and_md5(
         printf(" GETVERSION:\t%u\n", ioc.version_buff);
     }
 
-    if (ioc.xattr_ret) {
+    if (ioc.xattr_ret == NOT_ATTEMPTED) {
+        printf(" FS_IOC_FSGETXATTR: not attempted - unsupported\n");
+    } else if (ioc.xattr_ret) {
         printf(
             " FS_IOC_FSGETXATTR: failed with return code %i and errno %i\n",
             ioc.xattr_ret,
@@ -279,35 +428,131 @@ int parse_ioctl_and_md5(
         printf("  cowextsize:\t%u\n", ioc.xattr_buff.fsx_cowextsize);
     }
 
-    ret = fread(&md_len, sizeof(md_len), 1, datafile);
-    if (ret != 1) {
-        print_error("fread", ret);
-        return -1;
-    }
+    return parse_digest(datafile);
+}
+
+// Entries are printed as by parse_xattr(), names and values coming from
+// the dictionary or from the record
+int parse_xattr_dict(
+    FILE *datafile,
+    const struct xdict *dict
+) {
+    int ret;
+    int count;
+    int id;
+    int length;
+    ssize_t value_length;
+    int errno_out;
+    char *buff;
 
-    if (md_len > EVP_MAX_MD_SIZE) {
-        printf("md_len too large\n");
+    if (!dict->loaded) {
+        fprintf(stderr, "The record refers to a missing xattr dictionary\n");
         return -1;
     }
 
-    ret = fread(md_value, md_len, 1, datafile);
+    ret = fread(&count, sizeof(count), 1, datafile);
     if (ret != 1) {
         print_error("fread", ret);
         return -1;
     }
 
     printf("\n");
-    printf("MD5 Message Digest: ");
-    for (char *byte = md_value; byte != md_value + md_len; byte = byte + 1) {
-        printf("%02x", *byte & 0xff);
+
+    for (int idx = 0; idx < count; idx++) {
+        ret = fread(&id, sizeof(id), 1, datafile);
+        if (ret != 1) {
+            print_error("fread", ret);
+            return -1;
+        }
+        if (id == XDICT_INLINE) {
+            ret = fread(&length, sizeof(length), 1, datafile);
+            if (ret != 1 || length < 0) {
+                print_error("fread", ret);
+                return -1;
+            }
+            buff = malloc(length + 1);
+            if (buff == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                return -1;
+            }
+            ret = fread(buff, 1, length, datafile);
+            if (ret != length) {
+                print_error("fread", ret);
+                return -1;
+            }
+            buff[length] = '\0';
+            printf(" %s: ", buff);
+            free(buff);
+        } else if (id >= 0 && id < dict->count[XDICT_NAME]) {
+            printf(" %.*s: ", dict->lengths[XDICT_NAME][id], dict->entries[XDICT_NAME][id]);
+        } else {
+            fprintf(stderr, "Invalid xattr name id %i\n", id);
+            return -1;
+        }
+
+        ret = fread(&value_length, sizeof(value_length), 1, datafile);
+        if (ret != 1) {
+            print_error("fread", ret);
+            return -1;
+        }
+        if (value_length == NOT_ATTEMPTED) {
+            printf("not attempted - unsupported\n");
+            continue;
+        }
+        if (value_length < 0) {
+            ret = fread(&errno_out, sizeof(errno_out), 1, datafile);
+            if (ret != 1) {
+                print_error("fread", ret);
+                return -1;
+            }
+            printf("failed with return code %zi and errno %i\n", value_length, errno_out);
+            continue;
+        }
+        if (value_length < 1) {
+            printf("\n");
+            continue;
+        }
+
+        ret = fread(&id, sizeof(id), 1, datafile);
+        if (ret != 1) {
+            print_error("fread", ret);
+            return -1;
+        }
+        if (id == XDICT_INLINE) {
+            buff = malloc(value_length);
+            if (buff == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                return -1;
+            }
+            ret = fread(buff, value_length, 1, datafile);
+            if (ret != 1) {
+                print_error("fread", ret);
+                return -1;
+            }
+        } else if (id >= 0 && id < dict->count[XDICT_VALUE] && dict->lengths[XDICT_VALUE][id] == value_length) {
+            buff = dict->entries[XDICT_VALUE][id];
+        } else {
+            fprintf(stderr, "Invalid xattr value id %i\n", id);
+            return -1;
+        }
+
+        printf("0x");
+        for (char *byte = buff; byte != buff + value_length; byte = byte + 1) {
+            printf("%02x", *byte & 0xff);
+        }
+        printf("\n");
+
+        if (id == XDICT_INLINE) {
+            free(buff);
+        }
     }
-    printf("\n");
 
     return 0;
 }
 
 int parse_xattr(
-    FILE *datafile
+    FILE *datafile,
+    const struct xdict *dict
 ) {
     int ret;
     char *buff0;
@@ -324,6 +569,13 @@ int parse_xattr(
 
     printf("\nExtended Attributes:");
 
+    if (length0 == XATTR_DICT) {
+        return parse_xattr_dict(datafile, dict);
+    }
+    if (length0 == NOT_ATTEMPTED) {
+        printf(" not attempted - unsupported\n");
+        return 0;
+    }
     if (length0 < 0) {
         ret = fread(&errno_out, sizeof(errno_out), 1, datafile);
         if (ret != 1) {
@@ -385,6 +637,10 @@ int parse_xattr(
 
         printf(" %s: ", name);
 
+        if (length1 == NOT_ATTEMPTED) {
+            printf("not attempted - unsupported\n");
+            continue;
+        }
         if (length1 < 0) {
             ret = fread(&errno_out, sizeof(errno_out), 1, datafile);
             if (ret != 1) {
@@ -445,29 +701,26 @@ int parse_xattr(
     return 0;
 }
 
-int main(
-    int argc,
-    char *argv[]
+// Prints the record at datafile_pos
+int parse_record(
+    const char *datapath,
+    long long datafile_pos
 ) {
     int ret;
-    FILE *treefile;
     FILE *datafile;
 
     int version[3];
-    int marker;
-
-    if (argc != 4) {
-        fprintf(stderr, "Exactly 3 arguments required\n");
-        return -1;
-    }
+    int first;
+    bool packed;
+    struct xdict dict;
 
-    treefile = fopen(argv[1], "rb");
-    if (treefile == NULL) {
-        fprintf(stderr, "Can't open treefile %s\n", argv[1]);
+    datafile = fopen(datapath, "rb");
+    if (datafile == NULL) {
+        fprintf(stderr, "Can't open datafile %s\n", datapath);
         return -1;
     }
 
-    ret = fread(&version, sizeof(version), 1, treefile);
+    ret = fread(&version, sizeof(version), 1, datafile);
     if (ret != 1) {
         print_error("fread", ret);
         return -1;
@@ -477,51 +730,225 @@ int main(
         return ret;
     }
 
-    ret = find_file(treefile, argv[3], &marker);
+    ret = fseeko(datafile, datafile_pos - DATA_OFFSET, SEEK_SET);
     if (ret) {
-        return ret;
+        print_error("fseeko", ret);
+        return -1;
     }
 
-    fclose(treefile);
+    // The first byte of a plain record is that of a statx() return code
+    first = getc(datafile);
+    packed = first == PACKED_RECORD;
+    if (!packed) {
+        ungetc(first, datafile);
+    }
 
-    datafile = fopen(argv[2], "rb");
-    if (datafile == NULL) {
-        fprintf(stderr, "Can't open datafile %s\n", argv[2]);
-        return -1;
+    ret = parse_statx(datafile, packed);
+    if (ret) {
+        return ret;
     }
 
-    ret = fread(&version, sizeof(version), 1, datafile);
-    if (ret != 1) {
-        print_error("fread", ret);
-        return -1;
+    ret = parse_ioctl_and_md5(datafile, packed);
+    if (ret) {
+        return ret;
     }
-    ret = compare_versions(version, VERSION);
+
+    ret = xdict_load(&dict, datapath);
     if (ret) {
         return ret;
     }
 
-    ret = fseek(datafile, marker - DATA_OFFSET, SEEK_SET);
+    ret = parse_xattr(datafile, &dict);
     if (ret) {
-        print_error("fseek", ret);
-        return -1;
+        return ret;
     }
 
-    ret = parse_statx(datafile);
+    fclose(datafile);
+    xdict_free(&dict);
+
+    return 0;
+}
+
+// Every path of an inode, from the index written by metadump
+// --inode-index, and its record
+// The same inode number may be in use on several devices of one dump, so
+// the matches are grouped by device, in the order of the index
+int parse_inode(
+    const char *indexpath,
+    const char *datapath,
+    unsigned long long ino,
+    const unsigned int *dev
+) {
+    int ret;
+    struct inodes_match *matches;
+    int match_count;
+    int last;
+    int groups;
+
+    ret = inodes_find(indexpath, ino, &matches, &match_count);
     if (ret) {
+        inodes_free(matches, match_count);
         return ret;
     }
 
-    ret = parse_ioctl_and_md5(datafile);
+    groups = 0;
+    for (int first = 0; first < match_count && ret == 0; first = last) {
+        last = first + 1;
+        while (last < match_count &&
+            matches[last].dev_major == matches[first].dev_major &&
+            matches[last].dev_minor == matches[first].dev_minor) {
+            last++;
+        }
+        if (dev != NULL && (matches[first].dev_major != dev[0] || matches[first].dev_minor != dev[1])) {
+            continue;
+        }
+
+        if (groups > 0) {
+            printf("\n");
+        }
+        printf("Paths:\n");
+        for (int idx = first; idx < last; idx++) {
+            printf(
+                " %02x:%02x\t%s\n",
+                matches[idx].dev_major,
+                matches[idx].dev_minor,
+                matches[idx].path[0] != '\0' ? matches[idx].path : "."
+            );
+        }
+
+        // Hard links share one inode on one device, so one record stands
+        // for all of them
+        ret = parse_record(datapath, matches[first].datafile_pos);
+        groups++;
+    }
+    inodes_free(matches, match_count);
+
+    if (ret == 0 && groups == 0) {
+        fprintf(stderr, "Inode not found!\n");
+        return -1;
+    }
+
+    return ret;
+}
+
+void print_usage(
+    const char *name
+) {
+    fprintf(stderr, "Usage: %s treefile datafile path\n", name);
+    fprintf(stderr, "       %s --inode-index=FILE --inode=N [--dev=MAJ:MIN] treefile datafile\n", name);
+    fprintf(stderr, "  --inode-index=FILE\n");
+    fprintf(stderr, "                the index written by metadump --inode-index\n");
+    fprintf(stderr, "  --inode=N     print every path of inode N and its record, once per device\n");
+    fprintf(stderr, "  --dev=MAJ:MIN only the inode on this device, in hex as parse prints it\n");
+}
+
+int main(
+    int argc,
+    char *argv[]
+) {
+    int ret;
+    int opt;
+    FILE *treefile;
+    const char *indexpath;
+    const char *inode;
+    char *end;
+    unsigned long long ino;
+    unsigned int dev[2];
+    bool use_dev;
+    int length;
+
+    int version[3];
+    long long marker;
+
+    const struct option long_options[] = {
+        {"inode-index", required_argument, NULL, 'i'},
+        {"inode", required_argument, NULL, 'n'},
+        {"dev", required_argument, NULL, 'd'},
+        {NULL, 0, NULL, 0}
+    };
+
+    indexpath = NULL;
+    inode = NULL;
+    use_dev = false;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'i':
+            indexpath = optarg;
+            break;
+        case 'n':
+            inode = optarg;
+            break;
+        case 'd':
+            length = 0;
+            if (sscanf(optarg, "%x:%x%n", &dev[0], &dev[1], &length) != 2 || optarg[length] != '\0') {
+                fprintf(stderr, "Invalid device %s\n", optarg);
+                return -1;
+            }
+            use_dev = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (inode != NULL) {
+        if (indexpath == NULL) {
+            fprintf(stderr, "--inode needs --inode-index\n");
+            return -1;
+        }
+        if (argc - optind != 2) {
+            fprintf(stderr, "Exactly 2 arguments required\n");
+            print_usage(argv[0]);
+            return -1;
+        }
+        errno = 0;
+        ino = strtoull(inode, &end, 0);
+        if (errno || *end != '\0' || end == inode) {
+            fprintf(stderr, "Invalid inode number %s\n", inode);
+            return -1;
+        }
+        return parse_inode(indexpath, argv[optind + 1], ino, use_dev ? dev : NULL);
+    }
+
+    if (use_dev) {
+        fprintf(stderr, "--dev needs --inode\n");
+        return -1;
+    }
+
+    if (argc - optind != 3) {
+        fprintf(stderr, "Exactly 3 arguments required\n");
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    treefile = fopen(argv[optind], "rb");
+    if (treefile == NULL) {
+        fprintf(stderr, "Can't open treefile %s\n", argv[optind]);
+        return -1;
+    }
+
+    ret = fread(&version, sizeof(version), 1, treefile);
+    if (ret != 1) {
+        print_error("fread", ret);
+        return -1;
+    }
+    ret = compare_versions(version, VERSION);
     if (ret) {
         return ret;
     }
 
-    ret = parse_xattr(datafile);
+    ret = find_file(treefile, argv[optind + 2], &marker);
     if (ret) {
         return ret;
     }
 
-    fclose(datafile);
+    fclose(treefile);
 
-    return 0;
+    if (marker == MARKER_PRUNED) {
+        printf("Pruned by the crawl rules, no record\n");
+        return 0;
+    }
+
+    return parse_record(argv[optind + 1], marker);
 }
@@ -0,0 +1,101 @@
+#include "pathmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+size_t pathmap_hash(
+    const char *key
+) {
+    unsigned long long hash;
+
+    hash = 14695981039346656037ULL;
+    for (const char *c = key; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+struct pathmap_entry *pathmap_slot(
+    const struct pathmap *map,
+    const char *key
+) {
+    size_t idx;
+
+    idx = pathmap_hash(key) & (map->alloc - 1);
+    while (map->entries[idx].key != NULL && strcmp(map->entries[idx].key, key) != 0) {
+        idx = (idx + 1) & (map->alloc - 1);
+    }
+
+    return &map->entries[idx];
+}
+
+long long *pathmap_get(
+    const struct pathmap *map,
+    const char *key
+) {
+    struct pathmap_entry *slot;
+
+    if (map->alloc == 0) {
+        return NULL;
+    }
+
+    slot = pathmap_slot(map, key);
+    return slot->key != NULL ? &slot->value : NULL;
+}
+
+// Returns the value of key, inserted as 0 if it was missing
+long long *pathmap_put(
+    struct pathmap *map,
+    const char *key
+) {
+    struct pathmap_entry *old_entries;
+    size_t old_alloc;
+    struct pathmap_entry *slot;
+
+    // Keep the load factor under 1/2
+    if (2 * (map->used + 1) > map->alloc) {
+        old_entries = map->entries;
+        old_alloc = map->alloc;
+
+        map->alloc = old_alloc ? 2 * old_alloc : 1024;
+        map->entries = calloc(map->alloc, sizeof(*map->entries));
+        if (map->entries == NULL) {
+            fprintf(stderr, "calloc() failed with errno %i\n", errno);
+            map->entries = old_entries;
+            map->alloc = old_alloc;
+            return NULL;
+        }
+        for (size_t idx = 0; idx < old_alloc; idx++) {
+            if (old_entries[idx].key != NULL) {
+                *pathmap_slot(map, old_entries[idx].key) = old_entries[idx];
+            }
+        }
+        free(old_entries);
+    }
+
+    slot = pathmap_slot(map, key);
+    if (slot->key == NULL) {
+        slot->key = strdup(key);
+        if (slot->key == NULL) {
+            fprintf(stderr, "strdup() failed with errno %i\n", errno);
+            return NULL;
+        }
+        slot->value = 0;
+        map->used++;
+    }
+
+    return &slot->value;
+}
+
+void pathmap_free(
+    struct pathmap *map
+) {
+    for (size_t idx = 0; idx < map->alloc; idx++) {
+        free(map->entries[idx].key);
+    }
+    free(map->entries);
+    memset(map, 0x00, sizeof(*map));
+}
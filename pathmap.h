@@ -0,0 +1,24 @@
+#ifndef METADUMP_PATHMAP_H
+#define METADUMP_PATHMAP_H
+
+#include <stddef.h>
+
+struct pathmap_entry {
+    char *key;            // NULL for an empty slot
+    long long value;
+};
+
+// Open-addressing map from paths to integers, zero-initialised when empty
+struct pathmap {
+    struct pathmap_entry *entries;
+    size_t alloc;
+    size_t used;
+};
+
+long long *pathmap_get(const struct pathmap *map, const char *key);
+
+long long *pathmap_put(struct pathmap *map, const char *key);
+
+void pathmap_free(struct pathmap *map);
+
+#endif /* METADUMP_PATHMAP_H */
@@ -0,0 +1,624 @@
+#define _GNU_SOURCE
+
+#include "reader.h"
+#include "packed.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define TREE_BUFF_SIZE (1024 * 1024)
+#define DATA_BUFF_SIZE (256 * 1024)
+
+int grow_buff(
+    void **buff,
+    size_t *alloc,
+    size_t needed,
+    size_t item_size
+) {
+    void *new_buff;
+    size_t new_alloc;
+
+    if (needed <= *alloc) {
+        return 0;
+    }
+
+    new_alloc = *alloc * 2 > needed ? *alloc * 2 : needed;
+    new_buff = realloc(*buff, new_alloc * item_size);
+    if (new_buff == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    *buff = new_buff;
+    *alloc = new_alloc;
+
+    return 0;
+}
+
+int tree_walk_open(
+    struct tree_walk *walk,
+    const char *treepath
+) {
+    int ret;
+    int version[3];
+
+    memset(walk, 0x00, sizeof(*walk));
+    walk->entry = -1;
+
+    walk->treefile = fopen(treepath, "rb");
+    if (walk->treefile == NULL) {
+        fprintf(stderr, "Can't open treefile %s\n", treepath);
+        return -1;
+    }
+    setvbuf(walk->treefile, NULL, _IOFBF, TREE_BUFF_SIZE);
+
+    ret = fread(&version, sizeof(version), 1, walk->treefile);
+    if (ret != 1) {
+        fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    walk->offset = sizeof(version);
+
+    return compare_versions(version, VERSION);
+}
+
+int tree_walk_next(
+    struct tree_walk *walk
+) {
+    int ret;
+    long long token;
+    int markers;
+    size_t parent_end;
+    size_t name_length;
+
+    // Only a dumped directory is followed by MARKER_START
+    walk->opened_dir = false;
+    markers = 0;
+    for (;;) {
+        if (walk->end > 0 && walk->offset >= walk->end) {
+            return 0;
+        }
+        ret = fread(&token, sizeof(token), 1, walk->treefile);
+        if (ret != 1) {
+            if (feof(walk->treefile)) {
+                return 0;
+            }
+            fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+            return -1;
+        }
+        walk->offset += sizeof(token);
+
+        if (token == MARKER_START) {
+            walk->opened_dir = markers == 0;
+            markers++;
+            walk->level++;
+            continue;
+        }
+        if (token == MARKER_END) {
+            markers++;
+            walk->level--;
+            continue;
+        }
+
+        ret = fread(&walk->de, sizeof(walk->de), 1, walk->treefile);
+        if (ret != 1) {
+            fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+            return -1;
+        }
+        walk->offset += sizeof(walk->de);
+        if (token != MARKER_PRUNED || walk->keep_pruned) {
+            break;
+        }
+    }
+
+    walk->pruned = token == MARKER_PRUNED;
+    walk->pos = walk->pruned ? 0 : token;
+    if (!walk->pruned) {
+        walk->entry++;
+    }
+
+    // Entries at level L are children of the last entry seen at level L-1
+    ret = grow_buff((void **)&walk->path_ends, &walk->path_ends_alloc, walk->level + 1, sizeof(*walk->path_ends));
+    if (ret) {
+        return ret;
+    }
+
+    parent_end = walk->level > 1 ? walk->path_ends[walk->level - 1] : 0;
+    name_length = strlen(walk->de.d_name);
+
+    ret = grow_buff((void **)&walk->path, &walk->path_alloc, parent_end + name_length + 2, 1);
+    if (ret) {
+        return ret;
+    }
+
+    if (parent_end > 0) {
+        walk->path[parent_end] = '/';
+        parent_end++;
+    }
+    memcpy(walk->path + parent_end, walk->de.d_name, name_length + 1);
+    walk->path_ends[walk->level] = parent_end + name_length;
+
+    return 1;
+}
+
+void tree_walk_close(
+    struct tree_walk *walk
+) {
+    if (walk->treefile != NULL) {
+        fclose(walk->treefile);
+    }
+    free(walk->path);
+    free(walk->path_ends);
+    memset(walk, 0x00, sizeof(*walk));
+}
+
+int data_reader_open(
+    struct data_reader *reader,
+    const char *datapath
+) {
+    int ret;
+    int version[3];
+
+    memset(&reader->dict, 0x00, sizeof(reader->dict));
+    reader->datafile = fopen(datapath, "rb");
+    if (reader->datafile == NULL) {
+        fprintf(stderr, "Can't open datafile %s\n", datapath);
+        return -1;
+    }
+    setvbuf(reader->datafile, NULL, _IOFBF, DATA_BUFF_SIZE);
+
+    ret = fread(&version, sizeof(version), 1, reader->datafile);
+    if (ret != 1) {
+        fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    reader->offset = sizeof(version);
+
+    ret = compare_versions(version, VERSION);
+    if (ret) {
+        return ret;
+    }
+
+    return xdict_load(&reader->dict, datapath);
+}
+
+int read_field(
+    struct data_reader *reader,
+    void *buff,
+    size_t length
+) {
+    int ret;
+
+    if (length == 0) {
+        return 0;
+    }
+
+    ret = fread(buff, length, 1, reader->datafile);
+    if (ret != 1) {
+        fprintf(stderr, "Truncated record at offset %lli\n", reader->offset);
+        return -1;
+    }
+    reader->offset += length;
+
+    return 0;
+}
+
+// Names are looked up first and pointed at once the buffers stop moving
+int read_xattrs_dict(
+    struct data_reader *reader,
+    struct md_record *rec
+) {
+    int ret;
+    int count;
+    int id;
+    int length;
+    size_t names_used;
+    size_t values_used;
+    const struct xdict *dict = &reader->dict;
+    struct md_xattr *xattr;
+    char *name;
+
+    if (!dict->loaded) {
+        fprintf(stderr, "Record at offset %lli refers to a missing xattr dictionary\n", reader->offset);
+        return -1;
+    }
+
+    ret = read_field(reader, &count, sizeof(count));
+    if (ret) {
+        return ret;
+    }
+    if (count < 0) {
+        fprintf(stderr, "xattr count invalid at offset %lli\n", reader->offset);
+        return -1;
+    }
+    ret = grow_buff((void **)&rec->xattrs, &rec->xattrs_alloc, count, sizeof(*rec->xattrs));
+    if (ret) {
+        return ret;
+    }
+
+    names_used = 0;
+    values_used = 0;
+    for (int idx = 0; idx < count; idx++) {
+        ret = read_field(reader, &id, sizeof(id));
+        if (ret) {
+            return ret;
+        }
+        if (id == XDICT_INLINE) {
+            ret = read_field(reader, &length, sizeof(length));
+            if (ret) {
+                return ret;
+            }
+        } else if (id >= 0 && id < dict->count[XDICT_NAME]) {
+            length = dict->lengths[XDICT_NAME][id];
+        } else {
+            length = -1;
+        }
+        if (length < 0) {
+            fprintf(stderr, "xattr name invalid at offset %lli\n", reader->offset);
+            return -1;
+        }
+
+        ret = grow_buff((void **)&rec->xattr_names, &rec->xattr_names_alloc, names_used + length + 1, 1);
+        if (ret) {
+            return ret;
+        }
+        if (id == XDICT_INLINE) {
+            ret = read_field(reader, rec->xattr_names + names_used, length);
+            if (ret) {
+                return ret;
+            }
+        } else {
+            memcpy(rec->xattr_names + names_used, dict->entries[XDICT_NAME][id], length);
+        }
+        rec->xattr_names[names_used + length] = '\0';
+        names_used += length + 1;
+
+        xattr = &rec->xattrs[idx];
+        xattr->_errno = 0;
+        xattr->value = NULL;
+        ret = read_field(reader, &xattr->length, sizeof(xattr->length));
+        if (ret) {
+            return ret;
+        }
+        if (xattr->length < 0 && xattr->length != NOT_ATTEMPTED) {
+            ret = read_field(reader, &xattr->_errno, sizeof(xattr->_errno));
+            if (ret) {
+                return ret;
+            }
+        }
+        if (xattr->length < 1) {
+            continue;
+        }
+
+        ret = read_field(reader, &id, sizeof(id));
+        if (ret) {
+            return ret;
+        }
+        if (id != XDICT_INLINE && (id < 0 || id >= dict->count[XDICT_VALUE] || dict->lengths[XDICT_VALUE][id] != xattr->length)) {
+            fprintf(stderr, "xattr value invalid at offset %lli\n", reader->offset);
+            return -1;
+        }
+        ret = grow_buff((void **)&rec->xattr_values, &rec->xattr_values_alloc, values_used + xattr->length, 1);
+        if (ret) {
+            return ret;
+        }
+        if (id == XDICT_INLINE) {
+            ret = read_field(reader, rec->xattr_values + values_used, xattr->length);
+            if (ret) {
+                return ret;
+            }
+        } else {
+            memcpy(rec->xattr_values + values_used, dict->entries[XDICT_VALUE][id], xattr->length);
+        }
+        xattr->value_offset = values_used;
+        values_used += xattr->length;
+    }
+
+    rec->xattr_length = names_used;
+    rec->xattr_count = count;
+    name = rec->xattr_names;
+    for (int idx = 0; idx < count; idx++) {
+        rec->xattrs[idx].name = name;
+        name = strchr(name, '\0') + 1;
+        if (rec->xattrs[idx].length > 0) {
+            rec->xattrs[idx].value = rec->xattr_values + rec->xattrs[idx].value_offset;
+        }
+    }
+
+    return 0;
+}
+
+int read_xattrs(
+    struct data_reader *reader,
+    struct md_record *rec
+) {
+    int ret;
+    size_t values_used;
+    struct md_xattr *xattr;
+
+    rec->xattr_count = 0;
+    rec->xattr_errno = 0;
+
+    // Both the probing and the actual llistxattr() call are recorded
+    for (int call = 0; call < 2; call++) {
+        ret = read_field(reader, &rec->xattr_length, sizeof(rec->xattr_length));
+        if (ret) {
+            return ret;
+        }
+        if (call == 0 && rec->xattr_length == XATTR_DICT) {
+            return read_xattrs_dict(reader, rec);
+        }
+        if (rec->xattr_length == NOT_ATTEMPTED) {
+            return 0;
+        }
+        if (rec->xattr_length < 0) {
+            return read_field(reader, &rec->xattr_errno, sizeof(rec->xattr_errno));
+        }
+        if (rec->xattr_length < 1) {
+            return 0;
+        }
+    }
+
+    ret = grow_buff((void **)&rec->xattr_names, &rec->xattr_names_alloc, rec->xattr_length + 1, 1);
+    if (ret) {
+        return ret;
+    }
+    ret = read_field(reader, rec->xattr_names, rec->xattr_length);
+    if (ret) {
+        return ret;
+    }
+    rec->xattr_names[rec->xattr_length] = '\0';
+
+    values_used = 0;
+    for (char *name = rec->xattr_names; name < rec->xattr_names + rec->xattr_length; name = strchr(name, '\0') + 1) {
+        if (name[0] == '\0') {
+            continue;
+        }
+
+        ret = grow_buff((void **)&rec->xattrs, &rec->xattrs_alloc, rec->xattr_count + 1, sizeof(*rec->xattrs));
+        if (ret) {
+            return ret;
+        }
+
+        xattr = &rec->xattrs[rec->xattr_count++];
+        xattr->name = name;
+        xattr->_errno = 0;
+        xattr->value = NULL;
+
+        for (int call = 0; call < 2; call++) {
+            ret = read_field(reader, &xattr->length, sizeof(xattr->length));
+            if (ret) {
+                return ret;
+            }
+            if (xattr->length < 1) {
+                break;
+            }
+        }
+        if (xattr->length < 0 && xattr->length != NOT_ATTEMPTED) {
+            ret = read_field(reader, &xattr->_errno, sizeof(xattr->_errno));
+            if (ret) {
+                return ret;
+            }
+        }
+        if (xattr->length < 1) {
+            continue;
+        }
+
+        ret = grow_buff((void **)&rec->xattr_values, &rec->xattr_values_alloc, values_used + xattr->length, 1);
+        if (ret) {
+            return ret;
+        }
+        ret = read_field(reader, rec->xattr_values + values_used, xattr->length);
+        if (ret) {
+            return ret;
+        }
+        xattr->value_offset = values_used;
+        values_used += xattr->length;
+    }
+
+    // The values buffer may have moved while growing
+    for (int idx = 0; idx < rec->xattr_count; idx++) {
+        if (rec->xattrs[idx].length > 0) {
+            rec->xattrs[idx].value = rec->xattr_values + rec->xattrs[idx].value_offset;
+        }
+    }
+
+    return 0;
+}
+
+int read_digest(
+    struct data_reader *reader,
+    struct md_record *rec
+) {
+    int ret;
+
+    rec->md_len = 0;
+    rec->chunk_size = 0;
+    rec->extent_count = 0;
+
+    rec->digest_offset = reader->offset;
+    ret = read_field(reader, &rec->digest_kind, sizeof(rec->digest_kind));
+    if (ret) {
+        return ret;
+    }
+    if ((rec->digest_kind & DIGEST_KIND_MASK) == DIGEST_NONE) {
+        return 0;
+    }
+
+    ret = read_field(reader, &rec->md_len, sizeof(rec->md_len));
+    if (ret) {
+        return ret;
+    }
+    if (rec->md_len > EVP_MAX_MD_SIZE) {
+        fprintf(stderr, "md_len invalid at offset %lli\n", reader->offset);
+        return -1;
+    }
+
+    if (rec->digest_kind & DIGEST_SLOT) {
+        if (rec->md_len > (unsigned int)DIGEST_SLOT_MD_SIZE) {
+            fprintf(stderr, "md_len invalid at offset %lli\n", reader->offset);
+            return -1;
+        }
+        ret = read_field(reader, rec->md_value, DIGEST_SLOT_MD_SIZE);
+        if (ret) {
+            return ret;
+        }
+        return read_field(reader, &rec->chunk_size, sizeof(rec->chunk_size));
+    }
+
+    ret = read_field(reader, rec->md_value, rec->md_len);
+    if (ret) {
+        return ret;
+    }
+
+    if ((rec->digest_kind & DIGEST_KIND_MASK) == DIGEST_MD5_TREE ||
+        (rec->digest_kind & DIGEST_KIND_MASK) == DIGEST_MD5_FINGERPRINT) {
+        ret = read_field(reader, &rec->chunk_size, sizeof(rec->chunk_size));
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (!(rec->digest_kind & DIGEST_EXTENTS)) {
+        return 0;
+    }
+
+    ret = read_field(reader, &rec->extent_count, sizeof(rec->extent_count));
+    if (ret) {
+        return ret;
+    }
+    if (rec->extent_count < 0) {
+        fprintf(stderr, "extent count invalid at offset %lli\n", reader->offset);
+        return -1;
+    }
+    ret = grow_buff((void **)&rec->extents, &rec->extent_alloc, 2 * rec->extent_count, sizeof(*rec->extents));
+    if (ret) {
+        return ret;
+    }
+
+    return read_field(reader, rec->extents, 2 * rec->extent_count * sizeof(*rec->extents));
+}
+
+// Reads the statx and ioctl results of a packed record, after its first
+// byte
+int read_packed(
+    struct data_reader *reader,
+    struct md_record *rec
+) {
+    int length;
+
+    length = unpack_statx(reader->datafile, &rec->stx);
+    if (length < 0) {
+        fprintf(stderr, "Truncated record at offset %lli\n", reader->offset);
+        return -1;
+    }
+    reader->offset += length;
+
+    length = unpack_int(reader->datafile, &rec->open_errno);
+    if (length < 0) {
+        fprintf(stderr, "Truncated record at offset %lli\n", reader->offset);
+        return -1;
+    }
+    reader->offset += length;
+
+    memset(&rec->ioc, 0x00, sizeof(rec->ioc));
+    if (rec->open_errno != NO_ERROR) {
+        return 0;
+    }
+    length = unpack_ioctl(reader->datafile, &rec->ioc);
+    if (length < 0) {
+        fprintf(stderr, "Truncated record at offset %lli\n", reader->offset);
+        return -1;
+    }
+    reader->offset += length;
+
+    return 0;
+}
+
+int data_reader_read(
+    struct data_reader *reader,
+    long long pos,
+    struct md_record *rec
+) {
+    int ret;
+    long long offset;
+
+    // Records are usually read in the order they were written, and a
+    // seek would throw away the stdio buffer
+    offset = pos - DATA_OFFSET;
+    if (offset != reader->offset) {
+        ret = fseeko(reader->datafile, offset, SEEK_SET);
+        if (ret) {
+            fprintf(stderr, "fseeko() failed with errno %i\n", errno);
+            return -1;
+        }
+        reader->offset = offset;
+    }
+    rec->offset = offset;
+
+    ret = getc(reader->datafile);
+    if (ret == PACKED_RECORD) {
+        reader->offset++;
+        ret = read_packed(reader, rec);
+        if (ret) {
+            return ret;
+        }
+    } else {
+        ungetc(ret, reader->datafile);
+        ret = read_field(reader, &rec->stx, sizeof(rec->stx));
+        if (ret) {
+            return ret;
+        }
+        ret = read_field(reader, &rec->open_errno, sizeof(rec->open_errno));
+        if (ret) {
+            return ret;
+        }
+        memset(&rec->ioc, 0x00, sizeof(rec->ioc));
+        if (rec->open_errno == NO_ERROR) {
+            ret = read_field(reader, &rec->ioc, sizeof(rec->ioc));
+            if (ret) {
+                return ret;
+            }
+        }
+    }
+
+    rec->digest_kind = DIGEST_NONE;
+    rec->md_len = 0;
+    rec->extent_count = 0;
+    if (rec->open_errno == NO_ERROR) {
+        ret = read_digest(reader, rec);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    ret = read_xattrs(reader, rec);
+    if (ret) {
+        return ret;
+    }
+
+    rec->length = reader->offset - offset;
+
+    return 0;
+}
+
+void data_reader_close(
+    struct data_reader *reader
+) {
+    if (reader->datafile != NULL) {
+        fclose(reader->datafile);
+    }
+    reader->datafile = NULL;
+    xdict_free(&reader->dict);
+}
+
+void record_free(
+    struct md_record *rec
+) {
+    free(rec->extents);
+    free(rec->xattrs);
+    free(rec->xattr_names);
+    free(rec->xattr_values);
+    memset(rec, 0x00, sizeof(*rec));
+}
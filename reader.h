@@ -0,0 +1,83 @@
+#ifndef METADUMP_READER_H
+#define METADUMP_READER_H
+
+#include "common.h"
+#include "xdict.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+
+struct tree_walk {
+    FILE *treefile;
+    long long offset;     // treefile offset of the next token
+    long long end;        // offset to stop at, 0 for the end of the treefile
+    int level;
+    bool opened_dir;      // the previous entry is a directory whose children were dumped
+    bool keep_pruned;     // return pruned stubs instead of skipping them
+    bool pruned;          // the current entry is a stub, with no record
+    long long entry;      // index of the current entry in tree order, stubs not counted
+    long long pos;        // datafile_pos of the current entry
+    struct dirent de;
+    char *path;           // path of the current entry relative to the root
+    size_t path_alloc;
+    size_t *path_ends;    // length of the path of the last entry at each level
+    size_t path_ends_alloc;
+};
+
+struct md_xattr {
+    char *name;
+    ssize_t length;       // value length, or < 0 on error
+    int _errno;
+    char *value;
+    size_t value_offset;
+};
+
+struct md_record {
+    long long offset;     // byte offset of the record in the datafile
+    long long length;     // length of the record in bytes
+    struct statx_data stx;
+    int open_errno;
+    struct ioctl_data ioc;
+    long long digest_offset; // byte offset of the digest kind in the datafile
+    int digest_kind;
+    unsigned int md_len;
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+    long long chunk_size;
+    long long extent_count;
+    long long *extents;
+    size_t extent_alloc;
+    ssize_t xattr_length; // length of the name list, or < 0 on error
+    int xattr_errno;
+    int xattr_count;
+    struct md_xattr *xattrs;
+    size_t xattrs_alloc;
+    char *xattr_names;
+    size_t xattr_names_alloc;
+    char *xattr_values;
+    size_t xattr_values_alloc;
+};
+
+struct data_reader {
+    FILE *datafile;
+    long long offset;
+    struct xdict dict;    // empty unless the datafile has one
+};
+
+int tree_walk_open(struct tree_walk *walk, const char *treepath);
+
+int tree_walk_next(struct tree_walk *walk);
+
+void tree_walk_close(struct tree_walk *walk);
+
+int data_reader_open(struct data_reader *reader, const char *datapath);
+
+int data_reader_read(struct data_reader *reader, long long pos, struct md_record *rec);
+
+void data_reader_close(struct data_reader *reader);
+
+void record_free(struct md_record *rec);
+
+#endif /* METADUMP_READER_H */
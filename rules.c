@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+
+#include "rules.h"
+#include "pathmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+enum rule_kind {
+    RULE_NAME,            // literal name, found by hashing
+    RULE_NAME_GLOB,
+    RULE_PATH_GLOB,
+    RULE_REGEX
+};
+
+struct rule {
+    bool include;
+    enum rule_kind kind;
+    char *pattern;
+    regex_t regex;
+};
+
+struct rule *rules;
+int rule_count;
+
+// Literal names map to their first rule, the other rules are tried in order
+// only as long as they come before the best match so far
+struct pathmap rule_names;
+int *pattern_rules;
+int pattern_rule_count;
+
+int rules_add(
+    bool include,
+    const char *pattern
+) {
+    int ret;
+    struct rule *new_rules;
+    struct rule *rule;
+    char message[256];
+
+    new_rules = realloc(rules, (rule_count + 1) * sizeof(*rules));
+    if (new_rules == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    rules = new_rules;
+    rule = &rules[rule_count];
+    rule->include = include;
+
+    if (strncmp(pattern, "re:", 3) == 0) {
+        rule->kind = RULE_REGEX;
+        pattern += 3;
+        ret = regcomp(&rule->regex, pattern, REG_EXTENDED | REG_NOSUB);
+        if (ret) {
+            regerror(ret, &rule->regex, message, sizeof(message));
+            fprintf(stderr, "Invalid regex %s: %s\n", pattern, message);
+            return -1;
+        }
+    } else if (strchr(pattern, '/') != NULL) {
+        rule->kind = RULE_PATH_GLOB;
+        while (*pattern == '/') {
+            pattern++;
+        }
+    } else if (strpbrk(pattern, "*?[\\") != NULL) {
+        rule->kind = RULE_NAME_GLOB;
+    } else {
+        rule->kind = RULE_NAME;
+    }
+    if (*pattern == '\0') {
+        fprintf(stderr, "Empty pattern\n");
+        return -1;
+    }
+
+    rule->pattern = strdup(pattern);
+    if (rule->pattern == NULL) {
+        fprintf(stderr, "strdup() failed with errno %i\n", errno);
+        return -1;
+    }
+    rule_count++;
+
+    return 0;
+}
+
+// Lines are "- PATTERN" to exclude and "+ PATTERN" to include; blank
+// lines and lines starting with '#' are skipped
+int rules_load(
+    const char *rulespath
+) {
+    int ret;
+    int line_number;
+    FILE *rulesfile;
+    char *line;
+    size_t length;
+    ssize_t bytes;
+
+    rulesfile = fopen(rulespath, "r");
+    if (rulesfile == NULL) {
+        fprintf(stderr, "Can't open rules file %s\n", rulespath);
+        return -1;
+    }
+
+    ret = 0;
+    line = NULL;
+    length = 0;
+    line_number = 0;
+    while (ret == 0 && (bytes = getline(&line, &length, rulesfile)) != -1) {
+        line_number++;
+        if (bytes > 0 && line[bytes - 1] == '\n') {
+            line[--bytes] = '\0';
+        }
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (bytes < 3 || (line[0] != '-' && line[0] != '+') || line[1] != ' ') {
+            fprintf(stderr, "Invalid rule at %s:%i\n", rulespath, line_number);
+            ret = -1;
+            break;
+        }
+        ret = rules_add(line[0] == '+', line + 2);
+    }
+
+    free(line);
+    fclose(rulesfile);
+
+    return ret;
+}
+
+int rules_compile(void) {
+    long long *first;
+
+    pattern_rules = malloc(rule_count * sizeof(*pattern_rules));
+    if (pattern_rules == NULL && rule_count > 0) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    for (int idx = 0; idx < rule_count; idx++) {
+        if (rules[idx].kind != RULE_NAME) {
+            pattern_rules[pattern_rule_count++] = idx;
+            continue;
+        }
+        if (pathmap_get(&rule_names, rules[idx].pattern) != NULL) {
+            continue;
+        }
+        first = pathmap_put(&rule_names, rules[idx].pattern);
+        if (first == NULL) {
+            return -1;
+        }
+        *first = idx;
+    }
+
+    return 0;
+}
+
+bool rule_matches(
+    const struct rule *rule,
+    const char *relpath,
+    const char *name
+) {
+    switch (rule->kind) {
+    case RULE_NAME:
+        return strcmp(rule->pattern, name) == 0;
+    case RULE_NAME_GLOB:
+        return fnmatch(rule->pattern, name, 0) == 0;
+    case RULE_PATH_GLOB:
+        return fnmatch(rule->pattern, relpath, FNM_PATHNAME) == 0;
+    case RULE_REGEX:
+        return regexec(&rule->regex, relpath, 0, NULL, 0) == 0;
+    }
+
+    return false;
+}
+
+// Decides on one entry, whose parent was crawled, by its path relative to
+// the root and its name
+bool rules_excluded(
+    const char *relpath,
+    const char *name
+) {
+    int best;
+    int idx;
+    long long *first;
+
+    if (rule_count == 0) {
+        return false;
+    }
+
+    best = rule_count;
+    first = pathmap_get(&rule_names, name);
+    if (first != NULL) {
+        best = *first;
+    }
+    for (int pattern = 0; pattern < pattern_rule_count; pattern++) {
+        idx = pattern_rules[pattern];
+        if (idx >= best) {
+            break;
+        }
+        if (rule_matches(&rules[idx], relpath, name)) {
+            best = idx;
+            break;
+        }
+    }
+
+    return best < rule_count && !rules[best].include;
+}
+
+// Whether relpath or one of its parents is excluded
+bool rules_excluded_path(
+    const char *relpath
+) {
+    bool excluded;
+    char *path;
+    char *name;
+    char *slash;
+
+    if (rule_count == 0 || relpath[0] == '\0') {
+        return false;
+    }
+
+    path = strdup(relpath);
+    if (path == NULL) {
+        return false;
+    }
+
+    excluded = false;
+    name = path;
+    for (;;) {
+        slash = strchr(name, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        excluded = rules_excluded(path, name);
+        if (excluded || slash == NULL) {
+            break;
+        }
+        *slash = '/';
+        name = slash + 1;
+    }
+    free(path);
+
+    return excluded;
+}
+
+void rules_free(void) {
+    for (int idx = 0; idx < rule_count; idx++) {
+        if (rules[idx].kind == RULE_REGEX) {
+            regfree(&rules[idx].regex);
+        }
+        free(rules[idx].pattern);
+    }
+    free(rules);
+    free(pattern_rules);
+    pathmap_free(&rule_names);
+}
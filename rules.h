@@ -0,0 +1,24 @@
+#ifndef METADUMP_RULES_H
+#define METADUMP_RULES_H
+
+#include <stdbool.h>
+
+// The first rule matching an entry decides whether it is crawled; entries
+// no rule matches are. A pattern without '/' is a glob on the name, one
+// with '/' a glob on the path relative to the root (a leading '/' only
+// anchors it), and one starting with "re:" an extended regex on that path.
+// Unlike in the shell, wildcards match a leading '.' too.
+
+int rules_add(bool include, const char *pattern);
+
+int rules_load(const char *rulespath);
+
+int rules_compile(void);
+
+bool rules_excluded(const char *relpath, const char *name);
+
+bool rules_excluded_path(const char *relpath);
+
+void rules_free(void);
+
+#endif /* METADUMP_RULES_H */
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+
+#include "sample.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+
+// 95% two-sided normal quantile
+#define SAMPLE_Z 1.959963984540054
+
+const char *SAMPLE_NAMES[SAMPLE_MEASURES] = {"files", "dirs", "others", "bytes", "allocated"};
+
+double sample_fraction_files;
+double sample_fraction_dirs;
+long sample_seed_value;
+unsigned short sample_rand_state[3];
+
+// Estimated number and bytes of the regular files in each power-of-two size
+// class
+double sample_hist_count[SAMPLE_HIST_BUCKETS];
+double sample_hist_bytes[SAMPLE_HIST_BUCKETS];
+
+void sample_set(
+    double fraction,
+    double dir_fraction,
+    long seed
+) {
+    sample_fraction_files = fraction;
+    sample_fraction_dirs = dir_fraction;
+    sample_seed_value = seed;
+    sample_rand_state[0] = 0x330e;
+    sample_rand_state[1] = seed;
+    sample_rand_state[2] = seed >> 16;
+}
+
+long sample_seed(void) {
+    return sample_seed_value;
+}
+
+double sample_dir_fraction(void) {
+    return sample_fraction_dirs;
+}
+
+double sample_random(void) {
+    return erand48(sample_rand_state);
+}
+
+// Files to stat out of a directory's population; at least two when there
+// are, so the variance within the directory can be estimated
+long long sample_size(
+    long long population
+) {
+    long long size;
+
+    size = ceil(sample_fraction_files * population);
+    if (size < 2) {
+        size = 2;
+    }
+    return size < population ? size : population;
+}
+
+int sample_bucket(
+    unsigned long long size
+) {
+    return size == 0 ? 0 : 64 - __builtin_clzll(size);
+}
+
+// weight is the number of entries of the tree this one stands for. Only
+// regular files count towards the sizes; buff is NULL for an entry that is
+// known not to be one, or that statx() failed on.
+void sample_file(
+    struct sample_stratum *stratum,
+    const struct statx *buff,
+    double weight
+) {
+    double values[SAMPLE_MEASURES];
+    int bucket;
+    bool regular;
+
+    regular = buff != NULL && S_ISREG(buff->stx_mode);
+    values[SAMPLE_FILES] = regular;
+    values[SAMPLE_DIRS] = 0;
+    values[SAMPLE_OTHERS] = !regular;
+    values[SAMPLE_BYTES] = regular ? buff->stx_size : 0;
+    values[SAMPLE_ALLOCATED] = regular ? buff->stx_blocks * 512.0 : 0;
+
+    for (int measure = 0; measure < SAMPLE_MEASURES; measure++) {
+        stratum->sum[measure] += values[measure];
+        stratum->sum_squares[measure] += values[measure] * values[measure];
+    }
+    stratum->sampled++;
+
+    if (regular) {
+        bucket = sample_bucket(buff->stx_size);
+        sample_hist_count[bucket] += weight;
+        sample_hist_bytes[bucket] += weight * buff->stx_size;
+    }
+}
+
+// Expands a simple random sample without replacement to the directory's
+// population, with the usual finite population correction
+void sample_add_stratum(
+    struct sample_totals *totals,
+    const struct sample_stratum *stratum
+) {
+    double n;
+    double N;
+    double mean;
+    double s2;
+
+    if (stratum->sampled == 0) {
+        return;
+    }
+    n = stratum->sampled;
+    N = stratum->population;
+
+    for (int measure = 0; measure < SAMPLE_MEASURES; measure++) {
+        mean = stratum->sum[measure] / n;
+        totals->total[measure] += N * mean;
+        if (n > 1) {
+            s2 = (stratum->sum_squares[measure] - n * mean * mean) / (n - 1);
+            if (s2 < 0) {
+                s2 = 0;
+            }
+            totals->variance[measure] += N * N * (1 - n / N) * s2 / n;
+        }
+    }
+}
+
+// Adds a subdirectory that was descended into with probability
+// dir_fraction: Horvitz-Thompson expansion of its estimated totals, with
+// the between-directory variance of Poisson sampling on top of its own
+void sample_add_child(
+    struct sample_totals *totals,
+    const struct sample_totals *child
+) {
+    double q;
+
+    q = sample_fraction_dirs;
+    for (int measure = 0; measure < SAMPLE_MEASURES; measure++) {
+        totals->total[measure] += child->total[measure] / q;
+        totals->variance[measure] += (1 - q) / (q * q) * child->total[measure] * child->total[measure] +
+            child->variance[measure] / q;
+    }
+}
+
+int sample_report(
+    const char *summarypath,
+    const char *root,
+    const struct sample_totals *totals,
+    long long statx_calls
+) {
+    int ret;
+    FILE *summaryfile;
+    double margin;
+    double low;
+    int last_bucket;
+
+    if (strcmp(summarypath, "-") == 0) {
+        summaryfile = stdout;
+    } else {
+        summaryfile = fopen(summarypath, "w");
+        if (summaryfile == NULL) {
+            fprintf(stderr, "Can't open summary %s\n", summarypath);
+            return -1;
+        }
+    }
+
+    fprintf(summaryfile, "# sample of %s\n", root);
+    fprintf(summaryfile, "# %g of the regular files of each directory, %g of the directories, seed %li\n",
+        sample_fraction_files, sample_fraction_dirs, sample_seed_value);
+    fprintf(summaryfile, "statx_calls\t%lli\n", statx_calls);
+    fprintf(summaryfile, "# measure\testimate\t95%% low\t95%% high\n");
+    for (int measure = 0; measure < SAMPLE_MEASURES; measure++) {
+        margin = SAMPLE_Z * sqrt(totals->variance[measure]);
+        low = totals->total[measure] - margin;
+        fprintf(
+            summaryfile,
+            "%s\t%.0f\t%.0f\t%.0f\n",
+            SAMPLE_NAMES[measure],
+            totals->total[measure],
+            low > 0 ? low : 0,
+            totals->total[measure] + margin
+        );
+    }
+
+    last_bucket = 0;
+    for (int bucket = 0; bucket < SAMPLE_HIST_BUCKETS; bucket++) {
+        if (sample_hist_count[bucket] > 0) {
+            last_bucket = bucket;
+        }
+    }
+    fprintf(summaryfile, "# size from\tsize to\tfiles\tbytes\n");
+    for (int bucket = 0; bucket <= last_bucket; bucket++) {
+        fprintf(
+            summaryfile,
+            "size_hist\t%llu\t%llu\t%.0f\t%.0f\n",
+            bucket == 0 ? 0ULL : 1ULL << (bucket - 1),
+            bucket == 0 ? 0ULL : (1ULL << (bucket - 1)) * 2 - 1,
+            sample_hist_count[bucket],
+            sample_hist_bytes[bucket]
+        );
+    }
+
+    if (summaryfile != stdout) {
+        ret = fclose(summaryfile);
+        if (ret) {
+            fprintf(stderr, "fclose() failed with errno %i\n", errno);
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef METADUMP_SAMPLE_H
+#define METADUMP_SAMPLE_H
+
+#include "statx-wrapper.h"
+
+#define SAMPLE_FILES 0      // regular files
+#define SAMPLE_DIRS 1
+#define SAMPLE_OTHERS 2     // symlinks, devices, FIFOs, sockets and entries statx() failed on
+#define SAMPLE_BYTES 3      // sum of stx_size of the regular files
+#define SAMPLE_ALLOCATED 4  // sum of stx_blocks of the regular files in bytes
+#define SAMPLE_MEASURES 5
+
+#define SAMPLE_HIST_BUCKETS 65
+
+// Estimated totals of a subtree and the estimated variances of the totals
+struct sample_totals {
+    double total[SAMPLE_MEASURES];
+    double variance[SAMPLE_MEASURES];
+};
+
+// Sums over the files sampled from one directory
+struct sample_stratum {
+    long long population;
+    long long sampled;
+    double sum[SAMPLE_MEASURES];
+    double sum_squares[SAMPLE_MEASURES];
+};
+
+void sample_set(double fraction, double dir_fraction, long seed);
+
+long sample_seed(void);
+
+double sample_dir_fraction(void);
+
+double sample_random(void);
+
+long long sample_size(long long population);
+
+void sample_file(struct sample_stratum *stratum, const struct statx *buff, double weight);
+
+void sample_add_stratum(struct sample_totals *totals, const struct sample_stratum *stratum);
+
+void sample_add_child(struct sample_totals *totals, const struct sample_totals *child);
+
+int sample_report(const char *summarypath, const char *root, const struct sample_totals *totals, long long statx_calls);
+
+#endif /* METADUMP_SAMPLE_H */
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+
+#include "split.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct split_header {
+    long long tree_offset;
+    long long datafile_pos;
+    long long entry;
+    int level;
+    int path_length;
+};
+
+FILE *splitfile;
+long long split_entries;
+
+int split_open(
+    const char *splitpath
+) {
+    int ret;
+
+    splitfile = fopen(splitpath, "wb");
+    if (splitfile == NULL) {
+        fprintf(stderr, "Can't open split index %s\n", splitpath);
+        return -1;
+    }
+
+    ret = fwrite(&VERSION, sizeof(VERSION), 1, splitfile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    ret = fwrite(&(int){SPLIT_ENTRIES}, sizeof(int), 1, splitfile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    split_entries = 0;
+
+    return 0;
+}
+
+// Called before the tree entry of each record is written, relpath being
+// the path of the record relative to the root
+int split_add(
+    FILE *treefile,
+    const char *relpath,
+    long long datafile_pos
+) {
+    int ret;
+    const char *slash;
+    struct split_header header;
+
+    if (splitfile == NULL) {
+        return 0;
+    }
+    if (split_entries++ % SPLIT_ENTRIES != 0) {
+        return 0;
+    }
+
+    header.tree_offset = ftello(treefile);
+    if (header.tree_offset < 0) {
+        fprintf(stderr, "ftello() failed with errno %i\n", errno);
+        return -1;
+    }
+    header.datafile_pos = datafile_pos;
+    header.entry = split_entries - 1;
+    header.level = 1;
+    for (const char *c = relpath; *c != '\0'; c++) {
+        header.level += *c == '/';
+    }
+    slash = strrchr(relpath, '/');
+    header.path_length = slash != NULL ? slash - relpath : 0;
+
+    ret = fwrite(&header, sizeof(header), 1, splitfile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    ret = fwrite(relpath, 1, header.path_length, splitfile);
+    if (ret != header.path_length) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+int split_close(void) {
+    int ret;
+
+    if (splitfile == NULL) {
+        return 0;
+    }
+
+    ret = fclose(splitfile);
+    splitfile = NULL;
+    if (ret) {
+        fprintf(stderr, "fclose() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+int split_load(
+    const char *splitpath,
+    struct split_point **splits,
+    long long *split_count
+) {
+    int ret;
+    FILE *file;
+    int version[3];
+    int entries;
+    long long alloc;
+    struct split_header header;
+    struct split_point *new_splits;
+    struct split_point *split;
+
+    file = fopen(splitpath, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Can't open split index %s\n", splitpath);
+        return -1;
+    }
+
+    ret = fread(&version, sizeof(version), 1, file);
+    if (ret != 1) {
+        fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+        fclose(file);
+        return -1;
+    }
+    ret = compare_versions(version, VERSION);
+    if (ret) {
+        fclose(file);
+        return ret;
+    }
+
+    ret = fread(&entries, sizeof(entries), 1, file);
+    if (ret != 1 || entries < 1) {
+        fprintf(stderr, "Invalid split index header in %s\n", splitpath);
+        fclose(file);
+        return -1;
+    }
+
+    *splits = NULL;
+    *split_count = 0;
+    alloc = 0;
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        if (header.level < 1 || header.path_length < 0) {
+            fprintf(stderr, "Invalid split point in %s\n", splitpath);
+            fclose(file);
+            return -1;
+        }
+        if (*split_count == alloc) {
+            alloc = alloc * 2 + 64;
+            new_splits = realloc(*splits, alloc * sizeof(**splits));
+            if (new_splits == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                fclose(file);
+                return -1;
+            }
+            *splits = new_splits;
+        }
+
+        split = &(*splits)[*split_count];
+        split->path = malloc(header.path_length + 1);
+        if (split->path == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            fclose(file);
+            return -1;
+        }
+        ret = fread(split->path, 1, header.path_length, file);
+        if (ret != header.path_length) {
+            fprintf(stderr, "Truncated split index %s\n", splitpath);
+            free(split->path);
+            fclose(file);
+            return -1;
+        }
+        split->path[header.path_length] = '\0';
+        split->tree_offset = header.tree_offset;
+        split->datafile_pos = header.datafile_pos;
+        split->entry = header.entry;
+        split->level = header.level;
+        (*split_count)++;
+    }
+
+    fclose(file);
+
+    return 0;
+}
+
+void split_free(
+    struct split_point *splits,
+    long long split_count
+) {
+    for (long long idx = 0; idx < split_count; idx++) {
+        free(splits[idx].path);
+    }
+    free(splits);
+}
+
+// Limits an open walk to one of parts consecutive pieces of the tree, made
+// of whole runs between split points. The first piece starts at the start
+// of the treefile, so it also has the stubs before the first record.
+int split_seek(
+    struct tree_walk *walk,
+    const struct split_point *splits,
+    long long split_count,
+    int part,
+    int parts
+) {
+    int ret;
+    long long first;
+    long long last;
+    size_t length;
+    const struct split_point *split;
+
+    first = split_count * part / parts;
+    last = split_count * (part + 1) / parts;
+    walk->end = last < split_count ? splits[last].tree_offset : 0;
+    if (part == 0) {
+        return 0;
+    }
+    if (first == last) {
+        // Nothing left for this piece
+        walk->end = walk->offset;
+        return 0;
+    }
+
+    split = &splits[first];
+    ret = fseeko(walk->treefile, split->tree_offset, SEEK_SET);
+    if (ret) {
+        fprintf(stderr, "fseeko() failed with errno %i\n", errno);
+        return -1;
+    }
+    walk->offset = split->tree_offset;
+    walk->level = split->level;
+    walk->entry = split->entry - 1;
+
+    // The path of the parent and where each of its ancestors ends in it
+    length = strlen(split->path);
+    free(walk->path);
+    free(walk->path_ends);
+    walk->path_alloc = length + 1;
+    walk->path = malloc(walk->path_alloc);
+    walk->path_ends_alloc = split->level + 1;
+    walk->path_ends = calloc(walk->path_ends_alloc, sizeof(*walk->path_ends));
+    if (walk->path == NULL || walk->path_ends == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    memcpy(walk->path, split->path, length + 1);
+
+    for (int level = 1; level < split->level; level++) {
+        walk->path_ends[level] = level == 1 ? 0 : walk->path_ends[level - 1] + 1;
+        while (walk->path_ends[level] < length && walk->path[walk->path_ends[level]] != '/') {
+            walk->path_ends[level]++;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef METADUMP_SPLIT_H
+#define METADUMP_SPLIT_H
+
+#include "common.h"
+#include "reader.h"
+
+#include <stdio.h>
+
+#define SPLIT_ENTRIES 16384
+
+// A place in the treefile where a reader can start, just before the tree
+// entry of a record, with what it needs to know of the entries before
+struct split_point {
+    long long tree_offset;
+    long long datafile_pos;
+    long long entry;      // index of the record in tree order, stubs not counted
+    int level;
+    char *path;           // path of the parent directory relative to the root
+};
+
+int split_open(const char *splitpath);
+
+int split_add(FILE *treefile, const char *relpath, long long datafile_pos);
+
+int split_close(void);
+
+int split_load(const char *splitpath, struct split_point **splits, long long *split_count);
+
+void split_free(struct split_point *splits, long long split_count);
+
+int split_seek(struct tree_walk *walk, const struct split_point *splits, long long split_count, int part, int parts);
+
+#endif /* METADUMP_SPLIT_H */
@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+
+#include "store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <openssl/md5.h>
+
+struct store_entry {
+    unsigned char md_value[MD5_DIGEST_LENGTH];
+    long long pos;        // datafile_pos of the record, 0 for an empty slot
+    long long length;
+};
+
+FILE *store_datafile;
+FILE *store_indexfile;
+FILE *store_record;
+char *store_record_buff;
+size_t store_record_size;
+long long store_data_end;
+struct store_entry *store_table;
+size_t store_table_alloc;
+size_t store_table_used;
+
+struct store_entry *store_slot(
+    const unsigned char *md_value
+) {
+    size_t idx;
+
+    // The digest is already uniformly distributed
+    memcpy(&idx, md_value, sizeof(idx));
+    idx &= store_table_alloc - 1;
+    while (store_table[idx].pos != 0 && memcmp(store_table[idx].md_value, md_value, MD5_DIGEST_LENGTH) != 0) {
+        idx = (idx + 1) & (store_table_alloc - 1);
+    }
+
+    return &store_table[idx];
+}
+
+int store_insert(
+    const struct store_entry *entry
+) {
+    struct store_entry *old_table;
+    size_t old_alloc;
+    struct store_entry *slot;
+
+    // Keep the load factor under 1/2
+    if (2 * (store_table_used + 1) > store_table_alloc) {
+        old_table = store_table;
+        old_alloc = store_table_alloc;
+
+        store_table_alloc = 2 * old_alloc;
+        store_table = calloc(store_table_alloc, sizeof(*store_table));
+        if (store_table == NULL) {
+            fprintf(stderr, "calloc() failed with errno %i\n", errno);
+            return -1;
+        }
+        for (size_t idx = 0; idx < old_alloc; idx++) {
+            if (old_table[idx].pos != 0) {
+                *store_slot(old_table[idx].md_value) = old_table[idx];
+            }
+        }
+        free(old_table);
+    }
+
+    slot = store_slot(entry->md_value);
+    if (slot->pos == 0) {
+        store_table_used++;
+    }
+    *slot = *entry;
+
+    return 0;
+}
+
+FILE *store_fopen(
+    const char *storepath,
+    const char *name
+) {
+    int fd;
+    char *path;
+    FILE *file;
+
+    path = malloc(strlen(storepath) + strlen(name) + 2);
+    if (path == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return NULL;
+    }
+    sprintf(path, "%s/%s", storepath, name);
+
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open %s\n", path);
+        free(path);
+        return NULL;
+    }
+    free(path);
+
+    file = fdopen(fd, "a+b");
+    if (file == NULL) {
+        fprintf(stderr, "fdopen() failed with errno %i\n", errno);
+        close(fd);
+        return NULL;
+    }
+
+    return file;
+}
+
+// Writes the version to a new store file, or checks it in an existing one
+int store_check_version(
+    FILE *file,
+    off_t *size
+) {
+    int ret;
+    int version[3];
+    struct stat st;
+
+    ret = fstat(fileno(file), &st);
+    if (ret) {
+        fprintf(stderr, "fstat() failed with errno %i\n", errno);
+        return -1;
+    }
+    *size = st.st_size;
+
+    if (st.st_size == 0) {
+        ret = fwrite(&VERSION, sizeof(VERSION), 1, file);
+        if (ret != 1) {
+            fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+            return -1;
+        }
+        *size = sizeof(VERSION);
+        return 0;
+    }
+
+    ret = fread(&version, sizeof(version), 1, file);
+    if (ret != 1) {
+        fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    return compare_versions(version, VERSION);
+}
+
+int store_open(
+    const char *storepath,
+    FILE **datafile
+) {
+    int ret;
+    off_t data_size;
+    off_t index_size;
+    off_t index_end;
+    struct store_entry entry;
+
+    ret = mkdir(storepath, 0777);
+    if (ret && errno != EEXIST) {
+        fprintf(stderr, "mkdir() failed with errno %i for %s\n", errno, storepath);
+        return -1;
+    }
+
+    store_datafile = store_fopen(storepath, STORE_DATA);
+    if (store_datafile == NULL) {
+        return -1;
+    }
+
+    // Two dumps appending to one store would interleave their records
+    ret = flock(fileno(store_datafile), LOCK_EX | LOCK_NB);
+    if (ret) {
+        fprintf(stderr, "Store %s is in use by another dump\n", storepath);
+        return -1;
+    }
+
+    ret = store_check_version(store_datafile, &data_size);
+    if (ret) {
+        return ret;
+    }
+    store_data_end = data_size + DATA_OFFSET;
+
+    // Writes to a stream that was read from need a seek in between
+    ret = fseeko(store_datafile, 0, SEEK_END);
+    if (ret) {
+        fprintf(stderr, "fseeko() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    store_indexfile = store_fopen(storepath, STORE_INDEX);
+    if (store_indexfile == NULL) {
+        return -1;
+    }
+    ret = store_check_version(store_indexfile, &index_size);
+    if (ret) {
+        return ret;
+    }
+
+    store_table_alloc = 1024;
+    store_table = calloc(store_table_alloc, sizeof(*store_table));
+    if (store_table == NULL) {
+        fprintf(stderr, "calloc() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    index_end = sizeof(VERSION);
+    while (fread(&entry, sizeof(entry), 1, store_indexfile) == 1) {
+        index_end += sizeof(entry);
+
+        // An interrupted dump may have flushed index entries past its data
+        if (entry.pos < DATA_OFFSET || entry.pos + entry.length > store_data_end) {
+            continue;
+        }
+        ret = store_insert(&entry);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    // Drop a torn entry so that new entries stay aligned
+    if (index_end != index_size) {
+        ret = ftruncate(fileno(store_indexfile), index_end);
+        if (ret) {
+            fprintf(stderr, "ftruncate() failed with errno %i\n", errno);
+            return -1;
+        }
+    }
+    ret = fseeko(store_indexfile, 0, SEEK_END);
+    if (ret) {
+        fprintf(stderr, "fseeko() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    store_record = open_memstream(&store_record_buff, &store_record_size);
+    if (store_record == NULL) {
+        fprintf(stderr, "open_memstream() failed with errno %i\n", errno);
+        return -1;
+    }
+    *datafile = store_record;
+
+    return 0;
+}
+
+// Moves the record written since the last call into the store, and returns
+// the position of the stored copy. Records are keyed by key_head followed by
+// the record past its first head_length bytes, so the caller can leave
+// fields out of the comparison.
+int store_put(
+    long long *datafile_pos,
+    const void *key_head,
+    size_t key_head_length,
+    size_t head_length
+) {
+    int ret;
+    struct store_entry entry;
+    struct store_entry *slot;
+    EVP_MD_CTX *mdctx;
+
+    ret = fflush(store_record);
+    if (ret) {
+        fprintf(stderr, "fflush() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    mdctx = EVP_MD_CTX_new();
+    if (mdctx == NULL) {
+        fprintf(stderr, "EVP_MD_CTX_new() failed\n");
+        return -1;
+    }
+    ret = EVP_DigestInit_ex2(mdctx, EVP_md5(), NULL) == 1 &&
+        EVP_DigestUpdate(mdctx, key_head, key_head_length) == 1 &&
+        EVP_DigestUpdate(mdctx, store_record_buff + head_length, store_record_size - head_length) == 1 &&
+        EVP_DigestFinal_ex(mdctx, entry.md_value, NULL) == 1;
+    EVP_MD_CTX_free(mdctx);
+    if (!ret) {
+        fprintf(stderr, "EVP_Digest() failed\n");
+        return -1;
+    }
+    entry.length = store_record_size;
+
+    // The length is not compared, a record that only differs in a field
+    // left out of the key may be shorter or longer
+    slot = store_slot(entry.md_value);
+    if (slot->pos != 0) {
+        *datafile_pos = slot->pos;
+    } else {
+        ret = fwrite(store_record_buff, store_record_size, 1, store_datafile);
+        if (ret != 1) {
+            fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+            return -1;
+        }
+        entry.pos = store_data_end;
+        store_data_end += store_record_size;
+
+        ret = fwrite(&entry, sizeof(entry), 1, store_indexfile);
+        if (ret != 1) {
+            fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+            return -1;
+        }
+        ret = store_insert(&entry);
+        if (ret) {
+            return ret;
+        }
+        *datafile_pos = entry.pos;
+    }
+
+    ret = fseeko(store_record, 0, SEEK_SET);
+    if (ret) {
+        fprintf(stderr, "fseeko() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+int store_close(void) {
+    int ret;
+
+    fclose(store_record);
+    free(store_record_buff);
+    free(store_table);
+
+    // Data goes out before the index entries that point into it
+    ret = fclose(store_datafile);
+    if (ret) {
+        fprintf(stderr, "fclose() failed with errno %i\n", errno);
+        return -1;
+    }
+    ret = fclose(store_indexfile);
+    if (ret) {
+        fprintf(stderr, "fclose() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
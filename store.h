@@ -0,0 +1,20 @@
+#ifndef METADUMP_STORE_H
+#define METADUMP_STORE_H
+
+#include "common.h"
+
+#include <stdio.h>
+
+#define STORE_DATA "data"
+#define STORE_INDEX "index"
+
+// Datafile records shared by many dumps, each distinct record stored once.
+// STORE_DATA is an ordinary datafile, STORE_INDEX maps record digests to
+// positions in it.
+int store_open(const char *storepath, FILE **datafile);
+
+int store_put(long long *datafile_pos, const void *key_head, size_t key_head_length, size_t head_length);
+
+int store_close(void);
+
+#endif /* METADUMP_STORE_H */
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "stream.h"
+
+#include <stdio.h>
+#include <errno.h>
+
+struct stream_cookie {
+    FILE *out;
+    int type;
+};
+
+struct stream_cookie stream_tree_cookie;
+struct stream_cookie stream_data_cookie;
+
+ssize_t stream_write(
+    void *cookie,
+    const char *buff,
+    size_t size
+) {
+    struct stream_cookie *stream = cookie;
+    int header[2];
+    int ret;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    // Every flush of the tree or data buffer becomes one frame
+    header[0] = stream->type;
+    header[1] = size;
+
+    ret = fwrite(header, sizeof(header), 1, stream->out);
+    if (ret != 1) {
+        return -1;
+    }
+    ret = fwrite(buff, size, 1, stream->out);
+    if (ret != 1) {
+        return -1;
+    }
+
+    return size;
+}
+
+FILE *stream_fopen(
+    FILE *out,
+    struct stream_cookie *cookie,
+    int type
+) {
+    FILE *file;
+    cookie_io_functions_t funcs = {
+        .read = NULL,
+        .write = stream_write,
+        .seek = NULL,
+        .close = NULL
+    };
+
+    cookie->out = out;
+    cookie->type = type;
+
+    file = fopencookie(cookie, "w", funcs);
+    if (file == NULL) {
+        fprintf(stderr, "fopencookie() failed with errno %i\n", errno);
+        return NULL;
+    }
+
+    setvbuf(file, NULL, _IOFBF, STREAM_BUFF_SIZE);
+
+    return file;
+}
+
+int stream_open(
+    FILE *out,
+    FILE **treefile,
+    FILE **datafile
+) {
+    int ret;
+
+    ret = fwrite(&VERSION, sizeof(VERSION), 1, out);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    *treefile = stream_fopen(out, &stream_tree_cookie, STREAM_TREE);
+    if (*treefile == NULL) {
+        return -1;
+    }
+    *datafile = stream_fopen(out, &stream_data_cookie, STREAM_DATA);
+    if (*datafile == NULL) {
+        fclose(*treefile);
+        return -1;
+    }
+
+    return 0;
+}
+
+int stream_close(
+    FILE *out,
+    FILE *treefile,
+    FILE *datafile
+) {
+    int ret;
+    int header[2];
+
+    ret = fclose(treefile);
+    ret |= fclose(datafile);
+    if (ret) {
+        fprintf(stderr, "fclose() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    header[0] = STREAM_END;
+    header[1] = 0;
+    ret = fwrite(header, sizeof(header), 1, out);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    ret = fflush(out);
+    if (ret) {
+        fprintf(stderr, "fflush() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
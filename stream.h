@@ -0,0 +1,12 @@
+#ifndef METADUMP_STREAM_H
+#define METADUMP_STREAM_H
+
+#include <stdio.h>
+
+#define STREAM_BUFF_SIZE (256 * 1024)
+
+int stream_open(FILE *out, FILE **treefile, FILE **datafile);
+
+int stream_close(FILE *out, FILE *treefile, FILE *datafile);
+
+#endif /* METADUMP_STREAM_H */
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+
+#include "throttle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define BACKOFF_THRESHOLD 2.0
+#define BACKOFF_FACTOR 4.0
+#define BACKOFF_MAX 1.0
+
+// Token bucket holding at most one second worth of its rate. Takers may
+// overdraw it and then sleep off the debt, so one large read never stalls.
+struct bucket {
+    double rate;
+    double tokens;
+    double last;
+    pthread_mutex_t lock;
+};
+
+struct bucket bucket_bytes = {.lock = PTHREAD_MUTEX_INITIALIZER};
+struct bucket bucket_files = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+bool backoff_enabled;
+double latency_avg;
+double latency_base;
+
+double throttle_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void throttle_sleep(
+    double seconds
+) {
+    struct timespec ts;
+
+    ts.tv_sec = seconds;
+    ts.tv_nsec = (seconds - ts.tv_sec) * 1e9;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+        continue;
+    }
+}
+
+void throttle_set(
+    double bytes_rate,
+    double files_rate,
+    bool backoff
+) {
+    bucket_bytes.rate = bytes_rate;
+    bucket_bytes.tokens = bytes_rate;
+    bucket_bytes.last = throttle_now();
+    bucket_files.rate = files_rate;
+    bucket_files.tokens = files_rate;
+    bucket_files.last = bucket_bytes.last;
+    backoff_enabled = backoff;
+}
+
+// Accepts a plain number or one with a K, M or G suffix (powers of 1024)
+int throttle_parse_rate(
+    const char *text,
+    double *rate
+) {
+    char *end;
+
+    *rate = strtod(text, &end);
+    if (end == text || *rate <= 0) {
+        return -1;
+    }
+    switch (*end) {
+    case 'K':
+    case 'k':
+        *rate *= 1024;
+        end++;
+        break;
+    case 'M':
+    case 'm':
+        *rate *= 1024 * 1024;
+        end++;
+        break;
+    case 'G':
+    case 'g':
+        *rate *= 1024 * 1024 * 1024;
+        end++;
+        break;
+    }
+
+    return *end == '\0' ? 0 : -1;
+}
+
+void bucket_take(
+    struct bucket *bucket,
+    double amount
+) {
+    double now;
+    double wait;
+
+    if (bucket->rate <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&bucket->lock);
+    now = throttle_now();
+    bucket->tokens += (now - bucket->last) * bucket->rate;
+    if (bucket->tokens > bucket->rate) {
+        bucket->tokens = bucket->rate;
+    }
+    bucket->last = now;
+    bucket->tokens -= amount;
+    wait = bucket->tokens < 0 ? -bucket->tokens / bucket->rate : 0;
+    pthread_mutex_unlock(&bucket->lock);
+
+    if (wait > 0) {
+        throttle_sleep(wait);
+    }
+}
+
+// Called by the hash readers, possibly from several threads
+void throttle_bytes(
+    long long bytes
+) {
+    bucket_take(&bucket_bytes, bytes);
+}
+
+void throttle_file(void) {
+    bucket_take(&bucket_files, 1);
+}
+
+// Feeds the latency of one metadata call. The baseline follows the lowest
+// recent average and only slowly accepts a higher one, so a sustained rise
+// makes the crawl sleep in proportion to it. Called from the crawling
+// thread only.
+void throttle_latency(
+    double seconds
+) {
+    double delay;
+
+    if (!backoff_enabled) {
+        return;
+    }
+
+    latency_avg = latency_avg == 0 ? seconds : latency_avg + (seconds - latency_avg) / 16;
+    if (latency_base == 0 || latency_avg < latency_base) {
+        latency_base = latency_avg;
+    } else {
+        latency_base += (latency_avg - latency_base) / 4096;
+    }
+
+    if (latency_avg > BACKOFF_THRESHOLD * latency_base) {
+        delay = (latency_avg - latency_base) * BACKOFF_FACTOR;
+        throttle_sleep(delay < BACKOFF_MAX ? delay : BACKOFF_MAX);
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef METADUMP_THROTTLE_H
+#define METADUMP_THROTTLE_H
+
+#include <stdbool.h>
+
+// Rates are per second, 0 for no limit
+void throttle_set(double bytes_rate, double files_rate, bool backoff);
+
+int throttle_parse_rate(const char *text, double *rate);
+
+void throttle_bytes(long long bytes);
+
+void throttle_file(void);
+
+void throttle_latency(double seconds);
+
+double throttle_now(void);
+
+#endif /* METADUMP_THROTTLE_H */
@@ -0,0 +1,271 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "throttle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+const char *TRACE_NAMES[TRACE_OPS] = {
+    "statx",
+    "open",
+    "FS_IOC_GETFLAGS",
+    "FS_IOC_GETVERSION",
+    "FS_IOC_FSGETXATTR",
+    "hash",
+    "llistxattr",
+    "lgetxattr"
+};
+
+struct trace_op {
+    double seconds;
+    double start;
+    int op;
+    char *path;
+};
+
+bool trace_enabled;
+double trace_epoch;
+// Chrome trace events, one complete event per operation
+FILE *tracefile;
+bool trace_first_event = true;
+
+long long trace_calls[TRACE_OPS];
+double trace_seconds[TRACE_OPS];
+double trace_max[TRACE_OPS];
+
+// Min-heap on seconds of the slowest operations so far, so the fastest of
+// them is the one replaced
+struct trace_op *slowest;
+int slowest_count;
+int slowest_alloc;
+
+int trace_open(
+    const char *tracepath
+) {
+    tracefile = fopen(tracepath, "w");
+    if (tracefile == NULL) {
+        fprintf(stderr, "Can't open trace %s\n", tracepath);
+        return -1;
+    }
+    fprintf(tracefile, "[\n");
+
+    trace_enabled = true;
+    trace_epoch = throttle_now();
+
+    return 0;
+}
+
+int trace_slowest(
+    int count
+) {
+    slowest = calloc(count, sizeof(*slowest));
+    if (slowest == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    slowest_alloc = count;
+
+    trace_enabled = true;
+    trace_epoch = throttle_now();
+
+    return 0;
+}
+
+double trace_begin(void) {
+    if (!trace_enabled) {
+        return 0;
+    }
+    return throttle_now();
+}
+
+void trace_json_str(
+    FILE *file,
+    const char *text
+) {
+    unsigned char c;
+
+    fputc('"', file);
+    for (; *text != '\0'; text++) {
+        c = *text;
+        if (c == '"' || c == '\\') {
+            fputc('\\', file);
+            fputc(c, file);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+void slowest_sift_down(
+    int idx
+) {
+    int child;
+    struct trace_op tmp;
+
+    for (;;) {
+        child = 2 * idx + 1;
+        if (child >= slowest_count) {
+            break;
+        }
+        if (child + 1 < slowest_count && slowest[child + 1].seconds < slowest[child].seconds) {
+            child++;
+        }
+        if (slowest[idx].seconds <= slowest[child].seconds) {
+            break;
+        }
+        tmp = slowest[idx];
+        slowest[idx] = slowest[child];
+        slowest[child] = tmp;
+        idx = child;
+    }
+}
+
+void slowest_sift_up(
+    int idx
+) {
+    int parent;
+    struct trace_op tmp;
+
+    while (idx > 0) {
+        parent = (idx - 1) / 2;
+        if (slowest[parent].seconds <= slowest[idx].seconds) {
+            break;
+        }
+        tmp = slowest[idx];
+        slowest[idx] = slowest[parent];
+        slowest[parent] = tmp;
+        idx = parent;
+    }
+}
+
+void slowest_add(
+    int op,
+    const char *filepath,
+    double start,
+    double seconds
+) {
+    char *path;
+
+    if (slowest_count == slowest_alloc && seconds <= slowest[0].seconds) {
+        return;
+    }
+
+    // A path that can't be copied leaves its operation out
+    path = strdup(filepath);
+    if (path == NULL) {
+        return;
+    }
+
+    if (slowest_count < slowest_alloc) {
+        slowest[slowest_count] = (struct trace_op){seconds, start, op, path};
+        slowest_sift_up(slowest_count++);
+    } else {
+        free(slowest[0].path);
+        slowest[0] = (struct trace_op){seconds, start, op, path};
+        slowest_sift_down(0);
+    }
+}
+
+void trace_end(
+    int op,
+    const char *filepath,
+    double start
+) {
+    double seconds;
+    int saved_errno;
+
+    if (!trace_enabled) {
+        return;
+    }
+    seconds = throttle_now() - start;
+    // Callers read errno of the traced call after this
+    saved_errno = errno;
+
+    trace_calls[op]++;
+    trace_seconds[op] += seconds;
+    if (seconds > trace_max[op]) {
+        trace_max[op] = seconds;
+    }
+
+    if (slowest_alloc > 0) {
+        slowest_add(op, filepath, start, seconds);
+    }
+
+    if (tracefile != NULL) {
+        fprintf(
+            tracefile,
+            "%s{\"name\":\"%s\",\"cat\":\"fs\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"path\":",
+            trace_first_event ? "" : ",\n",
+            TRACE_NAMES[op],
+            (start - trace_epoch) * 1e6,
+            seconds * 1e6
+        );
+        trace_json_str(tracefile, filepath);
+        fprintf(tracefile, "}}");
+        trace_first_event = false;
+    }
+
+    errno = saved_errno;
+}
+
+int compare_slowest(
+    const void *a,
+    const void *b
+) {
+    const struct trace_op *op_a = a;
+    const struct trace_op *op_b = b;
+
+    return (op_a->seconds < op_b->seconds) - (op_a->seconds > op_b->seconds);
+}
+
+// Writes the totals per operation and the slowest operations to stderr
+int trace_close(void) {
+    int ret;
+
+    if (!trace_enabled) {
+        return 0;
+    }
+
+    fprintf(stderr, "# operation\tcalls\tseconds\tmax seconds\n");
+    for (int op = 0; op < TRACE_OPS; op++) {
+        if (trace_calls[op] == 0) {
+            continue;
+        }
+        fprintf(stderr, "%s\t%lli\t%.6f\t%.6f\n", TRACE_NAMES[op], trace_calls[op], trace_seconds[op], trace_max[op]);
+    }
+
+    if (slowest_alloc > 0) {
+        qsort(slowest, slowest_count, sizeof(*slowest), compare_slowest);
+        fprintf(stderr, "# seconds\tstart\toperation\tpath\n");
+        for (int idx = 0; idx < slowest_count; idx++) {
+            fprintf(
+                stderr,
+                "%.6f\t%.6f\t%s\t%s\n",
+                slowest[idx].seconds,
+                slowest[idx].start - trace_epoch,
+                TRACE_NAMES[slowest[idx].op],
+                slowest[idx].path
+            );
+            free(slowest[idx].path);
+        }
+        free(slowest);
+    }
+
+    if (tracefile != NULL) {
+        fprintf(tracefile, "\n]\n");
+        ret = fclose(tracefile);
+        if (ret) {
+            fprintf(stderr, "fclose() failed with errno %i\n", errno);
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef METADUMP_TRACE_H
+#define METADUMP_TRACE_H
+
+#include <stdio.h>
+
+#define TRACE_STATX 0
+#define TRACE_OPEN 1
+#define TRACE_GETFLAGS 2
+#define TRACE_GETVERSION 3
+#define TRACE_FSGETXATTR 4
+#define TRACE_HASH 5
+#define TRACE_LISTXATTR 6
+#define TRACE_GETXATTR 7
+#define TRACE_OPS 8
+
+// Timings are taken on the crawling thread only. Without trace_open() or
+// trace_slowest(), trace_begin() and trace_end() return straight away.
+
+int trace_open(const char *tracepath);
+
+int trace_slowest(int count);
+
+double trace_begin(void);
+
+void trace_end(int op, const char *filepath, double start);
+
+int trace_close(void);
+
+#endif /* METADUMP_TRACE_H */
@@ -0,0 +1,454 @@
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "hash.h"
+#include "reader.h"
+#include "verify.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define VERIFY_QUEUE_SIZE 256
+
+struct verify_job {
+    char *filepath;       // root/path
+    const char *path;     // points into filepath, relative to root
+    long long size;
+    int kind;
+    long long chunk_size;
+    unsigned int md_len;
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+};
+
+// A directory of the dump whose children are being walked
+struct verify_dir {
+    char *path;
+    long long children;
+    bool check;           // its children were dumped, so they can be counted
+};
+
+struct verify_job verify_queue[VERIFY_QUEUE_SIZE];
+int verify_queue_head;
+int verify_queue_count;
+bool verify_queue_done;
+pthread_mutex_t verify_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t verify_queue_filled = PTHREAD_COND_INITIALIZER;
+pthread_cond_t verify_queue_drained = PTHREAD_COND_INITIALIZER;
+
+pthread_mutex_t verify_report_lock = PTHREAD_MUTEX_INITIALIZER;
+long long verify_mismatches;
+long long verify_hashed;
+
+// One tab-separated line per mismatch, flushed right away
+void verify_report(
+    const char *kind,
+    const char *path,
+    const char *detail
+) {
+    pthread_mutex_lock(&verify_report_lock);
+    printf("%s\t%s", kind, path[0] != '\0' ? path : ".");
+    if (detail != NULL) {
+        printf("\t%s", detail);
+    }
+    putchar('\n');
+    fflush(stdout);
+    verify_mismatches++;
+    pthread_mutex_unlock(&verify_report_lock);
+}
+
+void verify_hash(
+    const struct verify_job *job,
+    struct digest *dgst
+) {
+    int ret;
+    int fd;
+    char detail[64];
+    struct hash_opts opts;
+
+    // Re-create the digest the way the dump computed it
+    memset(&opts, 0x00, sizeof(opts));
+    opts.sparse = (job->kind & DIGEST_KIND_MASK) == DIGEST_MD5_SPARSE;
+    opts.tree_chunk = (job->kind & DIGEST_KIND_MASK) == DIGEST_MD5_TREE ? job->chunk_size : 0;
+    opts.fingerprint_blocks = (job->kind & DIGEST_KIND_MASK) == DIGEST_MD5_FINGERPRINT ? job->chunk_size : 0;
+    opts.threads = 1;
+
+    fd = open_noatime(job->filepath);
+    if (fd < 0) {
+        snprintf(detail, sizeof(detail), "open() failed with errno %i", errno);
+        verify_report("error", job->path, detail);
+        return;
+    }
+    ret = hash_fd(job->filepath, fd, job->size, &opts, dgst);
+    close(fd);
+    if (ret) {
+        verify_report("error", job->path, "hashing failed");
+        return;
+    }
+
+    pthread_mutex_lock(&verify_report_lock);
+    verify_hashed++;
+    pthread_mutex_unlock(&verify_report_lock);
+
+    if (dgst->md_len != job->md_len || memcmp(dgst->md_value, job->md_value, job->md_len) != 0) {
+        verify_report("digest", job->path, NULL);
+    }
+}
+
+void *verify_worker(
+    void *arg
+) {
+    struct verify_job job;
+    struct digest dgst;
+
+    (void)arg;
+    memset(&dgst, 0x00, sizeof(dgst));
+
+    for (;;) {
+        pthread_mutex_lock(&verify_queue_lock);
+        while (verify_queue_count == 0 && !verify_queue_done) {
+            pthread_cond_wait(&verify_queue_filled, &verify_queue_lock);
+        }
+        if (verify_queue_count == 0) {
+            pthread_mutex_unlock(&verify_queue_lock);
+            break;
+        }
+        job = verify_queue[verify_queue_head];
+        verify_queue_head = (verify_queue_head + 1) % VERIFY_QUEUE_SIZE;
+        verify_queue_count--;
+        pthread_cond_signal(&verify_queue_drained);
+        pthread_mutex_unlock(&verify_queue_lock);
+
+        verify_hash(&job, &dgst);
+        free(job.filepath);
+    }
+
+    hash_free(&dgst);
+
+    return NULL;
+}
+
+void verify_enqueue(
+    const struct verify_job *job
+) {
+    pthread_mutex_lock(&verify_queue_lock);
+    while (verify_queue_count == VERIFY_QUEUE_SIZE) {
+        pthread_cond_wait(&verify_queue_drained, &verify_queue_lock);
+    }
+    verify_queue[(verify_queue_head + verify_queue_count) % VERIFY_QUEUE_SIZE] = *job;
+    verify_queue_count++;
+    pthread_cond_signal(&verify_queue_filled);
+    pthread_mutex_unlock(&verify_queue_lock);
+}
+
+// Deterministic, so that reruns sample the same files
+bool verify_sampled(
+    const char *path,
+    double sample
+) {
+    unsigned long long hash;
+
+    if (sample <= 0) {
+        return false;
+    }
+
+    hash = 14695981039346656037ULL;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+
+    return (double)(hash % 1000000) < sample * 1000000;
+}
+
+// Fields that a faithful restore preserves, unlike ino or ctime
+bool verify_compare(
+    const struct statx *dumped,
+    const struct statx *now,
+    char *detail,
+    size_t length
+) {
+    detail[0] = '\0';
+    if (dumped->stx_mode != now->stx_mode) {
+        strncat(detail, "mode,", length - strlen(detail) - 1);
+    }
+    if (dumped->stx_uid != now->stx_uid) {
+        strncat(detail, "uid,", length - strlen(detail) - 1);
+    }
+    if (dumped->stx_gid != now->stx_gid) {
+        strncat(detail, "gid,", length - strlen(detail) - 1);
+    }
+    if (dumped->stx_size != now->stx_size) {
+        strncat(detail, "size,", length - strlen(detail) - 1);
+    }
+    if (dumped->stx_mtime.tv_sec != now->stx_mtime.tv_sec || dumped->stx_mtime.tv_nsec != now->stx_mtime.tv_nsec) {
+        strncat(detail, "mtime,", length - strlen(detail) - 1);
+    }
+
+    if (detail[0] == '\0') {
+        return false;
+    }
+    detail[strlen(detail) - 1] = '\0';
+    return true;
+}
+
+int verify_entry(
+    const char *root,
+    const struct tree_walk *walk,
+    const struct md_record *rec,
+    const struct verify_opts *opts
+) {
+    int ret;
+    bool changed;
+    char detail[64];
+    struct statx now;
+    struct verify_job job;
+
+    job.filepath = malloc(strlen(root) + strlen(walk->path) + 2);
+    if (job.filepath == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    sprintf(job.filepath, "%s/%s", root, walk->path);
+    job.path = job.filepath + strlen(root) + 1;
+
+    ret = statx(
+        AT_FDCWD,
+        job.filepath,
+        AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW | opts->statx_flags,
+        STATX_BASIC_STATS,
+        &now
+    );
+    if (ret) {
+        if (errno == ENOENT) {
+            verify_report("missing", job.path, NULL);
+        } else {
+            snprintf(detail, sizeof(detail), "statx() failed with errno %i", errno);
+            verify_report("error", job.path, detail);
+        }
+        free(job.filepath);
+        return 0;
+    }
+
+    // Nothing was recorded to compare against
+    if (rec->stx.ret) {
+        free(job.filepath);
+        return 0;
+    }
+
+    changed = verify_compare(&rec->stx.buff, &now, detail, sizeof(detail));
+    if (changed) {
+        verify_report("changed", job.path, detail);
+    }
+
+    // A pending digest has md_len 0, and a new size can't keep the digest
+    if (!S_ISREG(now.stx_mode) || rec->md_len == 0 || now.stx_size != rec->stx.buff.stx_size ||
+        !(changed || verify_sampled(job.path, opts->sample))) {
+        free(job.filepath);
+        return 0;
+    }
+
+    job.size = rec->stx.buff.stx_size;
+    job.kind = rec->digest_kind;
+    job.chunk_size = rec->chunk_size;
+    job.md_len = rec->md_len;
+    memcpy(job.md_value, rec->md_value, rec->md_len);
+    verify_enqueue(&job);
+
+    return 0;
+}
+
+void verify_close_dir(
+    const char *root,
+    struct verify_dir *dir
+) {
+    DIR *dr;
+    struct dirent *de;
+    char *dirpath;
+    long long entries;
+    char detail[64];
+
+    if (!dir->check) {
+        free(dir->path);
+        return;
+    }
+
+    dirpath = malloc(strlen(root) + strlen(dir->path) + 2);
+    if (dirpath == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        free(dir->path);
+        return;
+    }
+    sprintf(dirpath, "%s/%s", root, dir->path);
+
+    // New entries don't show up in a walk of the dump, so count them
+    dr = opendir(dirpath);
+    if (dr == NULL) {
+        if (errno != ENOENT) {
+            snprintf(detail, sizeof(detail), "opendir() failed with errno %i", errno);
+            verify_report("error", dir->path, detail);
+        }
+    } else {
+        entries = 0;
+        while ((de = readdir(dr)) != NULL) {
+            if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+                entries++;
+            }
+        }
+        closedir(dr);
+
+        if (entries != dir->children) {
+            snprintf(detail, sizeof(detail), "%lli entries, dump has %lli", entries, dir->children);
+            verify_report("entries", dir->path, detail);
+        }
+    }
+
+    free(dirpath);
+    free(dir->path);
+}
+
+int verify_dump(
+    const char *treepath,
+    const char *datapath,
+    const char *root,
+    const struct verify_opts *opts
+) {
+    int ret;
+    int failed;
+    int depth;
+    int dirs_alloc;
+    bool dir_pushed;
+    long long entries;
+    pthread_t *threads;
+    struct verify_dir *dirs;
+    struct verify_dir *new_dirs;
+
+    struct tree_walk walk;
+    struct data_reader reader;
+    struct md_record rec;
+
+    ret = tree_walk_open(&walk, treepath);
+    if (ret) {
+        return ret;
+    }
+    // Pruned stubs still count as entries of their directory
+    walk.keep_pruned = true;
+    ret = data_reader_open(&reader, datapath);
+    if (ret) {
+        return ret;
+    }
+
+    threads = malloc(opts->threads * sizeof(*threads));
+    dirs_alloc = 16;
+    dirs = malloc(dirs_alloc * sizeof(*dirs));
+    if (threads == NULL || dirs == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    for (int idx = 0; idx < opts->threads; idx++) {
+        ret = pthread_create(&threads[idx], NULL, verify_worker, NULL);
+        if (ret) {
+            fprintf(stderr, "pthread_create() failed with return code %i\n", ret);
+            return -1;
+        }
+    }
+
+    // dirs[L - 1] is the parent of the entries at level L, the root first
+    dirs[0].path = strdup("");
+    dirs[0].children = 0;
+    dirs[0].check = false;
+    depth = 1;
+    dir_pushed = true;
+
+    failed = 0;
+    entries = 0;
+    memset(&rec, 0x00, sizeof(rec));
+    while (!failed && (ret = tree_walk_next(&walk)) > 0) {
+        if (dir_pushed) {
+            dirs[depth - 1].check = walk.opened_dir;
+            dir_pushed = false;
+        }
+        while (depth > walk.level) {
+            depth--;
+            verify_close_dir(root, &dirs[depth]);
+        }
+        if (depth != walk.level) {
+            fprintf(stderr, "Corrupt treefile at entry %lli\n", walk.entry);
+            failed = -1;
+            break;
+        }
+        dirs[depth - 1].children++;
+        if (walk.pruned) {
+            continue;
+        }
+        entries++;
+
+        failed = data_reader_read(&reader, walk.pos, &rec);
+        if (failed) {
+            break;
+        }
+        failed = verify_entry(root, &walk, &rec, opts);
+        if (failed) {
+            break;
+        }
+
+        if (!rec.stx.ret && S_ISDIR(rec.stx.buff.stx_mode)) {
+            if (depth == dirs_alloc) {
+                dirs_alloc *= 2;
+                new_dirs = realloc(dirs, dirs_alloc * sizeof(*dirs));
+                if (new_dirs == NULL) {
+                    fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                    failed = -1;
+                    break;
+                }
+                dirs = new_dirs;
+            }
+            dirs[depth].path = strdup(walk.path);
+            dirs[depth].children = 0;
+            dirs[depth].check = false;
+            depth++;
+            dir_pushed = true;
+        }
+    }
+    if (ret < 0) {
+        failed = ret;
+    }
+    if (!failed && dir_pushed) {
+        dirs[depth - 1].check = walk.opened_dir;
+    }
+    while (depth > 0) {
+        depth--;
+        if (failed) {
+            dirs[depth].check = false;
+        }
+        verify_close_dir(root, &dirs[depth]);
+    }
+
+    pthread_mutex_lock(&verify_queue_lock);
+    verify_queue_done = true;
+    pthread_cond_broadcast(&verify_queue_filled);
+    pthread_mutex_unlock(&verify_queue_lock);
+    for (int idx = 0; idx < opts->threads; idx++) {
+        pthread_join(threads[idx], NULL);
+    }
+
+    tree_walk_close(&walk);
+    data_reader_close(&reader);
+    record_free(&rec);
+    free(threads);
+    free(dirs);
+
+    if (failed) {
+        return failed;
+    }
+
+    fprintf(stderr, "%lli entries checked, %lli files re-hashed, %lli mismatches\n", entries, verify_hashed, verify_mismatches);
+
+    return verify_mismatches > 0 ? 1 : 0;
+}
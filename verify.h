@@ -0,0 +1,18 @@
+#ifndef METADUMP_VERIFY_H
+#define METADUMP_VERIFY_H
+
+struct verify_opts {
+    double sample;        // fraction of unchanged files to re-hash anyway
+    int threads;
+    int statx_flags;
+};
+
+// Returns 0 if root matches the dump, 1 if mismatches were reported
+int verify_dump(
+    const char *treepath,
+    const char *datapath,
+    const char *root,
+    const struct verify_opts *opts
+);
+
+#endif /* METADUMP_VERIFY_H */
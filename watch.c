@@ -0,0 +1,655 @@
+#define _GNU_SOURCE
+
+#include "watch.h"
+#include "statx-wrapper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+
+#define WATCH_BUFF_SIZE (256 * 1024)
+#define WATCH_POLL_MS 100
+
+#define FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ATTRIB | \
+    FAN_MODIFY | FAN_CLOSE_WRITE | FAN_ONDIR)
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+    IN_MODIFY | IN_CLOSE_WRITE | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+int watch_notify_fd = -1;
+bool use_fanotify;
+int mount_fd = -1;
+char *watch_root;         // realpath of the root
+size_t watch_root_length;
+dev_t watch_root_dev;
+char *watch_buff;
+char *event_path;
+
+// inotify only: path relative to the root of each watch descriptor
+char **wd_paths;
+int wd_alloc;
+
+char **ignored_paths;
+int ignored_count;
+
+// Collected by watch_thread, which owns the notify fd once started; the
+// lock also covers wd_paths, which watch_add_tree changes
+pthread_t watch_reader;
+bool watch_started;
+pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+struct pathmap watch_pending;
+bool watch_arrived;
+bool watch_overflow;
+bool watch_quit;
+int watch_error;
+
+int watch_fanotify(void) {
+    int ret;
+
+    watch_notify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_UNLIMITED_QUEUE | FAN_CLOEXEC, O_RDONLY);
+    if (watch_notify_fd < 0) {
+        return -1;
+    }
+
+    // One mark covers every directory, including those created later
+    ret = fanotify_mark(watch_notify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, watch_root);
+    if (ret) {
+        close(watch_notify_fd);
+        watch_notify_fd = -1;
+        return -1;
+    }
+
+    mount_fd = open(watch_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (mount_fd < 0) {
+        fprintf(stderr, "Can't open %s\n", watch_root);
+        return -1;
+    }
+    use_fanotify = true;
+
+    return 0;
+}
+
+int watch_open(
+    const char *root
+) {
+    int ret;
+    struct stat st;
+
+    watch_root = realpath(root, NULL);
+    if (watch_root == NULL) {
+        fprintf(stderr, "realpath() failed with errno %i for %s\n", errno, root);
+        return -1;
+    }
+    watch_root_length = strlen(watch_root);
+    if (watch_root_length == 1) {
+        watch_root_length = 0;
+    }
+
+    ret = lstat(watch_root, &st);
+    if (ret) {
+        fprintf(stderr, "lstat() failed with errno %i for %s\n", errno, watch_root);
+        return -1;
+    }
+    watch_root_dev = st.st_dev;
+
+    watch_buff = malloc(WATCH_BUFF_SIZE);
+    event_path = malloc(PATH_MAX);
+    if (watch_buff == NULL || event_path == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    // fanotify needs CAP_SYS_ADMIN, inotify a watch per directory
+    ret = watch_fanotify();
+    if (ret == 0) {
+        return 0;
+    }
+    if (mount_fd < 0 && watch_notify_fd < 0) {
+        watch_notify_fd = inotify_init1(IN_CLOEXEC);
+        if (watch_notify_fd < 0) {
+            fprintf(stderr, "inotify_init1() failed with errno %i\n", errno);
+            return -1;
+        }
+        return watch_add_tree("");
+    }
+
+    return -1;
+}
+
+// Events on path or below it, such as those of the dump itself, are dropped
+int watch_ignore(
+    const char *path
+) {
+    char *dir;
+    char *resolved;
+    char *name;
+    char **paths;
+
+    dir = strdup(path);
+    if (dir == NULL) {
+        fprintf(stderr, "strdup() failed with errno %i\n", errno);
+        return -1;
+    }
+    name = strrchr(dir, '/');
+    if (name != NULL) {
+        *name = '\0';
+        resolved = realpath(dir[0] != '\0' ? dir : "/", NULL);
+        name = strrchr(path, '/') + 1;
+    } else {
+        resolved = realpath(".", NULL);
+        name = (char *)path;
+    }
+    free(dir);
+    if (resolved == NULL) {
+        fprintf(stderr, "realpath() failed with errno %i for %s\n", errno, path);
+        return -1;
+    }
+
+    if (strncmp(resolved, watch_root, watch_root_length) != 0 ||
+        (resolved[watch_root_length] != '\0' && resolved[watch_root_length] != '/')) {
+        free(resolved);
+        return 0;
+    }
+
+    paths = realloc(ignored_paths, (ignored_count + 1) * sizeof(*ignored_paths));
+    if (paths == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        free(resolved);
+        return -1;
+    }
+    ignored_paths = paths;
+
+    ignored_paths[ignored_count] = malloc(strlen(resolved) + strlen(name) + 2);
+    if (ignored_paths[ignored_count] == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        free(resolved);
+        return -1;
+    }
+    if (resolved[watch_root_length] == '\0') {
+        strcpy(ignored_paths[ignored_count], name);
+    } else {
+        sprintf(ignored_paths[ignored_count], "%s/%s", resolved + watch_root_length + 1, name);
+    }
+    ignored_count++;
+    free(resolved);
+
+    return 0;
+}
+
+char *watch_fullpath(
+    const char *relpath
+) {
+    char *fullpath;
+
+    fullpath = malloc(watch_root_length + strlen(relpath) + 2);
+    if (fullpath == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return NULL;
+    }
+    if (relpath[0] == '\0') {
+        strcpy(fullpath, watch_root_length ? watch_root : "/");
+    } else {
+        sprintf(fullpath, "%.*s/%s", (int)watch_root_length, watch_root, relpath);
+    }
+
+    return fullpath;
+}
+
+int inotify_add_dir(
+    const char *relpath
+) {
+    int wd;
+    char **paths;
+    char *fullpath;
+
+    fullpath = watch_fullpath(relpath);
+    if (fullpath == NULL) {
+        return -1;
+    }
+
+    wd = inotify_add_watch(watch_notify_fd, fullpath, INOTIFY_MASK | IN_ONLYDIR);
+    free(fullpath);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            fprintf(stderr, "Out of inotify watches, raise fs.inotify.max_user_watches\n");
+            return -1;
+        }
+        // Gone again or not a directory any more, the parent's events cover it
+        return 0;
+    }
+
+    if (wd >= wd_alloc) {
+        paths = realloc(wd_paths, (wd + 1024) * sizeof(*wd_paths));
+        if (paths == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            return -1;
+        }
+        memset(paths + wd_alloc, 0x00, (wd + 1024 - wd_alloc) * sizeof(*wd_paths));
+        wd_paths = paths;
+        wd_alloc = wd + 1024;
+    }
+
+    // A directory moved within the tree keeps its descriptor
+    free(wd_paths[wd]);
+    wd_paths[wd] = strdup(relpath);
+    if (wd_paths[wd] == NULL) {
+        fprintf(stderr, "strdup() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Watches relpath and the directories below it on the same filesystem
+int inotify_add_tree(
+    const char *relpath
+) {
+    int ret;
+    DIR *dr;
+    struct dirent *de;
+    struct stat st;
+    char *fullpath;
+    char *childpath;
+
+    if (use_fanotify) {
+        return 0;
+    }
+
+    ret = inotify_add_dir(relpath);
+    if (ret) {
+        return ret;
+    }
+
+    fullpath = watch_fullpath(relpath);
+    if (fullpath == NULL) {
+        return -1;
+    }
+
+    dr = opendir(fullpath);
+    free(fullpath);
+    if (dr == NULL) {
+        return 0;
+    }
+
+    ret = 0;
+    while (ret == 0 && (de = readdir(dr)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN) {
+            continue;
+        }
+
+        childpath = malloc(watch_root_length + strlen(relpath) + strlen(de->d_name) + 3);
+        if (childpath == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            ret = -1;
+            break;
+        }
+        sprintf(childpath, "%.*s/%s%s%s", (int)watch_root_length, watch_root, relpath, relpath[0] ? "/" : "", de->d_name);
+        if (lstat(childpath, &st) == 0 && S_ISDIR(st.st_mode) && st.st_dev == watch_root_dev) {
+            ret = inotify_add_tree(childpath + watch_root_length + 1);
+        }
+        free(childpath);
+    }
+    closedir(dr);
+
+    return ret;
+}
+
+int watch_add_tree(
+    const char *relpath
+) {
+    int ret;
+
+    pthread_mutex_lock(&watch_lock);
+    ret = inotify_add_tree(relpath);
+    pthread_mutex_unlock(&watch_lock);
+
+    return ret;
+}
+
+void inotify_remove_tree(
+    const char *relpath
+) {
+    size_t length;
+
+    length = strlen(relpath);
+    for (int wd = 0; wd < wd_alloc; wd++) {
+        if (wd_paths[wd] == NULL || strncmp(wd_paths[wd], relpath, length) != 0) {
+            continue;
+        }
+        if (wd_paths[wd][length] == '\0' || wd_paths[wd][length] == '/') {
+            inotify_rm_watch(watch_notify_fd, wd);
+        }
+    }
+}
+
+int mark_dirty(
+    struct pathmap *dirty,
+    const char *dirpath,
+    const char *name,
+    int flags,
+    bool entries_changed
+) {
+    long long *value;
+    size_t length;
+    size_t ignored_length;
+
+    if (dirpath[0] == '\0' || strcmp(name, ".") == 0) {
+        length = snprintf(event_path, PATH_MAX, "%s", dirpath[0] == '\0' ? name : dirpath);
+        if (strcmp(event_path, ".") == 0) {
+            event_path[0] = '\0';
+        }
+    } else {
+        length = snprintf(event_path, PATH_MAX, "%s/%s", dirpath, name);
+    }
+    if (length >= PATH_MAX) {
+        return 0;
+    }
+
+    for (int idx = 0; idx < ignored_count; idx++) {
+        ignored_length = strlen(ignored_paths[idx]);
+        if (strncmp(event_path, ignored_paths[idx], ignored_length) == 0 &&
+            (event_path[ignored_length] == '\0' || event_path[ignored_length] == '/')) {
+            return 0;
+        }
+    }
+
+    value = pathmap_put(dirty, event_path);
+    if (value == NULL) {
+        return -1;
+    }
+    *value |= flags;
+
+    // New and removed entries change the directory's own times and link count
+    if (entries_changed && strcmp(name, ".") != 0) {
+        value = pathmap_put(dirty, dirpath);
+        if (value == NULL) {
+            return -1;
+        }
+        *value |= WATCH_CHANGED;
+    }
+
+    return 0;
+}
+
+// Returns the directory of a DFID_NAME record relative to the root, or
+// NULL if it is gone or outside the root
+const char *fanotify_dir(
+    struct file_handle *handle,
+    char *dirpath
+) {
+    int fd;
+    ssize_t length;
+    char linkpath[64];
+
+    fd = open_by_handle_at(mount_fd, handle, O_PATH);
+    if (fd < 0) {
+        return NULL;
+    }
+    sprintf(linkpath, "/proc/self/fd/%i", fd);
+    length = readlink(linkpath, dirpath, PATH_MAX - 1);
+    close(fd);
+    if (length < 0) {
+        return NULL;
+    }
+    dirpath[length] = '\0';
+
+    if (strncmp(dirpath, watch_root, watch_root_length) != 0) {
+        return NULL;
+    }
+    if (dirpath[watch_root_length] == '\0') {
+        return "";
+    }
+    if (dirpath[watch_root_length] != '/') {
+        return NULL;
+    }
+
+    return dirpath + watch_root_length + 1;
+}
+
+int fanotify_read(
+    struct pathmap *dirty,
+    bool *overflow
+) {
+    int ret;
+    ssize_t length;
+    struct fanotify_event_metadata *event;
+    struct fanotify_event_info_fid *fid;
+    struct file_handle *handle;
+    const char *dirpath;
+    const char *name;
+    char *dirbuff;
+
+    length = read(watch_notify_fd, watch_buff, WATCH_BUFF_SIZE);
+    if (length < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return 0;
+        }
+        fprintf(stderr, "read() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    dirbuff = malloc(PATH_MAX);
+    if (dirbuff == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    ret = 0;
+    for (event = (struct fanotify_event_metadata *)watch_buff;
+         ret == 0 && FAN_EVENT_OK(event, length);
+         event = FAN_EVENT_NEXT(event, length)) {
+        if (event->mask & FAN_Q_OVERFLOW) {
+            *overflow = true;
+            continue;
+        }
+        fid = (struct fanotify_event_info_fid *)(event + 1);
+        if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+            continue;
+        }
+        handle = (struct file_handle *)fid->handle;
+        name = (const char *)(handle->f_handle + handle->handle_bytes);
+
+        dirpath = fanotify_dir(handle, dirbuff);
+        if (dirpath == NULL) {
+            continue;
+        }
+        ret = mark_dirty(
+            dirty,
+            dirpath,
+            name,
+            event->mask & (FAN_CREATE | FAN_MOVED_TO) ? WATCH_CREATED : WATCH_CHANGED,
+            event->mask & (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO)
+        );
+    }
+
+    free(dirbuff);
+
+    return ret;
+}
+
+int inotify_read(
+    struct pathmap *dirty,
+    bool *overflow
+) {
+    int ret;
+    ssize_t length;
+    struct inotify_event *event;
+    const char *dirpath;
+    char *movedpath;
+
+    length = read(watch_notify_fd, watch_buff, WATCH_BUFF_SIZE);
+    if (length < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return 0;
+        }
+        fprintf(stderr, "read() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    ret = 0;
+    for (char *ptr = watch_buff; ret == 0 && ptr < watch_buff + length; ptr += sizeof(*event) + event->len) {
+        event = (struct inotify_event *)ptr;
+        if (event->mask & IN_Q_OVERFLOW) {
+            *overflow = true;
+            continue;
+        }
+        if (event->wd < 0 || event->wd >= wd_alloc || wd_paths[event->wd] == NULL) {
+            continue;
+        }
+        dirpath = wd_paths[event->wd];
+        if (event->mask & IN_IGNORED) {
+            free(wd_paths[event->wd]);
+            wd_paths[event->wd] = NULL;
+            continue;
+        }
+
+        // The directory's descriptors would keep reporting its old path
+        if ((event->mask & IN_MOVED_FROM) && (event->mask & IN_ISDIR)) {
+            movedpath = malloc(strlen(dirpath) + event->len + 2);
+            if (movedpath == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                return -1;
+            }
+            sprintf(movedpath, "%s%s%s", dirpath, dirpath[0] ? "/" : "", event->name);
+            inotify_remove_tree(movedpath);
+            free(movedpath);
+        }
+
+        ret = mark_dirty(
+            dirty,
+            dirpath,
+            event->len ? event->name : ".",
+            event->mask & (IN_CREATE | IN_MOVED_TO) ? WATCH_CREATED : WATCH_CHANGED,
+            event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+        );
+    }
+
+    return ret;
+}
+
+// Drains the notify fd into watch_pending until watch_close
+void *watch_thread(
+    void *arg
+) {
+    int ret;
+    int error;
+    bool quit;
+    struct pollfd pfd;
+
+    pfd.fd = watch_notify_fd;
+    pfd.events = POLLIN;
+    do {
+        ret = poll(&pfd, 1, WATCH_POLL_MS);
+        error = 0;
+        if (ret < 0 && errno != EINTR) {
+            fprintf(stderr, "poll() failed with errno %i\n", errno);
+            error = -1;
+        }
+
+        pthread_mutex_lock(&watch_lock);
+        if (!error && ret > 0 && !watch_quit) {
+            if (use_fanotify) {
+                error = fanotify_read(&watch_pending, &watch_overflow);
+            } else {
+                error = inotify_read(&watch_pending, &watch_overflow);
+            }
+            watch_arrived = true;
+        }
+        watch_error = error;
+        quit = watch_quit || error;
+        pthread_mutex_unlock(&watch_lock);
+    } while (!quit);
+
+    return NULL;
+}
+
+// Starts reading events on a thread of its own, so that the queue keeps
+// being drained while a dump or a compaction runs
+int watch_start(void) {
+    int ret;
+    sigset_t all;
+    sigset_t old;
+
+    // Signals are for the thread that runs the dump
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&watch_reader, NULL, watch_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret) {
+        fprintf(stderr, "pthread_create() failed with errno %i\n", ret);
+        return -1;
+    }
+    watch_started = true;
+
+    return 0;
+}
+
+// Tells whether events arrived or the queue overflowed since the last call
+int watch_status(
+    bool *arrived,
+    bool *overflow
+) {
+    int ret;
+
+    pthread_mutex_lock(&watch_lock);
+    *arrived = watch_arrived;
+    *overflow = watch_overflow;
+    watch_arrived = false;
+    watch_overflow = false;
+    ret = watch_error;
+    pthread_mutex_unlock(&watch_lock);
+
+    return ret;
+}
+
+// Moves the paths collected so far to dirty, which must be empty
+void watch_take(
+    struct pathmap *dirty
+) {
+    pthread_mutex_lock(&watch_lock);
+    *dirty = watch_pending;
+    memset(&watch_pending, 0x00, sizeof(watch_pending));
+    pthread_mutex_unlock(&watch_lock);
+}
+
+void watch_close(void) {
+    if (watch_started) {
+        pthread_mutex_lock(&watch_lock);
+        watch_quit = true;
+        pthread_mutex_unlock(&watch_lock);
+        pthread_join(watch_reader, NULL);
+        watch_started = false;
+    }
+    pathmap_free(&watch_pending);
+    if (watch_notify_fd >= 0) {
+        close(watch_notify_fd);
+    }
+    if (mount_fd >= 0) {
+        close(mount_fd);
+    }
+    for (int wd = 0; wd < wd_alloc; wd++) {
+        free(wd_paths[wd]);
+    }
+    free(wd_paths);
+    for (int idx = 0; idx < ignored_count; idx++) {
+        free(ignored_paths[idx]);
+    }
+    free(ignored_paths);
+    free(watch_root);
+    free(watch_buff);
+    free(event_path);
+}
@@ -0,0 +1,26 @@
+#ifndef METADUMP_WATCH_H
+#define METADUMP_WATCH_H
+
+#include "pathmap.h"
+
+#include <stdbool.h>
+
+// Flags of the paths collected by watch_take()
+#define WATCH_CHANGED 0x1
+#define WATCH_CREATED 0x2       // created or moved in, so nothing of the old entry survives
+
+int watch_open(const char *root);
+
+int watch_ignore(const char *path);
+
+int watch_add_tree(const char *relpath);
+
+int watch_start(void);
+
+int watch_status(bool *arrived, bool *overflow);
+
+void watch_take(struct pathmap *dirty);
+
+void watch_close(void);
+
+#endif /* METADUMP_WATCH_H */
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+
+#include "xdict.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct xdict_header {
+    int kind;
+    int length;
+};
+
+// What the crawl has seen so far; a value gets an id the second time
+struct xdict_seen {
+    char *bytes;          // NULL for an empty slot
+    int length;
+    int kind;
+    int id;               // XDICT_INLINE until it is in the dictionary
+};
+
+FILE *xdictfile;
+struct xdict_seen *xdict_seen;
+size_t xdict_seen_alloc;
+size_t xdict_seen_used;
+int xdict_next_id[XDICT_KINDS];
+
+char *xdict_path(
+    const char *datapath
+) {
+    char *path;
+
+    path = malloc(strlen(datapath) + strlen(XDICT_SUFFIX) + 1);
+    if (path == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return NULL;
+    }
+    sprintf(path, "%s%s", datapath, XDICT_SUFFIX);
+
+    return path;
+}
+
+int xdict_open(
+    const char *datapath
+) {
+    int ret;
+    char *path;
+
+    path = xdict_path(datapath);
+    if (path == NULL) {
+        return -1;
+    }
+    xdictfile = fopen(path, "wb");
+    if (xdictfile == NULL) {
+        fprintf(stderr, "Can't open xattr dictionary %s\n", path);
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    ret = fwrite(&VERSION, sizeof(VERSION), 1, xdictfile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+bool xdict_enabled(void) {
+    return xdictfile != NULL;
+}
+
+size_t xdict_hash(
+    int kind,
+    const char *bytes,
+    int length
+) {
+    unsigned long long hash;
+
+    hash = 14695981039346656037ULL ^ kind;
+    for (int idx = 0; idx < length; idx++) {
+        hash = (hash ^ (unsigned char)bytes[idx]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+struct xdict_seen *xdict_slot(
+    struct xdict_seen *seen,
+    size_t alloc,
+    int kind,
+    const char *bytes,
+    int length
+) {
+    size_t idx;
+    struct xdict_seen *slot;
+
+    idx = xdict_hash(kind, bytes, length) & (alloc - 1);
+    for (;;) {
+        slot = &seen[idx];
+        if (slot->bytes == NULL) {
+            return slot;
+        }
+        if (slot->kind == kind && slot->length == length && memcmp(slot->bytes, bytes, length) == 0) {
+            return slot;
+        }
+        idx = (idx + 1) & (alloc - 1);
+    }
+}
+
+int xdict_grow(void) {
+    struct xdict_seen *new_seen;
+    size_t new_alloc;
+
+    new_alloc = xdict_seen_alloc > 0 ? 2 * xdict_seen_alloc : 1024;
+    new_seen = calloc(new_alloc, sizeof(*new_seen));
+    if (new_seen == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        return -1;
+    }
+    for (size_t idx = 0; idx < xdict_seen_alloc; idx++) {
+        if (xdict_seen[idx].bytes != NULL) {
+            *xdict_slot(new_seen, new_alloc, xdict_seen[idx].kind, xdict_seen[idx].bytes, xdict_seen[idx].length) = xdict_seen[idx];
+        }
+    }
+    free(xdict_seen);
+    xdict_seen = new_seen;
+    xdict_seen_alloc = new_alloc;
+
+    return 0;
+}
+
+int xdict_add(
+    struct xdict_seen *slot
+) {
+    int ret;
+    struct xdict_header header;
+
+    header.kind = slot->kind;
+    header.length = slot->length;
+    ret = fwrite(&header, sizeof(header), 1, xdictfile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    ret = fwrite(slot->bytes, 1, slot->length, xdictfile);
+    if (ret != slot->length) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    slot->id = xdict_next_id[slot->kind]++;
+
+    return 0;
+}
+
+// Sets *id to the dictionary entry for bytes, or to XDICT_INLINE when the
+// record has to carry them. Names get an entry the first time they are
+// seen, values the second time.
+int xdict_id(
+    int kind,
+    const char *bytes,
+    int length,
+    int *id
+) {
+    int ret;
+    struct xdict_seen *slot;
+
+    *id = XDICT_INLINE;
+    if (kind == XDICT_VALUE && length > XDICT_MAX_VALUE) {
+        return 0;
+    }
+
+    if (2 * (xdict_seen_used + 1) > xdict_seen_alloc) {
+        ret = xdict_grow();
+        if (ret) {
+            return ret;
+        }
+    }
+
+    slot = xdict_slot(xdict_seen, xdict_seen_alloc, kind, bytes, length);
+    if (slot->bytes == NULL) {
+        // Past the limit, whatever is new stays inline
+        if (xdict_seen_used == XDICT_MAX_TRACKED) {
+            return 0;
+        }
+        slot->bytes = malloc(length > 0 ? length : 1);
+        if (slot->bytes == NULL) {
+            fprintf(stderr, "malloc() failed with errno %i\n", errno);
+            return -1;
+        }
+        memcpy(slot->bytes, bytes, length);
+        slot->length = length;
+        slot->kind = kind;
+        slot->id = XDICT_INLINE;
+        xdict_seen_used++;
+        if (kind == XDICT_VALUE) {
+            return 0;
+        }
+    }
+
+    if (slot->id == XDICT_INLINE) {
+        ret = xdict_add(slot);
+        if (ret) {
+            return ret;
+        }
+    }
+    *id = slot->id;
+
+    return 0;
+}
+
+int xdict_close(void) {
+    int ret;
+
+    for (size_t idx = 0; idx < xdict_seen_alloc; idx++) {
+        free(xdict_seen[idx].bytes);
+    }
+    free(xdict_seen);
+    xdict_seen = NULL;
+    xdict_seen_alloc = 0;
+    xdict_seen_used = 0;
+
+    if (xdictfile == NULL) {
+        return 0;
+    }
+
+    ret = fclose(xdictfile);
+    xdictfile = NULL;
+    if (ret) {
+        fprintf(stderr, "fclose() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Drops the dictionary an earlier dump to the same datafile may have left
+int xdict_remove(
+    const char *datapath
+) {
+    int ret;
+    char *path;
+
+    path = xdict_path(datapath);
+    if (path == NULL) {
+        return -1;
+    }
+    ret = unlink(path);
+    if (ret && errno != ENOENT) {
+        fprintf(stderr, "unlink() failed with errno %i for %s\n", errno, path);
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    return 0;
+}
+
+// Loads the dictionary of datapath, if it has one
+int xdict_load(
+    struct xdict *dict,
+    const char *datapath
+) {
+    int ret;
+    FILE *file;
+    char *path;
+    int version[3];
+    struct stat st;
+    size_t size;
+    size_t used;
+    int alloc[XDICT_KINDS];
+    void *new_buff;
+    struct xdict_header header;
+
+    memset(dict, 0x00, sizeof(*dict));
+
+    path = xdict_path(datapath);
+    if (path == NULL) {
+        return -1;
+    }
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        free(path);
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    ret = fread(&version, sizeof(version), 1, file);
+    if (ret != 1) {
+        fprintf(stderr, "Invalid xattr dictionary %s\n", path);
+        free(path);
+        fclose(file);
+        return -1;
+    }
+    ret = compare_versions(version, VERSION);
+    if (ret) {
+        free(path);
+        fclose(file);
+        return ret;
+    }
+
+    ret = fstat(fileno(file), &st);
+    if (ret) {
+        fprintf(stderr, "fstat() failed with errno %i\n", errno);
+        free(path);
+        fclose(file);
+        return -1;
+    }
+    size = st.st_size - sizeof(version);
+    dict->bytes = malloc(size + 1);
+    if (dict->bytes == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        free(path);
+        fclose(file);
+        return -1;
+    }
+    ret = fread(dict->bytes, 1, size, file);
+    fclose(file);
+    if ((size_t)ret != size) {
+        fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+        free(path);
+        return -1;
+    }
+
+    // Entries point into the file contents
+    memset(alloc, 0x00, sizeof(alloc));
+    used = 0;
+    while (used < size) {
+        if (size - used < sizeof(header)) {
+            fprintf(stderr, "Invalid xattr dictionary %s\n", path);
+            free(path);
+            return -1;
+        }
+        memcpy(&header, dict->bytes + used, sizeof(header));
+        if (header.kind < 0 || header.kind >= XDICT_KINDS || header.length < 0 ||
+            (size_t)header.length > size - used - sizeof(header)) {
+            fprintf(stderr, "Invalid xattr dictionary %s\n", path);
+            free(path);
+            return -1;
+        }
+        if (dict->count[header.kind] == alloc[header.kind]) {
+            alloc[header.kind] = alloc[header.kind] * 2 + 64;
+            new_buff = realloc(dict->entries[header.kind], alloc[header.kind] * sizeof(*dict->entries[0]));
+            if (new_buff == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                free(path);
+                return -1;
+            }
+            dict->entries[header.kind] = new_buff;
+            new_buff = realloc(dict->lengths[header.kind], alloc[header.kind] * sizeof(*dict->lengths[0]));
+            if (new_buff == NULL) {
+                fprintf(stderr, "malloc() failed with errno %i\n", errno);
+                free(path);
+                return -1;
+            }
+            dict->lengths[header.kind] = new_buff;
+        }
+        dict->entries[header.kind][dict->count[header.kind]] = dict->bytes + used + sizeof(header);
+        dict->lengths[header.kind][dict->count[header.kind]] = header.length;
+        dict->count[header.kind]++;
+        used += sizeof(header) + header.length;
+    }
+    free(path);
+    dict->loaded = true;
+
+    return 0;
+}
+
+void xdict_free(
+    struct xdict *dict
+) {
+    for (int kind = 0; kind < XDICT_KINDS; kind++) {
+        free(dict->entries[kind]);
+        free(dict->lengths[kind]);
+    }
+    free(dict->bytes);
+    memset(dict, 0x00, sizeof(*dict));
+}
@@ -0,0 +1,41 @@
+#ifndef METADUMP_XDICT_H
+#define METADUMP_XDICT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Extended attribute names and repeated values shared by the records of a
+// datafile, kept next to it in DATAFILE.xdict. Records refer to entries by
+// their index among the entries of the same kind.
+
+#define XDICT_SUFFIX ".xdict"
+#define XDICT_NAME 0
+#define XDICT_VALUE 1
+#define XDICT_KINDS 2
+#define XDICT_INLINE -1             // the bytes follow in the record
+#define XDICT_MAX_VALUE 256         // longer values are always inline
+#define XDICT_MAX_TRACKED (1 << 20) // distinct names and values looked at
+
+struct xdict {
+    bool loaded;
+    int count[XDICT_KINDS];
+    char **entries[XDICT_KINDS];
+    int *lengths[XDICT_KINDS];
+    char *bytes;
+};
+
+int xdict_open(const char *datapath);
+
+bool xdict_enabled(void);
+
+int xdict_id(int kind, const char *bytes, int length, int *id);
+
+int xdict_close(void);
+
+int xdict_remove(const char *datapath);
+
+int xdict_load(struct xdict *dict, const char *datapath);
+
+void xdict_free(struct xdict *dict);
+
+#endif /* METADUMP_XDICT_H */
@@ -0,0 +1,185 @@
+#include "zonemap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+FILE *zonefile;
+struct zone zone_current;
+
+int zonemap_open(
+    const char *zonepath
+) {
+    int ret;
+
+    zonefile = fopen(zonepath, "wb");
+    if (zonefile == NULL) {
+        fprintf(stderr, "Can't open zone map %s\n", zonepath);
+        return -1;
+    }
+
+    ret = fwrite(&VERSION, sizeof(VERSION), 1, zonefile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+    ret = fwrite(&(int){ZONE_BLOCK_ENTRIES}, sizeof(int), 1, zonefile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    memset(&zone_current, 0x00, sizeof(zone_current));
+
+    return 0;
+}
+
+int zonemap_flush(void) {
+    int ret;
+
+    if (zone_current.entries == 0) {
+        return 0;
+    }
+
+    ret = fwrite(&zone_current, sizeof(zone_current), 1, zonefile);
+    if (ret != 1) {
+        fprintf(stderr, "fwrite() failed with return code %i and errno %i\n", ret, errno);
+        return -1;
+    }
+
+    memset(&zone_current, 0x00, sizeof(zone_current));
+
+    return 0;
+}
+
+int zonemap_add(
+    const struct statx_data *stx,
+    long long datafile_pos
+) {
+    long long size;
+    long long mtime;
+    unsigned int uid;
+
+    if (zonefile == NULL) {
+        return 0;
+    }
+
+    // Failed statx records are zero-filled, and readers compare them as such
+    size = stx->buff.stx_size;
+    mtime = stx->buff.stx_mtime.tv_sec;
+    uid = stx->buff.stx_uid;
+
+    if (zone_current.entries == 0) {
+        zone_current.data_start = datafile_pos;
+        zone_current.min_size = size;
+        zone_current.max_size = size;
+        zone_current.min_mtime = mtime;
+        zone_current.max_mtime = mtime;
+        zone_current.min_uid = uid;
+        zone_current.max_uid = uid;
+    } else {
+        zone_current.min_size = size < zone_current.min_size ? size : zone_current.min_size;
+        zone_current.max_size = size > zone_current.max_size ? size : zone_current.max_size;
+        zone_current.min_mtime = mtime < zone_current.min_mtime ? mtime : zone_current.min_mtime;
+        zone_current.max_mtime = mtime > zone_current.max_mtime ? mtime : zone_current.max_mtime;
+        zone_current.min_uid = uid < zone_current.min_uid ? uid : zone_current.min_uid;
+        zone_current.max_uid = uid > zone_current.max_uid ? uid : zone_current.max_uid;
+    }
+    zone_current.entries++;
+
+    if (zone_current.entries == ZONE_BLOCK_ENTRIES) {
+        return zonemap_flush();
+    }
+
+    return 0;
+}
+
+int zonemap_close(void) {
+    int ret;
+
+    if (zonefile == NULL) {
+        return 0;
+    }
+
+    ret = zonemap_flush();
+    if (ret) {
+        return ret;
+    }
+
+    ret = fclose(zonefile);
+    zonefile = NULL;
+    if (ret) {
+        fprintf(stderr, "fclose() failed with errno %i\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+int zonemap_load(
+    const char *zonepath,
+    struct zone **zones,
+    long long *zone_count,
+    int *block_entries
+) {
+    int ret;
+    FILE *file;
+    int version[3];
+    struct stat st;
+    long long header;
+
+    file = fopen(zonepath, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Can't open zone map %s\n", zonepath);
+        return -1;
+    }
+
+    ret = fread(&version, sizeof(version), 1, file);
+    if (ret != 1) {
+        fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+        fclose(file);
+        return -1;
+    }
+    ret = compare_versions(version, VERSION);
+    if (ret) {
+        fclose(file);
+        return ret;
+    }
+
+    ret = fread(block_entries, sizeof(*block_entries), 1, file);
+    if (ret != 1 || *block_entries < 1) {
+        fprintf(stderr, "Invalid zone map header in %s\n", zonepath);
+        fclose(file);
+        return -1;
+    }
+
+    ret = fstat(fileno(file), &st);
+    if (ret) {
+        fprintf(stderr, "fstat() failed with errno %i\n", errno);
+        fclose(file);
+        return -1;
+    }
+
+    header = sizeof(version) + sizeof(*block_entries);
+    *zone_count = (st.st_size - header) / sizeof(**zones);
+
+    *zones = malloc(*zone_count * sizeof(**zones) + 1);
+    if (*zones == NULL) {
+        fprintf(stderr, "malloc() failed with errno %i\n", errno);
+        fclose(file);
+        return -1;
+    }
+
+    ret = fread(*zones, sizeof(**zones), *zone_count, file);
+    if (ret != *zone_count) {
+        fprintf(stderr, "fread() failed with return code %i and errno %i\n", ret, errno);
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+
+    return 0;
+}
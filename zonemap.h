@@ -0,0 +1,28 @@
+#ifndef METADUMP_ZONEMAP_H
+#define METADUMP_ZONEMAP_H
+
+#include "common.h"
+
+#define ZONE_BLOCK_ENTRIES 4096
+
+// Summary of ZONE_BLOCK_ENTRIES consecutive entries in tree order
+struct zone {
+    long long data_start; // datafile_pos of the first record of the block
+    long long entries;
+    long long min_size;
+    long long max_size;
+    long long min_mtime;
+    long long max_mtime;
+    unsigned int min_uid;
+    unsigned int max_uid;
+};
+
+int zonemap_open(const char *zonepath);
+
+int zonemap_add(const struct statx_data *stx, long long datafile_pos);
+
+int zonemap_close(void);
+
+int zonemap_load(const char *zonepath, struct zone **zones, long long *zone_count, int *block_entries);
+
+#endif /* METADUMP_ZONEMAP_H */